@@ -19,6 +19,7 @@
 #include "kyk_protocol.h"
 #include "kyk_block.h"
 #include "kyk_tx.h"
+#include "kyk_download.h"
 #include "dbg.h"
 
 #define WALLET_NAME ".bob_wallet"
@@ -35,9 +36,18 @@
 #define CMD_REQ_VERSION    "req-version"
 #define CMD_REQ_GETHEADERS "req-getheaders"
 #define CMD_REQ_GETDATA    "req-getdata"
+#define CMD_SYNC           "sync"
 
 #define DEFAULT_NODE "localhost"
 #define DEFAULT_SERVICE "8333"
+#define DEFAULT_PEERS "localhost:8333"
+
+/* filtered blocks being downloaded, indexed by height */
+struct sync_blocks {
+    const struct ptl_inv* inv_list;
+    const struct ptl_pkh_filter* filter;
+    struct kyk_block_list* blk_list;
+};
 
 static int match_cmd(char *src, char *cmd);
 static int cmd_add_address(struct kyk_wallet* wallet, const char* desc);
@@ -49,8 +59,17 @@ static int cmd_make_tx(struct kyk_wallet* wallet,
 
 static int cmd_ping(const char *node, const char* service);
 static int cmd_req_version(const char* node, const char* service);
-static int cmd_req_getheaders(const char* node, const char* service, struct kyk_wallet* wallet);
-static int cmd_req_getdata(const char* node, const char* service, struct kyk_wallet* wallet);
+static int cmd_req_getheaders(struct kyk_peer_conn* conn, struct kyk_wallet* wallet);
+static int cmd_req_getdata(struct kyk_peer_conn** conn_list, size_t conn_count, struct kyk_wallet* wallet);
+static int cmd_sync(const char* peers, int headers, int blocks, struct kyk_wallet* wallet);
+static int connect_peers(const char* peers, struct kyk_peer_conn*** new_conn_list, size_t* conn_count);
+static int sync_request_blocks(struct kyk_peer_conn* conn, const size_t* inx_list, size_t count, void* arg);
+static int sync_receive_block(struct kyk_peer_conn* conn, size_t inx, void* arg);
+static int sync_deliver_block(size_t inx, void* arg);
+static int req_filtered_blocks(struct kyk_peer_conn* conn,
+			       const struct ptl_inv* inv_list,
+			       size_t inv_count,
+			       const struct ptl_pkh_filter* filter);
 
 static void dump_tx_to_file(const struct kyk_tx* tx, const char* filepath);
 static int be_rejected(const ptl_message* rep_msg);
@@ -81,6 +100,7 @@ int main(int argc, char *argv[])
 	printf("version request:    %s %s\n", argv[0], CMD_REQ_VERSION);
 	printf("getheaders request: %s %s\n", argv[0], CMD_REQ_GETHEADERS);
 	printf("getdata request: %s %s\n", argv[0], CMD_REQ_GETDATA);
+	printf("sync headers and blocks: %s %s [node:port,node:port...]\n", argv[0], CMD_SYNC);
     }
     
     if(argc == 2){
@@ -107,10 +127,15 @@ int main(int argc, char *argv[])
 	} else if(match_cmd(argv[1], CMD_REQ_GETHEADERS)){
 	    wallet = kyk_open_wallet(wdir);
 	    check(wallet, "failed to open wallet");
-	    cmd_req_getheaders("localhost", "8333", wallet);
+	    cmd_sync(DEFAULT_PEERS, 1, 0, wallet);
 	} else if(match_cmd(argv[1], CMD_REQ_GETDATA)){
 	    wallet = kyk_open_wallet(wdir);
-	    cmd_req_getdata("localhost", "8333", wallet);
+	    check(wallet, "failed to open wallet");
+	    cmd_sync(DEFAULT_PEERS, 0, 1, wallet);
+	} else if(match_cmd(argv[1], CMD_SYNC)){
+	    wallet = kyk_open_wallet(wdir);
+	    check(wallet, "failed to open wallet");
+	    cmd_sync(DEFAULT_PEERS, 1, 1, wallet);
 	} else {
 	    printf("invalid options\n");
 	}
@@ -135,6 +160,10 @@ int main(int argc, char *argv[])
 	    res = kyk_wallet_check_config(wallet, wdir);
 	    check(res == 0, "failed to kyk_wallet_check_config");
 	    cmd_add_address(wallet, argv[2]);
+	} else if(match_cmd(argv[1], CMD_SYNC)){
+	    wallet = kyk_open_wallet(wdir);
+	    check(wallet, "failed to open wallet");
+	    cmd_sync(argv[2], 1, 1, wallet);
 	} else {
 	    printf("invalid command %s\n", argv[1]);
 	}
@@ -299,143 +328,384 @@ error:
     return -1;
 }
 
-int cmd_req_getheaders(const char* node, const char* service, struct kyk_wallet* wallet)
+/*
+ * Headers from the first peer, then the blocks from all of them at once.
+ * peers is a comma separated list of node:port, the same node can be listed more than once.
+ */
+int cmd_sync(const char* peers, int headers, int blocks, struct kyk_wallet* wallet)
+{
+    struct kyk_peer_conn** conn_list = NULL;
+    size_t conn_count = 0;
+    size_t i = 0;
+    int res = -1;
+
+    res = connect_peers(peers, &conn_list, &conn_count);
+    check(res == 0, "Failed to cmd_sync: connect_peers failed");
+
+    if(headers){
+	res = cmd_req_getheaders(conn_list[0], wallet);
+	check(res == 0, "Failed to cmd_sync: cmd_req_getheaders failed");
+    }
+
+    if(blocks){
+	res = cmd_req_getdata(conn_list, conn_count, wallet);
+	check(res == 0, "Failed to cmd_sync: cmd_req_getdata failed");
+    }
+
+    for(i = 0; i < conn_count; i++){
+	kyk_peer_close(conn_list[i]);
+    }
+    free(conn_list);
+
+    return 0;
+
+error:
+    if(conn_list){
+	for(i = 0; i < conn_count; i++){
+	    kyk_peer_close(conn_list[i]);
+	}
+	free(conn_list);
+    }
+    return -1;
+}
+
+/* peers that can't be reached are skipped, at least one has to be */
+int connect_peers(const char* peers, struct kyk_peer_conn*** new_conn_list, size_t* conn_count)
+{
+    struct kyk_peer_conn** conn_list = NULL;
+    char* buf = NULL;
+    char* saveptr = NULL;
+    char* node = NULL;
+    char* service = NULL;
+    size_t count = 0;
+    size_t cap = 1;
+    const char* p = NULL;
+    int res = -1;
+
+    for(p = peers; *p; p++){
+	if(*p == ',') cap++;
+    }
+
+    conn_list = calloc(cap, sizeof(*conn_list));
+    check(conn_list, "Failed to connect_peers: calloc failed");
+
+    buf = strdup(peers);
+    check(buf, "Failed to connect_peers: strdup failed");
+
+    for(node = strtok_r(buf, ",", &saveptr); node; node = strtok_r(NULL, ",", &saveptr)){
+	service = strrchr(node, ':');
+	if(service == NULL){
+	    service = DEFAULT_SERVICE;
+	} else {
+	    *service++ = '\0';
+	}
+
+	res = kyk_peer_connect(conn_list + count, node, service);
+	if(res != 0){
+	    log_warn("peer %s:%s is not reachable", node, service);
+	    continue;
+	}
+	count++;
+    }
+
+    check(count > 0, "Failed to connect_peers: no peer in %s is reachable", peers);
+
+    free(buf);
+
+    *new_conn_list = conn_list;
+    *conn_count = count;
+
+    return 0;
+
+error:
+    if(buf) free(buf);
+    if(conn_list) free(conn_list);
+    return -1;
+}
+
+/*
+ * Ask for the headers after our tip until the node has no more,
+ * a full reply of KYK_MAX_HEADERS_RESULTS headers means there are more to come.
+ * Every header has to extend our chain, each reply is appended to the block headers file.
+ */
+int cmd_req_getheaders(struct kyk_peer_conn* conn, struct kyk_wallet* wallet)
 {
     ptl_gethder_entity* et = NULL;
     struct kyk_blk_hd_chain* rep_hd_chain = NULL;
     struct kyk_blk_hd_chain* wallet_hd_chain = NULL;
-    struct kyk_blk_hd_chain* hd_chain = NULL;
     uint32_t version = 1;
     ptl_payload* pld = NULL;
     ptl_message* req_msg = NULL;
     ptl_message* rep_msg = NULL;
-    size_t hd_inx = 0;
+    size_t rep_len = 0;
+    size_t i = 0;
     int res = -1;
 
     res = kyk_load_blk_header_chain(&wallet_hd_chain, wallet);
     check(res == 0, "Failed to kyk_load_blk_header_chain");
 
-    res = kyk_build_new_getheaders_entity(&et, version);
-    check(res == 0, "kyk_build_new_getheaders_entity failed");
+    do {
+	res = kyk_build_new_getheaders_entity(&et, version, wallet_hd_chain);
+	check(res == 0, "kyk_build_new_getheaders_entity failed");
 
-    res = kyk_new_seri_gethder_entity_to_pld(et, &pld);
-    check(res == 0, "kyk_new_seri_gethder_entity_to_pld failed");
+	res = kyk_new_seri_gethder_entity_to_pld(et, &pld);
+	check(res == 0, "kyk_new_seri_gethder_entity_to_pld failed");
 
-    res = kyk_build_new_ptl_message(&req_msg, KYK_MSG_TYPE_GETHEADERS, NT_MAGIC_MAIN, pld);
-    check(res == 0, "kyk_build_new_ptl_message failed");
+	res = kyk_build_new_ptl_message(&req_msg, KYK_MSG_TYPE_GETHEADERS, NT_MAGIC_MAIN, pld);
+	check(res == 0, "kyk_build_new_ptl_message failed");
 
-    res = kyk_send_ptl_msg(node, service, req_msg, &rep_msg);
-    check(res == 0, "kyk_send_ptl_msg failed");
+	res = kyk_peer_write(conn, req_msg);
+	check(res == 0, "kyk_peer_write failed");
 
-    printf("===============> RECEIVED RESPONSE FROM NODE:\n");
-    kyk_print_ptl_message(rep_msg);
+	res = kyk_peer_read_cmd(conn, KYK_MSG_TYPE_HEADERS, &rep_msg);
+	check(res == 0, "kyk_peer_read_cmd failed");
+	check(!be_rejected(rep_msg), "Failed to cmd_req_getheaders: rejected by node");
 
-    res = kyk_deseri_headers_msg_to_new_hd_chain(rep_msg, &rep_hd_chain);
-    check(res == 0, "Failed to cmd_req_getheaders: kyk_deseri_headers_msg_to_new_hd_chain failed");
+	printf("===============> RECEIVED RESPONSE FROM NODE:\n");
+	kyk_print_ptl_message(rep_msg);
 
-    printf("===============> RECEIVED BLOCK HEADERS FROM NODE:\n");
-    kyk_print_blk_hd_chain(rep_hd_chain);
+	res = kyk_deseri_headers_msg_to_new_hd_chain(rep_msg, &rep_hd_chain);
+	check(res == 0, "Failed to cmd_req_getheaders: kyk_deseri_headers_msg_to_new_hd_chain failed");
 
-    res = kyk_compare_hd_chain(wallet_hd_chain, rep_hd_chain, &hd_inx);
-    check(res == 0, "Failed to cmd_req_getheaders: kyk_compare_hd_chain failed");
+	printf("===============> RECEIVED BLOCK HEADERS FROM NODE:\n");
+	kyk_print_blk_hd_chain(rep_hd_chain);
 
-    if(hd_inx < rep_hd_chain -> len){
-	/* have got some new headers needed to be saved to the block headers file */
-	hd_chain = calloc(1, sizeof(*hd_chain));
-	check(hd_chain, "Failed to cmd_req_getheaders: calloc failed");
+	for(i = 0; i < rep_hd_chain -> len; i++){
+	    res = kyk_validate_blk_header(wallet_hd_chain, rep_hd_chain -> hd_list + i);
+	    check(res == 0, "Failed to cmd_req_getheaders: header does not extend our chain");
 
-	hd_chain -> len = rep_hd_chain -> len - hd_inx;
-	hd_chain -> hd_list = rep_hd_chain -> hd_list + hd_inx;
+	    res = kyk_append_blk_hd_chain(wallet_hd_chain, rep_hd_chain -> hd_list + i, 1);
+	    check(res == 0, "Failed to cmd_req_getheaders: kyk_append_blk_hd_chain failed");
+	}
 
-	res = kyk_save_blk_header_chain(wallet, hd_chain, "ab");
-	check(res == 0, "Failed to cmd_req_getheaders: kyk_save_blk_header_chain failed");
-    }
+	if(rep_hd_chain -> len > 0){
+	    res = kyk_save_blk_header_chain(wallet, rep_hd_chain, "ab");
+	    check(res == 0, "Failed to cmd_req_getheaders: kyk_save_blk_header_chain failed");
+	}
+
+	rep_len = rep_hd_chain -> len;
+
+	kyk_free_blk_hd_chain(rep_hd_chain);
+	rep_hd_chain = NULL;
+	kyk_free_ptl_msg(rep_msg);
+	rep_msg = NULL;
+	kyk_free_ptl_msg(req_msg);
+	req_msg = NULL;
+	kyk_free_ptl_payload(pld);
+	pld = NULL;
+	kyk_free_ptl_gethder_entity(et);
+	et = NULL;
+    } while(rep_len == KYK_MAX_HEADERS_RESULTS);
+
+    kyk_free_blk_hd_chain(wallet_hd_chain);
     
     return 0;
     
 error:
-
+    if(rep_hd_chain) kyk_free_blk_hd_chain(rep_hd_chain);
+    if(wallet_hd_chain) kyk_free_blk_hd_chain(wallet_hd_chain);
+    if(rep_msg) kyk_free_ptl_msg(rep_msg);
+    if(req_msg) kyk_free_ptl_msg(req_msg);
+    if(pld) kyk_free_ptl_payload(pld);
+    if(et) kyk_free_ptl_gethder_entity(et);
     return -1;
 }
 
-int cmd_req_getdata(const char* node, const char* service, struct kyk_wallet* wallet)
+/*
+ * One filtered getdata per block, spread over all the peers by the download scheduler.
+ * Blocks are checked against our header chain in height order,
+ * the ones with txs of ours update the utxo chain once all are in.
+ */
+int cmd_req_getdata(struct kyk_peer_conn** conn_list, size_t conn_count, struct kyk_wallet* wallet)
 {
     struct kyk_blk_hd_chain* wallet_hd_chain = NULL;
     struct kyk_block_list* blk_list = NULL;
-    struct kyk_block* blk;
     struct ptl_inv* inv_list = NULL;
-    ptl_payload* pld = NULL;
-    ptl_message* req_msg = NULL;
-    ptl_message* rep_msg = NULL;
+    struct ptl_pkh_filter* filter = NULL;
+    struct sync_blocks sync;
+    struct kyk_dl_ops ops;
     varint_t inv_count = 0;
-    varint_t i = 0;
-    int sfd = 0;
     int res = -1;
 
     res = kyk_load_blk_header_chain(&wallet_hd_chain, wallet);
     check(res == 0, "Failed to kyk_load_blk_header_chain");
 
-    res = kyk_hd_chain_to_inv_list(wallet_hd_chain, PTL_INV_MSG_BLOCK, &inv_list, &inv_count);
+    /* only the txs touching our addresses are sent, with merkle proofs against the headers */
+    res = kyk_hd_chain_to_inv_list(wallet_hd_chain, PTL_INV_MSG_FILTERED_BLOCK, &inv_list, &inv_count);
     check(res == 0, "Failed to cmd_req_getdata: kyk_hd_chain_to_inv_list failed");
 
     kyk_print_inv_list(inv_list, inv_count);
 
+    res = kyk_wallet_build_pkh_filter(wallet, &filter);
+    check(res == 0, "Failed to cmd_req_getdata: kyk_wallet_build_pkh_filter failed");
+
     blk_list = calloc(1, sizeof(*blk_list));
     check(blk_list, "Failed to cmd_req_getdata: calloc failed");
 
-    blk_list -> len = inv_count;
-    blk_list -> data = calloc(blk_list -> len, sizeof(*blk_list -> data));
+    /* received blocks sit at their height until delivered, then move down to blk_list -> len */
+    blk_list -> len = 0;
+    blk_list -> data = calloc(inv_count, sizeof(*blk_list -> data));
     check(blk_list -> data, "Failed to cmd_req_getdata: calloc failed");
 
-    res = kyk_seri_ptl_inv_list_to_new_pld(&pld, inv_list, inv_count);
-    check(res == 0, "Failed to cmd_req_getdata: kyk_seri_ptl_inv_list_to_new_pld failed");
+    sync.inv_list = inv_list;
+    sync.filter = filter;
+    sync.blk_list = blk_list;
 
-    res = kyk_build_new_ptl_message(&req_msg, KYK_MSG_TYPE_GETDATA, NT_MAGIC_MAIN, pld);
-    check(res == 0, "kyk_build_new_ptl_message failed");
+    ops.request = sync_request_blocks;
+    ops.receive = sync_receive_block;
+    ops.deliver = sync_deliver_block;
 
-    res = kyk_socket_connect(node, service, &sfd);
-    check(res == 0, "Failed to kyk_socket_connect");
+    res = kyk_download(conn_list, conn_count, inv_count, &ops, &sync);
+    check(res == 0, "Failed to cmd_req_getdata: kyk_download failed");
 
-    res = kyk_write_ptl_msg(sfd, req_msg);
+    kyk_print_kyk_block_list(blk_list);
 
-    while(1){
-	res = kyk_recv_ptl_msg(sfd, &rep_msg, KYK_PL_BUF_SIZE, NULL);
-	check(res == 0, "Failed to cmd_req_getdata: kyk_recv_ptl_msg failed");	
-	kyk_print_ptl_message(rep_msg);
-	blk = blk_list -> data + i;
-	res = kyk_deseri_block_from_blk_message(blk, rep_msg, NULL);
-	if(be_rejected(rep_msg)){
-	    ptl_reject_entity* et = NULL;
-	    pld = rep_msg -> pld;
-	    res = kyk_deseri_new_reject_entity(pld -> data, pld -> len, &et, NULL);
-	    printf("rejected by node\n");
-	    kyk_print_ptl_reject_entity(et);
-	    break;
-	}
+    if(blk_list -> len > 0){
+	res = kyk_wallet_update_utxo_chain_with_block_list(wallet, blk_list);
+	check(res == 0, "Failed to cmd_req_getdata: kyk_wallet_update_utxo_chain_with_block_list failed");
+    }
+    
+    /* kyk_free_kyk_block_list(blk_list); */
+    kyk_free_pkh_filter(filter);
+    free(inv_list);
+    kyk_free_blk_hd_chain(wallet_hd_chain);
+
+    return 0;
+
+error:
+    /* if(blk_list) kyk_free_kyk_block_list(blk_list); */
+    if(filter) kyk_free_pkh_filter(filter);
+    if(inv_list) free(inv_list);
+    if(wallet_hd_chain) kyk_free_blk_hd_chain(wallet_hd_chain);
+    return -1;
+}
+
+int sync_request_blocks(struct kyk_peer_conn* conn, const size_t* inx_list, size_t count, void* arg)
+{
+    struct sync_blocks* sync = arg;
+    struct ptl_inv invs[KYK_PEER_PIPELINE_DEPTH];
+    size_t i = 0;
+
+    check(count <= KYK_PEER_PIPELINE_DEPTH, "Failed to sync_request_blocks: too many requests");
+
+    for(i = 0; i < count; i++){
+	invs[i] = sync -> inv_list[inx_list[i]];
+    }
+
+    return req_filtered_blocks(conn, invs, count, sync -> filter);
+
+error:
+
+    return -1;
+}
+
+/* a rejected block leaves its slot empty, a failed one is cleared so it can be asked for again */
+int sync_receive_block(struct kyk_peer_conn* conn, size_t inx, void* arg)
+{
+    struct sync_blocks* sync = arg;
+    struct kyk_block* blk = sync -> blk_list -> data + inx;
+    ptl_message* rep_msg = NULL;
+    ptl_payload* pld = NULL;
+    int res = -1;
+
+    res = kyk_peer_read(conn, &rep_msg);
+    check(res == 0, "Failed to sync_receive_block: kyk_peer_read failed");
+    kyk_print_ptl_message(rep_msg);
+
+    if(be_rejected(rep_msg)){
+	ptl_reject_entity* et = NULL;
+	pld = rep_msg -> pld;
+	res = kyk_deseri_new_reject_entity(pld -> data, pld -> len, &et, NULL);
+	printf("rejected by node\n");
+	kyk_print_ptl_reject_entity(et);
+	kyk_free_ptl_msg(rep_msg);
+	return 0;
+    }
 
-	i++;
-	if(i >= blk_list -> len){
-	    break;
+    /* the proof is checked against the header our chain holds at this height */
+    res = kyk_ptl_recv_merkle_blk(conn, rep_msg, (const uint8_t*)sync -> inv_list[inx].hash, blk);
+    check(res == 0, "Failed to sync_receive_block: kyk_ptl_recv_merkle_blk failed");
+
+    kyk_free_ptl_msg(rep_msg);
+
+    return 0;
+
+error:
+    if(rep_msg) kyk_free_ptl_msg(rep_msg);
+    if(blk -> hd) free(blk -> hd);
+    memset(blk, 0, sizeof(*blk));
+    return -1;
+}
+
+/* received blocks already match our header at their height, blocks with nothing of ours are dropped */
+int sync_deliver_block(size_t inx, void* arg)
+{
+    struct sync_blocks* sync = arg;
+    struct kyk_block_list* blk_list = sync -> blk_list;
+    struct kyk_block* blk = blk_list -> data + inx;
+
+    if(blk -> hd == NULL){
+	return 0;
+    }
+
+    if(blk -> tx_count > 0){
+	if(blk_list -> len != inx){
+	    blk_list -> data[blk_list -> len] = *blk;
+	    memset(blk, 0, sizeof(*blk));
 	}
+	blk_list -> len++;
+    } else {
+	free(blk -> hd);
+	blk -> hd = NULL;
     }
 
-    kyk_print_kyk_block_list(blk_list);
+    return 0;
+}
 
-    res = kyk_wallet_update_utxo_chain_with_block_list(wallet, blk_list);
-    check(res == 0, "Failed to cmd_req_getdata: kyk_wallet_update_utxo_chain_with_block_list failed");
-    
-    /* kyk_free_kyk_block_list(blk_list); */
+/* one getdata per block, all written with a single send */
+int req_filtered_blocks(struct kyk_peer_conn* conn,
+			const struct ptl_inv* inv_list,
+			size_t inv_count,
+			const struct ptl_pkh_filter* filter)
+{
+    ptl_payload* pld = NULL;
+    ptl_message** req_list = NULL;
+    size_t i = 0;
+    int res = -1;
+
+    req_list = calloc(inv_count, sizeof(*req_list));
+    check(req_list, "Failed to req_filtered_blocks: calloc failed");
+
+    for(i = 0; i < inv_count; i++){
+	res = kyk_seri_filtered_getdata_to_new_pld(&pld, inv_list + i, 1, filter);
+	check(res == 0, "Failed to req_filtered_blocks: kyk_seri_filtered_getdata_to_new_pld failed");
+
+	res = kyk_build_new_ptl_message(req_list + i, KYK_MSG_TYPE_GETDATA, NT_MAGIC_MAIN, pld);
+	check(res == 0, "Failed to req_filtered_blocks: kyk_build_new_ptl_message failed");
+
+	kyk_free_ptl_payload(pld);
+	pld = NULL;
+    }
+
+    res = kyk_peer_write_list(conn, (const ptl_message**)req_list, inv_count);
+    check(res == 0, "Failed to req_filtered_blocks: kyk_peer_write_list failed");
 
-    close(sfd);
+    for(i = 0; i < inv_count; i++){
+	kyk_free_ptl_msg(req_list[i]);
+    }
+    free(req_list);
 
     return 0;
 
 error:
-    /* if(blk_list) kyk_free_kyk_block_list(blk_list); */
-    if(sfd) close(sfd);
-    
+    if(pld) kyk_free_ptl_payload(pld);
+    if(req_list){
+	for(i = 0; i < inv_count; i++){
+	    if(req_list[i]) kyk_free_ptl_msg(req_list[i]);
+	}
+	free(req_list);
+    }
     return -1;
-    
 }
 
 int cmd_make_tx(struct kyk_wallet* wallet,
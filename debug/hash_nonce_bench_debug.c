@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <gmp.h>
+#include <openssl/sha.h>
+
+#include "kyk_block.h"
+#include "kyk_utils.h"
+#include "kyk_sha.h"
+#include "kyk_sha_simd.h"
+#include "kyk_difficulty.h"
+#include "beej_pack.h"
+
+/*
+ * Compare mining attempts per second of
+ * - the old path: full 80-byte hash256 + mpz_import + mpz_cmp against a GMP target
+ * - the new path: midstate header hasher + fixed-width 256-bit compare
+ * - the same with the nonces hashed side by side in the SIMD lanes
+ * Usage: hash_nonce_bench_debug.out [attempts]
+ */
+
+#define DEFAULT_ATTEMPTS 2000000
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_bench_header(struct kyk_blk_header* hd)
+{
+    hd -> version = 1;
+    kyk_parse_hex(hd -> pre_blk_hash, "0000000000000000000000000000000000000000000000000000000000000000");
+    kyk_parse_hex(hd -> mrk_root_hash, "4a5e1e4baab89f3a32518a88c31bc87f618f76673e2cc77ab2127b7afdeda33b");
+    hd -> tts = 1231006505;
+    hd -> bts = 486604799;
+    hd -> nonce = 0;
+}
+
+static double bench_gmp(const struct kyk_blk_header* hd, uint64_t attempts, uint64_t* hits)
+{
+    mpz_t tg, hs;
+    uint8_t hd_buf[KYK_BLK_HD_LEN];
+    uint8_t dgst[SHA256_DIGEST_LENGTH];
+    size_t len = 0;
+    uint64_t i = 0;
+    double t0 = 0;
+
+    mpz_init(tg);
+    mpz_init(hs);
+    kyk_bts2target(hd -> bts, tg);
+
+    len = kyk_seri_blk_hd_without_nonce(hd_buf, hd);
+    *hits = 0;
+
+    t0 = now_sec();
+    for(i = 0; i < attempts; i++){
+	beej_pack(hd_buf + len, "<L", (uint32_t)i);
+	kyk_dgst_hash256(dgst, hd_buf, KYK_BLK_HD_LEN);
+	kyk_reverse(dgst, SHA256_DIGEST_LENGTH);
+	mpz_import(hs, SHA256_DIGEST_LENGTH, 1, 1, 1, 0, dgst);
+	if(mpz_cmp(hs, tg) <= 0){
+	    *hits += 1;
+	}
+    }
+
+    mpz_clear(tg);
+    mpz_clear(hs);
+
+    return now_sec() - t0;
+}
+
+static double bench_target256(const struct kyk_blk_header* hd, uint64_t attempts, uint64_t* hits)
+{
+    struct kyk_target tg;
+    struct kyk_blk_hd_hasher hasher;
+    uint8_t dgst[SHA256_DIGEST_LENGTH];
+    uint64_t i = 0;
+    double t0 = 0;
+
+    kyk_bts2target256(hd -> bts, &tg);
+    kyk_init_blk_hd_hasher(&hasher, hd);
+    *hits = 0;
+
+    t0 = now_sec();
+    for(i = 0; i < attempts; i++){
+	kyk_blk_hd_hasher_hash(&hasher, dgst, (uint32_t)i);
+	if(kyk_digest_meets_target(dgst, &tg)){
+	    *hits += 1;
+	}
+    }
+
+    return now_sec() - t0;
+}
+
+static double bench_target256_n(const struct kyk_blk_header* hd, uint64_t attempts, uint64_t* hits)
+{
+    struct kyk_target tg;
+    struct kyk_blk_hd_hasher hasher;
+    uint8_t dgst[KYK_SHA256D_MAX_LANES * SHA256_DIGEST_LENGTH];
+    uint64_t i = 0;
+    size_t j = 0;
+    double t0 = 0;
+
+    kyk_bts2target256(hd -> bts, &tg);
+    kyk_init_blk_hd_hasher(&hasher, hd);
+    *hits = 0;
+
+    t0 = now_sec();
+    for(i = 0; i + KYK_SHA256D_MAX_LANES <= attempts; i += KYK_SHA256D_MAX_LANES){
+	kyk_blk_hd_hasher_hash_n(&hasher, dgst, (uint32_t)i, KYK_SHA256D_MAX_LANES);
+	for(j = 0; j < KYK_SHA256D_MAX_LANES; j++){
+	    if(kyk_digest_meets_target(dgst + j * SHA256_DIGEST_LENGTH, &tg)){
+		*hits += 1;
+	    }
+	}
+    }
+
+    return now_sec() - t0;
+}
+
+/* target compare alone, the digest is taken from a cheap counter */
+static double bench_cmp_gmp(uint32_t bts, uint64_t attempts, uint64_t* hits)
+{
+    mpz_t tg, hs;
+    uint8_t dgst[SHA256_DIGEST_LENGTH];
+    uint64_t i = 0;
+    double t0 = 0;
+
+    memset(dgst, 0, sizeof(dgst));
+    mpz_init(tg);
+    mpz_init(hs);
+    *hits = 0;
+
+    t0 = now_sec();
+    for(i = 0; i < attempts; i++){
+	beej_pack(dgst + 2, ">Q", i * 0x9E3779B97F4A7C15ull);
+	/* validate_hd_bts used to rebuild the target on every call */
+	kyk_bts2target(bts, tg);
+	mpz_import(hs, SHA256_DIGEST_LENGTH, 1, 1, 1, 0, dgst);
+	if(mpz_cmp(hs, tg) <= 0){
+	    *hits += 1;
+	}
+    }
+
+    mpz_clear(tg);
+    mpz_clear(hs);
+
+    return now_sec() - t0;
+}
+
+static double bench_cmp_target256(uint32_t bts, uint64_t attempts, uint64_t* hits)
+{
+    struct kyk_target tg;
+    uint8_t dgst[SHA256_DIGEST_LENGTH];
+    uint64_t i = 0;
+    double t0 = 0;
+
+    memset(dgst, 0, sizeof(dgst));
+    *hits = 0;
+
+    t0 = now_sec();
+    for(i = 0; i < attempts; i++){
+	beej_pack(dgst + 2, ">Q", i * 0x9E3779B97F4A7C15ull);
+	kyk_bts2target256(bts, &tg);
+	if(kyk_digest_meets_target(dgst, &tg)){
+	    *hits += 1;
+	}
+    }
+
+    return now_sec() - t0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct kyk_blk_header hd;
+    uint64_t attempts = DEFAULT_ATTEMPTS;
+    uint64_t hits1 = 0;
+    uint64_t hits2 = 0;
+    double t1 = 0;
+    double t2 = 0;
+
+    if(argc == 2){
+	attempts = strtoull(argv[1], NULL, 10);
+    }
+
+    make_bench_header(&hd);
+
+    t1 = bench_gmp(&hd, attempts, &hits1);
+    t2 = bench_target256(&hd, attempts, &hits2);
+
+    printf("attempts:                     %llu\n", (unsigned long long)attempts);
+    printf("hash256 + gmp compare:        %.0f attempts/s (%llu hits)\n", attempts / t1, (unsigned long long)hits1);
+    printf("midstate + 256-bit compare:   %.0f attempts/s (%llu hits)\n", attempts / t2, (unsigned long long)hits2);
+    printf("speedup:                      %.2fx\n", t1 / t2);
+
+    t2 = bench_target256_n(&hd, attempts, &hits2);
+    printf("%-30s%.0f attempts/s (%llu hits)\n", kyk_sha256d_impl_name(kyk_sha256d_get_impl()), attempts / t2, (unsigned long long)hits2);
+    printf("speedup:                      %.2fx\n", t1 / t2);
+
+    t1 = bench_cmp_gmp(0x1d00ffff, attempts, &hits1);
+    t2 = bench_cmp_target256(0x1d00ffff, attempts, &hits2);
+
+    printf("bts decode + gmp compare:     %.0f compares/s (%llu hits)\n", attempts / t1, (unsigned long long)hits1);
+    printf("bts decode + 256-bit compare: %.0f compares/s (%llu hits)\n", attempts / t2, (unsigned long long)hits2);
+    printf("speedup:                      %.2fx\n", t1 / t2);
+
+    return 0;
+}
@@ -43,7 +43,7 @@ int cmd_make_tx(struct kyk_wallet* wallet,
 
 int cmd_query_block(const char* blk_hash, const struct kyk_wallet* wallet);
 
-int cmd_serve(const char*host, const char* port);
+int cmd_serve(const char*host, const char* port, int thread_num);
 
 void dump_block_to_file(const struct kyk_block* blk, const char* filepath);
 
@@ -67,7 +67,7 @@ int main(int argc, char *argv[])
 	printf("make tx:           %s %s [amount] [address]\n", argv[0], CMD_MK_TX);
 	printf("query blance:      %s %s\n", argv[0], CMD_QUERY_BALANCE);
 	printf("show address list: %s %s\n", argv[0], CMD_SHOW_ADDR_LIST);
-	printf("start server:      %s %s\n", argv[0], CMD_SERVE);
+	printf("start server:      %s %s [port] [event loop count]\n", argv[0], CMD_SERVE);
 	printf("add address:       %s %s [address label]\n", argv[0], CMD_ADD_ADDRESS);
 	printf("query block:       %s %s [block hash]\n", argv[0], CMD_QUERY_BLOCK);
 	printf("delete wallet:     %s %s\n", argv[0], CMD_DELETE);
@@ -95,7 +95,7 @@ int main(int argc, char *argv[])
 	    wallet = kyk_open_wallet(wdir);
 	    cmd_show_addr_list(wallet);
 	} else if(match_cmd(argv[1], CMD_SERVE)){
-	    cmd_serve("localhost", "8333");
+	    cmd_serve("localhost", "8333", 1);
 	} else {
 	    printf("invalid options\n");
 	}
@@ -113,7 +113,7 @@ int main(int argc, char *argv[])
 	    check(res == 0, "failed to kyk_wallet_check_config");
 	    cmd_add_address(wallet, argv[2]);
 	} else if(match_cmd(argv[1], CMD_SERVE)){
-	    cmd_serve("localhost", argv[2]);
+	    cmd_serve("localhost", argv[2], 1);
 	} else {
 	    printf("invalid command %s\n", argv[1]);
 	}
@@ -129,6 +129,8 @@ int main(int argc, char *argv[])
 	    
 	    wallet = kyk_open_wallet(wdir);
 	    res = cmd_make_tx(wallet, btc_num, btc_addr);
+	} else if(match_cmd(argv[1], CMD_SERVE)){
+	    cmd_serve("localhost", argv[2], atoi(argv[3]));
 	} else {
 	    printf("invalid command %s\n", argv[1]);
 	}
@@ -288,9 +290,9 @@ error:
     return -1;
 }
 
-int cmd_serve(const char* host, const char* port)
+int cmd_serve(const char* host, const char* port, int thread_num)
 {
-    kyk_start_serve(host, port);
+    kyk_start_serve_mt(host, port, thread_num);
     return 0;
 }
 
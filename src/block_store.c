@@ -11,16 +11,16 @@
 #include "kyk_utils.h"
 #include "dbg.h"
 
-/* static const char DB_COIN = 'C'; */
+const char DB_COIN = 'C';
 /* static const char DB_COINS = 'c'; */
-/* static const char DB_BLOCK_FILES = 'f'; */
-/* static const char DB_TXINDEX = 't'; */
-static const char DB_BLOCK_INDEX = 'b';
-/* static const char DB_BEST_BLOCK = 'B'; */
-/* static const char DB_HEAD_BLOCKS = 'H'; */
-/* static const char DB_FLAG = 'F'; */
+const char DB_BLOCK_FILES = 'f';
+const char DB_TXINDEX = 't';
+const char DB_BLOCK_INDEX = 'b';
+const char DB_BEST_BLOCK = 'B';
+const char DB_HEAD_BLOCKS = 'H';
+const char DB_FLAG = 'F';
 /* static const char DB_REINDEX_FLAG = 'R'; */
-/* static const char DB_LAST_BLOCK = 'l'; */
+const char DB_LAST_BLOCK = 'l';
 
 void build_b_key(struct db_key *key, const char *blk_hash);
 size_t kyk_ser_bval(uint8_t *buf, struct kyk_bkey_val *bval);
@@ -50,6 +50,102 @@ void kyk_store_block(struct kyk_block_db* blk_db,
     if(buf) free_kyk_buff(buf);
 }
 
+void kyk_batch_store_block(leveldb_writebatch_t* batch, struct kyk_bkey_val* bval)
+{
+    struct db_key key;
+    struct kyk_buff *buf = NULL;
+    build_b_key(&key, (char *)bval -> blk_hd -> blk_hash);
+    buf = build_b_value(bval);
+    leveldb_writebatch_put(batch,
+			   key.body,
+			   key.len,
+			   (char *)buf -> base,
+			   buf -> len
+	);
+
+    kyk_free_db_key(&key);
+    if(buf) free_kyk_buff(buf);
+}
+
+/* the last block whose connect was written, the stores are consistent up to it */
+void kyk_batch_store_head_block(leveldb_writebatch_t* batch, const uint8_t* blk_hash)
+{
+    leveldb_writebatch_put(batch, &DB_HEAD_BLOCKS, sizeof(DB_HEAD_BLOCKS), (const char*)blk_hash, 32);
+}
+
+int kyk_read_head_block(struct kyk_block_db* blk_db, uint8_t* blk_hash, int* found)
+{
+    char* val = NULL;
+    char* errptr = NULL;
+    size_t vlen = 0;
+
+    check(blk_db, "Failed to kyk_read_head_block: blk_db is NULL");
+    check(blk_hash, "Failed to kyk_read_head_block: blk_hash is NULL");
+    check(found, "Failed to kyk_read_head_block: found is NULL");
+
+    *found = 0;
+
+    val = leveldb_get(blk_db -> db, blk_db -> rd_opts, &DB_HEAD_BLOCKS, sizeof(DB_HEAD_BLOCKS), &vlen, &errptr);
+    check(errptr == NULL, "Failed to kyk_read_head_block: leveldb_get failed: %s", errptr);
+
+    if(val){
+	check(vlen == 32, "Failed to kyk_read_head_block: invalid 'H' record");
+	memcpy(blk_hash, val, 32);
+	*found = 1;
+	leveldb_free(val);
+    }
+
+    return 0;
+
+error:
+    if(errptr) leveldb_free(errptr);
+    if(val) leveldb_free(val);
+    return -1;
+}
+
+/* like kyk_read_block, but a block with no 'b' record is not an error, *new_bval is NULL */
+int kyk_find_block(struct kyk_block_db* blk_db,
+		   const char* blk_hash,
+		   struct kyk_bkey_val** new_bval)
+{
+    struct db_key key;
+    struct kyk_buff bf;
+    struct kyk_bkey_val* bval = NULL;
+    char* errptr = NULL;
+
+    check(blk_db, "Failed to kyk_find_block: blk_db is NULL");
+    check(blk_hash, "Failed to kyk_find_block: blk_hash is NULL");
+    check(new_bval, "Failed to kyk_find_block: new_bval is NULL");
+
+    *new_bval = NULL;
+    bf.base = NULL;
+
+    build_b_key(&key, blk_hash);
+    bf.base = (uint8_t*)leveldb_get(blk_db -> db, blk_db -> rd_opts, (char *)key.body, key.len, &bf.len, &errptr);
+    check(errptr == NULL, "Failed to kyk_find_block: leveldb_get failed: %s", errptr);
+
+    if(bf.base == NULL){
+	return 0;
+    }
+
+    bval = malloc(sizeof(struct kyk_bkey_val));
+    check(bval, "Failed to kyk_find_block: malloc failed");
+    bval -> blk_hd = malloc(sizeof(struct kyk_blk_header));
+    check(bval -> blk_hd, "Failed to kyk_find_block: malloc failed");
+    unpack_bval_buf(bval, &bf);
+
+    free(bf.base);
+    *new_bval = bval;
+
+    return 0;
+
+error:
+    if(errptr) leveldb_free(errptr);
+    if(bf.base) free(bf.base);
+    if(bval) free(bval);
+    return -1;
+}
+
 struct kyk_bkey_val* kyk_read_block(struct kyk_block_db* blk_db,
 				    const char* blk_hash,
 				    char** errptr
@@ -116,13 +212,13 @@ void unpack_bval_buf(struct kyk_bkey_val *bval,
     }
 
     if(bval -> nStatus & BLOCK_HAVE_DATA){
-	ofst = read_varint(bufp, buf -> len - count, &bval -> nDataPos);
+	ofst = read_varint64(bufp, buf -> len - count, &bval -> nDataPos);
 	bufp += ofst;
 	count += ofst;
     }
 
     if(bval -> nStatus & BLOCK_HAVE_UNDO){
-	ofst = read_varint(bufp, buf -> len - count, &bval -> nUndoPos);
+	ofst = read_varint64(bufp, buf -> len - count, &bval -> nUndoPos);
 	bufp += ofst;
 	count += ofst;
     }
@@ -175,9 +271,9 @@ size_t kyk_ser_bval(uint8_t *buf, struct kyk_bkey_val *bval)
     buf += ofst;
     ofst = pack_varint(buf, bval -> nFile);
     buf += ofst;
-    ofst = pack_varint(buf, bval -> nDataPos);
+    ofst = pack_varint64(buf, bval -> nDataPos);
     buf += ofst;
-    ofst = pack_varint(buf, bval -> nUndoPos);
+    ofst = pack_varint64(buf, bval -> nUndoPos);
     buf += ofst;
 
     ofst = kyk_seri_blk_hd(buf, bval -> blk_hd);
@@ -3,6 +3,16 @@
 
 #include "kyk_ldb.h"
 
+/* the first byte of every key in the block index db, defined in block_store.c */
+extern const char DB_COIN;          /* chainstate coins */
+extern const char DB_BLOCK_FILES;   /* blk file info */
+extern const char DB_TXINDEX;       /* tx index */
+extern const char DB_BLOCK_INDEX;   /* block index */
+extern const char DB_BEST_BLOCK;    /* block the chainstate is flushed at */
+extern const char DB_HEAD_BLOCKS;   /* last connected block */
+extern const char DB_FLAG;          /* named flags */
+extern const char DB_LAST_BLOCK;    /* blk file being appended */
+
 void kyk_store_block(struct kyk_block_db* blk_db,
 		     struct kyk_bkey_val* bval,
 		     char **errptr
@@ -13,4 +23,14 @@ struct kyk_bkey_val* kyk_read_block(struct kyk_block_db* blk_db,
 				    char** errptr
     );
 
+int kyk_find_block(struct kyk_block_db* blk_db,
+		   const char* blk_hash,
+		   struct kyk_bkey_val** new_bval);
+
+void kyk_batch_store_block(leveldb_writebatch_t* batch, struct kyk_bkey_val* bval);
+
+void kyk_batch_store_head_block(leveldb_writebatch_t* batch, const uint8_t* blk_hash);
+
+int kyk_read_head_block(struct kyk_block_db* blk_db, uint8_t* blk_hash, int* found);
+
 #endif
@@ -58,7 +58,8 @@ struct kyk_block* make_gens_block()
     blk_hd -> nonce = 0;
     blk_size += KYK_BLK_HD_LEN;
 
-    kyk_hash_nonce(blk_hd);
+    res = kyk_hash_nonce(blk_hd);
+    check(res == 0, "Failed to make_gens_block: kyk_hash_nonce failed");
     blk -> magic_no = KYK_BLK_MAGIC_NO;
     blk -> blk_size = blk_size;
 
@@ -22,10 +22,8 @@ static uint8_t MAIN_NW = 0x00;
 
 char *kyk_make_address_from_pubkey(uint8_t *pub, size_t pub_len)
 {
-    uint8_t dgst2[SHA256_DIGEST_LENGTH];
     uint8_t dgst3[20];
     uint8_t dgst4[21];
-    uint8_t dgst5[32];
     uint8_t dgst6[32];
     uint8_t dgst7[4];
     uint8_t dgst8[25];
@@ -33,14 +31,9 @@ char *kyk_make_address_from_pubkey(uint8_t *pub, size_t pub_len)
 
     /*
      * 2 - Perform SHA-256 hashing on the public key
-     */
-    kyk_dgst_sha256(dgst2, pub, pub_len);
-    
-    
-    /*
      * 3 - Perform RIPEMD-160 hashing on the result of SHA-256
      */
-    kyk_dgst_rmd160(dgst3, dgst2, sizeof(dgst2));
+    kyk_dgst_hash160(dgst3, pub, pub_len);
     
 
     /*
@@ -51,14 +44,9 @@ char *kyk_make_address_from_pubkey(uint8_t *pub, size_t pub_len)
 
     /*
      * 5 - Perform SHA-256 hash on the extended RIPEMD-160 result
-     */
-    kyk_dgst_sha256(dgst5, dgst4, sizeof(dgst4));
-    
-
-    /*
      * 6 - Perform SHA-256 hash on the result of the previous SHA-256 hash
      */
-    kyk_dgst_sha256(dgst6, dgst5, sizeof(dgst5));
+    kyk_dgst_hash256(dgst6, dgst4, sizeof(dgst4));
 
     
     /*
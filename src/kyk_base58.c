@@ -70,6 +70,7 @@ char *kyk_base58(const uint8_t *bytes, size_t len)
 
 char *kyk_base58check(uint8_t addrtype, const uint8_t *bytes, size_t len)
 {
+    struct kyk_hash256_ctx ctx;
     size_t check_len;
     uint8_t *check;
     uint8_t digest[32];
@@ -81,7 +82,10 @@ char *kyk_base58check(uint8_t addrtype, const uint8_t *bytes, size_t len)
     check[0] = addrtype;
     memcpy(check + 1, bytes, len);
 
-    kyk_dgst_hash256(digest, check, len + 1);
+    kyk_hash256_init(&ctx);
+    kyk_hash256_update(&ctx, &addrtype, 1);
+    kyk_hash256_update(&ctx, bytes, len);
+    kyk_hash256_final(&ctx, digest);
     
     memcpy(check + 1 + len, digest, 4);
 
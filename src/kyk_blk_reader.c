@@ -0,0 +1,457 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "kyk_utils.h"
+#include "beej_pack.h"
+#include "kyk_block.h"
+#include "kyk_blk_reader.h"
+#include "dbg.h"
+
+#define BLK_CACHE_BUCKETS 1024
+
+/* magic number and block size precede the block */
+#define BLK_PREFIX_LEN 8
+
+static int blk_reader_map(struct kyk_blk_reader* reader,
+			  int nFile,
+			  size_t need_len,
+			  struct kyk_blk_map** new_map);
+static int blk_reader_view(struct kyk_blk_reader* reader,
+			   int nFile,
+			   uint64_t nDataPos,
+			   const uint8_t** new_buf,
+			   uint32_t* blk_size);
+static struct kyk_cached_blk* blk_cache_find(struct kyk_blk_reader* reader,
+					     int nFile,
+					     uint64_t nDataPos);
+static void blk_cache_insert(struct kyk_blk_reader* reader, struct kyk_cached_blk* cblk);
+static void blk_cache_touch(struct kyk_blk_reader* reader, struct kyk_cached_blk* cblk);
+static void blk_cache_evict(struct kyk_blk_reader* reader);
+static size_t blk_cache_bucket(const struct kyk_blk_reader* reader, int nFile, uint64_t nDataPos);
+static void free_blk_map(struct kyk_blk_map* map);
+
+int kyk_new_blk_reader(struct kyk_blk_reader** new_reader,
+		       const char* blk_dir,
+		       size_t cache_max)
+{
+    struct kyk_blk_reader* reader = NULL;
+    int res = -1;
+
+    check(new_reader, "Failed to kyk_new_blk_reader: new_reader is NULL");
+    check(blk_dir, "Failed to kyk_new_blk_reader: blk_dir is NULL");
+
+    reader = calloc(1, sizeof(*reader));
+    check(reader, "Failed to kyk_new_blk_reader: calloc failed");
+
+    reader -> blk_dir = kyk_asprintf("%s", blk_dir);
+    check(reader -> blk_dir, "Failed to kyk_new_blk_reader: kyk_asprintf failed");
+
+    reader -> bucket_count = BLK_CACHE_BUCKETS;
+    reader -> buckets = calloc(reader -> bucket_count, sizeof(*reader -> buckets));
+    check(reader -> buckets, "Failed to kyk_new_blk_reader: buckets calloc failed");
+
+    reader -> cache_max = cache_max;
+
+    res = pthread_mutex_init(&reader -> lock, NULL);
+    check(res == 0, "Failed to kyk_new_blk_reader: pthread_mutex_init failed");
+
+    *new_reader = reader;
+
+    return 0;
+
+error:
+    if(reader){
+	if(reader -> blk_dir) free(reader -> blk_dir);
+	if(reader -> buckets) free(reader -> buckets);
+	free(reader);
+    }
+    return -1;
+}
+
+void kyk_free_blk_reader(struct kyk_blk_reader* reader)
+{
+    struct kyk_cached_blk* cblk = NULL;
+    struct kyk_cached_blk* next = NULL;
+    size_t i = 0;
+
+    if(reader == NULL){
+	return;
+    }
+
+    for(cblk = reader -> lru_hd; cblk; cblk = next){
+	next = cblk -> next;
+	kyk_free_block(cblk -> blk);
+	free(cblk);
+    }
+
+    for(i = 0; i < reader -> map_count; i++){
+	free_blk_map(reader -> map_list[i]);
+    }
+
+    pthread_mutex_destroy(&reader -> lock);
+    free(reader -> map_list);
+    free(reader -> buckets);
+    free(reader -> blk_dir);
+    free(reader);
+}
+
+/* the view stays valid until the reader is freed */
+int kyk_blk_reader_get_view(struct kyk_blk_reader* reader,
+			    int nFile,
+			    uint64_t nDataPos,
+			    const uint8_t** new_buf,
+			    uint32_t* blk_size)
+{
+    int res = -1;
+
+    check(reader, "Failed to kyk_blk_reader_get_view: reader is NULL");
+    check(new_buf, "Failed to kyk_blk_reader_get_view: new_buf is NULL");
+    check(blk_size, "Failed to kyk_blk_reader_get_view: blk_size is NULL");
+
+    pthread_mutex_lock(&reader -> lock);
+    res = blk_reader_view(reader, nFile, nDataPos, new_buf, blk_size);
+    pthread_mutex_unlock(&reader -> lock);
+    check(res == 0, "Failed to kyk_blk_reader_get_view: blk_reader_view failed");
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* the block is pinned in the cache until kyk_blk_reader_put_block */
+int kyk_blk_reader_get_block(struct kyk_blk_reader* reader,
+			     int nFile,
+			     uint64_t nDataPos,
+			     struct kyk_cached_blk** new_cblk)
+{
+    struct kyk_cached_blk* cblk = NULL;
+    struct kyk_cached_blk* found = NULL;
+    struct kyk_block* blk = NULL;
+    const uint8_t* buf = NULL;
+    uint32_t blk_size = 0;
+    size_t checksize = 0;
+    int res = -1;
+
+    check(reader, "Failed to kyk_blk_reader_get_block: reader is NULL");
+    check(new_cblk, "Failed to kyk_blk_reader_get_block: new_cblk is NULL");
+
+    pthread_mutex_lock(&reader -> lock);
+    found = blk_cache_find(reader, nFile, nDataPos);
+    if(found){
+	found -> refs++;
+	blk_cache_touch(reader, found);
+	pthread_mutex_unlock(&reader -> lock);
+	*new_cblk = found;
+	return 0;
+    }
+    res = blk_reader_view(reader, nFile, nDataPos, &buf, &blk_size);
+    pthread_mutex_unlock(&reader -> lock);
+    check(res == 0, "Failed to kyk_blk_reader_get_block: blk_reader_view failed");
+
+    /* the view outlives the lock, parse without holding it */
+    blk = calloc(1, sizeof(*blk));
+    check(blk, "Failed to kyk_blk_reader_get_block: blk calloc failed");
+
+    beej_unpack(buf - BLK_PREFIX_LEN, "<L", &blk -> magic_no);
+
+    res = kyk_deseri_block(blk, buf, &checksize);
+    check(res == 0, "Failed to kyk_blk_reader_get_block: kyk_deseri_block failed");
+    check(checksize == blk_size, "Failed to kyk_blk_reader_get_block: block size does not match");
+
+    cblk = calloc(1, sizeof(*cblk));
+    check(cblk, "Failed to kyk_blk_reader_get_block: cblk calloc failed");
+
+    cblk -> blk = blk;
+    cblk -> nFile = nFile;
+    cblk -> nDataPos = nDataPos;
+    cblk -> size = blk_size;
+    cblk -> refs = 1;
+
+    pthread_mutex_lock(&reader -> lock);
+    found = blk_cache_find(reader, nFile, nDataPos);
+    if(found){
+	/* another thread parsed it first */
+	found -> refs++;
+	blk_cache_touch(reader, found);
+    } else {
+	blk_cache_insert(reader, cblk);
+	blk_cache_evict(reader);
+    }
+    pthread_mutex_unlock(&reader -> lock);
+
+    if(found){
+	kyk_free_block(blk);
+	free(cblk);
+	cblk = found;
+    }
+
+    *new_cblk = cblk;
+
+    return 0;
+
+error:
+    if(blk) kyk_free_block(blk);
+    return -1;
+}
+
+void kyk_blk_reader_put_block(struct kyk_blk_reader* reader, struct kyk_cached_blk* cblk)
+{
+    if(reader == NULL || cblk == NULL){
+	return;
+    }
+
+    pthread_mutex_lock(&reader -> lock);
+    cblk -> refs--;
+    if(cblk -> refs == 0){
+	blk_cache_evict(reader);
+    }
+    pthread_mutex_unlock(&reader -> lock);
+}
+
+/* maps the file if it is not yet, and again if it is shorter than need_len */
+int blk_reader_map(struct kyk_blk_reader* reader,
+		   int nFile,
+		   size_t need_len,
+		   struct kyk_blk_map** new_map)
+{
+    struct kyk_blk_map** map_list = NULL;
+    struct kyk_blk_map* map = NULL;
+    struct kyk_blk_map* new = NULL;
+    char* blk_file_path = NULL;
+    struct stat st;
+    size_t page_size = 0;
+    size_t map_len = 0;
+    int res = -1;
+
+    check(nFile >= 0, "Failed to blk_reader_map: invalid nFile");
+
+    if((size_t)nFile >= reader -> map_count){
+	map_list = realloc(reader -> map_list, (nFile + 1) * sizeof(*map_list));
+	check(map_list, "Failed to blk_reader_map: map_list realloc failed");
+	memset(map_list + reader -> map_count, 0, (nFile + 1 - reader -> map_count) * sizeof(*map_list));
+	reader -> map_list = map_list;
+	reader -> map_count = nFile + 1;
+    }
+
+    map = reader -> map_list[nFile];
+    if(map && need_len <= map -> file_len){
+	*new_map = map;
+	return 0;
+    }
+
+    if(map == NULL){
+	new = calloc(1, sizeof(*new));
+	check(new, "Failed to blk_reader_map: calloc failed");
+	new -> fd = -1;
+
+	blk_file_path = kyk_asprintf("%s/blk%05d.dat", reader -> blk_dir, nFile);
+	check(blk_file_path, "Failed to blk_reader_map: kyk_asprintf failed");
+
+	new -> fd = open(blk_file_path, O_RDONLY);
+	check(new -> fd != -1, "Failed to blk_reader_map: open %s failed", blk_file_path);
+
+	free(blk_file_path);
+	blk_file_path = NULL;
+
+	map = new;
+    }
+
+    res = fstat(map -> fd, &st);
+    check(res == 0, "Failed to blk_reader_map: fstat failed");
+    check((size_t)st.st_size >= need_len, "Failed to blk_reader_map: the block is out of the file");
+
+    if((size_t)st.st_size > map -> map_len){
+	if(map -> addr){
+	    /* keep the replaced map, its views may still be read */
+	    new = calloc(1, sizeof(*new));
+	    check(new, "Failed to blk_reader_map: calloc failed");
+	    *new = *map;
+	    map -> old = new;
+	    map -> addr = NULL;
+	    new = NULL;
+	}
+
+	page_size = sysconf(_SC_PAGESIZE);
+	map_len = (st.st_size * 2 + page_size - 1) / page_size * page_size;
+
+	map -> addr = mmap(NULL, map_len, PROT_READ, MAP_SHARED, map -> fd, 0);
+	check(map -> addr != MAP_FAILED, "Failed to blk_reader_map: mmap failed");
+	map -> map_len = map_len;
+    }
+
+    map -> file_len = st.st_size;
+    reader -> map_list[nFile] = map;
+    *new_map = map;
+
+    return 0;
+
+error:
+    if(blk_file_path) free(blk_file_path);
+    if(map && map -> addr == MAP_FAILED){
+	map -> addr = NULL;
+	map -> map_len = 0;
+	map -> file_len = 0;
+    }
+    if(new) free_blk_map(new);
+    return -1;
+}
+
+/* call with the lock held */
+int blk_reader_view(struct kyk_blk_reader* reader,
+		    int nFile,
+		    uint64_t nDataPos,
+		    const uint8_t** new_buf,
+		    uint32_t* blk_size)
+{
+    struct kyk_blk_map* map = NULL;
+    uint32_t size = 0;
+    int res = -1;
+
+    check(nDataPos >= BLK_PREFIX_LEN, "Failed to blk_reader_view: nDataPos is invalid");
+
+    res = blk_reader_map(reader, nFile, nDataPos, &map);
+    check(res == 0, "Failed to blk_reader_view: blk_reader_map failed");
+
+    beej_unpack(map -> addr + nDataPos - BLK_PREFIX_LEN + sizeof(uint32_t), "<L", &size);
+    check(size > 0, "Failed to blk_reader_view: block size is invalid");
+
+    res = blk_reader_map(reader, nFile, nDataPos + size, &map);
+    check(res == 0, "Failed to blk_reader_view: block size is out of the file");
+
+    *new_buf = map -> addr + nDataPos;
+    *blk_size = size;
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+struct kyk_cached_blk* blk_cache_find(struct kyk_blk_reader* reader,
+				      int nFile,
+				      uint64_t nDataPos)
+{
+    struct kyk_cached_blk* cblk = NULL;
+
+    cblk = reader -> buckets[blk_cache_bucket(reader, nFile, nDataPos)];
+    while(cblk){
+	if(cblk -> nFile == nFile && cblk -> nDataPos == nDataPos){
+	    return cblk;
+	}
+	cblk = cblk -> hnext;
+    }
+
+    return NULL;
+}
+
+void blk_cache_insert(struct kyk_blk_reader* reader, struct kyk_cached_blk* cblk)
+{
+    size_t i = blk_cache_bucket(reader, cblk -> nFile, cblk -> nDataPos);
+
+    cblk -> hnext = reader -> buckets[i];
+    reader -> buckets[i] = cblk;
+
+    cblk -> prev = NULL;
+    cblk -> next = reader -> lru_hd;
+    if(reader -> lru_hd){
+	reader -> lru_hd -> prev = cblk;
+    } else {
+	reader -> lru_tail = cblk;
+    }
+    reader -> lru_hd = cblk;
+
+    reader -> cache_bytes += cblk -> size;
+}
+
+void blk_cache_touch(struct kyk_blk_reader* reader, struct kyk_cached_blk* cblk)
+{
+    if(reader -> lru_hd == cblk){
+	return;
+    }
+
+    cblk -> prev -> next = cblk -> next;
+    if(cblk -> next){
+	cblk -> next -> prev = cblk -> prev;
+    } else {
+	reader -> lru_tail = cblk -> prev;
+    }
+
+    cblk -> prev = NULL;
+    cblk -> next = reader -> lru_hd;
+    reader -> lru_hd -> prev = cblk;
+    reader -> lru_hd = cblk;
+}
+
+/* drops the least recently used blocks nobody holds until the cache fits */
+void blk_cache_evict(struct kyk_blk_reader* reader)
+{
+    struct kyk_cached_blk* cblk = reader -> lru_tail;
+    struct kyk_cached_blk* prev = NULL;
+    struct kyk_cached_blk** pp = NULL;
+
+    while(cblk && reader -> cache_bytes > reader -> cache_max){
+	prev = cblk -> prev;
+	if(cblk -> refs > 0){
+	    cblk = prev;
+	    continue;
+	}
+
+	pp = reader -> buckets + blk_cache_bucket(reader, cblk -> nFile, cblk -> nDataPos);
+	while(*pp != cblk){
+	    pp = &(*pp) -> hnext;
+	}
+	*pp = cblk -> hnext;
+
+	if(prev){
+	    prev -> next = cblk -> next;
+	} else {
+	    reader -> lru_hd = cblk -> next;
+	}
+	if(cblk -> next){
+	    cblk -> next -> prev = prev;
+	} else {
+	    reader -> lru_tail = prev;
+	}
+
+	reader -> cache_bytes -= cblk -> size;
+	kyk_free_block(cblk -> blk);
+	free(cblk);
+
+	cblk = prev;
+    }
+}
+
+size_t blk_cache_bucket(const struct kyk_blk_reader* reader, int nFile, uint64_t nDataPos)
+{
+    uint32_t h = (uint32_t)nFile * 2654435761u ^ (uint32_t)(nDataPos ^ nDataPos >> 32) * 2246822519u;
+
+    return h % reader -> bucket_count;
+}
+
+void free_blk_map(struct kyk_blk_map* map)
+{
+    struct kyk_blk_map* old = NULL;
+
+    if(map == NULL){
+	return;
+    }
+
+    if(map -> fd != -1) close(map -> fd);
+
+    while(map){
+	old = map -> old;
+	if(map -> addr) munmap(map -> addr, map -> map_len);
+	free(map);
+	map = old;
+    }
+}
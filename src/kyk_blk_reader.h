@@ -0,0 +1,72 @@
+#ifndef KYK_BLK_READER_H__
+#define KYK_BLK_READER_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "kyk_block.h"
+
+/*
+ * Reads blocks out of the blk*.dat files without a syscall per block.
+ * Each file is mapped once, read only, and blocks are handed out as views into the map
+ * by (nFile, nDataPos), the position of the block bytes past magic number and size.
+ * The map is shared and reserved at twice the file size, blocks appended later show up in it
+ * and the file is mapped again only once it outgrows the reservation.
+ * The map it replaces stays until the reader is freed, views of it may still be in use.
+ *
+ * Deserialized blocks are kept in an lru cache that holds about cache_max serialized block bytes.
+ * A cached block is pinned from get to put and is not evicted while pinned.
+ * The reader takes its own lock, getdata is served by several threads at once.
+ */
+struct kyk_blk_map {
+    int fd;
+    uint8_t* addr;
+    size_t map_len;
+    size_t file_len;                  /* bytes of the file when it was mapped, views stay below */
+    struct kyk_blk_map* old;          /* replaced maps of the same file */
+};
+
+struct kyk_cached_blk {
+    struct kyk_block* blk;
+    int nFile;
+    uint64_t nDataPos;
+    size_t size;
+    int refs;
+    struct kyk_cached_blk* prev;      /* lru list, most recently used first */
+    struct kyk_cached_blk* next;
+    struct kyk_cached_blk* hnext;     /* bucket chain */
+};
+
+struct kyk_blk_reader {
+    pthread_mutex_t lock;
+    char* blk_dir;
+    struct kyk_blk_map** map_list;    /* by nFile */
+    size_t map_count;
+    struct kyk_cached_blk** buckets;
+    size_t bucket_count;
+    struct kyk_cached_blk* lru_hd;
+    struct kyk_cached_blk* lru_tail;
+    size_t cache_bytes;
+    size_t cache_max;
+};
+
+int kyk_new_blk_reader(struct kyk_blk_reader** new_reader,
+		       const char* blk_dir,
+		       size_t cache_max);
+
+void kyk_free_blk_reader(struct kyk_blk_reader* reader);
+
+int kyk_blk_reader_get_view(struct kyk_blk_reader* reader,
+			    int nFile,
+			    uint64_t nDataPos,
+			    const uint8_t** new_buf,
+			    uint32_t* blk_size);
+
+int kyk_blk_reader_get_block(struct kyk_blk_reader* reader,
+			     int nFile,
+			     uint64_t nDataPos,
+			     struct kyk_cached_blk** new_cblk);
+
+void kyk_blk_reader_put_block(struct kyk_blk_reader* reader, struct kyk_cached_blk* cblk);
+
+#endif
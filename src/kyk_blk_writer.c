@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "kyk_utils.h"
+#include "beej_pack.h"
+#include "kyk_block.h"
+#include "kyk_file.h"
+#include "kyk_blk_writer.h"
+#include "block_store.h"
+#include "dbg.h"
+
+/* 'f' | nFile big endian */
+#define BLK_FILE_KEY_LEN (1 + 4)
+/* nBlocks, nSize, nTimeFirst, nTimeLast little endian */
+#define BLK_FILE_VAL_LEN (4 + 8 + 4 + 4)
+
+static int blk_writer_load(struct kyk_blk_writer* writer);
+static int blk_writer_open(struct kyk_blk_writer* writer);
+static int blk_writer_finish_file(struct kyk_blk_writer* writer);
+static int blk_writer_alloc(struct kyk_blk_writer* writer, uint64_t need_len);
+static int blk_writer_store_info(struct kyk_blk_writer* writer, leveldb_writebatch_t* batch);
+static char* blk_file_path(const char* blk_dir, int nFile);
+static void blk_file_key(char* key, int nFile);
+
+int kyk_new_blk_writer(struct kyk_blk_writer** new_writer,
+		       const char* blk_dir,
+		       struct kyk_block_db* db,
+		       uint64_t file_max,
+		       uint64_t chunk_size)
+{
+    struct kyk_blk_writer* writer = NULL;
+    int res = -1;
+
+    check(new_writer, "Failed to kyk_new_blk_writer: new_writer is NULL");
+    check(blk_dir, "Failed to kyk_new_blk_writer: blk_dir is NULL");
+    check(db, "Failed to kyk_new_blk_writer: db is NULL");
+    check(file_max > 0, "Failed to kyk_new_blk_writer: invalid file_max");
+    check(chunk_size > 0, "Failed to kyk_new_blk_writer: invalid chunk_size");
+
+    writer = calloc(1, sizeof(*writer));
+    check(writer, "Failed to kyk_new_blk_writer: calloc failed");
+
+    writer -> fd = -1;
+    writer -> db = db;
+    writer -> file_max = file_max;
+    writer -> chunk_size = chunk_size;
+
+    writer -> blk_dir = kyk_asprintf("%s", blk_dir);
+    check(writer -> blk_dir, "Failed to kyk_new_blk_writer: kyk_asprintf failed");
+
+    res = blk_writer_load(writer);
+    check(res == 0, "Failed to kyk_new_blk_writer: blk_writer_load failed");
+
+    *new_writer = writer;
+
+    return 0;
+
+error:
+    if(writer) kyk_free_blk_writer(writer);
+    return -1;
+}
+
+/* the preallocation of the current file is kept, the next writer goes on after nSize */
+void kyk_free_blk_writer(struct kyk_blk_writer* writer)
+{
+    if(writer == NULL){
+	return;
+    }
+
+    if(writer -> fd != -1) close(writer -> fd);
+    if(writer -> blk_dir) free(writer -> blk_dir);
+    free(writer);
+}
+
+/* batch NULL writes the 'f' and 'l' records right away */
+int kyk_blk_writer_write(struct kyk_blk_writer* writer,
+			 const struct kyk_block* blk,
+			 leveldb_writebatch_t* batch,
+			 int* nFile,
+			 uint64_t* nDataPos)
+{
+    uint8_t* buf = NULL;
+    size_t buf_len = 0;
+    size_t len = 0;
+    uint64_t pos = 0;
+    int res = -1;
+
+    check(writer, "Failed to kyk_blk_writer_write: writer is NULL");
+    check(blk, "Failed to kyk_blk_writer_write: blk is NULL");
+    check(nFile, "Failed to kyk_blk_writer_write: nFile is NULL");
+    check(nDataPos, "Failed to kyk_blk_writer_write: nDataPos is NULL");
+
+    res = kyk_get_blkself_size(blk, &buf_len);
+    check(res == 0, "Failed to kyk_blk_writer_write: kyk_get_blkself_size failed");
+
+    buf = calloc(buf_len, sizeof(*buf));
+    check(buf, "Failed to kyk_blk_writer_write: buf calloc failed");
+
+    res = kyk_seri_blkself(buf, blk, &len);
+    check(res == 0, "Failed to kyk_blk_writer_write: kyk_seri_blkself failed");
+    check(len == buf_len, "Failed to kyk_blk_writer_write: kyk_seri_blkself size does not match");
+
+    /* a block larger than file_max still gets a file of its own */
+    if(writer -> info.nSize > 0 && writer -> info.nSize + buf_len > writer -> file_max){
+	res = blk_writer_finish_file(writer);
+	check(res == 0, "Failed to kyk_blk_writer_write: blk_writer_finish_file failed");
+    }
+
+    if(writer -> fd == -1){
+	res = blk_writer_open(writer);
+	check(res == 0, "Failed to kyk_blk_writer_write: blk_writer_open failed");
+    }
+
+    res = blk_writer_alloc(writer, writer -> info.nSize + buf_len);
+    check(res == 0, "Failed to kyk_blk_writer_write: blk_writer_alloc failed");
+
+    pos = writer -> info.nSize;
+    res = kyk_file_pwrite_all(writer -> fd, pos, buf, buf_len);
+    check(res == 0, "Failed to kyk_blk_writer_write: kyk_file_pwrite_all failed");
+
+    if(writer -> info.nBlocks == 0){
+	writer -> info.nTimeFirst = blk -> hd -> tts;
+    }
+    writer -> info.nTimeLast = blk -> hd -> tts;
+    writer -> info.nBlocks += 1;
+    writer -> info.nSize += buf_len;
+
+    res = blk_writer_store_info(writer, batch);
+    check(res == 0, "Failed to kyk_blk_writer_write: blk_writer_store_info failed");
+
+    *nFile = writer -> nFile;
+    *nDataPos = pos + sizeof(blk -> magic_no) + sizeof(blk -> blk_size);
+
+    free(buf);
+
+    return 0;
+
+error:
+    if(buf) free(buf);
+    return -1;
+}
+
+/* the blocks written so far are on the disk */
+int kyk_blk_writer_sync(struct kyk_blk_writer* writer)
+{
+    int res = -1;
+
+    check(writer, "Failed to kyk_blk_writer_sync: writer is NULL");
+
+    if(writer -> fd == -1){
+	return 0;
+    }
+
+    res = fdatasync(writer -> fd);
+    check(res == 0, "Failed to kyk_blk_writer_sync: fdatasync failed");
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/*
+ * Takes the writer back to where it was before writes whose batch was never written,
+ * the next block goes over the bytes they left behind.
+ */
+void kyk_blk_writer_rewind(struct kyk_blk_writer* writer,
+			   int nFile,
+			   const struct kyk_blk_file_info* info)
+{
+    if(writer -> nFile != nFile){
+	if(writer -> fd != -1){
+	    close(writer -> fd);
+	    writer -> fd = -1;
+	}
+	writer -> nAlloc = 0;
+	writer -> nFile = nFile;
+    }
+    writer -> info = *info;
+}
+
+/* a file without an 'f' record reads as empty */
+int kyk_read_blk_file_info(struct kyk_block_db* db,
+			   int nFile,
+			   struct kyk_blk_file_info* info)
+{
+    char key[BLK_FILE_KEY_LEN];
+    char* val = NULL;
+    char* errptr = NULL;
+    size_t vlen = 0;
+
+    check(db, "Failed to kyk_read_blk_file_info: db is NULL");
+    check(info, "Failed to kyk_read_blk_file_info: info is NULL");
+
+    memset(info, 0, sizeof(*info));
+
+    blk_file_key(key, nFile);
+    val = leveldb_get(db -> db, db -> rd_opts, key, sizeof(key), &vlen, &errptr);
+    check(errptr == NULL, "Failed to kyk_read_blk_file_info: leveldb_get failed: %s", errptr);
+
+    if(val){
+	check(vlen == BLK_FILE_VAL_LEN, "Failed to kyk_read_blk_file_info: invalid 'f' record");
+	beej_unpack((unsigned char*)val, "<L<Q<L<L",
+		    &info -> nBlocks,
+		    &info -> nSize,
+		    &info -> nTimeFirst,
+		    &info -> nTimeLast);
+	leveldb_free(val);
+    }
+
+    return 0;
+
+error:
+    if(errptr) leveldb_free(errptr);
+    if(val) leveldb_free(val);
+    return -1;
+}
+
+/*
+ * The 'l' record names the file to go on with.
+ * Without it the blocks were written before the writer kept records,
+ * the last blk*.dat file is taken as it is, it has no preallocation.
+ */
+int blk_writer_load(struct kyk_blk_writer* writer)
+{
+    char* val = NULL;
+    char* errptr = NULL;
+    char* path = NULL;
+    struct stat st;
+    uint32_t n = 0;
+    size_t vlen = 0;
+    int res = -1;
+
+    val = leveldb_get(writer -> db -> db, writer -> db -> rd_opts, &DB_LAST_BLOCK, sizeof(DB_LAST_BLOCK), &vlen, &errptr);
+    check(errptr == NULL, "Failed to blk_writer_load: leveldb_get failed: %s", errptr);
+
+    if(val){
+	check(vlen == sizeof(n), "Failed to blk_writer_load: invalid 'l' record");
+	beej_unpack((unsigned char*)val, "<L", &n);
+	leveldb_free(val);
+	val = NULL;
+
+	writer -> nFile = n;
+	res = kyk_read_blk_file_info(writer -> db, writer -> nFile, &writer -> info);
+	check(res == 0, "Failed to blk_writer_load: kyk_read_blk_file_info failed");
+
+	return 0;
+    }
+
+    writer -> nFile = 0;
+    while(1){
+	path = blk_file_path(writer -> blk_dir, writer -> nFile + 1);
+	check(path, "Failed to blk_writer_load: blk_file_path failed");
+	if(!kyk_file_exists(path)){
+	    break;
+	}
+	free(path);
+	writer -> nFile += 1;
+    }
+    free(path);
+
+    path = blk_file_path(writer -> blk_dir, writer -> nFile);
+    check(path, "Failed to blk_writer_load: blk_file_path failed");
+    if(stat(path, &st) == 0){
+	writer -> info.nSize = st.st_size;
+    }
+    free(path);
+
+    return 0;
+
+error:
+    if(errptr) leveldb_free(errptr);
+    if(val) leveldb_free(val);
+    return -1;
+}
+
+int blk_writer_open(struct kyk_blk_writer* writer)
+{
+    char* path = NULL;
+    struct stat st;
+    int res = -1;
+
+    path = blk_file_path(writer -> blk_dir, writer -> nFile);
+    check(path, "Failed to blk_writer_open: blk_file_path failed");
+
+    writer -> fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    check(writer -> fd != -1, "Failed to blk_writer_open: open %s failed", path);
+
+    res = fstat(writer -> fd, &st);
+    check(res == 0, "Failed to blk_writer_open: fstat failed");
+
+    writer -> nAlloc = st.st_size;
+
+    free(path);
+
+    return 0;
+
+error:
+    if(path) free(path);
+    if(writer -> fd != -1){
+	close(writer -> fd);
+	writer -> fd = -1;
+    }
+    return -1;
+}
+
+/* gives back the preallocation the file will not use and moves on to the next file */
+int blk_writer_finish_file(struct kyk_blk_writer* writer)
+{
+    int res = -1;
+
+    if(writer -> fd == -1){
+	res = blk_writer_open(writer);
+	check(res == 0, "Failed to blk_writer_finish_file: blk_writer_open failed");
+    }
+
+    if(writer -> nAlloc > writer -> info.nSize){
+	res = ftruncate(writer -> fd, writer -> info.nSize);
+	check(res == 0, "Failed to blk_writer_finish_file: ftruncate failed");
+    }
+
+    res = fdatasync(writer -> fd);
+    check(res == 0, "Failed to blk_writer_finish_file: fdatasync failed");
+
+    close(writer -> fd);
+    writer -> fd = -1;
+    writer -> nAlloc = 0;
+    writer -> nFile += 1;
+    memset(&writer -> info, 0, sizeof(writer -> info));
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* a file system that can not preallocate has the file grow on write instead */
+int blk_writer_alloc(struct kyk_blk_writer* writer, uint64_t need_len)
+{
+    uint64_t alloc_len = 0;
+    int res = -1;
+
+    if(need_len <= writer -> nAlloc){
+	return 0;
+    }
+
+    alloc_len = (need_len + writer -> chunk_size - 1) / writer -> chunk_size * writer -> chunk_size;
+    if(alloc_len > writer -> file_max){
+	alloc_len = writer -> file_max > need_len ? writer -> file_max : need_len;
+    }
+
+    res = posix_fallocate(writer -> fd, writer -> nAlloc, alloc_len - writer -> nAlloc);
+    if(res != 0){
+	log_warn("blk_writer_alloc: posix_fallocate failed: %s", strerror(res));
+	return 0;
+    }
+
+    writer -> nAlloc = alloc_len;
+
+    return 0;
+}
+
+int blk_writer_store_info(struct kyk_blk_writer* writer, leveldb_writebatch_t* batch)
+{
+    leveldb_writebatch_t* own_batch = NULL;
+    char key[BLK_FILE_KEY_LEN];
+    uint8_t val[BLK_FILE_VAL_LEN];
+    uint8_t last[4];
+    char* errptr = NULL;
+
+    blk_file_key(key, writer -> nFile);
+    beej_pack(val, "<L<Q<L<L",
+	      writer -> info.nBlocks,
+	      (unsigned long long int)writer -> info.nSize,
+	      writer -> info.nTimeFirst,
+	      writer -> info.nTimeLast);
+    beej_pack(last, "<L", (uint32_t)writer -> nFile);
+
+    if(batch == NULL){
+	own_batch = leveldb_writebatch_create();
+	check(own_batch, "Failed to blk_writer_store_info: leveldb_writebatch_create failed");
+    }
+
+    leveldb_writebatch_put(batch ? batch : own_batch, key, sizeof(key), (const char*)val, sizeof(val));
+    leveldb_writebatch_put(batch ? batch : own_batch, &DB_LAST_BLOCK, sizeof(DB_LAST_BLOCK), (const char*)last, sizeof(last));
+
+    if(own_batch){
+	leveldb_write(writer -> db -> db, writer -> db -> wr_opts, own_batch, &errptr);
+	check(errptr == NULL, "Failed to blk_writer_store_info: leveldb_write failed: %s", errptr);
+	leveldb_writebatch_destroy(own_batch);
+    }
+
+    return 0;
+
+error:
+    if(errptr) leveldb_free(errptr);
+    if(own_batch) leveldb_writebatch_destroy(own_batch);
+    return -1;
+}
+
+char* blk_file_path(const char* blk_dir, int nFile)
+{
+    return kyk_asprintf("%s/blk%05d.dat", blk_dir, nFile);
+}
+
+void blk_file_key(char* key, int nFile)
+{
+    key[0] = DB_BLOCK_FILES;
+    beej_pack((unsigned char*)key + 1, ">L", (uint32_t)nFile);
+}
@@ -0,0 +1,60 @@
+#ifndef KYK_BLK_WRITER_H__
+#define KYK_BLK_WRITER_H__
+
+#include <stdint.h>
+
+#include "kyk_ldb.h"
+#include "kyk_block.h"
+
+/* what the 'f' record of the block index db says about one blk*.dat file */
+struct kyk_blk_file_info {
+    uint32_t nBlocks;
+    uint64_t nSize;              /* bytes used, the file may be preallocated past them */
+    uint32_t nTimeFirst;
+    uint32_t nTimeLast;
+};
+
+/*
+ * Appends blocks to the blk*.dat files, the current one is kept open between blocks.
+ * A block that would take the file past file_max goes to the next file,
+ * the file it leaves is cut back to the bytes used.
+ * The file is preallocated chunk_size bytes at a time so appends do not grow it block by block.
+ * Every block updates the 'f' record of its file and the 'l' record naming the last file,
+ * staged into the caller's batch when it gives one, so they are written with the block's index record.
+ */
+struct kyk_blk_writer {
+    char* blk_dir;
+    struct kyk_block_db* db;     /* not owned */
+    uint64_t file_max;
+    uint64_t chunk_size;
+    int nFile;
+    int fd;                      /* the current file, -1 until the first block is written */
+    uint64_t nAlloc;             /* size of the current file with its preallocation */
+    struct kyk_blk_file_info info;
+};
+
+int kyk_new_blk_writer(struct kyk_blk_writer** new_writer,
+		       const char* blk_dir,
+		       struct kyk_block_db* db,
+		       uint64_t file_max,
+		       uint64_t chunk_size);
+
+void kyk_free_blk_writer(struct kyk_blk_writer* writer);
+
+int kyk_blk_writer_write(struct kyk_blk_writer* writer,
+			 const struct kyk_block* blk,
+			 leveldb_writebatch_t* batch,
+			 int* nFile,
+			 uint64_t* nDataPos);
+
+int kyk_blk_writer_sync(struct kyk_blk_writer* writer);
+
+void kyk_blk_writer_rewind(struct kyk_blk_writer* writer,
+			   int nFile,
+			   const struct kyk_blk_file_info* info);
+
+int kyk_read_blk_file_info(struct kyk_block_db* db,
+			   int nFile,
+			   struct kyk_blk_file_info* info);
+
+#endif
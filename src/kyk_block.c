@@ -10,11 +10,19 @@
 #include "kyk_buff.h"
 #include "kyk_mkl_tree.h"
 #include "kyk_sha.h"
+#include "kyk_sha_simd.h"
 #include "kyk_hash_nonce.h"
 #include "kyk_validate.h"
 #include "kyk_message.h"
 #include "dbg.h"
 
+static struct kyk_blk_header* make_blk_header_with_root(uint32_t version,
+							const uint8_t* pre_blk_hash,
+							const uint8_t* mrk_root,
+							uint32_t tts,
+							uint32_t bts);
+static size_t hd_index_slot(const struct kyk_hd_index* index, const uint8_t* hash);
+
 int kyk_get_blkself_size(const struct kyk_block* blk,
 			 size_t* blkself_size)
 {
@@ -390,6 +398,84 @@ error:
     return -1;
 }
 
+int kyk_init_blk_hd_hasher(struct kyk_blk_hd_hasher* hasher,
+			   const struct kyk_blk_header* hd)
+{
+    uint8_t buf[KYK_BLK_HD_LEN];
+    size_t len = 0;
+
+    check(hasher, "Failed to kyk_init_blk_hd_hasher: hasher is NULL");
+    check(hd, "Failed to kyk_init_blk_hd_hasher: hd is NULL");
+
+    len = kyk_seri_blk_hd(buf, hd);
+    check(len == KYK_BLK_HD_LEN, "Failed to kyk_init_blk_hd_hasher: kyk_seri_blk_hd failed");
+
+    SHA256_Init(&hasher -> mid_ctx);
+    SHA256_Update(&hasher -> mid_ctx, buf, SHA256_CBLOCK);
+    memcpy(hasher -> tail, buf + SHA256_CBLOCK, sizeof(hasher -> tail));
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* same digest as kyk_blk_hash256 with hd -> nonce replaced by nonce */
+void kyk_blk_hd_hasher_hash(struct kyk_blk_hd_hasher* hasher,
+			    uint8_t* digest,
+			    uint32_t nonce)
+{
+    SHA256_CTX ctx;
+    uint8_t tmp[SHA256_DIGEST_LENGTH];
+
+    beej_pack(hasher -> tail + sizeof(hasher -> tail) - sizeof(nonce), "<L", nonce);
+
+    memcpy(&ctx, &hasher -> mid_ctx, sizeof(ctx));
+    SHA256_Update(&ctx, hasher -> tail, sizeof(hasher -> tail));
+    SHA256_Final(tmp, &ctx);
+
+    kyk_dgst_sha256(digest, tmp, sizeof(tmp));
+    kyk_reverse(digest, SHA256_DIGEST_LENGTH);
+}
+
+/* n consecutive nonces starting at nonce, hashed side by side in the SIMD lanes */
+void kyk_blk_hd_hasher_hash_n(struct kyk_blk_hd_hasher* hasher,
+			      uint8_t* digests,
+			      uint32_t nonce,
+			      size_t n)
+{
+    uint8_t tails[KYK_SHA256D_MAX_LANES * sizeof(hasher -> tail)];
+    uint8_t* tail = NULL;
+    size_t chunk = 0;
+    size_t i = 0;
+
+    if(kyk_sha256d_get_impl() == KYK_SHA256D_SCALAR){
+	for(i = 0; i < n; i++){
+	    kyk_blk_hd_hasher_hash(hasher, digests + i * SHA256_DIGEST_LENGTH, nonce + (uint32_t)i);
+	}
+	return;
+    }
+
+    while(n > 0){
+	chunk = n < KYK_SHA256D_MAX_LANES ? n : KYK_SHA256D_MAX_LANES;
+	for(i = 0; i < chunk; i++){
+	    tail = tails + i * sizeof(hasher -> tail);
+	    memcpy(tail, hasher -> tail, sizeof(hasher -> tail));
+	    beej_pack(tail + sizeof(hasher -> tail) - sizeof(nonce), "<L", nonce + (uint32_t)i);
+	}
+
+	kyk_dgst_hash256_mid_n(digests, &hasher -> mid_ctx, tails, chunk);
+	for(i = 0; i < chunk; i++){
+	    kyk_reverse(digests + i * SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH);
+	}
+
+	digests += chunk * SHA256_DIGEST_LENGTH;
+	nonce += (uint32_t)chunk;
+	n -= chunk;
+    }
+}
+
 size_t kyk_seri_blk_hd_without_nonce(uint8_t *buf, const struct kyk_blk_header *hd)
 {
     size_t len = 0;
@@ -521,32 +607,46 @@ struct kyk_blk_header* kyk_make_blk_header(struct kyk_tx* tx_list,
 					   uint32_t bts)
 {
     struct kyk_blk_header* hd = NULL;
-    struct kyk_mkltree_level* mkl_root = NULL;
+    uint8_t mrk_root[MKL_NODE_BODY_LEN];
+    int res = -1;
 
     check(tx_list, "Failed to kyk_make_blk_header: tx_list is NULL");
 
-    hd = calloc(1, sizeof(struct kyk_blk_header));
-    check(hd, "Failed to kyk_make_blk_header: calloc failed");
+    res = kyk_mkl_root_from_tx_list(mrk_root, tx_list, tx_count);
+    check(res == 0, "Failed to kyk_make_blk_header: kyk_mkl_root_from_tx_list failed");
 
-    hd -> version = version;
-    memcpy(hd -> pre_blk_hash, pre_blk_hash, sizeof(hd -> pre_blk_hash));
+    hd = make_blk_header_with_root(version, pre_blk_hash, mrk_root, tts, bts);
+    check(hd, "Failed to kyk_make_blk_header: make_blk_header_with_root failed");
 
-    mkl_root = kyk_make_mkl_tree_root_from_tx_list(tx_list, tx_count);
-    check(mkl_root, "Failed to kyk_make_blk_header: kyk_make_mkl_tree_root_from_tx_list failed");
+    return hd;
+
+error:
+
+    return NULL;
+}
 
-    memcpy(hd -> mrk_root_hash, mkl_root -> nd -> bdy, sizeof(hd -> mrk_root_hash));
+struct kyk_blk_header* make_blk_header_with_root(uint32_t version,
+						 const uint8_t* pre_blk_hash,
+						 const uint8_t* mrk_root,
+						 uint32_t tts,
+						 uint32_t bts)
+{
+    struct kyk_blk_header* hd = NULL;
 
+    hd = calloc(1, sizeof(struct kyk_blk_header));
+    check(hd, "Failed to make_blk_header_with_root: calloc failed");
+
+    hd -> version = version;
+    memcpy(hd -> pre_blk_hash, pre_blk_hash, sizeof(hd -> pre_blk_hash));
+    memcpy(hd -> mrk_root_hash, mrk_root, sizeof(hd -> mrk_root_hash));
     hd -> tts = tts;
     hd -> bts = bts;
     hd -> nonce = 0;
 
-    kyk_free_mkl_tree(mkl_root);
-    mkl_root = NULL;
-
     return hd;
 
 error:
-    if(mkl_root) kyk_free_mkl_tree(mkl_root);
+
     return NULL;
 }
 
@@ -641,7 +741,8 @@ int kyk_make_coinbase_block(struct kyk_block** new_blk,
     check(hd, "Failed to kyk_make_coinbase_block: kyk_make_blk_header failed");
 
     /* mining */
-    kyk_hash_nonce(hd);
+    res = kyk_hash_nonce_mt(hd, kyk_get_miner_threads());
+    check(res == 0, "Failed to kyk_make_coinbase_block: kyk_hash_nonce_mt failed");
 
     res = kyk_make_block(&blk, hd, tx, tx_count);
     check(res == 0, "Failed to kyk_make_coinbase_block: kyk_make_block failed");
@@ -672,6 +773,14 @@ int kyk_make_tx_block(struct kyk_block** new_blk,
     struct kyk_blk_header* hd = NULL;
     struct kyk_tx* cb_tx = NULL;
     struct kyk_tx* tx_list = NULL;
+    struct kyk_mkl_template* mkl_tpl = NULL;
+    struct kyk_hash256_ctx ctx;
+    uint8_t mrk_root[MKL_NODE_BODY_LEN];
+    uint8_t branch[(KYK_MKL_TPL_MAX_LEVELS - 1) * MKL_NODE_BODY_LEN];
+    uint8_t cb_hash[MKL_NODE_BODY_LEN];
+    size_t branch_len = 0;
+    uint32_t extranonce = 0;
+    int found = 0;
     size_t tx_list_size = 0;
     size_t i = 0;
 
@@ -730,11 +839,37 @@ int kyk_make_tx_block(struct kyk_block** new_blk,
 	check(res == 0, "Failed to kyk_make_tx_block: kyk_copy_tx failed");
     }
 
-    hd = kyk_make_blk_header(tx_list, tx_list_size, version, pre_blk_hash, tts, bts);
-    check(hd, "Failed to kyk_make_coinbase_block: kyk_make_blk_header failed");
+    res = kyk_new_mkl_template_from_tx_list(&mkl_tpl, tx_list, tx_list_size);
+    check(res == 0, "Failed to kyk_make_tx_block: kyk_new_mkl_template_from_tx_list failed");
 
-    /* mining */
-    kyk_hash_nonce(hd);
+    res = kyk_mkl_template_root(mkl_tpl, mrk_root);
+    check(res == 0, "Failed to kyk_make_tx_block: kyk_mkl_template_root failed");
+
+    /* the branch doesn't depend on the coinbase, so one extranonce roll costs log(n) hashes */
+    branch_len = kyk_mkl_template_branch(mkl_tpl, branch);
+
+    hd = make_blk_header_with_root(version, pre_blk_hash, mrk_root, tts, bts);
+    check(hd, "Failed to kyk_make_tx_block: make_blk_header_with_root failed");
+
+    /* mining, when the nonce space is exhausted the coinbase extranonce is rolled */
+    for(extranonce = 1; ; extranonce++){
+	res = kyk_hash_nonce_space_mt(hd, kyk_get_miner_threads(), &found);
+	check(res == 0, "Failed to kyk_make_tx_block: kyk_hash_nonce_space_mt failed");
+
+	if(found){
+	    break;
+	}
+
+	res = kyk_set_coinbase_extranonce(tx_list, extranonce);
+	check(res == 0, "Failed to kyk_make_tx_block: kyk_set_coinbase_extranonce failed");
+
+	kyk_hash256_init(&ctx);
+	kyk_hash_tx(&ctx, tx_list);
+	kyk_hash256_final(&ctx, cb_hash);
+
+	kyk_mkl_root_from_branch(hd -> mrk_root_hash, cb_hash, branch, branch_len);
+	hd -> nonce = 0;
+    }
 
     res = kyk_make_block(&blk, hd, tx_list, tx_list_size);
     check(res == 0, "Failed to kyk_make_coinbase_block: kyk_make_block failed");
@@ -742,11 +877,13 @@ int kyk_make_tx_block(struct kyk_block** new_blk,
     *new_blk = blk;
 
     kyk_free_tx(cb_tx);
+    kyk_free_mkl_template(mkl_tpl);
 
     return 0;
     
 error:
     if(cb_tx) kyk_free_tx(cb_tx);
+    if(mkl_tpl) kyk_free_mkl_template(mkl_tpl);
     if(tx_list) kyk_free_tx_list(tx_list, tx_list_size);
     return -1;
 
@@ -921,6 +1058,147 @@ error:
     return -1;
 }
 
+/* the hashes are in display order, their leading bytes are the zeros of the proof of work */
+static size_t hd_index_slot(const struct kyk_hd_index* index, const uint8_t* hash)
+{
+    uint64_t h = 0;
+
+    memcpy(&h, hash + 24, sizeof(h));
+
+    return (size_t)h & (index -> slot_count - 1);
+}
+
+/* the header at height h takes the first free slot from its hash on */
+static void hd_index_put(struct kyk_hd_index* index, size_t h)
+{
+    size_t slot = 0;
+
+    slot = hd_index_slot(index, index -> hashes + h * SHA256_DIGEST_LENGTH);
+    while(index -> slots[slot] != 0){
+	slot = (slot + 1) & (index -> slot_count - 1);
+    }
+    index -> slots[slot] = h + 1;
+}
+
+int kyk_new_hd_index(struct kyk_hd_index** new_index,
+		     const struct kyk_blk_hd_chain* hd_chain)
+{
+    struct kyk_hd_index* index = NULL;
+    size_t i = 0;
+    int res = -1;
+
+    check(new_index, "Failed to kyk_new_hd_index: new_index is NULL");
+    check(hd_chain, "Failed to kyk_new_hd_index: hd_chain is NULL");
+
+    index = calloc(1, sizeof(*index));
+    check(index, "Failed to kyk_new_hd_index: calloc failed");
+
+    /* at most half full */
+    index -> slot_count = 16;
+    while(index -> slot_count < hd_chain -> len * 2){
+	index -> slot_count <<= 1;
+    }
+
+    index -> slots = calloc(index -> slot_count, sizeof(*index -> slots));
+    check(index -> slots, "Failed to kyk_new_hd_index: calloc failed");
+
+    index -> hashes = calloc(hd_chain -> len + 1, SHA256_DIGEST_LENGTH);
+    check(index -> hashes, "Failed to kyk_new_hd_index: calloc failed");
+    index -> cap = hd_chain -> len + 1;
+
+    for(i = 0; i < hd_chain -> len; i++){
+	res = kyk_blk_hash256(index -> hashes + i * SHA256_DIGEST_LENGTH, hd_chain -> hd_list + i);
+	check(res == 0, "Failed to kyk_new_hd_index: kyk_blk_hash256 failed");
+	hd_index_put(index, i);
+    }
+
+    index -> len = hd_chain -> len;
+
+    *new_index = index;
+
+    return 0;
+
+error:
+    if(index) kyk_free_hd_index(index);
+    return -1;
+}
+
+/*
+ * Index hd as the next height, for a header appended to the chain the index was built over.
+ * The slots are rebuilt twice as many once they would be more than half full.
+ */
+int kyk_hd_index_append(struct kyk_hd_index* index,
+			const struct kyk_blk_header* hd)
+{
+    uint8_t* hashes = NULL;
+    size_t* slots = NULL;
+    size_t i = 0;
+    int res = -1;
+
+    check(index, "Failed to kyk_hd_index_append: index is NULL");
+    check(hd, "Failed to kyk_hd_index_append: hd is NULL");
+
+    if(index -> len == index -> cap){
+	hashes = realloc(index -> hashes, index -> cap * 2 * SHA256_DIGEST_LENGTH);
+	check(hashes, "Failed to kyk_hd_index_append: realloc failed");
+	index -> hashes = hashes;
+	index -> cap *= 2;
+    }
+
+    res = kyk_blk_hash256(index -> hashes + index -> len * SHA256_DIGEST_LENGTH, hd);
+    check(res == 0, "Failed to kyk_hd_index_append: kyk_blk_hash256 failed");
+
+    if((index -> len + 1) * 2 > index -> slot_count){
+	slots = calloc(index -> slot_count * 2, sizeof(*slots));
+	check(slots, "Failed to kyk_hd_index_append: calloc failed");
+	free(index -> slots);
+	index -> slots = slots;
+	index -> slot_count *= 2;
+	for(i = 0; i < index -> len; i++){
+	    hd_index_put(index, i);
+	}
+    }
+
+    hd_index_put(index, index -> len);
+    index -> len += 1;
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* 1 and the height of the header if hash is in the chain, 0 otherwise */
+int kyk_hd_index_find(const struct kyk_hd_index* index,
+		      const uint8_t* hash,
+		      size_t* height)
+{
+    size_t slot = 0;
+    size_t h = 0;
+
+    slot = hd_index_slot(index, hash);
+    while(index -> slots[slot] != 0){
+	h = index -> slots[slot] - 1;
+	if(memcmp(index -> hashes + h * SHA256_DIGEST_LENGTH, hash, SHA256_DIGEST_LENGTH) == 0){
+	    *height = h;
+	    return 1;
+	}
+	slot = (slot + 1) & (index -> slot_count - 1);
+    }
+
+    return 0;
+}
+
+void kyk_free_hd_index(struct kyk_hd_index* index)
+{
+    if(index){
+	if(index -> hashes) free(index -> hashes);
+	if(index -> slots) free(index -> slots);
+	free(index);
+    }
+}
+
 int kyk_eq_blk_hd(const struct kyk_blk_header* lhd, const struct kyk_blk_header* rhd)
 {
     int pre_blk_hash_eq = 0;
@@ -1,6 +1,8 @@
 #ifndef KYK_BLOCK_H__
 #define KYK_BLOCK_H__
 
+#include <openssl/sha.h>
+
 #include "varint.h"
 #include "kyk_tx.h"
 #include "kyk_ldb.h"
@@ -13,6 +15,18 @@ struct kyk_blk_hd_chain {
     size_t len;
 };
 
+/*
+ * Block hash -> height over a header chain.
+ * Open addressing, slots holds height + 1 so that 0 marks an empty slot.
+ */
+struct kyk_hd_index {
+    uint8_t* hashes;       /* len * 32 bytes, the hash of the header at height h is at h * 32 */
+    size_t* slots;
+    size_t slot_count;     /* a power of two */
+    size_t len;
+    size_t cap;            /* hashes has room for cap hashes */
+};
+
 struct kyk_block_list {
     struct kyk_block* data;
     size_t len;
@@ -36,6 +50,15 @@ struct kyk_block {
     struct kyk_tx *tx;
 };
 
+/*
+ * SHA-256 midstate of the first 64 header bytes (version, prev hash and most of the merkle root).
+ * Only the 16-byte tail (rest of merkle root, tts, bts, nonce) is hashed for every nonce.
+ */
+struct kyk_blk_hd_hasher {
+    SHA256_CTX mid_ctx;
+    uint8_t tail[KYK_BLK_HD_LEN - SHA256_CBLOCK];
+};
+
 size_t kyk_seri_blk_hd(uint8_t *buf, const struct kyk_blk_header *hd);
 size_t kyk_seri_blk_hd_without_nonce(uint8_t *buf, const struct kyk_blk_header *hd);
 int kyk_seri_blk(uint8_t* buf, const struct kyk_block* blk, size_t* check_size);
@@ -63,6 +86,18 @@ int kyk_make_block(struct kyk_block** blk,
 
 int kyk_blk_hash256(uint8_t* digest, const struct kyk_blk_header* hd);
 
+int kyk_init_blk_hd_hasher(struct kyk_blk_hd_hasher* hasher,
+			   const struct kyk_blk_header* hd);
+
+void kyk_blk_hd_hasher_hash(struct kyk_blk_hd_hasher* hasher,
+			    uint8_t* digest,
+			    uint32_t nonce);
+
+void kyk_blk_hd_hasher_hash_n(struct kyk_blk_hd_hasher* hasher,
+			      uint8_t* digests,
+			      uint32_t nonce,
+			      size_t n);
+
 
 void kyk_free_block(struct kyk_block *blk);
 
@@ -120,6 +155,18 @@ int kyk_compare_hd_chain(const struct kyk_blk_hd_chain* lhd_chain,
 			 const struct kyk_blk_hd_chain* rhd_chain,
 			 size_t* inx);
 
+int kyk_new_hd_index(struct kyk_hd_index** new_index,
+		     const struct kyk_blk_hd_chain* hd_chain);
+
+int kyk_hd_index_append(struct kyk_hd_index* index,
+			const struct kyk_blk_header* hd);
+
+int kyk_hd_index_find(const struct kyk_hd_index* index,
+		      const uint8_t* hash,
+		      size_t* height);
+
+void kyk_free_hd_index(struct kyk_hd_index* index);
+
 int kyk_deseri_block(struct kyk_block* blk,
 		     const uint8_t* buf,
 		     size_t* checknum);
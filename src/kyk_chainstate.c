@@ -0,0 +1,774 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "kyk_tx.h"
+#include "kyk_block.h"
+#include "kyk_utxo.h"
+#include "kyk_utxo_set.h"
+#include "kyk_chainstate.h"
+#include "block_store.h"
+#include "dbg.h"
+
+/* 'C' | txid | outidx big endian | blkhash, the coins of an outpoint sort together */
+#define COIN_KEY_LEN (1 + 32 + 4 + 32)
+#define COIN_OUTPOINT_LEN (1 + 32 + 4)
+
+/* gets a coin read from the db, and owns it from then on */
+typedef int (*coin_visit_fn)(struct kyk_utxo* utxo, void* arg);
+
+struct coin_get {
+    const struct kyk_utxo_set* cache;
+    struct kyk_utxo* found;
+};
+
+struct coin_load {
+    const struct kyk_utxo_set* cache;
+    struct kyk_utxo_chain* utxo_chain;
+};
+
+static void coin_key(uint8_t* key, const uint8_t* txid, uint32_t outidx, const uint8_t* blkhash);
+static int chainstate_scan(struct kyk_chainstate* cs,
+			   const leveldb_readoptions_t* rd_opts,
+			   const uint8_t* prefix,
+			   size_t prefix_len,
+			   coin_visit_fn visit,
+			   void* arg);
+static int chainstate_spend(struct kyk_chainstate* cs, const uint8_t* txid, uint32_t outidx);
+static int chainstate_connect(struct kyk_chainstate* cs, const struct kyk_block* blk);
+static int chainstate_flush_due(const struct kyk_chainstate* cs);
+static int chainstate_stage(struct kyk_chainstate* cs, leveldb_writebatch_t* batch);
+static int chainstate_reset_cache(struct kyk_chainstate* cs);
+static int chainstate_reset_reads(struct kyk_chainstate* cs);
+static int chainstate_remember(struct kyk_chainstate* cs, struct kyk_utxo* utxo);
+static int chainstate_keep_flushed(struct kyk_chainstate* cs);
+static int batch_put_coin(leveldb_writebatch_t* batch, const struct kyk_utxo* utxo);
+static int visit_get(struct kyk_utxo* utxo, void* arg);
+static int visit_load(struct kyk_utxo* utxo, void* arg);
+static int visit_delete(struct kyk_utxo* utxo, void* arg);
+
+int kyk_new_chainstate(struct kyk_chainstate** new_cs,
+		       struct kyk_block_db* db,
+		       size_t cache_max,
+		       size_t flush_blocks)
+{
+    struct kyk_chainstate* cs = NULL;
+    char* errptr = NULL;
+    char* val = NULL;
+    size_t vlen = 0;
+    int res = -1;
+
+    check(new_cs, "Failed to kyk_new_chainstate: new_cs is NULL");
+    check(db && db -> db, "Failed to kyk_new_chainstate: db is not open");
+
+    cs = calloc(1, sizeof(*cs));
+    check(cs, "Failed to kyk_new_chainstate: calloc failed");
+
+    cs -> db = db;
+    cs -> cache_max = cache_max > 0 ? cache_max : 1;
+    cs -> flush_blocks = flush_blocks > 0 ? flush_blocks : 1;
+
+    res = chainstate_reset_cache(cs);
+    check(res == 0, "Failed to kyk_new_chainstate: chainstate_reset_cache failed");
+
+    res = chainstate_reset_reads(cs);
+    check(res == 0, "Failed to kyk_new_chainstate: chainstate_reset_reads failed");
+
+    val = leveldb_get(db -> db, db -> rd_opts, &DB_BEST_BLOCK, sizeof(DB_BEST_BLOCK), &vlen, &errptr);
+    check(errptr == NULL, "Failed to kyk_new_chainstate: leveldb_get failed: %s", errptr);
+
+    if(val && vlen == sizeof(cs -> best_hash)){
+	memcpy(cs -> best_hash, val, sizeof(cs -> best_hash));
+	cs -> has_best = 1;
+    }
+
+    if(val) leveldb_free(val);
+
+    *new_cs = cs;
+
+    return 0;
+
+error:
+    if(errptr) leveldb_free(errptr);
+    if(val) leveldb_free(val);
+    if(cs) kyk_free_chainstate(cs);
+    return -1;
+}
+
+/* changes not flushed yet are dropped */
+void kyk_free_chainstate(struct kyk_chainstate* cs)
+{
+    if(cs){
+	if(cs -> cache) kyk_free_utxo_set(cs -> cache);
+	if(cs -> reads) kyk_free_utxo_set(cs -> reads);
+	free(cs);
+    }
+}
+
+/*
+ * Adds the block's outputs and spends what its txins refer to,
+ * a txin spends one coin of its outpoint, the one kyk_chainstate_get_utxo finds.
+ */
+int kyk_chainstate_connect_block(struct kyk_chainstate* cs, const struct kyk_block* blk)
+{
+    int res = -1;
+
+    check(cs, "Failed to kyk_chainstate_connect_block: cs is NULL");
+    check(blk, "Failed to kyk_chainstate_connect_block: blk is NULL");
+
+    res = chainstate_connect(cs, blk);
+    check(res == 0, "Failed to kyk_chainstate_connect_block: chainstate_connect failed");
+
+    if(chainstate_flush_due(cs)){
+	res = kyk_chainstate_flush(cs);
+	check(res == 0, "Failed to kyk_chainstate_connect_block: kyk_chainstate_flush failed");
+    }
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/*
+ * Connects the block like kyk_chainstate_connect_block, but a flush that is due
+ * is staged into the caller's batch instead of written, *staged tells if it was.
+ * Once the batch is written the caller calls kyk_chainstate_flushed,
+ * if it is not written kyk_chainstate_discard.
+ */
+int kyk_chainstate_connect_block_to_batch(struct kyk_chainstate* cs,
+					  const struct kyk_block* blk,
+					  leveldb_writebatch_t* batch,
+					  int* staged)
+{
+    int res = -1;
+
+    check(cs, "Failed to kyk_chainstate_connect_block_to_batch: cs is NULL");
+    check(blk, "Failed to kyk_chainstate_connect_block_to_batch: blk is NULL");
+    check(batch, "Failed to kyk_chainstate_connect_block_to_batch: batch is NULL");
+    check(staged, "Failed to kyk_chainstate_connect_block_to_batch: staged is NULL");
+
+    *staged = 0;
+
+    res = chainstate_connect(cs, blk);
+    check(res == 0, "Failed to kyk_chainstate_connect_block_to_batch: chainstate_connect failed");
+
+    if(chainstate_flush_due(cs)){
+	res = chainstate_stage(cs, batch);
+	check(res == 0, "Failed to kyk_chainstate_connect_block_to_batch: chainstate_stage failed");
+	*staged = 1;
+    }
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* the staged cache is in the db now, its coins go on in reads */
+int kyk_chainstate_flushed(struct kyk_chainstate* cs)
+{
+    int res = -1;
+
+    check(cs, "Failed to kyk_chainstate_flushed: cs is NULL");
+
+    res = chainstate_keep_flushed(cs);
+    check(res == 0, "Failed to kyk_chainstate_flushed: chainstate_keep_flushed failed");
+
+    res = chainstate_reset_cache(cs);
+    check(res == 0, "Failed to kyk_chainstate_flushed: chainstate_reset_cache failed");
+    cs -> dirty_blocks = 0;
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* drops what is not flushed and goes back to the best block in the db */
+int kyk_chainstate_discard(struct kyk_chainstate* cs)
+{
+    char* errptr = NULL;
+    char* val = NULL;
+    size_t vlen = 0;
+    int res = -1;
+
+    check(cs, "Failed to kyk_chainstate_discard: cs is NULL");
+
+    res = chainstate_reset_cache(cs);
+    check(res == 0, "Failed to kyk_chainstate_discard: chainstate_reset_cache failed");
+    cs -> dirty_blocks = 0;
+    cs -> has_best = 0;
+    memset(cs -> best_hash, 0, sizeof(cs -> best_hash));
+
+    val = leveldb_get(cs -> db -> db, cs -> db -> rd_opts, &DB_BEST_BLOCK, sizeof(DB_BEST_BLOCK), &vlen, &errptr);
+    check(errptr == NULL, "Failed to kyk_chainstate_discard: leveldb_get failed: %s", errptr);
+
+    if(val && vlen == sizeof(cs -> best_hash)){
+	memcpy(cs -> best_hash, val, sizeof(cs -> best_hash));
+	cs -> has_best = 1;
+    }
+
+    if(val) leveldb_free(val);
+
+    return 0;
+
+error:
+    if(errptr) leveldb_free(errptr);
+    if(val) leveldb_free(val);
+    return -1;
+}
+
+/* writes the cache and the best block in one batch, then empties the cache */
+int kyk_chainstate_flush(struct kyk_chainstate* cs)
+{
+    leveldb_writebatch_t* batch = NULL;
+    char* errptr = NULL;
+    int res = -1;
+
+    check(cs, "Failed to kyk_chainstate_flush: cs is NULL");
+
+    if(cs -> dirty_blocks == 0 && cs -> cache -> len == 0){
+	return 0;
+    }
+
+    batch = leveldb_writebatch_create();
+    check(batch, "Failed to kyk_chainstate_flush: leveldb_writebatch_create failed");
+
+    res = chainstate_stage(cs, batch);
+    check(res == 0, "Failed to kyk_chainstate_flush: chainstate_stage failed");
+
+    leveldb_write(cs -> db -> db, cs -> db -> wr_opts, batch, &errptr);
+    check(errptr == NULL, "Failed to kyk_chainstate_flush: leveldb_write failed: %s", errptr);
+
+    leveldb_writebatch_destroy(batch);
+    batch = NULL;
+
+    res = kyk_chainstate_flushed(cs);
+    check(res == 0, "Failed to kyk_chainstate_flush: kyk_chainstate_flushed failed");
+
+    return 0;
+
+error:
+    if(errptr) leveldb_free(errptr);
+    if(batch) leveldb_writebatch_destroy(batch);
+    return -1;
+}
+
+/*
+ * The first unspent coin of the outpoint, *new_utxo is NULL if there is none.
+ * The cache is asked first, then reads, the db is only read for a coin neither of them has.
+ * A coin spent in the cache is gone whatever reads and the db have,
+ * an outpoint with a spent copy in the cache goes to the db for the copies left.
+ */
+int kyk_chainstate_get_utxo(struct kyk_chainstate* cs,
+			    const uint8_t* txid,
+			    uint32_t outidx,
+			    struct kyk_utxo** new_utxo)
+{
+    struct coin_get get;
+    const struct kyk_utxo_set* set = NULL;
+    const struct kyk_utxo_entry* entry = NULL;
+    uint8_t prefix[COIN_KEY_LEN];
+    int res = -1;
+
+    get.found = NULL;
+
+    check(cs, "Failed to kyk_chainstate_get_utxo: cs is NULL");
+    check(txid, "Failed to kyk_chainstate_get_utxo: txid is NULL");
+    check(new_utxo, "Failed to kyk_chainstate_get_utxo: new_utxo is NULL");
+
+    *new_utxo = NULL;
+
+    get.cache = cs -> cache;
+
+    set = cs -> cache;
+    entry = kyk_utxo_set_find(set, txid, outidx);
+    if(entry == NULL && kyk_utxo_set_find_outpoint(set, txid, outidx) == NULL){
+	set = cs -> reads;
+	entry = kyk_utxo_set_find(set, txid, outidx);
+    }
+
+    if(entry){
+	get.found = calloc(1, sizeof(*get.found));
+	check(get.found, "Failed to kyk_chainstate_get_utxo: calloc failed");
+	res = kyk_utxo_entry_to_utxo(get.found, set, entry);
+	check(res == 0, "Failed to kyk_chainstate_get_utxo: kyk_utxo_entry_to_utxo failed");
+    } else {
+	coin_key(prefix, txid, outidx, NULL);
+	res = chainstate_scan(cs, cs -> db -> rd_opts, prefix, COIN_OUTPOINT_LEN, visit_get, &get);
+	check(res == 0, "Failed to kyk_chainstate_get_utxo: chainstate_scan failed");
+
+	if(get.found){
+	    res = chainstate_remember(cs, get.found);
+	    check(res == 0, "Failed to kyk_chainstate_get_utxo: chainstate_remember failed");
+	}
+    }
+
+    *new_utxo = get.found;
+
+    return 0;
+
+error:
+    if(get.found) kyk_free_utxo(get.found);
+    return -1;
+}
+
+/* every unspent coin, the flushed ones in key order followed by the cached ones */
+int kyk_chainstate_load_utxo_chain(struct kyk_chainstate* cs,
+				   struct kyk_utxo_chain** new_utxo_chain)
+{
+    struct coin_load load;
+    const struct kyk_utxo_entry* entry = NULL;
+    struct kyk_utxo* utxo = NULL;
+    size_t i = 0;
+    int res = -1;
+
+    load.utxo_chain = NULL;
+
+    check(cs, "Failed to kyk_chainstate_load_utxo_chain: cs is NULL");
+    check(new_utxo_chain, "Failed to kyk_chainstate_load_utxo_chain: new_utxo_chain is NULL");
+
+    load.cache = cs -> cache;
+    load.utxo_chain = calloc(1, sizeof(*load.utxo_chain));
+    check(load.utxo_chain, "Failed to kyk_chainstate_load_utxo_chain: calloc failed");
+    kyk_init_utxo_chain(load.utxo_chain);
+
+    res = chainstate_scan(cs, cs -> db -> scan_rd_opts, (const uint8_t*)&DB_COIN, sizeof(DB_COIN), visit_load, &load);
+    check(res == 0, "Failed to kyk_chainstate_load_utxo_chain: chainstate_scan failed");
+
+    for(i = 0; i < cs -> cache -> len; i++){
+	entry = cs -> cache -> entries + i;
+	if(entry -> spent) continue;
+
+	utxo = calloc(1, sizeof(*utxo));
+	check(utxo, "Failed to kyk_chainstate_load_utxo_chain: calloc failed");
+
+	res = kyk_utxo_entry_to_utxo(utxo, cs -> cache, entry);
+	check(res == 0, "Failed to kyk_chainstate_load_utxo_chain: kyk_utxo_entry_to_utxo failed");
+
+	res = kyk_utxo_chain_append(load.utxo_chain, utxo);
+	check(res == 0, "Failed to kyk_chainstate_load_utxo_chain: kyk_utxo_chain_append failed");
+	utxo = NULL;
+    }
+
+    *new_utxo_chain = load.utxo_chain;
+
+    return 0;
+
+error:
+    if(utxo) kyk_free_utxo(utxo);
+    if(load.utxo_chain) kyk_free_utxo_chain(load.utxo_chain);
+    return -1;
+}
+
+/*
+ * Makes utxo_chain the whole coin set, in one batch.
+ * Costs a pass over every coin, connecting blocks is the way to keep the set up to date.
+ */
+int kyk_chainstate_replace_utxo_chain(struct kyk_chainstate* cs,
+				      const struct kyk_utxo_chain* utxo_chain)
+{
+    leveldb_writebatch_t* batch = NULL;
+    const struct kyk_utxo* utxo = NULL;
+    char* errptr = NULL;
+    size_t i = 0;
+    int res = -1;
+
+    check(cs, "Failed to kyk_chainstate_replace_utxo_chain: cs is NULL");
+    check(utxo_chain, "Failed to kyk_chainstate_replace_utxo_chain: utxo_chain is NULL");
+
+    batch = leveldb_writebatch_create();
+    check(batch, "Failed to kyk_chainstate_replace_utxo_chain: leveldb_writebatch_create failed");
+
+    res = chainstate_scan(cs, cs -> db -> scan_rd_opts, (const uint8_t*)&DB_COIN, sizeof(DB_COIN), visit_delete, batch);
+    check(res == 0, "Failed to kyk_chainstate_replace_utxo_chain: chainstate_scan failed");
+
+    utxo = utxo_chain -> hd;
+    for(i = 0; i < utxo_chain -> len && utxo; i++){
+	if(utxo -> spent == 0){
+	    res = batch_put_coin(batch, utxo);
+	    check(res == 0, "Failed to kyk_chainstate_replace_utxo_chain: batch_put_coin failed");
+	}
+	utxo = utxo -> next;
+    }
+
+    leveldb_writebatch_put(batch, &DB_BEST_BLOCK, sizeof(DB_BEST_BLOCK), (const char*)cs -> best_hash, sizeof(cs -> best_hash));
+
+    leveldb_write(cs -> db -> db, cs -> db -> wr_opts, batch, &errptr);
+    check(errptr == NULL, "Failed to kyk_chainstate_replace_utxo_chain: leveldb_write failed: %s", errptr);
+
+    leveldb_writebatch_destroy(batch);
+
+    res = chainstate_reset_cache(cs);
+    check(res == 0, "Failed to kyk_chainstate_replace_utxo_chain: chainstate_reset_cache failed");
+
+    res = chainstate_reset_reads(cs);
+    check(res == 0, "Failed to kyk_chainstate_replace_utxo_chain: chainstate_reset_reads failed");
+    cs -> dirty_blocks = 0;
+    cs -> has_best = 1;
+
+    return 0;
+
+error:
+    if(errptr) leveldb_free(errptr);
+    if(batch) leveldb_writebatch_destroy(batch);
+    return -1;
+}
+
+int chainstate_connect(struct kyk_chainstate* cs, const struct kyk_block* blk)
+{
+    const struct kyk_tx* tx = NULL;
+    const struct kyk_txin* txin = NULL;
+    varint_t i = 0;
+    varint_t j = 0;
+    int res = -1;
+
+    check(blk -> hd, "Failed to chainstate_connect: blk -> hd is NULL");
+
+    res = kyk_utxo_set_add_block(cs -> cache, blk);
+    check(res == 0, "Failed to chainstate_connect: kyk_utxo_set_add_block failed");
+
+    for(i = 0; i < blk -> tx_count; i++){
+	tx = blk -> tx + i;
+	for(j = 0; j < tx -> vin_sz; j++){
+	    txin = tx -> txin + j;
+	    res = chainstate_spend(cs, txin -> pre_txid, txin -> pre_txout_inx);
+	    check(res == 0, "Failed to chainstate_connect: chainstate_spend failed");
+	}
+    }
+
+    res = kyk_blk_hash256(cs -> best_hash, blk -> hd);
+    check(res == 0, "Failed to chainstate_connect: kyk_blk_hash256 failed");
+    cs -> has_best = 1;
+    cs -> dirty_blocks++;
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+int chainstate_flush_due(const struct kyk_chainstate* cs)
+{
+    return cs -> dirty_blocks >= cs -> flush_blocks || cs -> cache -> len >= cs -> cache_max;
+}
+
+/* puts the cached coins and the best block into batch */
+int chainstate_stage(struct kyk_chainstate* cs, leveldb_writebatch_t* batch)
+{
+    const struct kyk_utxo_entry* entry = NULL;
+    struct kyk_utxo utxo;
+    uint8_t key[COIN_KEY_LEN];
+    size_t i = 0;
+    int res = -1;
+
+    memset(&utxo, 0, sizeof(utxo));
+
+    for(i = 0; i < cs -> cache -> len; i++){
+	entry = cs -> cache -> entries + i;
+	if(entry -> spent){
+	    coin_key(key, entry -> txid, entry -> outidx, entry -> blkhash);
+	    leveldb_writebatch_delete(batch, (const char*)key, sizeof(key));
+	    continue;
+	}
+
+	res = kyk_utxo_entry_to_utxo(&utxo, cs -> cache, entry);
+	check(res == 0, "Failed to chainstate_stage: kyk_utxo_entry_to_utxo failed");
+
+	res = batch_put_coin(batch, &utxo);
+	check(res == 0, "Failed to chainstate_stage: batch_put_coin failed");
+
+	free(utxo.btc_addr);
+	free(utxo.sc);
+	memset(&utxo, 0, sizeof(utxo));
+    }
+
+    if(cs -> has_best){
+	leveldb_writebatch_put(batch, &DB_BEST_BLOCK, sizeof(DB_BEST_BLOCK), (const char*)cs -> best_hash, sizeof(cs -> best_hash));
+    }
+
+    return 0;
+
+error:
+    if(utxo.btc_addr) free(utxo.btc_addr);
+    if(utxo.sc) free(utxo.sc);
+    return -1;
+}
+
+/* blkhash NULL builds the COIN_OUTPOINT_LEN prefix only */
+void coin_key(uint8_t* key, const uint8_t* txid, uint32_t outidx, const uint8_t* blkhash)
+{
+    key[0] = DB_COIN;
+    memcpy(key + 1, txid, 32);
+    key[33] = (uint8_t)(outidx >> 24);
+    key[34] = (uint8_t)(outidx >> 16);
+    key[35] = (uint8_t)(outidx >> 8);
+    key[36] = (uint8_t)outidx;
+    if(blkhash){
+	memcpy(key + COIN_OUTPOINT_LEN, blkhash, 32);
+    }
+}
+
+/*
+ * Calls visit for every coin whose key starts with prefix, until it returns 1.
+ * A scan over all coins reads with scan_rd_opts so it does not push the lookups' blocks out of the cache.
+ */
+int chainstate_scan(struct kyk_chainstate* cs,
+		    const leveldb_readoptions_t* rd_opts,
+		    const uint8_t* prefix,
+		    size_t prefix_len,
+		    coin_visit_fn visit,
+		    void* arg)
+{
+    leveldb_iterator_t* it = NULL;
+    struct kyk_utxo* utxo = NULL;
+    const char* key = NULL;
+    const char* val = NULL;
+    size_t klen = 0;
+    size_t vlen = 0;
+    size_t len = 0;
+    int res = -1;
+
+    it = leveldb_create_iterator(cs -> db -> db, rd_opts);
+    check(it, "Failed to chainstate_scan: leveldb_create_iterator failed");
+
+    for(leveldb_iter_seek(it, (const char*)prefix, prefix_len); leveldb_iter_valid(it); leveldb_iter_next(it)){
+	key = leveldb_iter_key(it, &klen);
+	if(klen < prefix_len || memcmp(key, prefix, prefix_len) != 0){
+	    break;
+	}
+	check(klen == COIN_KEY_LEN, "Failed to chainstate_scan: invalid coin key");
+
+	val = leveldb_iter_value(it, &vlen);
+	res = kyk_deseri_utxo(&utxo, (const uint8_t*)val, &len);
+	check(res == 0, "Failed to chainstate_scan: kyk_deseri_utxo failed");
+	check(len <= vlen, "Failed to chainstate_scan: invalid coin record");
+
+	res = visit(utxo, arg);
+	utxo = NULL;
+	check(res >= 0, "Failed to chainstate_scan: visit failed");
+	if(res == 1){
+	    break;
+	}
+    }
+
+    leveldb_iter_destroy(it);
+
+    return 0;
+
+error:
+    if(utxo) kyk_free_utxo(utxo);
+    if(it) leveldb_iter_destroy(it);
+    return -1;
+}
+
+/* a flushed coin goes into the cache as spent, to be deleted on the next flush */
+int chainstate_spend(struct kyk_chainstate* cs, const uint8_t* txid, uint32_t outidx)
+{
+    struct kyk_utxo* utxo = NULL;
+    struct kyk_utxo_entry* entry = NULL;
+    int res = -1;
+
+    res = kyk_chainstate_get_utxo(cs, txid, outidx, &utxo);
+    check(res == 0, "Failed to chainstate_spend: kyk_chainstate_get_utxo failed");
+
+    if(utxo == NULL){
+	return 0;
+    }
+
+    entry = kyk_utxo_set_find_entry(cs -> cache, utxo);
+    if(entry){
+	res = kyk_utxo_set_spend_entry(cs -> cache, entry);
+	check(res >= 0, "Failed to chainstate_spend: kyk_utxo_set_spend_entry failed");
+    } else {
+	utxo -> spent = 1;
+	res = kyk_utxo_set_add(cs -> cache, utxo);
+	check(res == 0, "Failed to chainstate_spend: kyk_utxo_set_add failed");
+	/* the cache does not keep chain nodes */
+	cs -> cache -> entries[cs -> cache -> len - 1].node = NULL;
+    }
+
+    kyk_free_utxo(utxo);
+
+    return 0;
+
+error:
+    if(utxo) kyk_free_utxo(utxo);
+    return -1;
+}
+
+int chainstate_reset_cache(struct kyk_chainstate* cs)
+{
+    struct kyk_utxo_set* cache = NULL;
+    int res = -1;
+
+    res = kyk_new_utxo_set(&cache, 0);
+    check(res == 0, "Failed to chainstate_reset_cache: kyk_new_utxo_set failed");
+    cache -> keep_spent = 1;
+
+    if(cs -> cache) kyk_free_utxo_set(cs -> cache);
+    cs -> cache = cache;
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+int chainstate_reset_reads(struct kyk_chainstate* cs)
+{
+    struct kyk_utxo_set* reads = NULL;
+    int res = -1;
+
+    res = kyk_new_utxo_set(&reads, 0);
+    check(res == 0, "Failed to chainstate_reset_reads: kyk_new_utxo_set failed");
+
+    if(cs -> reads) kyk_free_utxo_set(cs -> reads);
+    cs -> reads = reads;
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* an unspent coin as the db has it, a full reads starts over */
+int chainstate_remember(struct kyk_chainstate* cs, struct kyk_utxo* utxo)
+{
+    int res = -1;
+
+    if(cs -> reads -> len - cs -> reads -> spent_count >= cs -> cache_max){
+	res = chainstate_reset_reads(cs);
+	check(res == 0, "Failed to chainstate_remember: chainstate_reset_reads failed");
+    }
+
+    res = kyk_utxo_set_add(cs -> reads, utxo);
+    check(res >= 0, "Failed to chainstate_remember: kyk_utxo_set_add failed");
+
+    /* reads does not keep chain nodes */
+    if(res == 0){
+	cs -> reads -> entries[cs -> reads -> len - 1].node = NULL;
+    }
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* what the cache spent is gone from reads, what it added is in the db now */
+int chainstate_keep_flushed(struct kyk_chainstate* cs)
+{
+    const struct kyk_utxo_entry* entry = NULL;
+    struct kyk_utxo utxo;
+    size_t i = 0;
+    int res = -1;
+
+    memset(&utxo, 0, sizeof(utxo));
+
+    for(i = 0; i < cs -> cache -> len; i++){
+	entry = cs -> cache -> entries + i;
+	if(entry -> spent){
+	    res = kyk_utxo_set_spend(cs -> reads, entry -> txid, entry -> outidx);
+	    check(res >= 0, "Failed to chainstate_keep_flushed: kyk_utxo_set_spend failed");
+	    continue;
+	}
+
+	res = kyk_utxo_entry_to_utxo(&utxo, cs -> cache, entry);
+	check(res == 0, "Failed to chainstate_keep_flushed: kyk_utxo_entry_to_utxo failed");
+
+	res = chainstate_remember(cs, &utxo);
+	check(res == 0, "Failed to chainstate_keep_flushed: chainstate_remember failed");
+
+	free(utxo.btc_addr);
+	free(utxo.sc);
+	memset(&utxo, 0, sizeof(utxo));
+    }
+
+    return 0;
+
+error:
+    if(utxo.btc_addr) free(utxo.btc_addr);
+    if(utxo.sc) free(utxo.sc);
+    return -1;
+}
+
+int batch_put_coin(leveldb_writebatch_t* batch, const struct kyk_utxo* utxo)
+{
+    uint8_t key[COIN_KEY_LEN];
+    uint8_t* buf = NULL;
+    size_t len = 0;
+    int res = -1;
+
+    res = kyk_get_utxo_size(utxo, &len);
+    check(res == 0, "Failed to batch_put_coin: kyk_get_utxo_size failed");
+
+    buf = calloc(len, sizeof(*buf));
+    check(buf, "Failed to batch_put_coin: calloc failed");
+
+    res = kyk_seri_utxo(buf, utxo, NULL);
+    check(res == 0, "Failed to batch_put_coin: kyk_seri_utxo failed");
+
+    coin_key(key, utxo -> txid, utxo -> outidx, utxo -> blkhash);
+    leveldb_writebatch_put(batch, (const char*)key, sizeof(key), (const char*)buf, len);
+
+    free(buf);
+
+    return 0;
+
+error:
+    if(buf) free(buf);
+    return -1;
+}
+
+/* a coin spent in the cache is not there any more */
+int visit_get(struct kyk_utxo* utxo, void* arg)
+{
+    struct coin_get* get = arg;
+    const struct kyk_utxo_entry* entry = NULL;
+
+    entry = kyk_utxo_set_find_entry(get -> cache, utxo);
+    if(entry && entry -> spent){
+	kyk_free_utxo(utxo);
+	return 0;
+    }
+
+    get -> found = utxo;
+
+    return 1;
+}
+
+/* a coin the cache has is taken from the cache */
+int visit_load(struct kyk_utxo* utxo, void* arg)
+{
+    struct coin_load* load = arg;
+
+    if(kyk_utxo_set_find_entry(load -> cache, utxo)){
+	kyk_free_utxo(utxo);
+	return 0;
+    }
+
+    return kyk_utxo_chain_append(load -> utxo_chain, utxo);
+}
+
+int visit_delete(struct kyk_utxo* utxo, void* arg)
+{
+    leveldb_writebatch_t* batch = arg;
+    uint8_t key[COIN_KEY_LEN];
+
+    coin_key(key, utxo -> txid, utxo -> outidx, utxo -> blkhash);
+    leveldb_writebatch_delete(batch, (const char*)key, sizeof(key));
+
+    kyk_free_utxo(utxo);
+
+    return 0;
+}
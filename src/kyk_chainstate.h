@@ -0,0 +1,62 @@
+#ifndef KYK_CHAINSTATE_H__
+#define KYK_CHAINSTATE_H__
+
+#include "kyk_ldb.h"
+#include "kyk_utxo_set.h"
+
+/*
+ * The utxo set kept in the block index db, one 'C' record per coin,
+ * next to the 'b' block index records.
+ * Connected blocks only touch the in-memory cache, which holds the coins added
+ * and spent since the last flush, a spent entry there is a delete still to be written.
+ * The cache is written back in one leveldb batch every flush_blocks blocks,
+ * or earlier once it holds cache_max coins.
+ * Coins read from the db, and the ones a flush writes, are kept in reads,
+ * so a txin spending a recent coin does not cost a db seek.
+ * reads is dropped and filled again once it holds cache_max coins.
+ * A block connect can stage that write into its own batch instead,
+ * so the coins land together with the block's other records.
+ */
+struct kyk_chainstate {
+    struct kyk_block_db* db;       /* not owned */
+    struct kyk_utxo_set* cache;
+    struct kyk_utxo_set* reads;    /* coins as they are in the db */
+    size_t cache_max;
+    size_t flush_blocks;
+    size_t dirty_blocks;           /* blocks connected since the last flush */
+    uint8_t best_hash[32];         /* the last block connected */
+    int has_best;                  /* the db has a best block record, the chainstate is set up */
+};
+
+int kyk_new_chainstate(struct kyk_chainstate** new_cs,
+		       struct kyk_block_db* db,
+		       size_t cache_max,
+		       size_t flush_blocks);
+
+void kyk_free_chainstate(struct kyk_chainstate* cs);
+
+int kyk_chainstate_connect_block(struct kyk_chainstate* cs, const struct kyk_block* blk);
+
+int kyk_chainstate_connect_block_to_batch(struct kyk_chainstate* cs,
+					  const struct kyk_block* blk,
+					  leveldb_writebatch_t* batch,
+					  int* staged);
+
+int kyk_chainstate_flushed(struct kyk_chainstate* cs);
+
+int kyk_chainstate_discard(struct kyk_chainstate* cs);
+
+int kyk_chainstate_flush(struct kyk_chainstate* cs);
+
+int kyk_chainstate_get_utxo(struct kyk_chainstate* cs,
+			    const uint8_t* txid,
+			    uint32_t outidx,
+			    struct kyk_utxo** new_utxo);
+
+int kyk_chainstate_load_utxo_chain(struct kyk_chainstate* cs,
+				   struct kyk_utxo_chain** new_utxo_chain);
+
+int kyk_chainstate_replace_utxo_chain(struct kyk_chainstate* cs,
+				      const struct kyk_utxo_chain* utxo_chain);
+
+#endif
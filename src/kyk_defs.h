@@ -66,9 +66,55 @@ typedef struct {
 /* serve defines */
 
 #define KYK_SERVE_PORT     "8333"  /* the port users will be connecting to */
-#define KYK_SERVE_BACKLOG  10      /* how many pending connections queue will hold */
+#define KYK_SERVE_BACKLOG  128     /* how many pending connections queue will hold */
 #define KYK_SERVE_MSG_SIZE 6000
 
 #define KYK_PL_BUF_SIZE    1024
 
+#define KYK_SEND_TIMEOUT_MS 30000  /* how long a reply waits for a peer that stopped reading */
+
+#define KYK_PEER_PIPELINE_DEPTH 16 /* requests a client keeps in flight on one connection */
+
+#define KYK_PEER_STALL_MS 10000    /* a peer that has not answered for this long is given up on */
+
+#define KYK_DOWNLOAD_WINDOW 1024   /* blocks requested past the first one not yet validated */
+
+#define KYK_MAX_HEADERS_RESULTS 2000 /* headers in one headers reply, a full reply means ask again */
+
+/* chainstate defines */
+
+#define KYK_COINS_CACHE_MAX 65536    /* coins the chainstate holds in memory before it flushes */
+
+#define KYK_COINS_FLUSH_BLOCKS 16    /* blocks connected between two chainstate flushes */
+
+#define KYK_CONNECT_SYNC 1           /* a block connect syncs its blk file and its index batch */
+
+/* block index db defines */
+
+#define KYK_LDB_CACHE_SIZE (8 * 1024 * 1024)         /* lru cache of the index db table blocks */
+
+#define KYK_LDB_BLOOM_BITS 10                         /* bloom filter bits per key, about 1% false positives */
+
+#define KYK_LDB_COMPRESSION 1
+
+#define KYK_LDB_WRITE_BUFFER_SIZE (4 * 1024 * 1024)
+
+#define KYK_LDB_BULK_WRITE_BUFFER_SIZE (64 * 1024 * 1024) /* the write buffer while bulk loading */
+
+#define KYK_LDB_MAX_OPEN_FILES 1000
+
+#define KYK_TXINDEX 1                 /* the index db keeps a txid -> tx position record for every tx */
+
+#define KYK_TXINDEX_BUILD_BLOCKS 64   /* blocks per batch when the tx index is built for an existing chain */
+
+/* block reader defines */
+
+#define KYK_BLK_CACHE_MAX (32 * 1024 * 1024) /* serialized block bytes the deserialized block cache holds */
+
+/* block writer defines */
+
+#define KYK_BLK_FILE_MAX (128 * 1024 * 1024)  /* a blk*.dat file takes no more blocks past this size */
+
+#define KYK_BLK_FILE_CHUNK (16 * 1024 * 1024) /* blk*.dat files are preallocated this much at a time */
+
 #endif
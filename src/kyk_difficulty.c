@@ -7,6 +7,21 @@
 
 #include <openssl/bn.h>
 
+#define TARGET_LIMB_COUNT 4
+#define TARGET_BIT_COUNT  256
+
+static int target256_bit_count(const struct kyk_target* tg);
+static void target256_shr_bytes(struct kyk_target* dst, const struct kyk_target* src, unsigned int n);
+static int target256_divmod(const struct kyk_target* a,
+			    const struct kyk_target* b,
+			    struct kyk_target* q,
+			    struct kyk_target* r);
+static void target256_add_ui(struct kyk_target* tg, uint64_t n);
+static int target256_is_zero(const struct kyk_target* tg);
+static int target256_ceil_div(const struct kyk_target* a,
+			      const struct kyk_target* b,
+			      struct kyk_target* q);
+
 
 /* When a variable of type mpz_t is used as a function parameter, it's effectively a call-by-reference, meaning anything the function does to it will be be done to the original in the caller */
 void kyk_bts2target(uint32_t bts, mpz_t tg)
@@ -100,27 +115,24 @@ int kyk_cal_next_work_req(uint32_t prev_timespan,
 
 uint64_t kyk_bts2dlt(uint32_t bts)
 {
+    struct kyk_target tg;
+    struct kyk_target dlt1_tg;
+    struct kyk_target q;
+    int res = -1;
 
-    uint64_t res;
-    mpz_t tg, dlt1_tg, q;
-    
-    mpz_init(tg);
-    mpz_init(dlt1_tg);
-    mpz_init(q);
-    
-    mpz_set_ui(tg, 0);
-    mpz_set_str(dlt1_tg, DLT1_TARGET_HEX_STR, 0);
-    kyk_bts2target(bts, tg);
+    res = kyk_bts2target256(bts, &tg);
+    check(res == 0, "Failed to kyk_bts2dlt: kyk_bts2target256 failed");
 
-    mpz_cdiv_q(q, dlt1_tg, tg);
+    kyk_bts2target256(DLT1_TARGET_BTS, &dlt1_tg);
 
-    res = mpz_get_ui(q);
+    res = target256_ceil_div(&dlt1_tg, &tg, &q);
+    check(res == 0, "Failed to kyk_bts2dlt: target is zero");
 
-    mpz_clear(tg);
-    mpz_clear(dlt1_tg);
-    mpz_clear(q);
+    return q.limb[0];
+
+error:
 
-    return res;
+    return 0;
 
 }
 
@@ -129,18 +141,267 @@ uint64_t kyk_bts2dlt(uint32_t bts)
 /* so then current_target = difficulty_1_target / difficulty */
 int kyk_dlt2target(uint32_t dlt, mpz_t tg)
 {
-    mpz_t q, dlt1_tg;
+    struct kyk_target tg256;
+    int res = -1;
 
-    mpz_init(q);
-    mpz_set_ui(q, dlt);
-    
-    mpz_init(dlt1_tg);
-    mpz_set_str(dlt1_tg, DLT1_TARGET_HEX_STR, 0);
-
-    mpz_cdiv_q(tg, dlt1_tg, q);
+    res = kyk_dlt2target256(dlt, &tg256);
+    check(res == 0, "Failed to kyk_dlt2target: kyk_dlt2target256 failed");
 
-    mpz_clear(q);
-    mpz_clear(dlt1_tg);
+    mpz_import(tg, TARGET_LIMB_COUNT, -1, sizeof(tg256.limb[0]), 0, 0, tg256.limb);
  
     return 0;
+
+error:
+
+    return -1;
+}
+
+int kyk_dlt2target256(uint32_t dlt, struct kyk_target* tg)
+{
+    struct kyk_target dlt1_tg;
+    struct kyk_target q;
+    int res = -1;
+
+    check(tg, "Failed to kyk_dlt2target256: tg is NULL");
+
+    kyk_bts2target256(DLT1_TARGET_BTS, &dlt1_tg);
+
+    memset(&q, 0, sizeof(q));
+    q.limb[0] = dlt;
+
+    res = target256_ceil_div(&dlt1_tg, &q, tg);
+    check(res == 0, "Failed to kyk_dlt2target256: dlt is zero");
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* compact bits to the fixed-width target, same rule as kyk_bts2target */
+int kyk_bts2target256(uint32_t bts, struct kyk_target* tg)
+{
+    uint8_t ep = bts >> 24;
+    uint64_t mt = bts & 0x007fffff;
+    unsigned int shift = 0;
+    unsigned int off = 0;
+    unsigned int idx = 0;
+
+    check(tg, "Failed to kyk_bts2target256: tg is NULL");
+
+    memset(tg, 0, sizeof(*tg));
+
+    if(ep <= 3){
+	mt >>= 8 * (3 - ep);
+	tg -> limb[0] = mt;
+	return 0;
+    }
+
+    if(mt == 0){
+	return 0;
+    }
+
+    shift = 8 * (ep - 3);
+    check(shift + 64 - __builtin_clzll(mt) <= TARGET_BIT_COUNT, "Failed to kyk_bts2target256: target overflow");
+
+    idx = shift / 64;
+    off = shift % 64;
+
+    tg -> limb[idx] = mt << off;
+    if(off > 0 && idx + 1 < TARGET_LIMB_COUNT){
+	tg -> limb[idx + 1] = mt >> (64 - off);
+    }
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+int kyk_target256_to_bts(const struct kyk_target* tg, uint32_t* new_bts)
+{
+    struct kyk_target tmp;
+    unsigned int size = 0;
+    uint32_t bts = 0;
+
+    check(tg, "Failed to kyk_target256_to_bts: tg is NULL");
+    check(new_bts, "Failed to kyk_target256_to_bts: new_bts is NULL");
+
+    size = (target256_bit_count(tg) + 7) / 8;
+
+    if(size <= 3){
+	bts = (uint32_t)(tg -> limb[0] << (8 * (3 - size)));
+    } else {
+	target256_shr_bytes(&tmp, tg, size - 3);
+	bts = (uint32_t)tmp.limb[0];
+    }
+
+    /* the 0x00800000 bit is the sign bit, prepend a zero byte */
+    if(bts & 0x00800000){
+	bts >>= 8;
+	size += 1;
+    }
+
+    bts &= 0x00ffffff;
+    bts |= size << 24;
+
+    *new_bts = bts;
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* digest is big-endian, as printed by kyk_blk_hash256 */
+void kyk_target256_from_digest(struct kyk_target* tg, const uint8_t* digest)
+{
+    int i = 0;
+    int j = 0;
+    uint64_t v = 0;
+
+    for(i = 0; i < TARGET_LIMB_COUNT; i++){
+	v = 0;
+	for(j = 0; j < 8; j++){
+	    v = (v << 8) | digest[i * 8 + j];
+	}
+	tg -> limb[TARGET_LIMB_COUNT - 1 - i] = v;
+    }
+}
+
+/* returns 1, 0, -1 like memcmp, every limb is visited so there is no early exit */
+int kyk_target256_cmp(const struct kyk_target* ltg, const struct kyk_target* rtg)
+{
+    int gt = 0;
+    int lt = 0;
+    int i = 0;
+
+    for(i = TARGET_LIMB_COUNT - 1; i >= 0; i--){
+	gt |= !lt & (ltg -> limb[i] > rtg -> limb[i]);
+	lt |= !gt & (ltg -> limb[i] < rtg -> limb[i]);
+    }
+
+    return gt - lt;
+}
+
+int kyk_digest_meets_target(const uint8_t* digest, const struct kyk_target* tg)
+{
+    struct kyk_target hs;
+
+    kyk_target256_from_digest(&hs, digest);
+
+    return kyk_target256_cmp(&hs, tg) <= 0;
+}
+
+int target256_bit_count(const struct kyk_target* tg)
+{
+    int i = 0;
+
+    for(i = TARGET_LIMB_COUNT - 1; i >= 0; i--){
+	if(tg -> limb[i]){
+	    return i * 64 + 64 - __builtin_clzll(tg -> limb[i]);
+	}
+    }
+
+    return 0;
+}
+
+void target256_shr_bytes(struct kyk_target* dst, const struct kyk_target* src, unsigned int n)
+{
+    unsigned int shift = 8 * n;
+    unsigned int idx = shift / 64;
+    unsigned int off = shift % 64;
+    unsigned int i = 0;
+
+    memset(dst, 0, sizeof(*dst));
+
+    for(i = 0; i + idx < TARGET_LIMB_COUNT; i++){
+	dst -> limb[i] = src -> limb[i + idx] >> off;
+	if(off > 0 && i + idx + 1 < TARGET_LIMB_COUNT){
+	    dst -> limb[i] |= src -> limb[i + idx + 1] << (64 - off);
+	}
+    }
+}
+
+int target256_is_zero(const struct kyk_target* tg)
+{
+    return (tg -> limb[0] | tg -> limb[1] | tg -> limb[2] | tg -> limb[3]) == 0;
+}
+
+void target256_add_ui(struct kyk_target* tg, uint64_t n)
+{
+    int i = 0;
+
+    for(i = 0; i < TARGET_LIMB_COUNT && n; i++){
+	tg -> limb[i] += n;
+	n = tg -> limb[i] < n ? 1 : 0;
+    }
+}
+
+/* shift-subtract long division, only used off the hot paths */
+int target256_divmod(const struct kyk_target* a,
+		     const struct kyk_target* b,
+		     struct kyk_target* q,
+		     struct kyk_target* r)
+{
+    int i = 0;
+    int j = 0;
+    uint64_t bit = 0;
+    uint64_t borrow = 0;
+    uint64_t tmp = 0;
+
+    check(!target256_is_zero(b), "Failed to target256_divmod: division by zero");
+
+    memset(q, 0, sizeof(*q));
+    memset(r, 0, sizeof(*r));
+
+    for(i = TARGET_BIT_COUNT - 1; i >= 0; i--){
+	bit = (a -> limb[i / 64] >> (i % 64)) & 1;
+
+	for(j = TARGET_LIMB_COUNT - 1; j > 0; j--){
+	    r -> limb[j] = (r -> limb[j] << 1) | (r -> limb[j - 1] >> 63);
+	}
+	r -> limb[0] = (r -> limb[0] << 1) | bit;
+
+	if(kyk_target256_cmp(r, b) >= 0){
+	    borrow = 0;
+	    for(j = 0; j < TARGET_LIMB_COUNT; j++){
+		tmp = r -> limb[j] - b -> limb[j] - borrow;
+		borrow = (r -> limb[j] < b -> limb[j]) || (r -> limb[j] - b -> limb[j] < borrow);
+		r -> limb[j] = tmp;
+	    }
+	    q -> limb[i / 64] |= (uint64_t)1 << (i % 64);
+	}
+    }
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* q = ceil(a / b), the same rounding as mpz_cdiv_q */
+int target256_ceil_div(const struct kyk_target* a,
+		       const struct kyk_target* b,
+		       struct kyk_target* q)
+{
+    struct kyk_target r;
+    int res = -1;
+
+    res = target256_divmod(a, b, q, &r);
+    check(res == 0, "Failed to target256_ceil_div: target256_divmod failed");
+
+    if(!target256_is_zero(&r)){
+	target256_add_ui(q, 1);
+    }
+
+    return 0;
+
+error:
+
+    return -1;
 }
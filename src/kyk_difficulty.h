@@ -6,10 +6,23 @@
 
 #define DLT1_TARGET_HEX_STR "0x00000000FFFF0000000000000000000000000000000000000000000000000000"
 #define POW_TARGET_TIME_SPAN 60 * 60 * 24 * 14 /* tow weeks */
+#define DLT1_TARGET_BTS 0x1d00ffff
+
+/* fixed-width 256-bit target, limb[0] is the least significant 64 bits */
+struct kyk_target {
+    uint64_t limb[4];
+};
 
 void kyk_bts2target(uint32_t bts, mpz_t tg);
 int kyk_target2bts(mpz_t tg, uint32_t* new_bts);
 
+int kyk_bts2target256(uint32_t bts, struct kyk_target* tg);
+int kyk_target256_to_bts(const struct kyk_target* tg, uint32_t* new_bts);
+void kyk_target256_from_digest(struct kyk_target* tg, const uint8_t* digest);
+int kyk_target256_cmp(const struct kyk_target* ltg, const struct kyk_target* rtg);
+int kyk_digest_meets_target(const uint8_t* digest, const struct kyk_target* tg);
+int kyk_dlt2target256(uint32_t dlt, struct kyk_target* tg);
+
 uint64_t kyk_bts2dlt(uint32_t bts);
 int kyk_dlt2target(uint32_t dlt, mpz_t tg);
 
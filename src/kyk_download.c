@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+
+#include "kyk_defs.h"
+#include "kyk_socket.h"
+#include "kyk_download.h"
+#include "dbg.h"
+
+/* how long a poll waits before the stall timers are looked at again */
+#define DL_POLL_MS 500
+
+enum dl_state {
+    DL_PENDING = 0,
+    DL_INFLIGHT,
+    DL_RECEIVED
+};
+
+/* requests written to one peer and not answered yet, oldest first */
+struct dl_peer {
+    struct kyk_peer_conn* conn;
+    size_t inflight[KYK_PEER_PIPELINE_DEPTH];
+    size_t head;
+    size_t count;
+    uint64_t last_ms;      /* when the peer last answered, or got requests while idle */
+    int alive;
+};
+
+/*
+ * Items are requested from the lowest pending one up, never further than
+ * KYK_DOWNLOAD_WINDOW past the first item not delivered yet,
+ * so a slow peer holds back at most one window of received items.
+ */
+struct dl_sched {
+    struct dl_peer* peers;
+    size_t peer_count;
+    uint8_t* state;
+    size_t item_count;
+    size_t next_pending;   /* no item below it is pending */
+    size_t delivered;      /* items below it have been delivered */
+    const struct kyk_dl_ops* ops;
+    void* arg;
+};
+
+static uint64_t dl_now_ms(void);
+static int dl_fill_peer(struct dl_sched* sched, struct dl_peer* peer);
+static int dl_wait_peers(struct dl_sched* sched, struct pollfd* pfds);
+static int dl_receive(struct dl_sched* sched, struct dl_peer* peer);
+static void dl_drop_peer(struct dl_sched* sched, struct dl_peer* peer, const char* why);
+static int dl_deliver(struct dl_sched* sched);
+
+/*
+ * Download item_count items from the peers in conn_list at once.
+ * Every peer keeps up to KYK_PEER_PIPELINE_DEPTH requests in flight out of a shared window.
+ * A peer that fails or has not answered for KYK_PEER_STALL_MS is dropped
+ * and its requests go back to the other peers.
+ * Items are delivered in order as soon as all the items before them are in.
+ * The connections stay owned by the caller, dropped ones are not used again.
+ */
+int kyk_download(struct kyk_peer_conn** conn_list,
+		 size_t conn_count,
+		 size_t item_count,
+		 const struct kyk_dl_ops* ops,
+		 void* arg)
+{
+    struct dl_sched sched;
+    struct pollfd* pfds = NULL;
+    struct dl_peer* peer = NULL;
+    uint64_t now = 0;
+    size_t alive = 0;
+    size_t i = 0;
+    int res = -1;
+
+    memset(&sched, 0, sizeof(sched));
+
+    check(conn_list, "Failed to kyk_download: conn_list is NULL");
+    check(conn_count > 0, "Failed to kyk_download: no peers");
+    check(ops, "Failed to kyk_download: ops is NULL");
+
+    sched.peer_count = conn_count;
+    sched.item_count = item_count;
+    sched.ops = ops;
+    sched.arg = arg;
+
+    sched.peers = calloc(conn_count, sizeof(*sched.peers));
+    check(sched.peers, "Failed to kyk_download: calloc failed");
+
+    sched.state = calloc(item_count + 1, sizeof(*sched.state));
+    check(sched.state, "Failed to kyk_download: calloc failed");
+
+    pfds = calloc(conn_count, sizeof(*pfds));
+    check(pfds, "Failed to kyk_download: calloc failed");
+
+    for(i = 0; i < conn_count; i++){
+	sched.peers[i].conn = conn_list[i];
+	sched.peers[i].alive = 1;
+    }
+
+    while(sched.delivered < sched.item_count){
+	alive = 0;
+	for(i = 0; i < sched.peer_count; i++){
+	    peer = sched.peers + i;
+	    if(!peer -> alive) continue;
+	    if(dl_fill_peer(&sched, peer) != 0){
+		dl_drop_peer(&sched, peer, "request failed");
+		continue;
+	    }
+	    alive++;
+	}
+	check(alive > 0, "Failed to kyk_download: no peer left, %zu of %zu items delivered", sched.delivered, sched.item_count);
+
+	res = dl_wait_peers(&sched, pfds);
+	check(res == 0, "Failed to kyk_download: dl_wait_peers failed");
+
+	now = dl_now_ms();
+	for(i = 0; i < sched.peer_count; i++){
+	    peer = sched.peers + i;
+	    if(!peer -> alive || peer -> count == 0) continue;
+
+	    if(pfds[i].revents || kyk_peer_buffered(peer -> conn)){
+		if(dl_receive(&sched, peer) != 0){
+		    dl_drop_peer(&sched, peer, "receive failed");
+		}
+	    } else if(now - peer -> last_ms > KYK_PEER_STALL_MS){
+		dl_drop_peer(&sched, peer, "stalled");
+	    }
+	}
+
+	res = dl_deliver(&sched);
+	check(res == 0, "Failed to kyk_download: dl_deliver failed");
+    }
+
+    free(pfds);
+    free(sched.state);
+    free(sched.peers);
+
+    return 0;
+
+error:
+    if(pfds) free(pfds);
+    if(sched.state) free(sched.state);
+    if(sched.peers) free(sched.peers);
+    return -1;
+}
+
+uint64_t dl_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* top the peer up to KYK_PEER_PIPELINE_DEPTH requests with the lowest pending items in the window */
+int dl_fill_peer(struct dl_sched* sched, struct dl_peer* peer)
+{
+    size_t inx_list[KYK_PEER_PIPELINE_DEPTH];
+    size_t window_end = 0;
+    size_t count = 0;
+    size_t inx = 0;
+    size_t i = 0;
+    int res = -1;
+
+    window_end = sched -> delivered + KYK_DOWNLOAD_WINDOW;
+    if(window_end > sched -> item_count) window_end = sched -> item_count;
+
+    while(sched -> next_pending < window_end && sched -> state[sched -> next_pending] != DL_PENDING){
+	sched -> next_pending++;
+    }
+
+    for(inx = sched -> next_pending; inx < window_end && peer -> count + count < KYK_PEER_PIPELINE_DEPTH; inx++){
+	if(sched -> state[inx] == DL_PENDING){
+	    inx_list[count++] = inx;
+	}
+    }
+
+    if(count == 0){
+	return 0;
+    }
+
+    res = sched -> ops -> request(peer -> conn, inx_list, count, sched -> arg);
+    check(res == 0, "Failed to dl_fill_peer: request failed");
+
+    if(peer -> count == 0){
+	peer -> last_ms = dl_now_ms();
+    }
+
+    for(i = 0; i < count; i++){
+	sched -> state[inx_list[i]] = DL_INFLIGHT;
+	peer -> inflight[(peer -> head + peer -> count) % KYK_PEER_PIPELINE_DEPTH] = inx_list[i];
+	peer -> count++;
+    }
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* wait until a peer with requests in flight has something to read, pfds[i] belongs to peer i */
+int dl_wait_peers(struct dl_sched* sched, struct pollfd* pfds)
+{
+    struct dl_peer* peer = NULL;
+    int timeout = DL_POLL_MS;
+    size_t i = 0;
+    int res = -1;
+
+    for(i = 0; i < sched -> peer_count; i++){
+	peer = sched -> peers + i;
+	pfds[i].fd = (peer -> alive && peer -> count > 0) ? peer -> conn -> fd : -1;
+	pfds[i].events = POLLIN;
+	pfds[i].revents = 0;
+	if(pfds[i].fd != -1 && kyk_peer_buffered(peer -> conn)){
+	    /* a reply is already read ahead, don't sleep on the socket */
+	    timeout = 0;
+	}
+    }
+
+    res = poll(pfds, sched -> peer_count, timeout);
+    if(res == -1 && errno == EINTR){
+	return 0;
+    }
+    check(res != -1, "Failed to dl_wait_peers: poll failed");
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* the peer answers in request order, the reply is for its oldest request */
+int dl_receive(struct dl_sched* sched, struct dl_peer* peer)
+{
+    size_t inx = 0;
+    int res = -1;
+
+    inx = peer -> inflight[peer -> head];
+
+    res = sched -> ops -> receive(peer -> conn, inx, sched -> arg);
+    check(res == 0, "Failed to dl_receive: receive failed");
+
+    sched -> state[inx] = DL_RECEIVED;
+    peer -> head = (peer -> head + 1) % KYK_PEER_PIPELINE_DEPTH;
+    peer -> count--;
+    peer -> last_ms = dl_now_ms();
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* stop using the peer, the items it still owed are requested again from the others */
+void dl_drop_peer(struct dl_sched* sched, struct dl_peer* peer, const char* why)
+{
+    size_t inx = 0;
+
+    log_warn("dropping download peer: %s, %zu requests reassigned", why, peer -> count);
+
+    while(peer -> count > 0){
+	inx = peer -> inflight[peer -> head];
+	sched -> state[inx] = DL_PENDING;
+	if(inx < sched -> next_pending) sched -> next_pending = inx;
+	peer -> head = (peer -> head + 1) % KYK_PEER_PIPELINE_DEPTH;
+	peer -> count--;
+    }
+
+    peer -> alive = 0;
+}
+
+int dl_deliver(struct dl_sched* sched)
+{
+    int res = -1;
+
+    while(sched -> delivered < sched -> item_count && sched -> state[sched -> delivered] == DL_RECEIVED){
+	res = sched -> ops -> deliver(sched -> delivered, sched -> arg);
+	check(res == 0, "Failed to dl_deliver: deliver failed for item %zu", sched -> delivered);
+	sched -> delivered++;
+    }
+
+    return 0;
+
+error:
+
+    return -1;
+}
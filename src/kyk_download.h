@@ -0,0 +1,27 @@
+#ifndef KYK_DOWNLOAD_H__
+#define KYK_DOWNLOAD_H__
+
+#include <stddef.h>
+
+struct kyk_peer_conn;
+
+/*
+ * What the download scheduler needs from its user.
+ * Items are numbered 0 .. item_count - 1 in chain order.
+ * request writes the requests for inx_list to conn, the peer answers them in that order.
+ * receive reads the reply for item inx from conn.
+ * deliver hands item inx on, it is called once per item in increasing order.
+ */
+struct kyk_dl_ops {
+    int (*request)(struct kyk_peer_conn* conn, const size_t* inx_list, size_t count, void* arg);
+    int (*receive)(struct kyk_peer_conn* conn, size_t inx, void* arg);
+    int (*deliver)(size_t inx, void* arg);
+};
+
+int kyk_download(struct kyk_peer_conn** conn_list,
+		 size_t conn_count,
+		 size_t item_count,
+		 const struct kyk_dl_ops* ops,
+		 void* arg);
+
+#endif
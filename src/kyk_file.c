@@ -140,6 +140,33 @@ error:
     return -1;
 }
 
+/* pwrite until all len bytes are in, a short write goes on from where it stopped */
+int kyk_file_pwrite_all(int fd,
+			uint64_t offset,
+			const void *buf,
+			size_t len)
+{
+    const uint8_t* bufp = buf;
+    ssize_t n = 0;
+
+    while(len > 0){
+	n = pwrite(fd, bufp, len, offset);
+	if(n == -1 && (errno == EAGAIN || errno == EINTR)){
+	    continue;
+	}
+	check(n > 0, "Failed to kyk_file_pwrite_all: pwrite failed");
+	bufp += n;
+	len -= n;
+	offset += n;
+    }
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
 bool kyk_file_exists(const char *filename)
 {
     struct stat s;
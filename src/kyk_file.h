@@ -21,6 +21,11 @@ int kyk_file_pwrite(const struct file_descriptor *desc,
   		    size_t len,
 		    size_t *numWritten);
 
+int kyk_file_pwrite_all(int fd,
+			uint64_t offset,
+			const void *buf,
+			size_t len);
+
 void kyk_file_close(struct file_descriptor *desc);
 
 bool kyk_file_exists(const char *filename);
@@ -0,0 +1,541 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "beej_pack.h"
+#include "kyk_frame.h"
+#include "dbg.h"
+
+static size_t frame_need(const struct kyk_frame_ring* ring);
+static int queue_write(struct kyk_frame_queue* queue, struct iovec* iov, size_t iov_cnt);
+static int queue_append(struct kyk_frame_queue* queue, const uint8_t* buf, size_t len);
+
+
+int kyk_new_frame_ring(struct kyk_frame_ring** new_ring, size_t cap, size_t max_pld_len)
+{
+    struct kyk_frame_ring* ring = NULL;
+
+    check(new_ring, "Failed to kyk_new_frame_ring: new_ring is NULL");
+    check(cap >= KYK_MSG_HEADER_LEN, "Failed to kyk_new_frame_ring: cap is too small");
+
+    ring = calloc(1, sizeof(*ring));
+    check(ring, "Failed to kyk_new_frame_ring: ring calloc failed");
+
+    ring -> base = malloc(cap);
+    check(ring -> base, "Failed to kyk_new_frame_ring: base malloc failed");
+
+    ring -> cap = cap;
+    ring -> max_pld_len = max_pld_len;
+
+    *new_ring = ring;
+
+    return 0;
+
+error:
+    if(ring) kyk_free_frame_ring(ring);
+    return -1;
+}
+
+/* bytes the frame at head takes once complete, only the header size until the header is in */
+size_t frame_need(const struct kyk_frame_ring* ring)
+{
+    uint32_t pld_len = 0;
+
+    if(ring -> tail - ring -> head < KYK_MSG_HEADER_LEN){
+	return KYK_MSG_HEADER_LEN;
+    }
+
+    beej_unpack(ring -> base + ring -> head + KYK_PLD_LEN_POS, "<L", &pld_len);
+
+    return KYK_MSG_HEADER_LEN + (size_t)pld_len;
+}
+
+/*
+ * Free space to receive into.
+ * The ring grows only when the frame at head is larger than the whole ring,
+ * otherwise the unread bytes are moved to the start once the end is reached.
+ */
+int kyk_frame_ring_space(struct kyk_frame_ring* ring, uint8_t** space, size_t* space_len)
+{
+    uint8_t* larger_base = NULL;
+    size_t need = 0;
+    size_t cap = 0;
+
+    check(ring, "Failed to kyk_frame_ring_space: ring is NULL");
+    check(space, "Failed to kyk_frame_ring_space: space is NULL");
+    check(space_len, "Failed to kyk_frame_ring_space: space_len is NULL");
+
+    need = frame_need(ring);
+    check(need - KYK_MSG_HEADER_LEN <= ring -> max_pld_len, "Failed to kyk_frame_ring_space: frame is too large");
+
+    if(ring -> head == ring -> tail){
+	ring -> head = 0;
+	ring -> tail = 0;
+    }
+
+    if(ring -> cap - ring -> tail < KYK_PL_BUF_SIZE || ring -> cap - ring -> head < need){
+	if(ring -> head > 0){
+	    memmove(ring -> base, ring -> base + ring -> head, ring -> tail - ring -> head);
+	    ring -> tail -= ring -> head;
+	    ring -> head = 0;
+	}
+
+	if(ring -> cap < need){
+	    cap = ring -> cap;
+	    while(cap < need) cap *= 2;
+	    larger_base = realloc(ring -> base, cap);
+	    check(larger_base, "Failed to kyk_frame_ring_space: realloc failed");
+	    ring -> base = larger_base;
+	    ring -> cap = cap;
+	}
+    }
+
+    check(ring -> tail < ring -> cap, "Failed to kyk_frame_ring_space: ring is full");
+
+    *space = ring -> base + ring -> tail;
+    *space_len = ring -> cap - ring -> tail;
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* len bytes were written into the space given by kyk_frame_ring_space */
+int kyk_frame_ring_commit(struct kyk_frame_ring* ring, size_t len)
+{
+    check(ring, "Failed to kyk_frame_ring_commit: ring is NULL");
+    check(len <= ring -> cap - ring -> tail, "Failed to kyk_frame_ring_commit: len is out of the ring");
+
+    ring -> tail += len;
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/*
+ * One recv into the ring, *recv_len is what recv returned:
+ * 0 when the peer closed, -1 with errno set when nothing could be read.
+ */
+int kyk_frame_ring_recv(struct kyk_frame_ring* ring, int fd, ssize_t* recv_len)
+{
+    uint8_t* space = NULL;
+    size_t space_len = 0;
+    ssize_t n = 0;
+    int res = -1;
+
+    check(recv_len, "Failed to kyk_frame_ring_recv: recv_len is NULL");
+
+    res = kyk_frame_ring_space(ring, &space, &space_len);
+    check(res == 0, "Failed to kyk_frame_ring_recv: kyk_frame_ring_space failed");
+
+    n = recv(fd, space, space_len, 0);
+    if(n > 0){
+	ring -> tail += n;
+    }
+
+    *recv_len = n;
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* *ready is 1 when a whole frame is buffered and decoded into frame, 0 when more bytes are needed */
+int kyk_frame_ring_next(struct kyk_frame_ring* ring, struct kyk_frame* frame, int* ready)
+{
+    const uint8_t* bufp = NULL;
+    size_t need = 0;
+
+    check(ring, "Failed to kyk_frame_ring_next: ring is NULL");
+    check(frame, "Failed to kyk_frame_ring_next: frame is NULL");
+    check(ready, "Failed to kyk_frame_ring_next: ready is NULL");
+
+    *ready = 0;
+
+    need = frame_need(ring);
+    check(need - KYK_MSG_HEADER_LEN <= ring -> max_pld_len, "Failed to kyk_frame_ring_next: frame is too large");
+
+    if(ring -> tail - ring -> head < need){
+	return 0;
+    }
+
+    bufp = ring -> base + ring -> head;
+
+    beej_unpack(bufp, "<L", &frame -> magic);
+    bufp += sizeof(frame -> magic);
+
+    memcpy(frame -> cmd, bufp, sizeof(frame -> cmd));
+    bufp += sizeof(frame -> cmd);
+
+    beej_unpack(bufp, "<L", &frame -> pld_len);
+    bufp += sizeof(frame -> pld_len);
+
+    memcpy(frame -> checksum, bufp, sizeof(frame -> checksum));
+    bufp += sizeof(frame -> checksum);
+
+    frame -> pld = bufp;
+
+    *ready = 1;
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* drop the frame returned by the last kyk_frame_ring_next, its payload view is gone after this */
+void kyk_frame_ring_consume(struct kyk_frame_ring* ring, const struct kyk_frame* frame)
+{
+    ring -> head += KYK_MSG_HEADER_LEN + (size_t)frame -> pld_len;
+
+    if(ring -> head == ring -> tail){
+	ring -> head = 0;
+	ring -> tail = 0;
+    }
+}
+
+/* a message borrowing the frame payload, for handlers that only read it */
+void kyk_frame_to_msg_view(ptl_message* msg, ptl_payload* pld, const struct kyk_frame* frame)
+{
+    msg -> magic = frame -> magic;
+    memcpy(msg -> cmd, frame -> cmd, sizeof(msg -> cmd));
+    msg -> pld_len = frame -> pld_len;
+    memcpy(msg -> checksum, frame -> checksum, sizeof(msg -> checksum));
+
+    pld -> len = frame -> pld_len;
+    pld -> data = (uint8_t*)frame -> pld;
+    msg -> pld = pld;
+}
+
+/* a message owning a copy of the payload, for frames kept after they are consumed */
+int kyk_frame_to_new_ptl_message(ptl_message** new_msg, const struct kyk_frame* frame)
+{
+    ptl_message* msg = NULL;
+    ptl_payload* pld = NULL;
+
+    check(new_msg, "Failed to kyk_frame_to_new_ptl_message: new_msg is NULL");
+    check(frame, "Failed to kyk_frame_to_new_ptl_message: frame is NULL");
+
+    msg = calloc(1, sizeof(*msg));
+    check(msg, "Failed to kyk_frame_to_new_ptl_message: msg calloc failed");
+
+    pld = calloc(1, sizeof(*pld));
+    check(pld, "Failed to kyk_frame_to_new_ptl_message: pld calloc failed");
+
+    kyk_frame_to_msg_view(msg, pld, frame);
+
+    pld -> data = malloc(frame -> pld_len > 0 ? frame -> pld_len : 1);
+    check(pld -> data, "Failed to kyk_frame_to_new_ptl_message: pld data malloc failed");
+    memcpy(pld -> data, frame -> pld, frame -> pld_len);
+
+    *new_msg = msg;
+
+    return 0;
+
+error:
+    if(pld){
+	pld -> data = NULL;
+	free(pld);
+    }
+    if(msg) free(msg);
+    return -1;
+}
+
+void kyk_free_frame_ring(struct kyk_frame_ring* ring)
+{
+    if(ring){
+	if(ring -> base) free(ring -> base);
+	free(ring);
+    }
+}
+
+/*
+ * A header iovec and a payload iovec per message, at most KYK_FRAME_IOV_BATCH messages.
+ * The headers are built in hd_bufs, one per message, the payloads are the messages' own buffers.
+ */
+int kyk_frame_iov_fill(struct iovec* iov,
+		       size_t* iov_cnt,
+		       uint8_t (*hd_bufs)[KYK_MSG_HEADER_LEN],
+		       const ptl_message** msg_list,
+		       size_t count)
+{
+    const ptl_message* msg = NULL;
+    size_t i = 0;
+    int res = -1;
+
+    check(msg_list, "Failed to kyk_frame_iov_fill: msg_list is NULL");
+    check(count <= KYK_FRAME_IOV_BATCH, "Failed to kyk_frame_iov_fill: too many messages");
+
+    *iov_cnt = 0;
+    for(i = 0; i < count; i++){
+	msg = msg_list[i];
+	check(msg, "Failed to kyk_frame_iov_fill: msg is NULL");
+	check(msg -> pld, "Failed to kyk_frame_iov_fill: msg -> pld is NULL");
+	check(msg -> pld_len == msg -> pld -> len, "Failed to kyk_frame_iov_fill: invalid msg -> pld_len");
+
+	res = kyk_seri_ptl_msg_header(hd_bufs[i], msg);
+	check(res == 0, "Failed to kyk_frame_iov_fill: kyk_seri_ptl_msg_header failed");
+
+	iov[*iov_cnt].iov_base = hd_bufs[i];
+	iov[*iov_cnt].iov_len = KYK_MSG_HEADER_LEN;
+	(*iov_cnt)++;
+
+	if(msg -> pld_len > 0){
+	    iov[*iov_cnt].iov_base = msg -> pld -> data;
+	    iov[*iov_cnt].iov_len = msg -> pld_len;
+	    (*iov_cnt)++;
+	}
+    }
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* skips the len bytes a sendmsg wrote from iov + iov_idx, the first unfinished entry is trimmed */
+size_t kyk_frame_iov_skip(struct iovec* iov, size_t iov_cnt, size_t iov_idx, size_t len)
+{
+    while(iov_idx < iov_cnt && len >= iov[iov_idx].iov_len){
+	len -= iov[iov_idx].iov_len;
+	iov_idx++;
+    }
+
+    if(iov_idx < iov_cnt){
+	iov[iov_idx].iov_base = (uint8_t*)iov[iov_idx].iov_base + len;
+	iov[iov_idx].iov_len -= len;
+    }
+
+    return iov_idx;
+}
+
+int kyk_new_frame_queue(struct kyk_frame_queue** new_queue, int fd, size_t max_len)
+{
+    struct kyk_frame_queue* queue = NULL;
+
+    check(new_queue, "Failed to kyk_new_frame_queue: new_queue is NULL");
+
+    queue = calloc(1, sizeof(*queue));
+    check(queue, "Failed to kyk_new_frame_queue: queue calloc failed");
+
+    /* the buffer is only allocated once something has to wait */
+    queue -> fd = fd;
+    queue -> max_len = max_len;
+
+    *new_queue = queue;
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/*
+ * Queue count messages, the headers are built in a stack buffer and
+ * the payloads are sent from the messages' own buffers,
+ * only what the socket does not take right away is copied.
+ */
+int kyk_frame_queue_msgs(struct kyk_frame_queue* queue, const ptl_message** msg_list, size_t count)
+{
+    uint8_t hd_bufs[KYK_FRAME_IOV_BATCH][KYK_MSG_HEADER_LEN];
+    struct iovec iov[KYK_FRAME_IOV_BATCH * 2];
+    size_t done = 0;
+    size_t batch = 0;
+    size_t iov_cnt = 0;
+    int res = -1;
+
+    check(queue, "Failed to kyk_frame_queue_msgs: queue is NULL");
+    check(msg_list, "Failed to kyk_frame_queue_msgs: msg_list is NULL");
+
+    while(done < count){
+	batch = count - done < KYK_FRAME_IOV_BATCH ? count - done : KYK_FRAME_IOV_BATCH;
+	res = kyk_frame_iov_fill(iov, &iov_cnt, hd_bufs, msg_list + done, batch);
+	check(res == 0, "Failed to kyk_frame_queue_msgs: kyk_frame_iov_fill failed");
+
+	res = queue_write(queue, iov, iov_cnt);
+	check(res == 0, "Failed to kyk_frame_queue_msgs: queue_write failed");
+
+	done += batch;
+    }
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* the bytes collected in src go after the ones in queue, src is left empty */
+int kyk_frame_queue_move(struct kyk_frame_queue* queue, struct kyk_frame_queue* src)
+{
+    struct iovec iov;
+    int res = -1;
+
+    check(queue, "Failed to kyk_frame_queue_move: queue is NULL");
+    check(src, "Failed to kyk_frame_queue_move: src is NULL");
+    check(queue != src, "Failed to kyk_frame_queue_move: src is queue");
+
+    if(src -> head == src -> tail){
+	return 0;
+    }
+
+    iov.iov_base = src -> base + src -> head;
+    iov.iov_len = src -> tail - src -> head;
+
+    res = queue_write(queue, &iov, 1);
+    check(res == 0, "Failed to kyk_frame_queue_move: queue_write failed");
+
+    src -> head = 0;
+    src -> tail = 0;
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/*
+ * Write the queued bytes until the socket is full.
+ * Returning 0 with bytes still pending means waiting until the socket is writable again.
+ */
+int kyk_frame_queue_flush(struct kyk_frame_queue* queue)
+{
+    ssize_t n = 0;
+
+    check(queue, "Failed to kyk_frame_queue_flush: queue is NULL");
+    check(queue -> fd != -1, "Failed to kyk_frame_queue_flush: queue has no socket");
+
+    while(queue -> head < queue -> tail){
+	n = send(queue -> fd, queue -> base + queue -> head, queue -> tail - queue -> head, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if(n == -1 && errno == EINTR){
+	    continue;
+	}
+
+	if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+	    break;
+	}
+
+	check(n >= 0, "Failed to kyk_frame_queue_flush: send failed");
+	queue -> head += n;
+    }
+
+    if(queue -> head == queue -> tail){
+	queue -> head = 0;
+	queue -> tail = 0;
+	/* a buffer grown for a large block is not kept by an idle connection */
+	if(queue -> cap > KYK_FRAME_RING_SIZE){
+	    free(queue -> base);
+	    queue -> base = NULL;
+	    queue -> cap = 0;
+	}
+    }
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+size_t kyk_frame_queue_pending(const struct kyk_frame_queue* queue)
+{
+    return queue -> tail - queue -> head;
+}
+
+/* send iov while nothing is queued ahead of it, whatever the socket does not take is copied in */
+int queue_write(struct kyk_frame_queue* queue, struct iovec* iov, size_t iov_cnt)
+{
+    struct msghdr mh;
+    size_t iov_idx = 0;
+    ssize_t len = 0;
+    int res = -1;
+
+    while(queue -> fd != -1 && queue -> head == queue -> tail && iov_idx < iov_cnt){
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov + iov_idx;
+	mh.msg_iovlen = iov_cnt - iov_idx;
+
+	len = sendmsg(queue -> fd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if(len == -1 && errno == EINTR){
+	    continue;
+	}
+
+	if(len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+	    break;
+	}
+
+	check(len >= 0, "Failed to queue_write: sendmsg failed");
+	iov_idx = kyk_frame_iov_skip(iov, iov_cnt, iov_idx, len);
+    }
+
+    for(; iov_idx < iov_cnt; iov_idx++){
+	res = queue_append(queue, iov[iov_idx].iov_base, iov[iov_idx].iov_len);
+	check(res == 0, "Failed to queue_write: queue_append failed");
+    }
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* the space of the bytes already sent is reused before the buffer grows */
+int queue_append(struct kyk_frame_queue* queue, const uint8_t* buf, size_t len)
+{
+    uint8_t* larger_base = NULL;
+    size_t pending = queue -> tail - queue -> head;
+    size_t cap = 0;
+
+    if(len == 0){
+	return 0;
+    }
+
+    check(len <= queue -> max_len && pending <= queue -> max_len - len, "Failed to queue_append: peer is not reading");
+
+    if(queue -> cap - queue -> tail < len && queue -> head > 0){
+	memmove(queue -> base, queue -> base + queue -> head, pending);
+	queue -> tail = pending;
+	queue -> head = 0;
+    }
+
+    if(queue -> cap - queue -> tail < len){
+	cap = queue -> cap > 0 ? queue -> cap : KYK_FRAME_RING_SIZE;
+	while(cap - queue -> tail < len) cap *= 2;
+	larger_base = realloc(queue -> base, cap);
+	check(larger_base, "Failed to queue_append: realloc failed");
+	queue -> base = larger_base;
+	queue -> cap = cap;
+    }
+
+    memcpy(queue -> base + queue -> tail, buf, len);
+    queue -> tail += len;
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+void kyk_free_frame_queue(struct kyk_frame_queue* queue)
+{
+    if(queue){
+	if(queue -> base) free(queue -> base);
+	free(queue);
+    }
+}
@@ -0,0 +1,96 @@
+#ifndef KYK_FRAME_H__
+#define KYK_FRAME_H__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "kyk_message.h"
+
+#define KYK_FRAME_RING_SIZE (64 * 1024)
+
+/* a peer with more unsent bytes than this is not reading */
+#define KYK_FRAME_QUEUE_MAX (64 * 1024 * 1024)
+
+/* messages per sendmsg, two iovecs each */
+#define KYK_FRAME_IOV_BATCH 64
+
+/*
+ * Per connection receive buffer with a streaming frame decoder.
+ * Bytes are received into the free space after tail and decoded in place,
+ * any number of frames can arrive in one recv.
+ * When the free space runs out the unread bytes, at most one partial frame,
+ * are moved back to the start, so a frame always sits in one piece
+ * and its payload can be handed out as a view instead of a copy.
+ */
+struct kyk_frame_ring {
+    uint8_t* base;
+    size_t cap;
+    size_t head;          /* first unread byte */
+    size_t tail;          /* end of the received bytes */
+    size_t max_pld_len;   /* frames announcing more are rejected */
+};
+
+/* a decoded frame, pld points into the ring and is valid until kyk_frame_ring_consume */
+struct kyk_frame {
+    uint32_t magic;
+    char cmd[KYK_MSG_TYPE_LEN];
+    uint32_t pld_len;
+    uint8_t checksum[KYK_MSG_CK_LEN];
+    const uint8_t* pld;
+};
+
+/*
+ * Per connection send queue, the counterpart of the ring.
+ * Messages are written straight to the non-blocking socket while nothing is queued,
+ * the bytes the socket does not take are copied in and written by kyk_frame_queue_flush
+ * once it is writable again, so a peer that reads slowly never blocks the writer.
+ * A queue with fd -1 only collects bytes, to be moved onto a connection's queue later.
+ */
+struct kyk_frame_queue {
+    int fd;
+    uint8_t* base;
+    size_t cap;
+    size_t head;          /* first unsent byte */
+    size_t tail;          /* end of the queued bytes */
+    size_t max_len;       /* queuing more fails */
+};
+
+int kyk_new_frame_ring(struct kyk_frame_ring** new_ring, size_t cap, size_t max_pld_len);
+
+int kyk_frame_ring_space(struct kyk_frame_ring* ring, uint8_t** space, size_t* space_len);
+
+int kyk_frame_ring_commit(struct kyk_frame_ring* ring, size_t len);
+
+int kyk_frame_ring_recv(struct kyk_frame_ring* ring, int fd, ssize_t* recv_len);
+
+int kyk_frame_ring_next(struct kyk_frame_ring* ring, struct kyk_frame* frame, int* ready);
+
+void kyk_frame_ring_consume(struct kyk_frame_ring* ring, const struct kyk_frame* frame);
+
+void kyk_frame_to_msg_view(ptl_message* msg, ptl_payload* pld, const struct kyk_frame* frame);
+
+int kyk_frame_to_new_ptl_message(ptl_message** new_msg, const struct kyk_frame* frame);
+
+void kyk_free_frame_ring(struct kyk_frame_ring* ring);
+
+int kyk_new_frame_queue(struct kyk_frame_queue** new_queue, int fd, size_t max_len);
+
+int kyk_frame_queue_msgs(struct kyk_frame_queue* queue, const ptl_message** msg_list, size_t count);
+
+int kyk_frame_queue_move(struct kyk_frame_queue* queue, struct kyk_frame_queue* src);
+
+int kyk_frame_queue_flush(struct kyk_frame_queue* queue);
+
+size_t kyk_frame_queue_pending(const struct kyk_frame_queue* queue);
+
+void kyk_free_frame_queue(struct kyk_frame_queue* queue);
+
+int kyk_frame_iov_fill(struct iovec* iov,
+		       size_t* iov_cnt,
+		       uint8_t (*hd_bufs)[KYK_MSG_HEADER_LEN],
+		       const ptl_message** msg_list,
+		       size_t count);
+
+size_t kyk_frame_iov_skip(struct iovec* iov, size_t iov_cnt, size_t iov_idx, size_t len);
+
+#endif
@@ -1,38 +1,65 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <openssl/sha.h>
 
 #include "kyk_block.h"
 #include "kyk_utils.h"
 #include "kyk_sha.h"
+#include "kyk_sha_simd.h"
 #include "kyk_difficulty.h"
+#include "kyk_hash_nonce.h"
 #include "beej_pack.h"
+#include "dbg.h"
 
-void kyk_hash_nonce(struct kyk_blk_header *hd)
+/* 2 ** 32, the whole nonce space */
+#define NONCE_SPACE_SIZE 0x100000000ull
+
+/* shared by all the workers of one mining job */
+struct nonce_job {
+    struct kyk_blk_header hd;
+    struct kyk_target tg;
+    atomic_int found;
+    pthread_mutex_t mtx;
+    uint32_t nonce;
+    uint8_t blk_hash[32];
+};
+
+struct nonce_worker {
+    pthread_t tid;
+    struct nonce_job* job;
+    uint32_t nonce_begin;
+    uint64_t nonce_count;
+};
+
+static int miner_threads = KYK_MINER_THREADS_AUTO;
+
+static int hash_nonce_mt(struct kyk_blk_header *hd, int thread_num, int roll_tts, int* found);
+static void* nonce_worker_run(void* arg);
+static int run_nonce_round(struct nonce_job* job,
+			   struct nonce_worker* workers,
+			   int thread_num,
+			   uint32_t nonce_start);
+
+int kyk_hash_nonce(struct kyk_blk_header *hd)
 {
-    mpz_t tg, hs;
-    size_t len;
-    uint8_t hd_buf[KYK_BLK_HD_LEN + 20];
+    struct kyk_target tg;
+    struct kyk_blk_hd_hasher hasher;
     uint8_t dgst[SHA256_DIGEST_LENGTH];
+    int res = -1;
     
-    mpz_init(tg);
-    mpz_set_ui(tg, 0);
-
-    mpz_init(hs);
-    mpz_set_ui(hs, 0);
-
     /* bts to target */
-    kyk_bts2target(hd -> bts, tg);    
+    res = kyk_bts2target256(hd -> bts, &tg);
+    check(res == 0, "Failed to kyk_hash_nonce: kyk_bts2target256 failed");
 
-    len = kyk_seri_blk_hd_without_nonce(hd_buf, hd);
+    kyk_init_blk_hd_hasher(&hasher, hd);
 
     do{
-    	beej_pack(hd_buf+len, "<L", hd -> nonce);
-    	kyk_dgst_hash256(dgst, hd_buf, KYK_BLK_HD_LEN);
-    	kyk_reverse(dgst, SHA256_DIGEST_LENGTH);
-	mpz_import(hs, SHA256_DIGEST_LENGTH, 1, 1, 1, 0, dgst);
-	if(mpz_cmp(hs, tg) > 0){
+	kyk_blk_hd_hasher_hash(&hasher, dgst, hd -> nonce);
+	if(!kyk_digest_meets_target(dgst, &tg)){
 	    hd -> nonce += 1;
 	} else {
 	    break;
@@ -42,7 +69,210 @@ void kyk_hash_nonce(struct kyk_blk_header *hd)
 
     memcpy(hd -> blk_hash, dgst, sizeof(dgst));
 
-    mpz_clear(tg);
-    mpz_clear(hs);
+    return 0;
+
+error:
+
+    return -1;
+}
+
+void kyk_set_miner_threads(int thread_num)
+{
+    if(thread_num < 0){
+	thread_num = KYK_MINER_THREADS_AUTO;
+    }
+
+    if(thread_num > KYK_MINER_MAX_THREADS){
+	thread_num = KYK_MINER_MAX_THREADS;
+    }
+
+    miner_threads = thread_num;
+}
+
+int kyk_get_miner_threads(void)
+{
+    return miner_threads;
+}
+
+/*
+ * Parallel version of kyk_hash_nonce.
+ * The nonce space is split into thread_num slices starting at hd -> nonce,
+ * every worker walks its own slice, and the first worker reaching the target stops the others.
+ * If the whole nonce space is exhausted, the timestamp is rolled and the search starts over.
+ */
+int kyk_hash_nonce_mt(struct kyk_blk_header *hd, int thread_num)
+{
+    int found = 0;
+
+    return hash_nonce_mt(hd, thread_num, 1, &found);
+}
+
+/*
+ * One pass of kyk_hash_nonce_mt over the nonce space, nothing else in hd is rolled.
+ * found is 0 when no nonce reaches the target, the caller changes the merkle root
+ * (the coinbase extranonce) and searches again.
+ */
+int kyk_hash_nonce_space_mt(struct kyk_blk_header *hd, int thread_num, int* found)
+{
+    check(found, "Failed to kyk_hash_nonce_space_mt: found is NULL");
+
+    return hash_nonce_mt(hd, thread_num, 0, found);
+
+error:
+
+    return -1;
+}
+
+int hash_nonce_mt(struct kyk_blk_header *hd, int thread_num, int roll_tts, int* found)
+{
+    struct nonce_job* job = NULL;
+    struct nonce_worker* workers = NULL;
+    uint32_t nonce_start = 0;
+    int res = -1;
+
+    check(hd, "Failed to hash_nonce_mt: hd is NULL");
+
+    if(thread_num <= KYK_MINER_THREADS_AUTO){
+	thread_num = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    if(thread_num < 1){
+	thread_num = 1;
+    }
+
+    if(thread_num > KYK_MINER_MAX_THREADS){
+	thread_num = KYK_MINER_MAX_THREADS;
+    }
+
+    job = calloc(1, sizeof(*job));
+    check(job, "Failed to hash_nonce_mt: job calloc failed");
+
+    workers = calloc(thread_num, sizeof(*workers));
+    check(workers, "Failed to hash_nonce_mt: workers calloc failed");
+
+    /* an overflowing target can never be met, don't start the search */
+    res = kyk_bts2target256(hd -> bts, &job -> tg);
+    check(res == 0, "Failed to hash_nonce_mt: kyk_bts2target256 failed");
+
+    res = pthread_mutex_init(&job -> mtx, NULL);
+    check(res == 0, "Failed to hash_nonce_mt: pthread_mutex_init failed");
+
+    memcpy(&job -> hd, hd, sizeof(job -> hd));
+    nonce_start = hd -> nonce;
+
+    do{
+	atomic_store(&job -> found, 0);
+	res = run_nonce_round(job, workers, thread_num, nonce_start);
+	check(res == 0, "Failed to hash_nonce_mt: run_nonce_round failed");
+
+	if(atomic_load(&job -> found) || !roll_tts){
+	    break;
+	}
+
+	/* nonce space is exhausted, roll the timestamp */
+	job -> hd.tts += 1;
+    } while(1);
+
+    *found = atomic_load(&job -> found);
+    if(*found){
+	hd -> tts = job -> hd.tts;
+	hd -> nonce = job -> nonce;
+	memcpy(hd -> blk_hash, job -> blk_hash, sizeof(hd -> blk_hash));
+    }
+
+    pthread_mutex_destroy(&job -> mtx);
+    free(workers);
+    free(job);
+
+    return 0;
+
+error:
+    if(job) free(job);
+    if(workers) free(workers);
+    return -1;
+}
+
+int run_nonce_round(struct nonce_job* job,
+		    struct nonce_worker* workers,
+		    int thread_num,
+		    uint32_t nonce_start)
+{
+    struct nonce_worker* wk = NULL;
+    uint64_t slice = NONCE_SPACE_SIZE / thread_num;
+    int started = 0;
+    int i = 0;
+    int res = -1;
+
+    for(i = 0; i < thread_num; i++){
+	wk = workers + i;
+	wk -> job = job;
+	wk -> nonce_begin = nonce_start + (uint32_t)(slice * i);
+	wk -> nonce_count = slice;
+	if(i == thread_num - 1){
+	    wk -> nonce_count = NONCE_SPACE_SIZE - slice * i;
+	}
+
+	res = pthread_create(&wk -> tid, NULL, nonce_worker_run, wk);
+	check(res == 0, "Failed to run_nonce_round: pthread_create failed");
+	started++;
+    }
+
+    for(i = 0; i < started; i++){
+	pthread_join(workers[i].tid, NULL);
+    }
+
+    return 0;
+
+error:
+    /* let the already started workers quit early */
+    atomic_store(&job -> found, -1);
+    for(i = 0; i < started; i++){
+	pthread_join(workers[i].tid, NULL);
+    }
+    return -1;
+}
+
+void* nonce_worker_run(void* arg)
+{
+    struct nonce_worker* wk = arg;
+    struct nonce_job* job = wk -> job;
+    struct kyk_blk_hd_hasher hasher;
+    uint8_t dgst[KYK_SHA256D_MAX_LANES * SHA256_DIGEST_LENGTH];
+    uint32_t nonce = wk -> nonce_begin;
+    uint64_t left = wk -> nonce_count;
+    size_t batch = 0;
+    size_t i = 0;
+
+    kyk_init_blk_hd_hasher(&hasher, &job -> hd);
+
+    while(left > 0){
+	if(atomic_load_explicit(&job -> found, memory_order_relaxed)){
+	    break;
+	}
+
+	batch = left < KYK_SHA256D_MAX_LANES ? (size_t)left : KYK_SHA256D_MAX_LANES;
+	kyk_blk_hd_hasher_hash_n(&hasher, dgst, nonce, batch);
+
+	for(i = 0; i < batch; i++){
+	    if(kyk_digest_meets_target(dgst + i * SHA256_DIGEST_LENGTH, &job -> tg)){
+		break;
+	    }
+	}
+
+	if(i < batch){
+	    pthread_mutex_lock(&job -> mtx);
+	    if(atomic_load(&job -> found) == 0){
+		job -> nonce = nonce + (uint32_t)i;
+		memcpy(job -> blk_hash, dgst + i * SHA256_DIGEST_LENGTH, sizeof(job -> blk_hash));
+		atomic_store(&job -> found, 1);
+	    }
+	    pthread_mutex_unlock(&job -> mtx);
+	    break;
+	}
+
+	nonce += (uint32_t)batch;
+	left -= batch;
+    }
 
+    return NULL;
 }
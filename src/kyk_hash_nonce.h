@@ -1,6 +1,18 @@
 #ifndef KYK_HASH_NONCE_H__
 #define KYK_HASH_NONCE_H__
 
-void kyk_hash_nonce(struct kyk_blk_header *hd);
+/* 0 means one worker per online CPU */
+#define KYK_MINER_THREADS_AUTO 0
+#define KYK_MINER_MAX_THREADS  256
+
+int kyk_hash_nonce(struct kyk_blk_header *hd);
+
+int kyk_hash_nonce_mt(struct kyk_blk_header *hd, int thread_num);
+
+int kyk_hash_nonce_space_mt(struct kyk_blk_header *hd, int thread_num, int* found);
+
+void kyk_set_miner_threads(int thread_num);
+
+int kyk_get_miner_threads(void);
 
 #endif
@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "kyk_utils.h"
+#include "kyk_file.h"
+#include "beej_pack.h"
+#include "kyk_block.h"
+#include "kyk_validate.h"
+#include "kyk_hd_file.h"
+#include "dbg.h"
+
+/* record count, little endian, then the hash of the last record */
+#define HD_CKPT_LEN (8 + 32)
+/* appends move the checkpoint once every this many records */
+#define HD_CKPT_INTERVAL 2016
+
+static int hd_file_read_ckpt(const char* path, uint64_t* count, uint8_t* hash);
+static int hd_file_write_ckpt(const char* path, uint64_t count, const struct kyk_blk_header* hd);
+static int hd_file_seri(uint8_t** new_buf,
+			const struct kyk_blk_header* hd_list,
+			size_t count);
+
+int kyk_load_hd_file(struct kyk_blk_hd_chain** new_hd_chain, const char* path)
+{
+    struct kyk_blk_hd_chain* hdc = NULL;
+    struct kyk_blk_header* hd = NULL;
+    struct stat st;
+    uint8_t* map = NULL;
+    size_t map_len = 0;
+    size_t hd_count = 0;
+    size_t trusted = 0;
+    size_t hd_len = 0;
+    size_t i = 0;
+    uint64_t ckpt_count = 0;
+    uint8_t ckpt_hash[32];
+    uint8_t digest[32];
+    int fd = -1;
+    int res = -1;
+
+    check(new_hd_chain, "Failed to kyk_load_hd_file: new_hd_chain is NULL");
+    check(path, "Failed to kyk_load_hd_file: path is NULL");
+
+    fd = open(path, O_RDONLY);
+    check(fd != -1, "Failed to kyk_load_hd_file: open %s failed", path);
+
+    res = fstat(fd, &st);
+    check(res == 0, "Failed to kyk_load_hd_file: fstat failed");
+
+    /* a torn last record is left out */
+    hd_count = st.st_size / KYK_BLK_HD_LEN;
+    check(hd_count >= 1, "Failed to kyk_load_hd_file: invalid hd_count");
+    map_len = hd_count * KYK_BLK_HD_LEN;
+
+    map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    check(map != MAP_FAILED, "Failed to kyk_load_hd_file: mmap failed");
+    madvise(map, map_len, MADV_SEQUENTIAL);
+
+    res = hd_file_read_ckpt(path, &ckpt_count, ckpt_hash);
+    check(res == 0, "Failed to kyk_load_hd_file: hd_file_read_ckpt failed");
+
+    res = kyk_init_blk_hd_chain(&hdc);
+    check(res == 0, "Failed to kyk_load_hd_file: kyk_init_blk_hd_chain failed");
+
+    hdc -> hd_list = calloc(hd_count, sizeof(*hdc -> hd_list));
+    check(hdc -> hd_list, "Failed to kyk_load_hd_file: hd_list calloc failed");
+
+    if(ckpt_count > 0 && ckpt_count <= hd_count){
+	hd = hdc -> hd_list + ckpt_count - 1;
+	kyk_deseri_blk_header(hd, map + (ckpt_count - 1) * KYK_BLK_HD_LEN, &hd_len);
+	kyk_blk_hash256(digest, hd);
+	if(kyk_digest_eq(digest, ckpt_hash, sizeof(digest))){
+	    trusted = ckpt_count;
+	}
+    }
+
+    for(i = 0; i < hd_count; i++){
+	hd = hdc -> hd_list + i;
+	res = kyk_deseri_blk_header(hd, map + i * KYK_BLK_HD_LEN, &hd_len);
+	check(res == 0, "Failed to kyk_load_hd_file: kyk_deseri_blk_header failed");
+
+	if(i >= trusted){
+	    res = kyk_validate_blk_header(hdc, hd);
+	    check(res == 0, "Failed to kyk_load_hd_file: kyk_validate_blk_header failed at %zu", i);
+	}
+
+	hdc -> len += 1;
+    }
+
+    munmap(map, map_len);
+    close(fd);
+
+    *new_hd_chain = hdc;
+
+    return 0;
+
+error:
+    if(hdc) kyk_free_blk_hd_chain(hdc);
+    if(map && map != MAP_FAILED) munmap(map, map_len);
+    if(fd != -1) close(fd);
+    return -1;
+}
+
+/* the headers are validated against the chain in the file by the caller */
+int kyk_append_hd_file(const char* path,
+		       const struct kyk_blk_header* hd_list,
+		       size_t count)
+{
+    struct stat st;
+    uint8_t* buf = NULL;
+    off_t end = 0;
+    uint64_t old_count = 0;
+    uint64_t new_count = 0;
+    int fd = -1;
+    int res = -1;
+
+    check(path, "Failed to kyk_append_hd_file: path is NULL");
+    check(hd_list, "Failed to kyk_append_hd_file: hd_list is NULL");
+    check(count > 0, "Failed to kyk_append_hd_file: invalid count");
+
+    fd = open(path, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    check(fd != -1, "Failed to kyk_append_hd_file: open %s failed", path);
+
+    res = fstat(fd, &st);
+    check(res == 0, "Failed to kyk_append_hd_file: fstat failed");
+
+    end = st.st_size - st.st_size % KYK_BLK_HD_LEN;
+    if(end != st.st_size){
+	res = ftruncate(fd, end);
+	check(res == 0, "Failed to kyk_append_hd_file: ftruncate failed");
+    }
+
+    res = hd_file_seri(&buf, hd_list, count);
+    check(res == 0, "Failed to kyk_append_hd_file: hd_file_seri failed");
+
+    res = kyk_file_pwrite_all(fd, end, buf, count * KYK_BLK_HD_LEN);
+    check(res == 0, "Failed to kyk_append_hd_file: kyk_file_pwrite_all failed");
+
+    close(fd);
+    fd = -1;
+
+    old_count = end / KYK_BLK_HD_LEN;
+    new_count = old_count + count;
+    if(old_count / HD_CKPT_INTERVAL != new_count / HD_CKPT_INTERVAL){
+	res = hd_file_write_ckpt(path, new_count, hd_list + count - 1);
+	check(res == 0, "Failed to kyk_append_hd_file: hd_file_write_ckpt failed");
+    }
+
+    free(buf);
+
+    return 0;
+
+error:
+    if(fd != -1) close(fd);
+    if(buf) free(buf);
+    return -1;
+}
+
+/* rewrites the file with the whole chain */
+int kyk_save_hd_file(const char* path, const struct kyk_blk_hd_chain* hd_chain)
+{
+    uint8_t* buf = NULL;
+    int fd = -1;
+    int res = -1;
+
+    check(path, "Failed to kyk_save_hd_file: path is NULL");
+    check(hd_chain, "Failed to kyk_save_hd_file: hd_chain is NULL");
+    check(hd_chain -> len > 0, "Failed to kyk_save_hd_file: hd_chain is empty");
+
+    res = hd_file_seri(&buf, hd_chain -> hd_list, hd_chain -> len);
+    check(res == 0, "Failed to kyk_save_hd_file: hd_file_seri failed");
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    check(fd != -1, "Failed to kyk_save_hd_file: open %s failed", path);
+
+    res = kyk_file_pwrite_all(fd, 0, buf, hd_chain -> len * KYK_BLK_HD_LEN);
+    check(res == 0, "Failed to kyk_save_hd_file: kyk_file_pwrite_all failed");
+
+    close(fd);
+    fd = -1;
+
+    res = hd_file_write_ckpt(path, hd_chain -> len, hd_chain -> hd_list + hd_chain -> len - 1);
+    check(res == 0, "Failed to kyk_save_hd_file: hd_file_write_ckpt failed");
+
+    free(buf);
+
+    return 0;
+
+error:
+    if(fd != -1) close(fd);
+    if(buf) free(buf);
+    return -1;
+}
+
+/* no checkpoint, or one that is not whole, reads as count 0 */
+int hd_file_read_ckpt(const char* path, uint64_t* count, uint8_t* hash)
+{
+    char* ckpt_path = NULL;
+    uint8_t buf[HD_CKPT_LEN];
+    unsigned long long int n = 0;
+    ssize_t len = 0;
+    int fd = -1;
+
+    *count = 0;
+
+    ckpt_path = kyk_asprintf("%s.ckpt", path);
+    check(ckpt_path, "Failed to hd_file_read_ckpt: kyk_asprintf failed");
+
+    fd = open(ckpt_path, O_RDONLY);
+    if(fd != -1){
+	len = pread(fd, buf, sizeof(buf), 0);
+	if(len == sizeof(buf)){
+	    beej_unpack(buf, "<Q", &n);
+	    memcpy(hash, buf + 8, 32);
+	    *count = n;
+	}
+	close(fd);
+    }
+
+    free(ckpt_path);
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+int hd_file_write_ckpt(const char* path, uint64_t count, const struct kyk_blk_header* hd)
+{
+    char* ckpt_path = NULL;
+    uint8_t buf[HD_CKPT_LEN];
+    int fd = -1;
+    int res = -1;
+
+    ckpt_path = kyk_asprintf("%s.ckpt", path);
+    check(ckpt_path, "Failed to hd_file_write_ckpt: kyk_asprintf failed");
+
+    beej_pack(buf, "<Q", (unsigned long long int)count);
+    res = kyk_blk_hash256(buf + 8, hd);
+    check(res == 0, "Failed to hd_file_write_ckpt: kyk_blk_hash256 failed");
+
+    fd = open(ckpt_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    check(fd != -1, "Failed to hd_file_write_ckpt: open %s failed", ckpt_path);
+
+    res = kyk_file_pwrite_all(fd, 0, buf, sizeof(buf));
+    check(res == 0, "Failed to hd_file_write_ckpt: kyk_file_pwrite_all failed");
+
+    close(fd);
+    free(ckpt_path);
+
+    return 0;
+
+error:
+    if(fd != -1) close(fd);
+    if(ckpt_path) free(ckpt_path);
+    return -1;
+}
+
+int hd_file_seri(uint8_t** new_buf,
+		 const struct kyk_blk_header* hd_list,
+		 size_t count)
+{
+    uint8_t* buf = NULL;
+    size_t hd_len = 0;
+    size_t i = 0;
+
+    buf = calloc(count, KYK_BLK_HD_LEN);
+    check(buf, "Failed to hd_file_seri: calloc failed");
+
+    for(i = 0; i < count; i++){
+	hd_len = kyk_seri_blk_hd(buf + i * KYK_BLK_HD_LEN, hd_list + i);
+	check(hd_len == KYK_BLK_HD_LEN, "Failed to hd_file_seri: kyk_seri_blk_hd failed");
+    }
+
+    *new_buf = buf;
+
+    return 0;
+
+error:
+    if(buf) free(buf);
+    return -1;
+}
@@ -0,0 +1,22 @@
+#ifndef KYK_HD_FILE_H__
+#define KYK_HD_FILE_H__
+
+#include "kyk_block.h"
+
+/*
+ * The block header chain file, KYK_BLK_HD_LEN byte header records in chain order,
+ * only ever appended to.
+ * Next to it <path>.ckpt holds how many records have been validated and the hash of the last of them,
+ * loading takes those records as they are and validates only the ones after.
+ * Saving always rewrites it, appending only once every 2016 records.
+ * A record cut short by a crash is not loaded and is cut off by the next append.
+ */
+int kyk_load_hd_file(struct kyk_blk_hd_chain** new_hd_chain, const char* path);
+
+int kyk_append_hd_file(const char* path,
+		       const struct kyk_blk_header* hd_list,
+		       size_t count);
+
+int kyk_save_hd_file(const char* path, const struct kyk_blk_hd_chain* hd_chain);
+
+#endif
@@ -3,6 +3,7 @@
 #include <leveldb/c.h>
 #include <string.h>
 
+#include "kyk_defs.h"
 #include "kyk_block.h"
 #include "kyk_ldb.h"
 #include "kyk_utils.h"
@@ -47,22 +48,79 @@ const uint32_t    BLOCK_HAVE_MASK          =   8 | 16;
 /* const uint32_t    BLOCK_OPT_WITNESS       =   128; //!< block data in blk*.data was received with a witness-enforcing client */
 
 
+static void store_db_open(struct kyk_block_db *blk_db);
+static void store_db_close(struct kyk_block_db *blk_db);
+
+void kyk_init_db_opts(struct kyk_db_opts *opts)
+{
+    opts -> cache_size = KYK_LDB_CACHE_SIZE;
+    opts -> bloom_bits = KYK_LDB_BLOOM_BITS;
+    opts -> compression = KYK_LDB_COMPRESSION;
+    opts -> write_buffer_size = KYK_LDB_WRITE_BUFFER_SIZE;
+    opts -> max_open_files = KYK_LDB_MAX_OPEN_FILES;
+    opts -> verify_checksums = 0;
+    opts -> fill_cache = 1;
+    opts -> bulk_load = 0;
+}
+
 int kyk_init_store_db(struct kyk_block_db *blk_db, char *path)
 {
-    check(blk_db, "Failed to kyk_init_store_db: blk_db is NULL");
-    check(path, "Failed to kyk_init_store_db: path is NULL");
-    
-    blk_db -> errptr = NULL;
-    /* blk_db -> path = malloc(sizeof(char) * (strlen(path) + 1)); */
-    /* blk_db -> path = memcpy(blk_db -> path, path, strlen(path) + 1); */
+    struct kyk_db_opts opts;
+
+    kyk_init_db_opts(&opts);
+
+    return kyk_open_store_db(blk_db, path, &opts);
+}
+
+/* an open failure is left in blk_db -> errptr */
+int kyk_open_store_db(struct kyk_block_db *blk_db, char *path, const struct kyk_db_opts *opts)
+{
+    check(blk_db, "Failed to kyk_open_store_db: blk_db is NULL");
+    check(path, "Failed to kyk_open_store_db: path is NULL");
+    check(opts, "Failed to kyk_open_store_db: opts is NULL");
+
+    memset(blk_db, 0, sizeof(*blk_db));
     blk_db -> path = kyk_strdup(path);
-    check(blk_db -> path, "Failed to kyk_init_store_db: blk_db -> path kyk_strdup failed");
-    
-    blk_db -> db_opts = leveldb_options_create();
-    leveldb_options_set_create_if_missing(blk_db -> db_opts, 1);
-    blk_db -> db = leveldb_open(blk_db -> db_opts, blk_db -> path, &blk_db -> errptr);
-    blk_db -> rd_opts = leveldb_readoptions_create();
-    blk_db -> wr_opts = leveldb_writeoptions_create();
+    check(blk_db -> path, "Failed to kyk_open_store_db: blk_db -> path kyk_strdup failed");
+    blk_db -> opts = *opts;
+    blk_db -> txindex = KYK_TXINDEX;
+
+    store_db_open(blk_db);
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/*
+ * The write buffer is fixed while the db is open, switching reopens it.
+ * blk_db stays the same struct, whoever holds it goes on using it,
+ * a failed switch opens it again with the setting it had.
+ */
+int kyk_store_db_set_bulk_load(struct kyk_block_db *blk_db, int bulk_load)
+{
+    int old_bulk_load = 0;
+
+    check(blk_db, "Failed to kyk_store_db_set_bulk_load: blk_db is NULL");
+
+    old_bulk_load = blk_db -> opts.bulk_load;
+    if(old_bulk_load == bulk_load){
+	return 0;
+    }
+
+    store_db_close(blk_db);
+    blk_db -> opts.bulk_load = bulk_load;
+    store_db_open(blk_db);
+    if(blk_db -> errptr){
+	log_err("Failed to kyk_store_db_set_bulk_load: leveldb_open failed: %s", blk_db -> errptr);
+	store_db_close(blk_db);
+	blk_db -> opts.bulk_load = old_bulk_load;
+	store_db_open(blk_db);
+	check(blk_db -> errptr == NULL, "Failed to kyk_store_db_set_bulk_load: leveldb_open of the old options failed: %s", blk_db -> errptr);
+	return -1;
+    }
 
     return 0;
 
@@ -73,11 +131,65 @@ error:
 
 void kyk_free_block_db(struct kyk_block_db *blk_db)
 {
+    store_db_close(blk_db);
     if(blk_db -> path) free(blk_db -> path);
+    blk_db -> path = NULL;
+}
+
+void store_db_open(struct kyk_block_db *blk_db)
+{
+    const struct kyk_db_opts *opts = &blk_db -> opts;
+
+    blk_db -> errptr = NULL;
+
+    blk_db -> db_opts = leveldb_options_create();
+    leveldb_options_set_create_if_missing(blk_db -> db_opts, 1);
+    if(opts -> cache_size > 0){
+	blk_db -> cache = leveldb_cache_create_lru(opts -> cache_size);
+	leveldb_options_set_cache(blk_db -> db_opts, blk_db -> cache);
+    }
+    if(opts -> bloom_bits > 0){
+	blk_db -> filter = leveldb_filterpolicy_create_bloom(opts -> bloom_bits);
+	leveldb_options_set_filter_policy(blk_db -> db_opts, blk_db -> filter);
+    }
+    leveldb_options_set_compression(blk_db -> db_opts, opts -> compression ? leveldb_snappy_compression : leveldb_no_compression);
+    leveldb_options_set_write_buffer_size(blk_db -> db_opts, opts -> bulk_load ? KYK_LDB_BULK_WRITE_BUFFER_SIZE : opts -> write_buffer_size);
+    leveldb_options_set_max_open_files(blk_db -> db_opts, opts -> max_open_files);
+
+    blk_db -> db = leveldb_open(blk_db -> db_opts, blk_db -> path, &blk_db -> errptr);
+
+    blk_db -> rd_opts = leveldb_readoptions_create();
+    leveldb_readoptions_set_verify_checksums(blk_db -> rd_opts, opts -> verify_checksums);
+    leveldb_readoptions_set_fill_cache(blk_db -> rd_opts, opts -> bulk_load ? 0 : opts -> fill_cache);
+    blk_db -> scan_rd_opts = leveldb_readoptions_create();
+    leveldb_readoptions_set_verify_checksums(blk_db -> scan_rd_opts, opts -> verify_checksums);
+    leveldb_readoptions_set_fill_cache(blk_db -> scan_rd_opts, 0);
+    blk_db -> wr_opts = leveldb_writeoptions_create();
+    blk_db -> sync_wr_opts = leveldb_writeoptions_create();
+    leveldb_writeoptions_set_sync(blk_db -> sync_wr_opts, 1);
+}
+
+/* the cache and the filter are used by the db until it is closed */
+void store_db_close(struct kyk_block_db *blk_db)
+{
+    if(blk_db -> db) leveldb_close(blk_db -> db);
     if(blk_db -> db_opts) leveldb_options_destroy(blk_db -> db_opts);
+    if(blk_db -> cache) leveldb_cache_destroy(blk_db -> cache);
+    if(blk_db -> filter) leveldb_filterpolicy_destroy(blk_db -> filter);
     if(blk_db -> rd_opts) leveldb_readoptions_destroy(blk_db -> rd_opts);
+    if(blk_db -> scan_rd_opts) leveldb_readoptions_destroy(blk_db -> scan_rd_opts);
     if(blk_db -> wr_opts) leveldb_writeoptions_destroy(blk_db -> wr_opts);
-    if(blk_db -> db) leveldb_close(blk_db -> db);
+    if(blk_db -> sync_wr_opts) leveldb_writeoptions_destroy(blk_db -> sync_wr_opts);
+    if(blk_db -> errptr) leveldb_free(blk_db -> errptr);
+    blk_db -> db = NULL;
+    blk_db -> db_opts = NULL;
+    blk_db -> cache = NULL;
+    blk_db -> filter = NULL;
+    blk_db -> rd_opts = NULL;
+    blk_db -> scan_rd_opts = NULL;
+    blk_db -> wr_opts = NULL;
+    blk_db -> sync_wr_opts = NULL;
+    blk_db -> errptr = NULL;
 }
 
 void kyk_free_db_key(struct db_key *key)
@@ -138,6 +250,24 @@ size_t pack_varint(uint8_t *buf, uint32_t n)
     return len+1;
 }
 
+/* the same encoding as pack_varint, a value below 2^32 packs to the same bytes */
+size_t pack_varint64(uint8_t *buf, uint64_t n)
+{
+    unsigned char tmp[(sizeof(n)*8+6)/7];
+    int len=0;
+    while(1) {
+        tmp[len] = (n & 0x7F) | (len ? 0x80 : 0x00);
+        if (n <= 0x7F)
+            break;
+        n = (n >> 7) - 1;
+        len++;
+    }
+
+    kyk_reverse_pack_chars(buf, tmp, len+1);
+
+    return len+1;
+}
+
 void kyk_free_bval(struct kyk_bkey_val *bval)
 {
     if(bval -> blk_hd) free(bval -> blk_hd);
@@ -154,8 +284,8 @@ void kyk_print_bval(struct kyk_bkey_val *bval)
     printf("nStatus:  %d\n", bval -> nStatus);
     printf("nTx:      %d\n", bval -> nTx);
     printf("nFile:    %d\n", bval -> nFile);
-    printf("nDataPos: %d\n", bval -> nDataPos);
-    printf("nUndoPos: %d\n", bval -> nUndoPos);
+    printf("nDataPos: %llu\n", (unsigned long long int)bval -> nDataPos);
+    printf("nUndoPos: %llu\n", (unsigned long long int)bval -> nUndoPos);
     printf("Following is Block Header:\n");
     printf("nVersion: %d\n", hd -> version);
     kyk_print_hex("PrevHash ", hd -> pre_blk_hash, sizeof(hd -> pre_blk_hash));
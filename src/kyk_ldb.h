@@ -32,12 +32,30 @@ struct db_key {
     size_t len;
 };
 
+/* how the block index db is opened, kyk_init_db_opts fills in the defaults */
+struct kyk_db_opts {
+    size_t cache_size;           /* lru cache of uncompressed table blocks, 0 leaves leveldb's own */
+    int bloom_bits;              /* bloom filter bits per key, 0 for no filter */
+    int compression;             /* snappy compressed table blocks */
+    size_t write_buffer_size;
+    int max_open_files;
+    int verify_checksums;
+    int fill_cache;
+    int bulk_load;               /* a bigger write buffer and reads that leave the cache alone, for imports */
+};
+
 struct kyk_block_db {
     char                   *path;
     leveldb_t              *db;
     leveldb_options_t      *db_opts;
     leveldb_readoptions_t  *rd_opts;
+    leveldb_readoptions_t  *scan_rd_opts;  /* rd_opts that do not fill the cache, for whole-range scans */
     leveldb_writeoptions_t *wr_opts;
+    leveldb_writeoptions_t *sync_wr_opts;  /* wr_opts with sync, for writes that have to reach the disk */
+    leveldb_cache_t        *cache;
+    leveldb_filterpolicy_t *filter;
+    struct kyk_db_opts     opts;
+    int                    txindex;  /* keep the 't' tx index records, KYK_TXINDEX after kyk_open_store_db */
     char *errptr;
 };
 
@@ -47,12 +65,15 @@ struct kyk_bkey_val{
     uint32_t nStatus;
     unsigned int nTx;
     int nFile;
-    unsigned int nDataPos;
-    unsigned int nUndoPos;
+    uint64_t nDataPos;
+    uint64_t nUndoPos;
     struct kyk_blk_header *blk_hd;
 };
 
+void kyk_init_db_opts(struct kyk_db_opts *opts);
 int kyk_init_store_db(struct kyk_block_db *blk_db, char *path);
+int kyk_open_store_db(struct kyk_block_db *blk_db, char *path, const struct kyk_db_opts *opts);
+int kyk_store_db_set_bulk_load(struct kyk_block_db *blk_db, int bulk_load);
 void kyk_free_block_db(struct kyk_block_db *blk_db);
 void kyk_free_db_key(struct db_key *key);
 void build_db_key(struct db_key *key, const char flag, char *src, size_t len);
@@ -60,6 +81,7 @@ size_t read_varint(const uint8_t *buf, size_t len, uint32_t *val);
 size_t read_varint(const uint8_t *buf, size_t len, uint32_t *val);
 size_t read_varint64(const uint8_t *buf, size_t len, uint64_t *val);
 size_t pack_varint(uint8_t *buf, uint32_t n);
+size_t pack_varint64(uint8_t *buf, uint64_t n);
 void kyk_free_bval(struct kyk_bkey_val *bval);
 void kyk_print_bval(struct kyk_bkey_val *bval);
 
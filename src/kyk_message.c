@@ -12,12 +12,16 @@
 #include "beej_pack.h"
 #include "kyk_sha.h"
 #include "kyk_message.h"
+#include "kyk_mkl_tree.h"
 #include "kyk_utils.h"
 #include "dbg.h"
 
 static int kyk_copy_ptl_payload(ptl_payload* dest_pld, const ptl_payload* src_pld);
 static ptl_net_addr* build_net_addr(const char* ip_src, int port);
 
+/* locator hashes taken one by one back from the tip before the step starts doubling */
+#define LOCATOR_DENSE_LEN 10
+
 
 int kyk_build_new_ptl_message(ptl_message** new_msg,
 			      const char* cmd,
@@ -367,38 +371,46 @@ error:
 */
 int kyk_seri_ptl_message(ptl_msg_buf* msg_buf, const ptl_message* msg)
 {
-    unsigned char *buf = NULL;
-    size_t len = 0;
+    int res = -1;
 
     check(msg_buf, "Failed to kyk_seri_ptl_message: msg_buf is NULL");
     check(msg, "Failed to kyk_seri_ptl_message: ptl_msg is NULL");
     check(msg -> pld, "Failed to kyk_seri_ptl_message: msg -> pld is NULL");
     check(msg -> pld_len == msg -> pld -> len, "Failed to kyk_seri_ptl_message: invalid msg -> pld_len");
 
-    buf = msg_buf -> data;
-    msg_buf -> len = 0;
+    res = kyk_seri_ptl_msg_header(msg_buf -> data, msg);
+    check(res == 0, "Failed to kyk_seri_ptl_message: kyk_seri_ptl_msg_header failed");
+
+    memcpy(msg_buf -> data + KYK_MSG_HEADER_LEN, msg -> pld -> data, msg -> pld_len);
+    msg_buf -> len = KYK_MSG_HEADER_LEN + msg -> pld_len;
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* the 24 byte header alone, buf must hold KYK_MSG_HEADER_LEN bytes */
+int kyk_seri_ptl_msg_header(uint8_t* buf, const ptl_message* msg)
+{
+    size_t len = 0;
+
+    check(buf, "Failed to kyk_seri_ptl_msg_header: buf is NULL");
+    check(msg, "Failed to kyk_seri_ptl_msg_header: msg is NULL");
+
     len = beej_pack(buf, "<L", msg -> magic);
-    msg_buf -> len += len;
     buf += len;
 
     len = sizeof(msg -> cmd);
     memcpy(buf, msg -> cmd, len);
-    msg_buf -> len += len;
     buf += len;
     
     len = beej_pack(buf, "<L", msg -> pld_len);
-    msg_buf -> len += len;
     buf += len;
 
     len = sizeof(msg -> checksum);
     memcpy(buf, msg -> checksum, len);
-    msg_buf -> len += len;
-    buf += len;
-
-    len = msg -> pld_len;
-    memcpy(buf, msg -> pld -> data, len);
-    msg_buf -> len += len;
-    buf += len;
 
     return 0;
 
@@ -816,33 +828,106 @@ void kyk_free_ptl_gethder_entity(ptl_gethder_entity* entity)
     }
 }
 
+/*
+ * Locator of hd_chain: the last LOCATOR_DENSE_LEN headers from the tip back,
+ * then the step doubles each time, the genesis header always closes it.
+ * An empty chain has an empty locator, the node then answers from its genesis header.
+ * hash_stop is zero, as many headers as one reply carries.
+ */
 int kyk_build_new_getheaders_entity(ptl_gethder_entity** new_entity,
-				    uint32_t version)
-				    
+				    uint32_t version,
+				    const struct kyk_blk_hd_chain* hd_chain)
 {
     ptl_gethder_entity* entity = NULL;
-    varint_t i = 0;
     uint256* uhash = NULL;
+    size_t height = 0;
+    size_t step = 1;
+    int res = -1;
 
     check(new_entity, "Failed to kyk_build_new_getheaders_entity: new_entity is NULL");
+    check(hd_chain, "Failed to kyk_build_new_getheaders_entity: hd_chain is NULL");
 
     entity = calloc(1, sizeof(*entity));
     check(entity, "Failed to kyk_build_new_getheaders_entity: entity calloc failed");
 
     entity -> version = version;
-    entity -> hash_count = 1;
-    entity -> locator_hashes = calloc(entity -> hash_count, sizeof(*entity -> locator_hashes));
+    entity -> hash_count = 0;
+
+    /* the doubling step bounds the locator to LOCATOR_DENSE_LEN + 64 sparse hashes */
+    entity -> locator_hashes = calloc(LOCATOR_DENSE_LEN + 64 + 1, sizeof(*entity -> locator_hashes));
     check(entity -> locator_hashes, "Failed to kyk_build_new_getheaders_entity: calloc failed");
 
-    for(i = 0; i < entity -> hash_count; i++){
-	uhash = entity -> locator_hashes + i;
-	memset(uhash -> data, 0, sizeof(uhash -> data));
+    if(hd_chain -> len > 0){
+	height = hd_chain -> len - 1;
+	for(;;){
+	    uhash = entity -> locator_hashes + entity -> hash_count;
+	    res = kyk_blk_hash256(uhash -> data, hd_chain -> hd_list + height);
+	    check(res == 0, "Failed to kyk_build_new_getheaders_entity: kyk_blk_hash256 failed");
+	    entity -> hash_count++;
+
+	    if(height == 0){
+		break;
+	    }
+
+	    if(entity -> hash_count >= LOCATOR_DENSE_LEN){
+		step *= 2;
+	    }
+
+	    height = height > step ? height - step : 0;
+	}
     }
 
     uhash = &entity -> hash_stop;
     memset(uhash -> data, 0, sizeof(uhash -> data));
 
-    uhash = NULL;
+    *new_entity = entity;
+
+    return 0;
+
+error:
+    if(entity) kyk_free_ptl_gethder_entity(entity);
+    return -1;
+}
+
+int kyk_deseri_new_gethder_entity(ptl_gethder_entity** new_entity, const ptl_payload* pld)
+{
+    ptl_gethder_entity* entity = NULL;
+    const uint8_t* bufp = NULL;
+    size_t left = 0;
+    size_t len = 0;
+    varint_t count = 0;
+
+    check(new_entity, "Failed to kyk_deseri_new_gethder_entity: new_entity is NULL");
+    check(pld, "Failed to kyk_deseri_new_gethder_entity: pld is NULL");
+    check(pld -> len >= sizeof(uint32_t) + 1, "Failed to kyk_deseri_new_gethder_entity: pld is too short");
+
+    entity = calloc(1, sizeof(*entity));
+    check(entity, "Failed to kyk_deseri_new_gethder_entity: calloc failed");
+
+    bufp = pld -> data;
+    left = pld -> len;
+
+    beej_unpack(bufp, "<L", &entity -> version);
+    bufp += sizeof(uint32_t);
+    left -= sizeof(uint32_t);
+
+    /* the first byte of a varint tells its size */
+    check(left >= get_varint_len_by_prefix(*bufp), "Failed to kyk_deseri_new_gethder_entity: pld is too short");
+    len = kyk_unpack_varint(bufp, &count);
+    bufp += len;
+    left -= len;
+
+    /* the count comes from the peer, the payload has to hold it and the hash_stop */
+    check(count < left / sizeof(uint256), "Failed to kyk_deseri_new_gethder_entity: invalid hash_count");
+
+    entity -> hash_count = count;
+    entity -> locator_hashes = calloc(count + 1, sizeof(*entity -> locator_hashes));
+    check(entity -> locator_hashes, "Failed to kyk_deseri_new_gethder_entity: calloc failed");
+
+    memcpy(entity -> locator_hashes, bufp, count * sizeof(uint256));
+    bufp += count * sizeof(uint256);
+
+    memcpy(entity -> hash_stop.data, bufp, sizeof(entity -> hash_stop.data));
 
     *new_entity = entity;
 
@@ -931,7 +1016,6 @@ int kyk_seri_hd_chain_to_new_pld(ptl_payload** new_pld, const struct kyk_blk_hd_
     size_t i = 0;
     
     check(hd_chain, "Failed to kyk_seri_hd_chain_to_new_pld: hd_chain is NULL");
-    check(hd_chain -> len > 0, "Failed to kyk_seri_hd_chain_to_new_pld: hd_chain is NULL");
 
     pld = calloc(1, sizeof(*pld));
     check(pld, "Failed to kyk_seri_hd_chain_to_new_pld: calloc failed");
@@ -1007,14 +1091,22 @@ int kyk_deseri_headers_msg_to_new_hd_chain(ptl_message* msg, struct kyk_blk_hd_c
     hd_chain = calloc(1, sizeof(*hd_chain));
     check(hd_chain, "Failed to kyk_deseri_headers_msg_to_new_hd_chain: calloc failed");
 
+    check(msg -> pld && msg -> pld -> len > 0, "Failed to kyk_deseri_headers_msg_to_new_hd_chain: pld is empty");
+
     bufp = msg -> pld -> data;
 
+    /* the first byte of a varint tells its size */
+    check(get_varint_len_by_prefix(*bufp) <= msg -> pld -> len, "Failed to kyk_deseri_headers_msg_to_new_hd_chain: pld is too short");
     len = kyk_unpack_varint(bufp, &count);
     bufp += len;
 
+    /* an empty reply means the peer has nothing after our locator */
+    check(count <= (msg -> pld -> len - len) / (KYK_BLK_HD_LEN + 1),
+	  "Failed to kyk_deseri_headers_msg_to_new_hd_chain: invalid count");
+
     hd_chain -> len = count;
 
-    hd_chain -> hd_list = calloc(hd_chain -> len, sizeof(*hd_chain -> hd_list));
+    hd_chain -> hd_list = calloc(hd_chain -> len + 1, sizeof(*hd_chain -> hd_list));
     check(hd_chain -> hd_list, "Failed to kyk_deseri_headers_msg_to_new_hd_chain: calloc failed");
 
     for(i = 0; i < hd_chain -> len; i++){
@@ -1030,7 +1122,7 @@ int kyk_deseri_headers_msg_to_new_hd_chain(ptl_message* msg, struct kyk_blk_hd_c
     return 0;
     
 error:
-
+    if(hd_chain) kyk_free_blk_hd_chain(hd_chain);
     return -1;
 }
 
@@ -1445,3 +1537,164 @@ error:
     return -1;
 }
 
+
+#define PKH_FILTER_ITEM_LEN 20
+
+/*
+ * getdata payload followed by the pubkey hash filter:
+ * inv count, inv list, pkh count, pkh list.
+ * This stands in for the filterload message of BIP37 as every connection carries one request.
+ */
+int kyk_seri_filtered_getdata_to_new_pld(ptl_payload** new_pld,
+					 const struct ptl_inv* inv_list,
+					 varint_t inv_count,
+					 const struct ptl_pkh_filter* filter)
+{
+    ptl_payload* pld = NULL;
+    uint8_t* bufp = NULL;
+    size_t len = 0;
+    varint_t i = 0;
+
+    check(new_pld, "Failed to kyk_seri_filtered_getdata_to_new_pld: new_pld is NULL");
+    check(inv_list, "Failed to kyk_seri_filtered_getdata_to_new_pld: inv_list is NULL");
+    check(filter, "Failed to kyk_seri_filtered_getdata_to_new_pld: filter is NULL");
+
+    pld = calloc(1, sizeof(*pld));
+    check(pld, "Failed to kyk_seri_filtered_getdata_to_new_pld: calloc failed");
+
+    pld -> len = get_varint_size(inv_count) + inv_count * sizeof(struct ptl_inv);
+    pld -> len += get_varint_size(filter -> count) + filter -> count * PKH_FILTER_ITEM_LEN;
+    pld -> data = calloc(pld -> len, sizeof(*pld -> data));
+    check(pld -> data, "Failed to kyk_seri_filtered_getdata_to_new_pld: calloc failed");
+
+    bufp = pld -> data;
+    len = kyk_pack_varint(bufp, inv_count);
+    bufp += len;
+
+    for(i = 0; i < inv_count; i++){
+	kyk_seri_ptl_inv(bufp, inv_list + i, &len);
+	bufp += len;
+    }
+
+    len = kyk_pack_varint(bufp, filter -> count);
+    bufp += len;
+
+    memcpy(bufp, filter -> pkhs, filter -> count * PKH_FILTER_ITEM_LEN);
+
+    *new_pld = pld;
+
+    return 0;
+
+error:
+    if(pld) kyk_free_ptl_payload(pld);
+    return -1;
+}
+
+/* a getdata without a filter gets an empty one, so that filtered blocks match nothing */
+int kyk_deseri_getdata_pkh_filter(const ptl_payload* pld,
+				  varint_t inv_count,
+				  struct ptl_pkh_filter** new_filter)
+{
+    struct ptl_pkh_filter* filter = NULL;
+    const uint8_t* bufp = NULL;
+    size_t offset = 0;
+    size_t len = 0;
+
+    check(pld, "Failed to kyk_deseri_getdata_pkh_filter: pld is NULL");
+    check(new_filter, "Failed to kyk_deseri_getdata_pkh_filter: new_filter is NULL");
+
+    filter = calloc(1, sizeof(*filter));
+    check(filter, "Failed to kyk_deseri_getdata_pkh_filter: calloc failed");
+
+    offset = get_varint_size(inv_count) + inv_count * sizeof(struct ptl_inv);
+    if(offset < pld -> len){
+	bufp = pld -> data + offset;
+	check(get_varint_len_by_prefix(*bufp) <= pld -> len - offset,
+	      "Failed to kyk_deseri_getdata_pkh_filter: filter count is truncated");
+	len = kyk_unpack_varint(bufp, &filter -> count);
+	bufp += len;
+	offset += len;
+	check(filter -> count <= (pld -> len - offset) / PKH_FILTER_ITEM_LEN,
+	      "Failed to kyk_deseri_getdata_pkh_filter: filter is truncated");
+
+	filter -> pkhs = malloc(filter -> count * PKH_FILTER_ITEM_LEN + 1);
+	check(filter -> pkhs, "Failed to kyk_deseri_getdata_pkh_filter: malloc failed");
+	memcpy(filter -> pkhs, bufp, filter -> count * PKH_FILTER_ITEM_LEN);
+    }
+
+    *new_filter = filter;
+
+    return 0;
+
+error:
+    if(filter) kyk_free_pkh_filter(filter);
+    return -1;
+}
+
+void kyk_free_pkh_filter(struct ptl_pkh_filter* filter)
+{
+    if(filter){
+	if(filter -> pkhs) free(filter -> pkhs);
+	free(filter);
+    }
+}
+
+/* merkleblock payload: block header, then the partial merkle tree */
+int kyk_seri_merkle_blk_to_new_pld(ptl_payload** new_pld,
+				   const struct kyk_blk_header* hd,
+				   const struct kyk_partial_mkl* pmt)
+{
+    ptl_payload* pld = NULL;
+    size_t len = 0;
+
+    check(new_pld, "Failed to kyk_seri_merkle_blk_to_new_pld: new_pld is NULL");
+    check(hd, "Failed to kyk_seri_merkle_blk_to_new_pld: hd is NULL");
+    check(pmt, "Failed to kyk_seri_merkle_blk_to_new_pld: pmt is NULL");
+
+    pld = calloc(1, sizeof(*pld));
+    check(pld, "Failed to kyk_seri_merkle_blk_to_new_pld: calloc failed");
+
+    pld -> len = KYK_BLK_HD_LEN + kyk_get_partial_mkl_size(pmt);
+    pld -> data = calloc(pld -> len, sizeof(*pld -> data));
+    check(pld -> data, "Failed to kyk_seri_merkle_blk_to_new_pld: calloc failed");
+
+    len = kyk_seri_blk_hd(pld -> data, hd);
+    check(len == KYK_BLK_HD_LEN, "Failed to kyk_seri_merkle_blk_to_new_pld: kyk_seri_blk_hd failed");
+
+    len += kyk_seri_partial_mkl(pld -> data + len, pmt);
+    check(len == pld -> len, "Failed to kyk_seri_merkle_blk_to_new_pld: kyk_seri_partial_mkl failed");
+
+    *new_pld = pld;
+
+    return 0;
+
+error:
+    if(pld) kyk_free_ptl_payload(pld);
+    return -1;
+}
+
+int kyk_deseri_merkle_blk_msg(const ptl_message* msg,
+			      struct kyk_blk_header* hd,
+			      struct kyk_partial_mkl** new_pmt)
+{
+    size_t len = 0;
+    int res = -1;
+
+    check(msg, "Failed to kyk_deseri_merkle_blk_msg: msg is NULL");
+    check(hd, "Failed to kyk_deseri_merkle_blk_msg: hd is NULL");
+    check(strcmp(msg -> cmd, KYK_MSG_TYPE_MERKLEBLOCK) == 0, "Failed to kyk_deseri_merkle_blk_msg: invalid message type");
+    check(msg -> pld, "Failed to kyk_deseri_merkle_blk_msg: msg -> pld is NULL");
+    check(msg -> pld -> len > KYK_BLK_HD_LEN, "Failed to kyk_deseri_merkle_blk_msg: payload is too short");
+
+    res = kyk_deseri_blk_header(hd, msg -> pld -> data, &len);
+    check(res == 0, "Failed to kyk_deseri_merkle_blk_msg: kyk_deseri_blk_header failed");
+
+    res = kyk_deseri_new_partial_mkl(new_pmt, msg -> pld -> data + len, msg -> pld -> len - len, NULL);
+    check(res == 0, "Failed to kyk_deseri_merkle_blk_msg: kyk_deseri_new_partial_mkl failed");
+
+    return 0;
+
+error:
+
+    return -1;
+}
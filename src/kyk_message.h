@@ -29,6 +29,7 @@
 #define KYK_MSG_TYPE_BLOCK      "block"
 #define KYK_MSG_TYPE_TX         "tx"
 #define KYK_MSG_TYPE_REJECT     "reject"
+#define KYK_MSG_TYPE_MERKLEBLOCK "merkleblock"
 
 #define PTL_INV_ERROR              0
 #define PTL_INV_MSG_TX             1
@@ -99,6 +100,17 @@ struct ptl_inv {
     char hash[32];
 };
 
+/*
+ * Pubkey hashes a SPV client is watching, sent after the inventory list of a getdata
+ * asking for MSG_FILTERED_BLOCK. A tx matches if it pays to or spends from one of them.
+ */
+struct ptl_pkh_filter {
+    varint_t count;
+    uint8_t* pkhs;       /* count * 20 bytes */
+};
+
+struct kyk_partial_mkl;
+
 typedef struct ptl_reject_entity {
     var_str* message;
     uint8_t ccode;
@@ -132,6 +144,7 @@ void kyk_free_ptl_gethder_entity(ptl_gethder_entity* entity);
 /* serialize message to buffer */
 int kyk_seri_ptl_message(ptl_msg_buf *msg_buf, const ptl_message* msg);
 int kyk_new_seri_ptl_message(ptl_msg_buf** new_msg_buf, const ptl_message* msg);
+int kyk_seri_ptl_msg_header(uint8_t* buf, const ptl_message* msg);
 
 /* deserialize buffer to message */
 int kyk_deseri_new_ptl_message(ptl_message** new_ptl_msg, const uint8_t* buf, size_t buf_len);
@@ -165,7 +178,9 @@ void kyk_print_ptl_version_entity(ptl_ver_entity* ver);
 /* build payload methods */
 int kyk_build_new_pong_payload(ptl_payload** new_pld, uint64_t nonce);
 int kyk_build_new_getheaders_entity(ptl_gethder_entity** new_entity,
-				    uint32_t version);
+				    uint32_t version,
+				    const struct kyk_blk_hd_chain* hd_chain);
+int kyk_deseri_new_gethder_entity(ptl_gethder_entity** new_entity, const ptl_payload* pld);
 int kyk_deseri_new_version_entity(ptl_ver_entity** new_ver_entity, uint8_t* buf, size_t* checknum);
 int kyk_deseri_new_net_addr(ptl_net_addr** new_net_addr, uint8_t* buf, size_t* checknum);
 
@@ -218,4 +233,23 @@ void kyk_print_ptl_reject_entity(const ptl_reject_entity* et);
 
 int kyk_seri_tx_to_new_pld(ptl_payload** new_pld, const struct kyk_tx* tx);
 
+int kyk_seri_filtered_getdata_to_new_pld(ptl_payload** new_pld,
+					 const struct ptl_inv* inv_list,
+					 varint_t inv_count,
+					 const struct ptl_pkh_filter* filter);
+
+int kyk_deseri_getdata_pkh_filter(const ptl_payload* pld,
+				  varint_t inv_count,
+				  struct ptl_pkh_filter** new_filter);
+
+void kyk_free_pkh_filter(struct ptl_pkh_filter* filter);
+
+int kyk_seri_merkle_blk_to_new_pld(ptl_payload** new_pld,
+				   const struct kyk_blk_header* hd,
+				   const struct kyk_partial_mkl* pmt);
+
+int kyk_deseri_merkle_blk_msg(const ptl_message* msg,
+			      struct kyk_blk_header* hd,
+			      struct kyk_partial_mkl** new_pmt);
+
 #endif
@@ -1,13 +1,17 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <openssl/sha.h>
 
 #include "kyk_sha.h"
+#include "kyk_sha_simd.h"
 #include "kyk_utils.h"
 #include "kyk_tx.h"
 #include "kyk_buff.h"
 #include "kyk_mkl_tree.h"
+#include "beej_pack.h"
 #include "dbg.h"
 
 
@@ -15,13 +19,67 @@ static void kyk_init_mkltree_node(struct kyk_mkltree_node *nd);
 static void kyk_hash_mkl_leaf(struct kyk_mkltree_node *nd, struct kyk_bon_buff buf);
 struct kyk_mkltree_level *create_parent_mkl_level(struct kyk_mkltree_level *level);
 static void kyk_hash_mkltree_level(struct kyk_mkltree_level *level);
-static void kyk_hash_mkltree_node(struct kyk_mkltree_node *nd);
+static void kyk_mkltree_node_msg(const struct kyk_mkltree_node *nd, uint8_t *msg);
 static int kyk_up_mkltree_level(struct kyk_mkltree_level *level, struct kyk_mkltree_level *child_level);
 static int root_mkl_level(const struct kyk_mkltree_level *level);
 void kyk_init_mkl_level(struct kyk_mkltree_level *level);
 void kyk_free_mkl_node(struct kyk_mkltree_node* nd);
 int kyk_free_mkl_level(struct kyk_mkltree_level* lv);
 
+/* one slice of a parallel merkle phase */
+struct mkl_worker {
+    pthread_t tid;
+    const struct kyk_tx* tx_list;
+    const uint8_t* in;
+    uint8_t* out;
+    size_t begin;
+    size_t end;
+};
+
+/* state of one partial merkle tree traversal, see BIP37 */
+struct pmt_walker {
+    size_t tx_count;
+    const uint8_t* hashes;     /* leaves, only used while building */
+    const uint8_t* matches;    /* only used while building */
+    uint8_t* out_hashes;
+    size_t hash_used;
+    size_t hash_count;
+    uint8_t* flags;
+    size_t bit_used;
+    size_t bit_count;
+    uint8_t* txids;            /* matched txids, only used while extracting */
+    size_t match_count;
+    int bad;
+};
+
+static int mkl_threads = KYK_MKL_THREADS_AUTO;
+
+static void mkl_hash_odd_tail(uint8_t* out, const uint8_t* in, size_t count);
+static size_t pmt_width(size_t tx_count, int height);
+static int pmt_height(size_t tx_count);
+static void pmt_calc_hash(const struct pmt_walker* wk, int height, size_t pos, uint8_t* out);
+static void pmt_build(struct pmt_walker* wk, int height, size_t pos);
+static void pmt_extract(struct pmt_walker* wk, int height, size_t pos, uint8_t* out);
+static int mkl_template_grow(struct kyk_mkl_template* tpl, size_t cap);
+static void mkl_template_update_path(struct kyk_mkl_template* tpl, size_t pos);
+static void* mkl_leaf_worker_run(void* arg);
+static void* mkl_pair_worker_run(void* arg);
+static int mkl_thread_count(int thread_num);
+static int run_mkl_workers(struct mkl_worker* workers,
+			   int thread_num,
+			   size_t n,
+			   void* (*run)(void*),
+			   const struct kyk_tx* tx_list,
+			   const uint8_t* in,
+			   uint8_t* out);
+static int run_mkl_phase(struct mkl_worker* workers,
+			 int thread_num,
+			 size_t n,
+			 void* (*run)(void*),
+			 const struct kyk_tx* tx_list,
+			 const uint8_t* in,
+			 uint8_t* out);
+
 
 int kyk_free_mkl_tree(struct kyk_mkltree_level* mkl_root)
 {
@@ -195,24 +253,43 @@ int root_mkl_level(const struct kyk_mkltree_level *level)
 }
 
 
+/* the nodes of one level are independent, hash them KYK_SHA256D_MAX_LANES at a time */
 void kyk_hash_mkltree_level(struct kyk_mkltree_level *level)
 {
+    uint8_t msgs[KYK_SHA256D_MAX_LANES * 64];
+    uint8_t dgsts[KYK_SHA256D_MAX_LANES * MKL_NODE_BODY_LEN];
+    struct kyk_mkltree_node *nd = NULL;
+    size_t chunk = 0;
     size_t i = 0;
-    for(i = 0; i < level -> len; i++){
-	kyk_hash_mkltree_node(level -> nd + i);
+    size_t j = 0;
+
+    for(i = 0; i < level -> len; i += chunk){
+	chunk = level -> len - i;
+	if(chunk > KYK_SHA256D_MAX_LANES){
+	    chunk = KYK_SHA256D_MAX_LANES;
+	}
+
+	for(j = 0; j < chunk; j++){
+	    kyk_mkltree_node_msg(level -> nd + i + j, msgs + j * 64);
+	}
+
+	kyk_dgst_hash256_64_n(dgsts, msgs, chunk);
+
+	for(j = 0; j < chunk; j++){
+	    nd = level -> nd + i + j;
+	    memcpy(nd -> bdy, dgsts + j * MKL_NODE_BODY_LEN, MKL_NODE_BODY_LEN);
+	    kyk_reverse(nd -> bdy, MKL_NODE_BODY_LEN);
+	}
     }
 }
 
-void kyk_hash_mkltree_node(struct kyk_mkltree_node *nd)
+/* build the 64-byte message of a branch node from its two children */
+void kyk_mkltree_node_msg(const struct kyk_mkltree_node *nd, uint8_t *msg)
 {
-    uint8_t tmp_buf[64];
-
-    memcpy(tmp_buf, nd -> child_lft -> bdy, 32);
-    kyk_reverse(tmp_buf, 32);
-    memcpy(tmp_buf + 32, nd -> child_rgt -> bdy, 32);
-    kyk_reverse(tmp_buf + 32, 32);
-    kyk_dgst_hash256(nd -> bdy, tmp_buf, sizeof(tmp_buf));
-    kyk_reverse(nd -> bdy, MKL_NODE_BODY_LEN);
+    memcpy(msg, nd -> child_lft -> bdy, 32);
+    kyk_reverse(msg, 32);
+    memcpy(msg + 32, nd -> child_rgt -> bdy, 32);
+    kyk_reverse(msg + 32, 32);
 }
 
 int kyk_up_mkltree_level(struct kyk_mkltree_level *level,
@@ -331,22 +408,55 @@ void kyk_cpy_mkl_root_value(uint8_t *src, struct kyk_mkltree_level *root_level)
 }
 
 
+struct kyk_mkltree_level *create_mkl_leafs_from_tx_list(const struct kyk_tx* tx_list, size_t tx_count)
+{
+    struct kyk_mkltree_level *mkl_level = NULL;
+    struct kyk_mkltree_node *nd_list = NULL;
+    struct kyk_mkltree_node *nd = NULL;
+    size_t i = 0;
+    int res = -1;
+
+    mkl_level = malloc(sizeof(*mkl_level));
+    check(mkl_level, "Failed to create_mkl_leafs_from_tx_list: mkl_level malloc failed");
+
+    nd_list = calloc(tx_count, sizeof(*nd_list));
+    check(nd_list, "Failed to create_mkl_leafs_from_tx_list: nd_list calloc failed");
+
+    kyk_init_mkl_level(mkl_level);
+    mkl_level -> nd = nd_list;
+    mkl_level -> len = 0;
+    mkl_level -> inx = 1;
+
+    nd = nd_list;
+    for(i = 0; i < tx_count; i++){
+	kyk_init_mkltree_node(nd);
+	/* the txid is the leaf, no need to serialize the tx first */
+	res = kyk_tx_hash256(nd -> bdy, tx_list + i);
+	check(res == 0, "Failed to create_mkl_leafs_from_tx_list: kyk_tx_hash256 failed");
+	mkl_level -> len++;
+	nd++;
+    }
+
+    if(mkl_level -> len == 1){
+	mkl_level -> nd -> ntype = ROOT_ND_T;
+    }
+
+    return mkl_level;
+
+error:
+    if(mkl_level) free(mkl_level);
+    if(nd_list) free(nd_list);
+    return NULL;
+}
+
 struct kyk_mkltree_level* kyk_make_mkl_tree_root_from_tx_list(const struct kyk_tx* tx_list,
 							      size_t tx_count)
 {
-    struct kyk_bon_buff *buf_list = NULL;
     struct kyk_mkltree_level *leaf_level;
     struct kyk_mkltree_level *root_level;
-    int res = -1;
-
-    buf_list = calloc(tx_count, sizeof(struct kyk_bon_buff));
-    check(buf_list, "Failed to kyk_make_mkl_tree_root: calloc failed");
 
-    res = kyk_seri_tx_list(buf_list, tx_list, tx_count);
-    check(res == 0, "Failed to kyk_make_mkl_tree_root_from_tx_list: kyk_seri_tx_list failed");
-
-    leaf_level = create_mkl_leafs(buf_list, tx_count);
-    check(leaf_level, "Failed to kyk_make_mkl_tree_root_from_tx_list: create_mkl_leafs failed");
+    leaf_level = create_mkl_leafs_from_tx_list(tx_list, tx_count);
+    check(leaf_level, "Failed to kyk_make_mkl_tree_root_from_tx_list: create_mkl_leafs_from_tx_list failed");
     
     root_level = create_mkl_tree(leaf_level);
 
@@ -357,16 +467,913 @@ error:
     return NULL;
 }
 
+/*
+ * Merkle root without building the node tree.
+ * hashes holds count 32-byte hashes back to back in the internal (not reversed) byte order,
+ * every level is reduced in place: pair i of a level is the 64-byte message at hashes + i * 64
+ * and its parent is written to hashes + i * 32.
+ * root receives the root in the reversed byte order of the node bodies.
+ */
+int kyk_mkl_root_from_hashes(uint8_t* root, uint8_t* hashes, size_t count)
+{
+    size_t pairs = 0;
 
-    
+    check(root, "Failed to kyk_mkl_root_from_hashes: root is NULL");
+    check(hashes, "Failed to kyk_mkl_root_from_hashes: hashes is NULL");
+    check(count > 0, "Failed to kyk_mkl_root_from_hashes: count is 0");
 
+    while(count > 1){
+	pairs = count / 2;
+	kyk_dgst_hash256_64_n(hashes, hashes, pairs);
+	mkl_hash_odd_tail(hashes, hashes, count);
+	count = (count + 1) / 2;
+    }
 
+    memcpy(root, hashes, MKL_NODE_BODY_LEN);
+    kyk_reverse(root, MKL_NODE_BODY_LEN);
 
+    return 0;
 
+error:
 
+    return -1;
+}
+
+/* parent of an odd last node, which is paired with itself */
+void mkl_hash_odd_tail(uint8_t* out, const uint8_t* in, size_t count)
+{
+    uint8_t last_pair[64];
+
+    if(count % 2 == 0){
+	return;
+    }
+
+    memcpy(last_pair, in + (count - 1) * MKL_NODE_BODY_LEN, MKL_NODE_BODY_LEN);
+    memcpy(last_pair + MKL_NODE_BODY_LEN, last_pair, MKL_NODE_BODY_LEN);
+    kyk_dgst_hash256(out + (count / 2) * MKL_NODE_BODY_LEN, last_pair, sizeof(last_pair));
+}
+
+int kyk_mkl_root_from_tx_list(uint8_t* root, const struct kyk_tx* tx_list, size_t tx_count)
+{
+    struct kyk_hash256_ctx ctx;
+    uint8_t* hashes = NULL;
+    size_t i = 0;
+    int res = -1;
+
+    check(root, "Failed to kyk_mkl_root_from_tx_list: root is NULL");
+    check(tx_list, "Failed to kyk_mkl_root_from_tx_list: tx_list is NULL");
+    check(tx_count > 0, "Failed to kyk_mkl_root_from_tx_list: tx_count is 0");
+
+    if(tx_count >= KYK_MKL_PARALLEL_MIN){
+	res = kyk_mkl_root_from_tx_list_mt(root, tx_list, tx_count, mkl_threads);
+	check(res == 0, "Failed to kyk_mkl_root_from_tx_list: kyk_mkl_root_from_tx_list_mt failed");
+	return 0;
+    }
+
+    hashes = malloc(tx_count * MKL_NODE_BODY_LEN);
+    check(hashes, "Failed to kyk_mkl_root_from_tx_list: hashes malloc failed");
+
+    for(i = 0; i < tx_count; i++){
+	kyk_hash256_init(&ctx);
+	kyk_hash_tx(&ctx, tx_list + i);
+	kyk_hash256_final(&ctx, hashes + i * MKL_NODE_BODY_LEN);
+    }
+
+    res = kyk_mkl_root_from_hashes(root, hashes, tx_count);
+    check(res == 0, "Failed to kyk_mkl_root_from_tx_list: kyk_mkl_root_from_hashes failed");
+
+    free(hashes);
+
+    return 0;
+
+error:
+    if(hashes) free(hashes);
+    return -1;
+}
 
+void kyk_set_mkl_threads(int thread_num)
+{
+    if(thread_num < 0){
+	thread_num = KYK_MKL_THREADS_AUTO;
+    }
+
+    if(thread_num > KYK_MKL_MAX_THREADS){
+	thread_num = KYK_MKL_MAX_THREADS;
+    }
+
+    mkl_threads = thread_num;
+}
+
+int kyk_get_mkl_threads(void)
+{
+    return mkl_threads;
+}
+
+/*
+ * Parallel version of kyk_mkl_root_from_tx_list, same root bit for bit.
+ * The txids and then the pairs of every level are split into thread_num slices,
+ * levels smaller than KYK_MKL_PARALLEL_MIN are finished on the calling thread.
+ * Levels go back and forth between two buffers because a slice written in place
+ * would overwrite pairs the previous slice is still reading.
+ */
+int kyk_mkl_root_from_tx_list_mt(uint8_t* root,
+				 const struct kyk_tx* tx_list,
+				 size_t tx_count,
+				 int thread_num)
+{
+    struct mkl_worker* workers = NULL;
+    uint8_t* hashes = NULL;
+    uint8_t* parents = NULL;
+    uint8_t* tmp = NULL;
+    size_t count = tx_count;
+    int res = -1;
+
+    check(root, "Failed to kyk_mkl_root_from_tx_list_mt: root is NULL");
+    check(tx_list, "Failed to kyk_mkl_root_from_tx_list_mt: tx_list is NULL");
+    check(tx_count > 0, "Failed to kyk_mkl_root_from_tx_list_mt: tx_count is 0");
 
+    thread_num = mkl_thread_count(thread_num);
 
+    workers = calloc(thread_num, sizeof(*workers));
+    check(workers, "Failed to kyk_mkl_root_from_tx_list_mt: workers calloc failed");
 
+    hashes = malloc(tx_count * MKL_NODE_BODY_LEN);
+    check(hashes, "Failed to kyk_mkl_root_from_tx_list_mt: hashes malloc failed");
+
+    parents = malloc((tx_count + 1) / 2 * MKL_NODE_BODY_LEN);
+    check(parents, "Failed to kyk_mkl_root_from_tx_list_mt: parents malloc failed");
+
+    res = run_mkl_workers(workers, thread_num, tx_count, mkl_leaf_worker_run, tx_list, NULL, hashes);
+    check(res == 0, "Failed to kyk_mkl_root_from_tx_list_mt: run_mkl_workers failed");
+
+    while(count / 2 >= KYK_MKL_PARALLEL_MIN){
+	res = run_mkl_workers(workers, thread_num, count / 2, mkl_pair_worker_run, NULL, hashes, parents);
+	check(res == 0, "Failed to kyk_mkl_root_from_tx_list_mt: run_mkl_workers failed");
+	mkl_hash_odd_tail(parents, hashes, count);
+	count = (count + 1) / 2;
+
+	tmp = hashes;
+	hashes = parents;
+	parents = tmp;
+    }
+
+    res = kyk_mkl_root_from_hashes(root, hashes, count);
+    check(res == 0, "Failed to kyk_mkl_root_from_tx_list_mt: kyk_mkl_root_from_hashes failed");
+
+    free(parents);
+    free(hashes);
+    free(workers);
+
+    return 0;
+
+error:
+    if(parents) free(parents);
+    if(hashes) free(hashes);
+    if(workers) free(workers);
+    return -1;
+}
+
+int mkl_thread_count(int thread_num)
+{
+    if(thread_num <= KYK_MKL_THREADS_AUTO){
+	thread_num = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    if(thread_num < 1){
+	thread_num = 1;
+    }
+
+    if(thread_num > KYK_MKL_MAX_THREADS){
+	thread_num = KYK_MKL_MAX_THREADS;
+    }
+
+    return thread_num;
+}
+
+int run_mkl_workers(struct mkl_worker* workers,
+		    int thread_num,
+		    size_t n,
+		    void* (*run)(void*),
+		    const struct kyk_tx* tx_list,
+		    const uint8_t* in,
+		    uint8_t* out)
+{
+    struct mkl_worker* wk = NULL;
+    size_t slice = 0;
+    int started = 0;
+    int i = 0;
+    int res = -1;
+
+    if((size_t)thread_num > n){
+	thread_num = (int)n;
+    }
+
+    slice = n / thread_num;
+
+    for(i = 0; i < thread_num; i++){
+	wk = workers + i;
+	wk -> tx_list = tx_list;
+	wk -> in = in;
+	wk -> out = out;
+	wk -> begin = slice * i;
+	wk -> end = i == thread_num - 1 ? n : slice * (i + 1);
+
+	res = pthread_create(&wk -> tid, NULL, run, wk);
+	check(res == 0, "Failed to run_mkl_workers: pthread_create failed");
+	started++;
+    }
+
+    for(i = 0; i < started; i++){
+	pthread_join(workers[i].tid, NULL);
+    }
+
+    return 0;
+
+error:
+    for(i = 0; i < started; i++){
+	pthread_join(workers[i].tid, NULL);
+    }
+    return -1;
+}
+
+/* like run_mkl_workers, but small phases (or no workers at all) run on the calling thread */
+int run_mkl_phase(struct mkl_worker* workers,
+		  int thread_num,
+		  size_t n,
+		  void* (*run)(void*),
+		  const struct kyk_tx* tx_list,
+		  const uint8_t* in,
+		  uint8_t* out)
+{
+    struct mkl_worker wk;
+
+    if(workers && n >= KYK_MKL_PARALLEL_MIN){
+	return run_mkl_workers(workers, thread_num, n, run, tx_list, in, out);
+    }
+
+    memset(&wk, 0, sizeof(wk));
+    wk.tx_list = tx_list;
+    wk.in = in;
+    wk.out = out;
+    wk.begin = 0;
+    wk.end = n;
+    run(&wk);
+
+    return 0;
+}
+
+void* mkl_leaf_worker_run(void* arg)
+{
+    struct mkl_worker* wk = arg;
+    struct kyk_hash256_ctx ctx;
+    size_t i = 0;
+
+    for(i = wk -> begin; i < wk -> end; i++){
+	kyk_hash256_init(&ctx);
+	kyk_hash_tx(&ctx, wk -> tx_list + i);
+	kyk_hash256_final(&ctx, wk -> out + i * MKL_NODE_BODY_LEN);
+    }
+
+    return NULL;
+}
+
+void* mkl_pair_worker_run(void* arg)
+{
+    struct mkl_worker* wk = arg;
+
+    kyk_dgst_hash256_64_n(wk -> out + wk -> begin * MKL_NODE_BODY_LEN,
+			  wk -> in + wk -> begin * 2 * MKL_NODE_BODY_LEN,
+			  wk -> end - wk -> begin);
+
+    return NULL;
+}
+
+/* number of nodes at height of a tree with tx_count leaves */
+size_t pmt_width(size_t tx_count, int height)
+{
+    return (tx_count + ((size_t)1 << height) - 1) >> height;
+}
+
+int pmt_height(size_t tx_count)
+{
+    int height = 0;
+
+    while(pmt_width(tx_count, height) > 1){
+	height++;
+    }
+
+    return height;
+}
+
+void pmt_calc_hash(const struct pmt_walker* wk, int height, size_t pos, uint8_t* out)
+{
+    uint8_t pair[2 * MKL_NODE_BODY_LEN];
+
+    if(height == 0){
+	memcpy(out, wk -> hashes + pos * MKL_NODE_BODY_LEN, MKL_NODE_BODY_LEN);
+	return;
+    }
+
+    pmt_calc_hash(wk, height - 1, pos * 2, pair);
+    if(pos * 2 + 1 < pmt_width(wk -> tx_count, height - 1)){
+	pmt_calc_hash(wk, height - 1, pos * 2 + 1, pair + MKL_NODE_BODY_LEN);
+    } else {
+	memcpy(pair + MKL_NODE_BODY_LEN, pair, MKL_NODE_BODY_LEN);
+    }
+
+    kyk_dgst_hash256(out, pair, sizeof(pair));
+}
+
+void pmt_build(struct pmt_walker* wk, int height, size_t pos)
+{
+    size_t begin = pos << height;
+    size_t end = (pos + 1) << height;
+    size_t i = 0;
+    int parent_of_match = 0;
+
+    if(end > wk -> tx_count){
+	end = wk -> tx_count;
+    }
+
+    for(i = begin; i < end && !parent_of_match; i++){
+	parent_of_match = wk -> matches[i] ? 1 : 0;
+    }
+
+    if(parent_of_match){
+	wk -> flags[wk -> bit_used / 8] |= 1 << (wk -> bit_used % 8);
+    }
+    wk -> bit_used++;
+
+    if(height == 0 || !parent_of_match){
+	pmt_calc_hash(wk, height, pos, wk -> out_hashes + wk -> hash_used * MKL_NODE_BODY_LEN);
+	wk -> hash_used++;
+	return;
+    }
+
+    pmt_build(wk, height - 1, pos * 2);
+    if(pos * 2 + 1 < pmt_width(wk -> tx_count, height - 1)){
+	pmt_build(wk, height - 1, pos * 2 + 1);
+    }
+}
+
+/*
+ * hashes holds the tx_count txids in the internal byte order,
+ * matches[i] is non-zero for every tx the peer is interested in.
+ */
+int kyk_build_partial_mkl(struct kyk_partial_mkl** new_pmt,
+			  const uint8_t* hashes,
+			  const uint8_t* matches,
+			  size_t tx_count)
+{
+    struct kyk_partial_mkl* pmt = NULL;
+    struct pmt_walker wk = {0};
+
+    check(new_pmt, "Failed to kyk_build_partial_mkl: new_pmt is NULL");
+    check(hashes, "Failed to kyk_build_partial_mkl: hashes is NULL");
+    check(matches, "Failed to kyk_build_partial_mkl: matches is NULL");
+    check(tx_count > 0 && tx_count <= UINT32_MAX, "Failed to kyk_build_partial_mkl: tx_count is invalid");
+
+    pmt = calloc(1, sizeof(*pmt));
+    check(pmt, "Failed to kyk_build_partial_mkl: pmt calloc failed");
+
+    wk.tx_count = tx_count;
+    wk.hashes = hashes;
+    wk.matches = matches;
+
+    /* every pushed hash covers its own leaves, and every visited node adds one bit */
+    wk.out_hashes = malloc(tx_count * MKL_NODE_BODY_LEN);
+    check(wk.out_hashes, "Failed to kyk_build_partial_mkl: out_hashes malloc failed");
+    wk.flags = calloc((2 * tx_count + 64) / 8, sizeof(*wk.flags));
+    check(wk.flags, "Failed to kyk_build_partial_mkl: flags calloc failed");
+
+    pmt_build(&wk, pmt_height(tx_count), 0);
+
+    pmt -> tx_count = (uint32_t)tx_count;
+    pmt -> hash_count = wk.hash_used;
+    pmt -> hashes = wk.out_hashes;
+    pmt -> flag_len = (wk.bit_used + 7) / 8;
+    pmt -> flags = wk.flags;
+
+    *new_pmt = pmt;
+
+    return 0;
+
+error:
+    if(pmt) free(pmt);
+    if(wk.out_hashes) free(wk.out_hashes);
+    return -1;
+}
+
+int kyk_build_partial_mkl_from_tx_list(struct kyk_partial_mkl** new_pmt,
+				       const struct kyk_tx* tx_list,
+				       const uint8_t* matches,
+				       size_t tx_count)
+{
+    struct kyk_hash256_ctx ctx;
+    uint8_t* hashes = NULL;
+    size_t i = 0;
+    int res = -1;
+
+    check(tx_list, "Failed to kyk_build_partial_mkl_from_tx_list: tx_list is NULL");
+    check(tx_count > 0, "Failed to kyk_build_partial_mkl_from_tx_list: tx_count is 0");
+
+    hashes = malloc(tx_count * MKL_NODE_BODY_LEN);
+    check(hashes, "Failed to kyk_build_partial_mkl_from_tx_list: hashes malloc failed");
+
+    for(i = 0; i < tx_count; i++){
+	kyk_hash256_init(&ctx);
+	kyk_hash_tx(&ctx, tx_list + i);
+	kyk_hash256_final(&ctx, hashes + i * MKL_NODE_BODY_LEN);
+    }
 
+    res = kyk_build_partial_mkl(new_pmt, hashes, matches, tx_count);
+    check(res == 0, "Failed to kyk_build_partial_mkl_from_tx_list: kyk_build_partial_mkl failed");
 
+    free(hashes);
+
+    return 0;
+
+error:
+    if(hashes) free(hashes);
+    return -1;
+}
+
+void pmt_extract(struct pmt_walker* wk, int height, size_t pos, uint8_t* out)
+{
+    uint8_t pair[2 * MKL_NODE_BODY_LEN];
+    int parent_of_match = 0;
+
+    if(wk -> bad){
+	return;
+    }
+
+    if(wk -> bit_used >= wk -> bit_count){
+	wk -> bad = 1;
+	return;
+    }
+
+    parent_of_match = (wk -> flags[wk -> bit_used / 8] >> (wk -> bit_used % 8)) & 1;
+    wk -> bit_used++;
+
+    if(height == 0 || !parent_of_match){
+	if(wk -> hash_used >= wk -> hash_count){
+	    wk -> bad = 1;
+	    return;
+	}
+	memcpy(out, wk -> hashes + wk -> hash_used * MKL_NODE_BODY_LEN, MKL_NODE_BODY_LEN);
+	wk -> hash_used++;
+
+	if(height == 0 && parent_of_match){
+	    memcpy(wk -> txids + wk -> match_count * MKL_NODE_BODY_LEN, out, MKL_NODE_BODY_LEN);
+	    kyk_reverse(wk -> txids + wk -> match_count * MKL_NODE_BODY_LEN, MKL_NODE_BODY_LEN);
+	    wk -> match_count++;
+	}
+	return;
+    }
+
+    pmt_extract(wk, height - 1, pos * 2, pair);
+    if(pos * 2 + 1 < pmt_width(wk -> tx_count, height - 1)){
+	pmt_extract(wk, height - 1, pos * 2 + 1, pair + MKL_NODE_BODY_LEN);
+	/* two identical children would let a forged tree duplicate txs (CVE-2012-2459) */
+	if(memcmp(pair, pair + MKL_NODE_BODY_LEN, MKL_NODE_BODY_LEN) == 0){
+	    wk -> bad = 1;
+	}
+    } else {
+	memcpy(pair + MKL_NODE_BODY_LEN, pair, MKL_NODE_BODY_LEN);
+    }
+
+    kyk_dgst_hash256(out, pair, sizeof(pair));
+}
+
+/*
+ * Walk a partial merkle tree received from a peer.
+ * root gets the merkle root and *new_txids the match_count matched txids,
+ * both in the reversed byte order of kyk_blk_header -> mrk_root_hash and kyk_tx_hash256.
+ * Fails on trees that are malformed or leave hashes or bits unused.
+ */
+int kyk_partial_mkl_extract(const struct kyk_partial_mkl* pmt,
+			    uint8_t* root,
+			    uint8_t** new_txids,
+			    size_t* match_count)
+{
+    struct pmt_walker wk;
+
+    memset(&wk, 0, sizeof(wk));
+
+    check(pmt, "Failed to kyk_partial_mkl_extract: pmt is NULL");
+    check(root, "Failed to kyk_partial_mkl_extract: root is NULL");
+    check(new_txids, "Failed to kyk_partial_mkl_extract: new_txids is NULL");
+    check(match_count, "Failed to kyk_partial_mkl_extract: match_count is NULL");
+    check(pmt -> tx_count > 0, "Failed to kyk_partial_mkl_extract: tx_count is 0");
+    check(pmt -> hash_count <= pmt -> tx_count, "Failed to kyk_partial_mkl_extract: too many hashes");
+    check(pmt -> flag_len * 8 >= pmt -> hash_count, "Failed to kyk_partial_mkl_extract: too few flag bits");
+
+    wk.tx_count = pmt -> tx_count;
+    wk.hashes = pmt -> hashes;
+    wk.hash_count = pmt -> hash_count;
+    wk.flags = pmt -> flags;
+    wk.bit_count = pmt -> flag_len * 8;
+
+    wk.txids = malloc((pmt -> hash_count > 0 ? pmt -> hash_count : 1) * MKL_NODE_BODY_LEN);
+    check(wk.txids, "Failed to kyk_partial_mkl_extract: txids malloc failed");
+
+    pmt_extract(&wk, pmt_height(pmt -> tx_count), 0, root);
+    check(wk.bad == 0, "Failed to kyk_partial_mkl_extract: malformed partial merkle tree");
+    check(wk.hash_used == wk.hash_count, "Failed to kyk_partial_mkl_extract: not all hashes were used");
+    check((wk.bit_used + 7) / 8 == pmt -> flag_len, "Failed to kyk_partial_mkl_extract: not all flag bits were used");
+
+    kyk_reverse(root, MKL_NODE_BODY_LEN);
+
+    *new_txids = wk.txids;
+    *match_count = wk.match_count;
+
+    return 0;
+
+error:
+    if(wk.txids) free(wk.txids);
+    return -1;
+}
+
+size_t kyk_get_partial_mkl_size(const struct kyk_partial_mkl* pmt)
+{
+    size_t len = 0;
+
+    len += sizeof(pmt -> tx_count);
+    len += get_varint_size(pmt -> hash_count);
+    len += pmt -> hash_count * MKL_NODE_BODY_LEN;
+    len += get_varint_size(pmt -> flag_len);
+    len += pmt -> flag_len;
+
+    return len;
+}
+
+/* total_transactions, hashes and flags fields of a merkleblock message */
+size_t kyk_seri_partial_mkl(uint8_t* buf, const struct kyk_partial_mkl* pmt)
+{
+    size_t len = 0;
+    size_t total = 0;
+
+    len = beej_pack(buf, "<L", pmt -> tx_count);
+    buf += len;
+    total += len;
+
+    len = kyk_pack_varint(buf, pmt -> hash_count);
+    buf += len;
+    total += len;
+
+    memcpy(buf, pmt -> hashes, pmt -> hash_count * MKL_NODE_BODY_LEN);
+    buf += pmt -> hash_count * MKL_NODE_BODY_LEN;
+    total += pmt -> hash_count * MKL_NODE_BODY_LEN;
+
+    len = kyk_pack_varint(buf, pmt -> flag_len);
+    buf += len;
+    total += len;
+
+    memcpy(buf, pmt -> flags, pmt -> flag_len);
+    total += pmt -> flag_len;
+
+    return total;
+}
+
+int kyk_deseri_new_partial_mkl(struct kyk_partial_mkl** new_pmt,
+			       const uint8_t* buf,
+			       size_t buf_len,
+			       size_t* checknum)
+{
+    struct kyk_partial_mkl* pmt = NULL;
+    const uint8_t* bufp = buf;
+    size_t len = 0;
+
+    check(new_pmt, "Failed to kyk_deseri_new_partial_mkl: new_pmt is NULL");
+    check(buf, "Failed to kyk_deseri_new_partial_mkl: buf is NULL");
+    check(buf_len >= sizeof(uint32_t) + 2, "Failed to kyk_deseri_new_partial_mkl: buf_len is too small");
+
+    pmt = calloc(1, sizeof(*pmt));
+    check(pmt, "Failed to kyk_deseri_new_partial_mkl: pmt calloc failed");
+
+    beej_unpack(bufp, "<L", &pmt -> tx_count);
+    bufp += sizeof(pmt -> tx_count);
+
+    check((size_t)(bufp - buf) + get_varint_len_by_prefix(*bufp) <= buf_len, "Failed to kyk_deseri_new_partial_mkl: buf is truncated");
+    len = kyk_unpack_varint(bufp, &pmt -> hash_count);
+    bufp += len;
+    check(pmt -> hash_count <= pmt -> tx_count, "Failed to kyk_deseri_new_partial_mkl: hash_count is invalid");
+    check((size_t)(bufp - buf) + pmt -> hash_count * MKL_NODE_BODY_LEN < buf_len, "Failed to kyk_deseri_new_partial_mkl: buf is truncated");
+
+    pmt -> hashes = malloc(pmt -> hash_count * MKL_NODE_BODY_LEN + 1);
+    check(pmt -> hashes, "Failed to kyk_deseri_new_partial_mkl: hashes malloc failed");
+    memcpy(pmt -> hashes, bufp, pmt -> hash_count * MKL_NODE_BODY_LEN);
+    bufp += pmt -> hash_count * MKL_NODE_BODY_LEN;
+
+    check((size_t)(bufp - buf) + get_varint_len_by_prefix(*bufp) <= buf_len, "Failed to kyk_deseri_new_partial_mkl: buf is truncated");
+    len = kyk_unpack_varint(bufp, &pmt -> flag_len);
+    bufp += len;
+    check((size_t)(bufp - buf) + pmt -> flag_len <= buf_len, "Failed to kyk_deseri_new_partial_mkl: buf is truncated");
+
+    pmt -> flags = malloc(pmt -> flag_len + 1);
+    check(pmt -> flags, "Failed to kyk_deseri_new_partial_mkl: flags malloc failed");
+    memcpy(pmt -> flags, bufp, pmt -> flag_len);
+    bufp += pmt -> flag_len;
+
+    *new_pmt = pmt;
+
+    if(checknum){
+	*checknum = bufp - buf;
+    }
+
+    return 0;
+
+error:
+    if(pmt) kyk_free_partial_mkl(pmt);
+    return -1;
+}
+
+void kyk_free_partial_mkl(struct kyk_partial_mkl* pmt)
+{
+    if(pmt){
+	if(pmt -> hashes) free(pmt -> hashes);
+	if(pmt -> flags) free(pmt -> flags);
+	free(pmt);
+    }
+}
+
+/* cap is only a hint, the template grows as txs are appended */
+int kyk_new_mkl_template(struct kyk_mkl_template** new_tpl, size_t cap)
+{
+    struct kyk_mkl_template* tpl = NULL;
+    int res = -1;
+
+    check(new_tpl, "Failed to kyk_new_mkl_template: new_tpl is NULL");
+
+    tpl = calloc(1, sizeof(*tpl));
+    check(tpl, "Failed to kyk_new_mkl_template: tpl calloc failed");
+
+    res = mkl_template_grow(tpl, cap > 0 ? cap : 1);
+    check(res == 0, "Failed to kyk_new_mkl_template: mkl_template_grow failed");
+
+    *new_tpl = tpl;
+
+    return 0;
+
+error:
+    if(tpl) kyk_free_mkl_template(tpl);
+    return -1;
+}
+
+/*
+ * Template over a whole tx list in one pass: the txids and then every level are hashed once,
+ * O(n) instead of the O(n log n) of appending the txs one by one.
+ * Big lists are hashed on the same worker slices as kyk_mkl_root_from_tx_list_mt.
+ */
+int kyk_new_mkl_template_from_tx_list(struct kyk_mkl_template** new_tpl,
+				      const struct kyk_tx* tx_list,
+				      size_t tx_count)
+{
+    struct kyk_mkl_template* tpl = NULL;
+    struct mkl_worker* workers = NULL;
+    int thread_num = 1;
+    size_t width = 0;
+    size_t h = 0;
+    int res = -1;
+
+    check(new_tpl, "Failed to kyk_new_mkl_template_from_tx_list: new_tpl is NULL");
+    check(tx_list, "Failed to kyk_new_mkl_template_from_tx_list: tx_list is NULL");
+    check(tx_count > 0, "Failed to kyk_new_mkl_template_from_tx_list: tx_count is 0");
+
+    res = kyk_new_mkl_template(&tpl, tx_count);
+    check(res == 0, "Failed to kyk_new_mkl_template_from_tx_list: kyk_new_mkl_template failed");
+
+    if(tx_count >= KYK_MKL_PARALLEL_MIN){
+	thread_num = mkl_thread_count(mkl_threads);
+	workers = calloc(thread_num, sizeof(*workers));
+	check(workers, "Failed to kyk_new_mkl_template_from_tx_list: workers calloc failed");
+    }
+
+    res = run_mkl_phase(workers, thread_num, tx_count, mkl_leaf_worker_run, tx_list, NULL, tpl -> levels[0]);
+    check(res == 0, "Failed to kyk_new_mkl_template_from_tx_list: run_mkl_phase failed");
+
+    /* unlike the in place root, every level has its own buffer and is kept */
+    for(h = 0, width = tx_count; width > 1; h++){
+	res = run_mkl_phase(workers, thread_num, width / 2, mkl_pair_worker_run, NULL, tpl -> levels[h], tpl -> levels[h + 1]);
+	check(res == 0, "Failed to kyk_new_mkl_template_from_tx_list: run_mkl_phase failed");
+	mkl_hash_odd_tail(tpl -> levels[h + 1], tpl -> levels[h], width);
+	width = (width + 1) / 2;
+    }
+
+    tpl -> count = tx_count;
+    tpl -> level_count = h + 1;
+
+    *new_tpl = tpl;
+
+    if(workers) free(workers);
+
+    return 0;
+
+error:
+    if(workers) free(workers);
+    if(tpl) kyk_free_mkl_template(tpl);
+    return -1;
+}
+
+/* every level gets room for the parents of cap leaves */
+int mkl_template_grow(struct kyk_mkl_template* tpl, size_t cap)
+{
+    uint8_t* level = NULL;
+    size_t width = cap;
+    size_t h = 0;
+
+    for(h = 0; h < KYK_MKL_TPL_MAX_LEVELS; h++){
+	level = realloc(tpl -> levels[h], width * MKL_NODE_BODY_LEN);
+	check(level, "Failed to mkl_template_grow: realloc failed");
+	tpl -> levels[h] = level;
+	if(width == 1){
+	    break;
+	}
+	width = (width + 1) / 2;
+    }
+
+    check(h < KYK_MKL_TPL_MAX_LEVELS, "Failed to mkl_template_grow: cap is too large");
+
+    tpl -> cap = cap;
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* rehash the parents of leaf pos up to the root, a missing right sibling is the node itself */
+void mkl_template_update_path(struct kyk_mkl_template* tpl, size_t pos)
+{
+    uint8_t pair[2 * MKL_NODE_BODY_LEN];
+    size_t width = tpl -> count;
+    size_t h = 0;
+    size_t left = 0;
+
+    for(h = 0; width > 1; h++){
+	left = pos & ~(size_t)1;
+	memcpy(pair, tpl -> levels[h] + left * MKL_NODE_BODY_LEN, MKL_NODE_BODY_LEN);
+	if(left + 1 < width){
+	    memcpy(pair + MKL_NODE_BODY_LEN, tpl -> levels[h] + (left + 1) * MKL_NODE_BODY_LEN, MKL_NODE_BODY_LEN);
+	} else {
+	    memcpy(pair + MKL_NODE_BODY_LEN, pair, MKL_NODE_BODY_LEN);
+	}
+
+	pos /= 2;
+	width = (width + 1) / 2;
+	kyk_dgst_hash256(tpl -> levels[h + 1] + pos * MKL_NODE_BODY_LEN, pair, sizeof(pair));
+    }
+
+    tpl -> level_count = h + 1;
+}
+
+/* hash is a txid in the internal byte order */
+int kyk_mkl_template_append(struct kyk_mkl_template* tpl, const uint8_t* hash)
+{
+    int res = -1;
+
+    check(tpl, "Failed to kyk_mkl_template_append: tpl is NULL");
+    check(hash, "Failed to kyk_mkl_template_append: hash is NULL");
+
+    if(tpl -> count == tpl -> cap){
+	res = mkl_template_grow(tpl, tpl -> cap * 2);
+	check(res == 0, "Failed to kyk_mkl_template_append: mkl_template_grow failed");
+    }
+
+    memcpy(tpl -> levels[0] + tpl -> count * MKL_NODE_BODY_LEN, hash, MKL_NODE_BODY_LEN);
+    tpl -> count++;
+
+    mkl_template_update_path(tpl, tpl -> count - 1);
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+int kyk_mkl_template_append_tx(struct kyk_mkl_template* tpl, const struct kyk_tx* tx)
+{
+    struct kyk_hash256_ctx ctx;
+    uint8_t txid[MKL_NODE_BODY_LEN];
+
+    check(tx, "Failed to kyk_mkl_template_append_tx: tx is NULL");
+
+    kyk_hash256_init(&ctx);
+    kyk_hash_tx(&ctx, tx);
+    kyk_hash256_final(&ctx, txid);
+
+    return kyk_mkl_template_append(tpl, txid);
+
+error:
+
+    return -1;
+}
+
+int kyk_mkl_template_set_leaf(struct kyk_mkl_template* tpl, size_t pos, const uint8_t* hash)
+{
+    check(tpl, "Failed to kyk_mkl_template_set_leaf: tpl is NULL");
+    check(hash, "Failed to kyk_mkl_template_set_leaf: hash is NULL");
+    check(pos < tpl -> count, "Failed to kyk_mkl_template_set_leaf: pos is out of range");
+
+    memcpy(tpl -> levels[0] + pos * MKL_NODE_BODY_LEN, hash, MKL_NODE_BODY_LEN);
+    mkl_template_update_path(tpl, pos);
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* the coinbase is always the first leaf, appended if the template is still empty */
+int kyk_mkl_template_set_coinbase(struct kyk_mkl_template* tpl, const struct kyk_tx* cb_tx)
+{
+    struct kyk_hash256_ctx ctx;
+    uint8_t txid[MKL_NODE_BODY_LEN];
+
+    check(tpl, "Failed to kyk_mkl_template_set_coinbase: tpl is NULL");
+    check(cb_tx, "Failed to kyk_mkl_template_set_coinbase: cb_tx is NULL");
+
+    kyk_hash256_init(&ctx);
+    kyk_hash_tx(&ctx, cb_tx);
+    kyk_hash256_final(&ctx, txid);
+
+    if(tpl -> count == 0){
+	return kyk_mkl_template_append(tpl, txid);
+    }
+
+    return kyk_mkl_template_set_leaf(tpl, 0, txid);
+
+error:
+
+    return -1;
+}
+
+/* root in the byte order of kyk_blk_header -> mrk_root_hash */
+int kyk_mkl_template_root(const struct kyk_mkl_template* tpl, uint8_t* root)
+{
+    check(tpl, "Failed to kyk_mkl_template_root: tpl is NULL");
+    check(root, "Failed to kyk_mkl_template_root: root is NULL");
+    check(tpl -> count > 0, "Failed to kyk_mkl_template_root: template is empty");
+
+    memcpy(root, tpl -> levels[tpl -> level_count - 1], MKL_NODE_BODY_LEN);
+    kyk_reverse(root, MKL_NODE_BODY_LEN);
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/*
+ * Siblings on the path from the coinbase to the root, lowest first, internal byte order.
+ * They don't depend on the coinbase, so a new coinbase only costs kyk_mkl_root_from_branch.
+ * branch needs room for KYK_MKL_TPL_MAX_LEVELS - 1 hashes, returns the number of hashes.
+ */
+size_t kyk_mkl_template_branch(const struct kyk_mkl_template* tpl, uint8_t* branch)
+{
+    size_t width = tpl -> count;
+    size_t h = 0;
+
+    for(h = 0; width > 1; h++){
+	memcpy(branch + h * MKL_NODE_BODY_LEN, tpl -> levels[h] + MKL_NODE_BODY_LEN, MKL_NODE_BODY_LEN);
+	width = (width + 1) / 2;
+    }
+
+    return h;
+}
+
+/* cb_hash is the coinbase txid in the internal byte order, root comes out reversed */
+void kyk_mkl_root_from_branch(uint8_t* root,
+			      const uint8_t* cb_hash,
+			      const uint8_t* branch,
+			      size_t branch_len)
+{
+    uint8_t pair[2 * MKL_NODE_BODY_LEN];
+    size_t i = 0;
+
+    memcpy(root, cb_hash, MKL_NODE_BODY_LEN);
+
+    for(i = 0; i < branch_len; i++){
+	memcpy(pair, root, MKL_NODE_BODY_LEN);
+	memcpy(pair + MKL_NODE_BODY_LEN, branch + i * MKL_NODE_BODY_LEN, MKL_NODE_BODY_LEN);
+	kyk_dgst_hash256(root, pair, sizeof(pair));
+    }
+
+    kyk_reverse(root, MKL_NODE_BODY_LEN);
+}
+
+void kyk_free_mkl_template(struct kyk_mkl_template* tpl)
+{
+    size_t h = 0;
+
+    if(tpl){
+	for(h = 0; h < KYK_MKL_TPL_MAX_LEVELS; h++){
+	    if(tpl -> levels[h]) free(tpl -> levels[h]);
+	}
+	free(tpl);
+    }
+}
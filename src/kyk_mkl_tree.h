@@ -1,8 +1,20 @@
 #ifndef KYK_MKL_TREE_H__
 #define KYK_MKL_TREE_H__
 
+#include "varint.h"
+
 #define MKL_NODE_BODY_LEN 32
 
+/* below this many txids (or pairs in a level) the merkle root is computed on one thread */
+#define KYK_MKL_PARALLEL_MIN 256
+
+/* enough levels for 2 ** 32 leaves */
+#define KYK_MKL_TPL_MAX_LEVELS 33
+
+/* 0 means one worker per online CPU */
+#define KYK_MKL_THREADS_AUTO 0
+#define KYK_MKL_MAX_THREADS  64
+
 struct kyk_tx;
 struct kyk_bon_buff;
 
@@ -20,6 +32,30 @@ struct kyk_mkltree_node{
     enum mkltree_node_type ntype;
 };
 
+/*
+ * BIP37 partial merkle tree: the hashes and traversal bits a peer needs to rebuild
+ * the merkle root and learn which txids of the block matched its filter.
+ */
+struct kyk_partial_mkl{
+    uint32_t tx_count;
+    varint_t hash_count;
+    uint8_t *hashes;      /* hash_count * 32 bytes, internal byte order as on the wire */
+    varint_t flag_len;
+    uint8_t *flags;       /* depth-first traversal bits, least significant bit first */
+};
+
+/*
+ * Merkle tree of a block template, every level is kept.
+ * Replacing the coinbase or appending a tx only rehashes the path of that leaf to the root,
+ * and the coinbase branch lets the miner roll the extranonce without the template at all.
+ */
+struct kyk_mkl_template{
+    size_t count;         /* leaves */
+    size_t cap;           /* leaves the levels have room for */
+    size_t level_count;
+    uint8_t *levels[KYK_MKL_TPL_MAX_LEVELS];   /* levels[0] are the txids, internal byte order */
+};
+
 struct kyk_mkltree_level{
     struct kyk_mkltree_node *nd;
     struct kyk_mkltree_level *dwn; /* 指向下级 level */
@@ -32,6 +68,7 @@ struct kyk_mkltree_level *create_mkl_tree(struct kyk_mkltree_level *leaf_level);
 struct kyk_mkltree_level *create_mkl_leafs(struct kyk_bon_buff *buf_list, size_t len);
 void kyk_print_mkl_tree(const struct kyk_mkltree_level *root_level);
 struct kyk_mkltree_level *create_mkl_leafs_from_txid_hexs(const char *hexs[], size_t row_num);
+struct kyk_mkltree_level *create_mkl_leafs_from_tx_list(const struct kyk_tx* tx_list, size_t tx_count);
 void kyk_print_mkl_level(const struct kyk_mkltree_level *level);
 void kyk_cpy_mkl_root_value(uint8_t *src, struct kyk_mkltree_level *root_level);
 struct kyk_mkltree_level* kyk_make_mkl_tree_root_from_tx_list(const struct kyk_tx* tx_list,
@@ -39,5 +76,54 @@ struct kyk_mkltree_level* kyk_make_mkl_tree_root_from_tx_list(const struct kyk_t
 
 int kyk_free_mkl_tree(struct kyk_mkltree_level* mkl_root);
 
+int kyk_mkl_root_from_hashes(uint8_t* root, uint8_t* hashes, size_t count);
+int kyk_mkl_root_from_tx_list(uint8_t* root, const struct kyk_tx* tx_list, size_t tx_count);
+int kyk_mkl_root_from_tx_list_mt(uint8_t* root,
+				 const struct kyk_tx* tx_list,
+				 size_t tx_count,
+				 int thread_num);
+
+void kyk_set_mkl_threads(int thread_num);
+int kyk_get_mkl_threads(void);
+
+int kyk_build_partial_mkl(struct kyk_partial_mkl** new_pmt,
+			  const uint8_t* hashes,
+			  const uint8_t* matches,
+			  size_t tx_count);
+
+int kyk_build_partial_mkl_from_tx_list(struct kyk_partial_mkl** new_pmt,
+				       const struct kyk_tx* tx_list,
+				       const uint8_t* matches,
+				       size_t tx_count);
+
+int kyk_partial_mkl_extract(const struct kyk_partial_mkl* pmt,
+			    uint8_t* root,
+			    uint8_t** new_txids,
+			    size_t* match_count);
+
+size_t kyk_get_partial_mkl_size(const struct kyk_partial_mkl* pmt);
+size_t kyk_seri_partial_mkl(uint8_t* buf, const struct kyk_partial_mkl* pmt);
+int kyk_deseri_new_partial_mkl(struct kyk_partial_mkl** new_pmt,
+			       const uint8_t* buf,
+			       size_t buf_len,
+			       size_t* checknum);
+void kyk_free_partial_mkl(struct kyk_partial_mkl* pmt);
+
+int kyk_new_mkl_template(struct kyk_mkl_template** new_tpl, size_t cap);
+int kyk_new_mkl_template_from_tx_list(struct kyk_mkl_template** new_tpl,
+				      const struct kyk_tx* tx_list,
+				      size_t tx_count);
+int kyk_mkl_template_append(struct kyk_mkl_template* tpl, const uint8_t* hash);
+int kyk_mkl_template_append_tx(struct kyk_mkl_template* tpl, const struct kyk_tx* tx);
+int kyk_mkl_template_set_leaf(struct kyk_mkl_template* tpl, size_t pos, const uint8_t* hash);
+int kyk_mkl_template_set_coinbase(struct kyk_mkl_template* tpl, const struct kyk_tx* cb_tx);
+int kyk_mkl_template_root(const struct kyk_mkl_template* tpl, uint8_t* root);
+size_t kyk_mkl_template_branch(const struct kyk_mkl_template* tpl, uint8_t* branch);
+void kyk_mkl_root_from_branch(uint8_t* root,
+			      const uint8_t* cb_hash,
+			      const uint8_t* branch,
+			      size_t branch_len);
+void kyk_free_mkl_template(struct kyk_mkl_template* tpl);
+
 
 #endif
@@ -11,8 +11,27 @@
 #include "kyk_block.h"
 #include "kyk_utxo.h"
 #include "kyk_validate.h"
+#include "kyk_mkl_tree.h"
+#include "kyk_sha.h"
+#include "kyk_tx.h"
+#include "kyk_script.h"
+#include "block_store.h"
+#include "kyk_blk_reader.h"
 #include "dbg.h"
 
+#define P2PKH_SC_LEN 25
+#define PKH_LEN 20
+
+static int pkh_filter_has(const struct ptl_pkh_filter* filter, const uint8_t* pkh);
+static int pkh_filter_match_tx(const struct ptl_pkh_filter* filter, const struct kyk_tx* tx);
+static int kyk_ptl_merkle_blk_rep(struct kyk_frame_queue* outq,
+				  const struct kyk_block* blk,
+				  const struct ptl_pkh_filter* filter);
+static int kyk_ptl_raw_blk_rep(struct kyk_frame_queue* outq,
+			       const struct kyk_wallet* wallet,
+			       const struct kyk_bkey_val* bval);
+static void free_bval_list(struct kyk_bkey_val** bval_list, size_t count);
+
 /* The ping message is sent primarily to confirm that the TCP/IP connection is still valid. */
 /* An error in transmission is presumed to be a closed connection and the address is removed as a current peer. */
 int kyk_ptl_ping_req(const char* node,
@@ -45,7 +64,7 @@ error:
 }
 
 /* The pong message is sent in response to a ping message. In modern protocol versions, a pong response is generated using a nonce included in the ping. */
-int kyk_ptl_pong_rep(int sockfd, ptl_message* req_msg)
+int kyk_ptl_pong_rep(struct kyk_frame_queue* outq, ptl_message* req_msg)
 {
     ptl_payload* pld = NULL;
     ptl_payload* rep_pld = NULL;
@@ -68,7 +87,7 @@ int kyk_ptl_pong_rep(int sockfd, ptl_message* req_msg)
     res = kyk_build_new_ptl_message(&rep_msg, KYK_MSG_TYPE_PONG, NT_MAGIC_MAIN, pld);
     check(res == 0, "Failed to kyk_ptl_pong_rep: kyk_build_new_ptl_message failed");
 
-    res = kyk_reply_ptl_msg(sockfd, rep_msg);
+    res = kyk_reply_ptl_msg(outq, rep_msg);
     check(res == 0, "Failed to kyk_ptl_pong_rep");
     
 
@@ -81,7 +100,7 @@ error:
 
 /* When a node creates an outgoing connection, it will immediately advertise its version. */
 /* The remote node will respond with its version. No further communication is possible until both peers have exchanged their version. */
-int kyk_ptl_version_rep(int sockfd, ptl_message* req_msg)
+int kyk_ptl_version_rep(struct kyk_frame_queue* outq, ptl_message* req_msg)
 {
     ptl_ver_entity* ver_entity = NULL;
     ptl_message* rep_msg = NULL;
@@ -113,7 +132,7 @@ int kyk_ptl_version_rep(int sockfd, ptl_message* req_msg)
     res = kyk_build_new_ptl_message(&rep_msg, KYK_MSG_TYPE_VERSION, NT_MAGIC_MAIN, pld);
     check(res == 0, "Failed to kyk_ptl_version_rep: kyk_build_new_ptl_message failed");
 
-    res = kyk_reply_ptl_msg(sockfd, rep_msg);
+    res = kyk_reply_ptl_msg(outq, rep_msg);
     check(res == 0, "Failed to kyk_ptl_version_rep: kyk_reply_ptl_msg failed");
     
     return 0;
@@ -124,45 +143,118 @@ error:
 }
 
 
-int kyk_ptl_headers_rep(int sockfd,
+/*
+ * Headers to send for a getheaders: the first locator hash found in the chain is
+ * the last header the peer shares with us, the reply starts right after it
+ * (at the genesis header if none is found) and ends at hash_stop,
+ * at the tip or after KYK_MAX_HEADERS_RESULTS headers, whichever comes first.
+ */
+int kyk_ptl_locate_headers(const struct kyk_hd_index* hd_index,
+			   const ptl_gethder_entity* et,
+			   size_t* start,
+			   size_t* count)
+{
+    uint256 zero_hash;
+    size_t height = 0;
+    size_t end = 0;
+    varint_t i = 0;
+
+    check(hd_index, "Failed to kyk_ptl_locate_headers: hd_index is NULL");
+    check(et, "Failed to kyk_ptl_locate_headers: et is NULL");
+
+    *start = 0;
+    for(i = 0; i < et -> hash_count; i++){
+	if(kyk_hd_index_find(hd_index, et -> locator_hashes[i].data, &height)){
+	    *start = height + 1;
+	    break;
+	}
+    }
+
+    end = hd_index -> len;
+    if(end - *start > KYK_MAX_HEADERS_RESULTS){
+	end = *start + KYK_MAX_HEADERS_RESULTS;
+    }
+
+    memset(zero_hash.data, 0, sizeof(zero_hash.data));
+    if(!kyk_digest_eq(et -> hash_stop.data, zero_hash.data, sizeof(zero_hash.data)) &&
+       kyk_hd_index_find(hd_index, et -> hash_stop.data, &height) &&
+       height >= *start && height < end){
+	end = height + 1;
+    }
+
+    *count = end > *start ? end - *start : 0;
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+int kyk_ptl_headers_rep(struct kyk_frame_queue* outq,
 			const ptl_message* req_msg,
-			const struct kyk_blk_hd_chain* hd_chain)
+			const struct kyk_blk_hd_chain* hd_chain,
+			const struct kyk_hd_index* hd_index)
 {
+    ptl_gethder_entity* et = NULL;
+    struct kyk_blk_hd_chain rep_chain;
     ptl_payload* pld = NULL;
     ptl_message* rep_msg = NULL;
+    size_t start = 0;
+    size_t count = 0;
     int res = -1;
 
     check(req_msg, "Failed to kyk_ptl_headers_rep: req_msg is NULL");
     check(hd_chain, "Failed to kyk_ptl_headers_rep: hd_chain is NULL");
+    check(hd_index, "Failed to kyk_ptl_headers_rep: hd_index is NULL");
+    check(hd_index -> len == hd_chain -> len, "Failed to kyk_ptl_headers_rep: hd_index is stale");
+
+    res = kyk_deseri_new_gethder_entity(&et, req_msg -> pld);
+    check(res == 0, "Failed to kyk_ptl_headers_rep: kyk_deseri_new_gethder_entity failed");
+
+    res = kyk_ptl_locate_headers(hd_index, et, &start, &count);
+    check(res == 0, "Failed to kyk_ptl_headers_rep: kyk_ptl_locate_headers failed");
 
-    res = kyk_seri_hd_chain_to_new_pld(&pld, hd_chain);
+    /* a view of the part of the chain the peer is missing */
+    rep_chain.hd_list = hd_chain -> hd_list + start;
+    rep_chain.len = count;
+
+    res = kyk_seri_hd_chain_to_new_pld(&pld, &rep_chain);
     check(res == 0, "Failed to kyk_ptl_headers_rep: kyk_seri_hd_chain_to_new_pld failed");
 
     res = kyk_build_new_ptl_message(&rep_msg, KYK_MSG_TYPE_HEADERS, NT_MAGIC_MAIN, pld);
     check(res == 0, "Failed to kyk_ptl_headers_rep: kyk_build_new_ptl_message failed");
 
-    res = kyk_reply_ptl_msg(sockfd, rep_msg);
+    res = kyk_reply_ptl_msg(outq, rep_msg);
     check(res == 0, "Failed to kyk_ptl_headers_rep: kyk_reply_ptl_msg failed");
 
+    kyk_free_ptl_gethder_entity(et);
+    kyk_free_ptl_payload(pld);
+    kyk_free_ptl_msg(rep_msg);
+
     return 0;
     
 error:
-
+    if(et) kyk_free_ptl_gethder_entity(et);
+    if(pld) kyk_free_ptl_payload(pld);
+    if(rep_msg) kyk_free_ptl_msg(rep_msg);
     return -1;
 }
 
-int kyk_ptl_blk_rep(int sockfd,
+int kyk_ptl_blk_rep(struct kyk_frame_queue* outq,
 		    const ptl_message* req_msg,
 		    struct kyk_wallet* wallet)
 {
-    /* struct kyk_block** blk = NULL; */
-    struct kyk_block** blk_list = NULL;
+    struct kyk_bkey_val** bval_list = NULL;
+    struct kyk_cached_blk* cblk = NULL;
     struct ptl_inv* inv_list = NULL;
     struct ptl_inv* inv = NULL;
-    ptl_payload* pld = NULL;
-    ptl_message* rep_msg = NULL;
+    struct ptl_pkh_filter* filter = NULL;
+    const uint8_t** tx_buf_list = NULL;
+    size_t* tx_size_list = NULL;
     varint_t inv_count = 0;
     varint_t i = 0;
+    char* errptr = NULL;
     char* hashstr = NULL;
     char* msg = NULL;
     int res = -1;
@@ -174,52 +266,361 @@ int kyk_ptl_blk_rep(int sockfd,
     res = kyk_deseri_new_ptl_inv_list(req_msg -> pld -> data, &inv_list, &inv_count);
     check(res == 0, "Failed to kyk_ptl_blk_rep: kyk_deseri_new_ptl_inv_list failed");
 
-    blk_list = calloc(inv_count, sizeof(*blk_list));
-    check(blk_list, "Failed to kyk_ptl_blk_rep: calloc failed");
+    bval_list = calloc(inv_count, sizeof(*bval_list));
+    check(bval_list, "Failed to kyk_ptl_blk_rep: calloc failed");
+
+    tx_buf_list = calloc(inv_count, sizeof(*tx_buf_list));
+    check(tx_buf_list, "Failed to kyk_ptl_blk_rep: calloc failed");
+
+    tx_size_list = calloc(inv_count, sizeof(*tx_size_list));
+    check(tx_size_list, "Failed to kyk_ptl_blk_rep: calloc failed");
 
+    /*
+     * Only the indexes are read here, every block and tx is known before the first one is sent.
+     * A tx view stays valid until the wallet's blk reader is freed, it is sent from here as it is.
+     */
     for(i = 0; i < inv_count; i++){
 	inv = inv_list + i;
-	res = kyk_wallet_query_block_by_hashbytes(wallet, (uint8_t*)inv -> hash, &blk_list[i]);
-	if(res != 0){
+	if(inv -> type == PTL_INV_MSG_TX){
+	    res = kyk_wallet_get_tx_view(wallet, (uint8_t*)inv -> hash, tx_buf_list + i, tx_size_list + i);
+	    check(res == 0, "Failed to kyk_ptl_blk_rep: kyk_wallet_get_tx_view failed");
+	} else {
+	    bval_list[i] = kyk_read_block(wallet -> blk_index_db, (char*)inv -> hash, &errptr);
+	}
+	if(bval_list[i] == NULL && tx_buf_list[i] == NULL){
 	    hashstr = bytes2hexstr((uint8_t*)inv -> hash, sizeof(inv -> hash));
 	    check(hashstr, "Failed to kyk_ptl_blk_rep: bytes2hexstr failed");
 	    
-	    msg = kyk_asprintf("found no block: %s", hashstr);
+	    msg = kyk_asprintf("found no %s: %s", inv -> type == PTL_INV_MSG_TX ? "tx" : "block", hashstr);
 	    check(msg, "Failed to kyk_ptl_blk_rep: kyk_asprintf failed");
 	    
 	    kyk_print_hex("invalid blk hash", (uint8_t*)inv -> hash, sizeof(inv -> hash));
-	    kyk_ptl_reject_rep(sockfd, CC_REJECT_INVALID, msg);
+	    kyk_ptl_reject_rep(outq, CC_REJECT_INVALID, msg);
 	    free(hashstr);
 	    free(msg);
 	    goto error;
 	}
-	
-
     }
 
     for(i = 0; i < inv_count; i++){
-	
-	res = kyk_seri_blk_to_new_pld(&pld, blk_list[i]);
-	check(res == 0, "Failed to kyk_ptl_blk_rep: kyk_seri_blk_to_new_pld failed");
-	
-	res = kyk_build_new_ptl_message(&rep_msg, KYK_MSG_TYPE_BLOCK, NT_MAGIC_MAIN, pld);
-	check(res == 0, "Failed to kyk_ptl_blk_rep: kyk_build_new_ptl_message failed");
+	if(inv_list[i].type == PTL_INV_MSG_TX){
+	    res = kyk_reply_ptl_buf_msg(outq, KYK_MSG_TYPE_TX, NT_MAGIC_MAIN, tx_buf_list[i], tx_size_list[i]);
+	    check(res == 0, "Failed to kyk_ptl_blk_rep: kyk_reply_ptl_buf_msg failed");
+	    continue;
+	}
+
+	if(inv_list[i].type == PTL_INV_MSG_FILTERED_BLOCK){
+	    if(filter == NULL){
+		res = kyk_deseri_getdata_pkh_filter(req_msg -> pld, inv_count, &filter);
+		check(res == 0, "Failed to kyk_ptl_blk_rep: kyk_deseri_getdata_pkh_filter failed");
+	    }
 
-	res = kyk_reply_ptl_msg(sockfd, rep_msg);
-	check(res == 0, "Failed to kyk_ptl_blk_rep: kyk_write_ptl_msg failed");
+	    /* matching txs needs the parsed block, it is kept in the reader's cache for the next peer */
+	    res = kyk_blk_reader_get_block(wallet -> blk_reader, bval_list[i] -> nFile, bval_list[i] -> nDataPos, &cblk);
+	    check(res == 0, "Failed to kyk_ptl_blk_rep: kyk_blk_reader_get_block failed");
 
+	    res = kyk_ptl_merkle_blk_rep(outq, cblk -> blk, filter);
+	    check(res == 0, "Failed to kyk_ptl_blk_rep: kyk_ptl_merkle_blk_rep failed");
+
+	    kyk_blk_reader_put_block(wallet -> blk_reader, cblk);
+	    cblk = NULL;
+	    continue;
+	}
+
+	res = kyk_ptl_raw_blk_rep(outq, wallet, bval_list[i]);
+	check(res == 0, "Failed to kyk_ptl_blk_rep: kyk_ptl_raw_blk_rep failed");
     }
 
-    kyk_free_block_list(blk_list, inv_count);
+    free_bval_list(bval_list, inv_count);
+    free(tx_buf_list);
+    free(tx_size_list);
+    kyk_free_pkh_filter(filter);
     
     return 0;
 
 error:
-    if(blk_list) kyk_free_block_list(blk_list, inv_count);
+    if(cblk) kyk_blk_reader_put_block(wallet -> blk_reader, cblk);
+    if(bval_list) free_bval_list(bval_list, inv_count);
+    if(tx_buf_list) free(tx_buf_list);
+    if(tx_size_list) free(tx_size_list);
+    if(filter) kyk_free_pkh_filter(filter);
+    return -1;
+}
+
+/* the block bytes in blk*.dat are the 'block' payload, they are sent as they are from the mapped file */
+int kyk_ptl_raw_blk_rep(struct kyk_frame_queue* outq,
+			const struct kyk_wallet* wallet,
+			const struct kyk_bkey_val* bval)
+{
+    const uint8_t* blk_buf = NULL;
+    uint32_t blk_size = 0;
+    int res = -1;
+
+    res = kyk_wallet_get_block_view(wallet, bval, &blk_buf, &blk_size);
+    check(res == 0, "Failed to kyk_ptl_raw_blk_rep: kyk_wallet_get_block_view failed");
+
+    res = kyk_reply_ptl_buf_msg(outq, KYK_MSG_TYPE_BLOCK, NT_MAGIC_MAIN, blk_buf, blk_size);
+    check(res == 0, "Failed to kyk_ptl_raw_blk_rep: kyk_reply_ptl_buf_msg failed");
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+void free_bval_list(struct kyk_bkey_val** bval_list, size_t count)
+{
+    size_t i = 0;
+
+    for(i = 0; i < count; i++){
+	if(bval_list[i]) kyk_free_bval(bval_list[i]);
+    }
+
+    free(bval_list);
+}
+
+int pkh_filter_has(const struct ptl_pkh_filter* filter, const uint8_t* pkh)
+{
+    varint_t i = 0;
+
+    for(i = 0; i < filter -> count; i++){
+	if(memcmp(filter -> pkhs + i * PKH_LEN, pkh, PKH_LEN) == 0){
+	    return 1;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * A tx matches when one of its txouts is a P2PKH paying to the filter,
+ * or one of its txins is signed by a pubkey hashing into the filter.
+ */
+int pkh_filter_match_tx(const struct ptl_pkh_filter* filter, const struct kyk_tx* tx)
+{
+    const struct kyk_txout* txout = NULL;
+    const struct kyk_txin* txin = NULL;
+    const uint8_t* push = NULL;
+    uint8_t pkh[PKH_LEN];
+    size_t push_len = 0;
+    size_t pos = 0;
+    varint_t i = 0;
+
+    if(filter -> count == 0){
+	return 0;
+    }
+
+    for(i = 0; i < tx -> vout_sz; i++){
+	txout = tx -> txout + i;
+	if(txout -> sc_size == P2PKH_SC_LEN &&
+	   txout -> sc[0] == OP_DUP &&
+	   txout -> sc[1] == OP_HASH160 &&
+	   txout -> sc[2] == PKH_LEN &&
+	   txout -> sc[23] == OP_EQUALVERIFY &&
+	   txout -> sc[24] == OP_CHECKSIG &&
+	   pkh_filter_has(filter, txout -> sc + 3)){
+	    return 1;
+	}
+    }
+
+    for(i = 0; i < tx -> vin_sz; i++){
+	txin = tx -> txin + i;
+	push = NULL;
+	push_len = 0;
+
+	/* scriptSig of a P2PKH spend is <sig> <pubkey>, the pubkey is the last push */
+	for(pos = 0; pos < txin -> sc_size; pos += 1 + txin -> sc[pos]){
+	    if(txin -> sc[pos] == 0 || txin -> sc[pos] > 75 || pos + 1 + txin -> sc[pos] > txin -> sc_size){
+		push = NULL;
+		break;
+	    }
+	    push = txin -> sc + pos + 1;
+	    push_len = txin -> sc[pos];
+	}
+
+	if(push){
+	    kyk_dgst_hash160(pkh, push, push_len);
+	    if(pkh_filter_has(filter, pkh)){
+		return 1;
+	    }
+	}
+    }
+
+    return 0;
+}
+
+/* merkleblock of blk, followed by one tx message per matched tx in block order */
+int kyk_ptl_merkle_blk_rep(struct kyk_frame_queue* outq,
+			   const struct kyk_block* blk,
+			   const struct ptl_pkh_filter* filter)
+{
+    struct kyk_partial_mkl* pmt = NULL;
+    uint8_t* matches = NULL;
+    ptl_payload* pld = NULL;
+    ptl_message** rep_list = NULL;
+    size_t rep_count = 0;
+    varint_t i = 0;
+    int res = -1;
+
+    check(blk, "Failed to kyk_ptl_merkle_blk_rep: blk is NULL");
+    check(blk -> tx_count > 0, "Failed to kyk_ptl_merkle_blk_rep: blk -> tx_count is invalid");
+
+    matches = calloc(blk -> tx_count, sizeof(*matches));
+    check(matches, "Failed to kyk_ptl_merkle_blk_rep: calloc failed");
+
+    for(i = 0; i < blk -> tx_count; i++){
+	matches[i] = (uint8_t)pkh_filter_match_tx(filter, blk -> tx + i);
+    }
+
+    res = kyk_build_partial_mkl_from_tx_list(&pmt, blk -> tx, matches, blk -> tx_count);
+    check(res == 0, "Failed to kyk_ptl_merkle_blk_rep: kyk_build_partial_mkl_from_tx_list failed");
+
+    /* the merkleblock and the matched txs after it go out together */
+    rep_list = calloc(blk -> tx_count + 1, sizeof(*rep_list));
+    check(rep_list, "Failed to kyk_ptl_merkle_blk_rep: calloc failed");
+
+    res = kyk_seri_merkle_blk_to_new_pld(&pld, blk -> hd, pmt);
+    check(res == 0, "Failed to kyk_ptl_merkle_blk_rep: kyk_seri_merkle_blk_to_new_pld failed");
+
+    res = kyk_build_new_ptl_message(rep_list + rep_count, KYK_MSG_TYPE_MERKLEBLOCK, NT_MAGIC_MAIN, pld);
+    check(res == 0, "Failed to kyk_ptl_merkle_blk_rep: kyk_build_new_ptl_message failed");
+    rep_count++;
+
+    kyk_free_ptl_payload(pld);
+    pld = NULL;
+
+    for(i = 0; i < blk -> tx_count; i++){
+	if(!matches[i]){
+	    continue;
+	}
+
+	res = kyk_seri_tx_to_new_pld(&pld, blk -> tx + i);
+	check(res == 0, "Failed to kyk_ptl_merkle_blk_rep: kyk_seri_tx_to_new_pld failed");
+
+	res = kyk_build_new_ptl_message(rep_list + rep_count, KYK_MSG_TYPE_TX, NT_MAGIC_MAIN, pld);
+	check(res == 0, "Failed to kyk_ptl_merkle_blk_rep: kyk_build_new_ptl_message failed");
+	rep_count++;
+
+	kyk_free_ptl_payload(pld);
+	pld = NULL;
+    }
+
+    res = kyk_frame_queue_msgs(outq, (const ptl_message**)rep_list, rep_count);
+    check(res == 0, "Failed to kyk_ptl_merkle_blk_rep: kyk_frame_queue_msgs failed");
+
+    for(i = 0; i < rep_count; i++){
+	kyk_free_ptl_msg(rep_list[i]);
+    }
+    free(rep_list);
+    kyk_free_partial_mkl(pmt);
+    free(matches);
+
+    return 0;
+
+error:
+    if(rep_list){
+	for(i = 0; i < rep_count; i++){
+	    kyk_free_ptl_msg(rep_list[i]);
+	}
+	free(rep_list);
+    }
+    if(pld) kyk_free_ptl_payload(pld);
+    if(pmt) kyk_free_partial_mkl(pmt);
+    if(matches) free(matches);
     return -1;
 }
 
-int kyk_ptl_reject_rep(int sockfd,
+/*
+ * SPV side of a filtered block: mrk_msg is the merkleblock received on sockfd,
+ * the matched txs follow it on the same socket.
+ * The header must hash to blk_hash, the one our header chain holds at that height,
+ * the partial merkle tree must rebuild its merkle root and every tx must be one of its matches.
+ * blk gets the header and only the matched txs, blk -> tx_count is 0 when nothing matched.
+ */
+int kyk_ptl_recv_merkle_blk(struct kyk_peer_conn* conn,
+			    const ptl_message* mrk_msg,
+			    const uint8_t* blk_hash,
+			    struct kyk_block* blk)
+{
+    struct kyk_blk_header* hd = NULL;
+    struct kyk_partial_mkl* pmt = NULL;
+    struct kyk_tx* tx_list = NULL;
+    ptl_message* tx_msg = NULL;
+    uint8_t* txids = NULL;
+    uint8_t root[MKL_NODE_BODY_LEN];
+    uint8_t txid[MKL_NODE_BODY_LEN];
+    uint8_t digest[32];
+    size_t match_count = 0;
+    size_t i = 0;
+    int res = -1;
+
+    check(conn, "Failed to kyk_ptl_recv_merkle_blk: conn is NULL");
+    check(mrk_msg, "Failed to kyk_ptl_recv_merkle_blk: mrk_msg is NULL");
+    check(blk_hash, "Failed to kyk_ptl_recv_merkle_blk: blk_hash is NULL");
+    check(blk, "Failed to kyk_ptl_recv_merkle_blk: blk is NULL");
+    check(blk -> hd == NULL, "Failed to kyk_ptl_recv_merkle_blk: blk -> hd should be NULL");
+
+    hd = calloc(1, sizeof(*hd));
+    check(hd, "Failed to kyk_ptl_recv_merkle_blk: hd calloc failed");
+
+    res = kyk_deseri_merkle_blk_msg(mrk_msg, hd, &pmt);
+    check(res == 0, "Failed to kyk_ptl_recv_merkle_blk: kyk_deseri_merkle_blk_msg failed");
+
+    res = kyk_blk_hash256(digest, hd);
+    check(res == 0, "Failed to kyk_ptl_recv_merkle_blk: kyk_blk_hash256 failed");
+    check(kyk_digest_eq(digest, blk_hash, sizeof(digest)), "Failed to kyk_ptl_recv_merkle_blk: header is not in our header chain");
+
+    res = kyk_partial_mkl_extract(pmt, root, &txids, &match_count);
+    check(res == 0, "Failed to kyk_ptl_recv_merkle_blk: kyk_partial_mkl_extract failed");
+    check(kyk_digest_eq(root, hd -> mrk_root_hash, sizeof(root)), "Failed to kyk_ptl_recv_merkle_blk: merkle root mismatched");
+
+    if(match_count > 0){
+	tx_list = calloc(match_count, sizeof(*tx_list));
+	check(tx_list, "Failed to kyk_ptl_recv_merkle_blk: tx_list calloc failed");
+    }
+
+    for(i = 0; i < match_count; i++){
+	res = kyk_peer_read(conn, &tx_msg);
+	check(res == 0, "Failed to kyk_ptl_recv_merkle_blk: kyk_peer_read failed");
+	check(strcmp(tx_msg -> cmd, KYK_MSG_TYPE_TX) == 0, "Failed to kyk_ptl_recv_merkle_blk: expected a tx message");
+
+	res = kyk_deseri_tx(tx_list + i, tx_msg -> pld -> data, NULL);
+	check(res == 0, "Failed to kyk_ptl_recv_merkle_blk: kyk_deseri_tx failed");
+
+	res = kyk_tx_hash256(txid, tx_list + i);
+	check(res == 0, "Failed to kyk_ptl_recv_merkle_blk: kyk_tx_hash256 failed");
+	check(kyk_digest_eq(txid, txids + i * MKL_NODE_BODY_LEN, sizeof(txid)), "Failed to kyk_ptl_recv_merkle_blk: tx is not in the merkle block");
+
+	kyk_free_ptl_msg(tx_msg);
+	tx_msg = NULL;
+    }
+
+    blk -> hd = hd;
+    blk -> tx_count = match_count;
+    blk -> tx = tx_list;
+
+    kyk_free_partial_mkl(pmt);
+    free(txids);
+
+    return 0;
+
+error:
+    if(tx_msg) kyk_free_ptl_msg(tx_msg);
+    if(tx_list){
+	for(i = 0; i < match_count; i++){
+	    if(tx_list[i].txin) kyk_free_txin_list(tx_list[i].txin, tx_list[i].vin_sz);
+	    if(tx_list[i].txout) kyk_free_txout_list(tx_list[i].txout, tx_list[i].vout_sz);
+	}
+	free(tx_list);
+    }
+    if(pmt) kyk_free_partial_mkl(pmt);
+    if(txids) free(txids);
+    if(hd) free(hd);
+    return -1;
+}
+
+int kyk_ptl_reject_rep(struct kyk_frame_queue* outq,
 		       uint8_t ccode,
 		       const char* message)
 {
@@ -237,7 +638,7 @@ int kyk_ptl_reject_rep(int sockfd,
     res = kyk_build_new_ptl_message(&rep_msg, KYK_MSG_TYPE_REJECT, NT_MAGIC_MAIN, pld);
     check(res == 0, "Failed to kyk_ptl_reject_rep: kyk_build_new_ptl_message failed");
 
-    res = kyk_reply_ptl_msg(sockfd, rep_msg);
+    res = kyk_reply_ptl_msg(outq, rep_msg);
     check(res == 0, "Failed to kyk_ptl_reject_rep: kyk_write_ptl_msg failed");
 
     kyk_free_var_str(msg);
@@ -252,9 +653,18 @@ error:
     return -1;
 }
 
-int kyk_ptl_tx_rep(int sockfd,
+/*
+ * utxo_chain is the spendable set the tx is checked against,
+ * NULL looks the txins up in the wallet's chainstate.
+ * new_blk gets the block mined with the tx on top of hd_chain, not stored yet,
+ * it is NULL when the tx was rejected.
+ */
+int kyk_ptl_tx_rep(struct kyk_frame_queue* outq,
 		   const ptl_message* req_msg,
-		   struct kyk_wallet* wallet)
+		   struct kyk_wallet* wallet,
+		   const struct kyk_blk_hd_chain* hd_chain,
+		   const struct kyk_utxo_chain* utxo_chain,
+		   struct kyk_block** new_blk)
 {
     struct kyk_tx* tx = NULL;
     struct kyk_utxo_list* utxo_list = NULL;
@@ -265,7 +675,9 @@ int kyk_ptl_tx_rep(int sockfd,
     check(wallet, "Failed to kyk_ptl_tx_rep: wallet is NULL");
     check(req_msg, "Failed to kyk_ptl_tx_rep: req_msg is NULL");
     check(req_msg -> pld, "Failed to kyk_ptl_tx_rep: req_msg -> pld is NULL");
+    check(new_blk, "Failed to kyk_ptl_tx_rep: new_blk is NULL");
 
+    *new_blk = NULL;
     pld = req_msg -> pld;
 
     tx = calloc(1, sizeof(*tx));
@@ -277,8 +689,12 @@ int kyk_ptl_tx_rep(int sockfd,
     utxo_list = calloc(1, sizeof(*utxo_list));
     check(utxo_list, "Failed to kyk_ptl_tx_rep: calloc failed");
 
-    res = kyk_wallet_find_utxo_list_for_tx(wallet, tx, utxo_list);
-    check(res == 0, "Failed to kyk_ptl_tx_rep: kyk_wallet_find_utxo_list_for_tx failed");
+    if(utxo_chain){
+	res = kyk_find_utxo_list_for_tx(utxo_chain, tx, utxo_list);
+    } else {
+	res = kyk_wallet_find_utxo_list_for_tx(wallet, tx, utxo_list);
+    }
+    check(res == 0, "Failed to kyk_ptl_tx_rep: find utxo list for tx failed");
 
     /* kyk_print_utxo_list(utxo_list); */
     /* printf("??????????????\n"); */
@@ -288,18 +704,26 @@ int kyk_ptl_tx_rep(int sockfd,
     res = kyk_validate_tx(tx, utxo_list -> data, utxo_list -> len);
     if(res == -1){
 	printf("Failed to validate tx \n");
-	kyk_ptl_reject_rep(sockfd, CC_REJECT_INVALID, "validate tx failed");
-	goto error;
+	res = kyk_ptl_reject_rep(outq, CC_REJECT_INVALID, "validate tx failed");
+	check(res == 0, "Failed to kyk_ptl_tx_rep: kyk_ptl_reject_rep failed");
+    } else {
+	printf("================== Mining Block\n");
+	res = kyk_wallet_mining_block(&blk, tx, utxo_list, wallet, hd_chain);
+	check(res == 0, "Failed to kyk_ptl_tx_rep: kyk_wallet_mining_block failed");
+	kyk_print_block(blk);
     }
 
-    printf("================== Mining Block\n");
-    kyk_wallet_mining_block(&blk, tx, utxo_list, wallet);
-    kyk_print_block(blk);
+    kyk_free_tx(tx);
+    kyk_free_utxo_list(utxo_list);
+
+    *new_blk = blk;
 
     return 0;
     
 error:
-
+    if(tx) kyk_free_tx(tx);
+    if(utxo_list) kyk_free_utxo_list(utxo_list);
+    if(blk) kyk_free_block(blk);
     return -1;
 }
 
@@ -5,30 +5,46 @@
 #include "kyk_socket.h"
 
 struct kyk_wallet;
+struct kyk_utxo_chain;
+struct kyk_block;
 
 int kyk_ptl_ping_req(const char* node,
 		     const char* service,
 		     ptl_message** rep_msg);
 
 
-int kyk_ptl_pong_rep(int sockfd, ptl_message* ptl_msg);
+int kyk_ptl_pong_rep(struct kyk_frame_queue* outq, ptl_message* ptl_msg);
 
-int kyk_ptl_version_rep(int sockfd, ptl_message* req_msg);
+int kyk_ptl_version_rep(struct kyk_frame_queue* outq, ptl_message* req_msg);
 
-int kyk_ptl_headers_rep(int sockfd,
+int kyk_ptl_locate_headers(const struct kyk_hd_index* hd_index,
+			   const ptl_gethder_entity* et,
+			   size_t* start,
+			   size_t* count);
+
+int kyk_ptl_headers_rep(struct kyk_frame_queue* outq,
 			const ptl_message* req_msg,
-			const struct kyk_blk_hd_chain* hd_chain);
+			const struct kyk_blk_hd_chain* hd_chain,
+			const struct kyk_hd_index* hd_index);
 
-int kyk_ptl_blk_rep(int sockfd,
+int kyk_ptl_blk_rep(struct kyk_frame_queue* outq,
 		    const ptl_message* req_msg,
 		    struct kyk_wallet* wallet);
 
-int kyk_ptl_reject_rep(int sockfd,
+int kyk_ptl_reject_rep(struct kyk_frame_queue* outq,
 		       uint8_t ccode,
 		       const char* message);
 
-int kyk_ptl_tx_rep(int sockfd,
+int kyk_ptl_recv_merkle_blk(struct kyk_peer_conn* conn,
+			    const ptl_message* mrk_msg,
+			    const uint8_t* blk_hash,
+			    struct kyk_block* blk);
+
+int kyk_ptl_tx_rep(struct kyk_frame_queue* outq,
 		   const ptl_message* req_msg,
-		   struct kyk_wallet* wallet);
+		   struct kyk_wallet* wallet,
+		   const struct kyk_blk_hd_chain* hd_chain,
+		   const struct kyk_utxo_chain* utxo_chain,
+		   struct kyk_block** new_blk);
 
 #endif
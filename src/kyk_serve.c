@@ -8,9 +8,12 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
-#include <sys/wait.h>
 #include <signal.h>
 #include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include "kyk_file.h"
 #include "kyk_block.h"
@@ -23,30 +26,294 @@
 #include "beej_pack.h"
 #include "kyk_protocol.h"
 #include "kyk_socket.h"
+#include "kyk_frame.h"
+#include "kyk_serve.h"
 #include "dbg.h"
 
 #define WALLET_NAME ".kyk_miner"
 
+#define SERVE_MAX_EVENTS  64
+
+/* larger frames are a broken or hostile peer, the connection is dropped */
+#define SERVE_MAX_PLD_LEN (32 * 1024 * 1024)
+
+/*
+ * One accepted peer, owned by the event loop that accepted it.
+ * While replies wait in outq the connection waits for EPOLLOUT and reads no more requests.
+ * While a tx is with the miner the frames after it wait in the ring,
+ * replies go out in the order the requests came.
+ */
+struct serve_conn {
+    int fd;
+    struct kyk_frame_ring* ring;
+    struct kyk_frame_queue* outq;
+    uint32_t events;              /* what the connection is registered for in epoll */
+    int jobs;                     /* mining jobs not back yet, the connection is freed after them */
+    int eof;                      /* the peer closed its side, it is dropped once its replies are out */
+    int closed;
+    char addr[INET6_ADDRSTRLEN];
+};
+
+/*
+ * Node state loaded once at startup and shared by all the event loops:
+ * the wallet (keys, config, the block index db handle and the chainstate over it)
+ * and the block header chain with its hash -> height index.
+ * Handlers that only read take the lock shared,
+ * the miner thread takes it exclusive only to store a mined block and swap in the longer chain.
+ */
+struct serve_node {
+    pthread_rwlock_t lock;
+    struct kyk_wallet* wallet;
+    struct kyk_blk_hd_chain* hd_chain;
+    struct kyk_hd_index* hd_index;
+};
+
+struct serve_loop;
+
+/*
+ * A tx handed to the miner thread.
+ * Its reply is collected in outq, a queue without a socket,
+ * and moved onto the connection's queue once the loop gets the job back.
+ */
+struct serve_job {
+    struct serve_job* next;
+    struct serve_loop* loop;
+    struct serve_conn* conn;
+    ptl_message* msg;
+    struct kyk_frame_queue* outq;
+    int res;
+};
+
+/* one thread mines the txs in the order they came, the chain only ever grows under it */
+struct serve_miner {
+    pthread_t tid;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    struct serve_job* head;
+    struct serve_job* tail;
+    int stop;
+    int started;
+};
+
+/* shared by all the event loops */
+struct serve_ctx {
+    const char* host;
+    const char* port;
+    int reuseport;
+    struct serve_node node;
+    struct serve_miner miner;
+};
+
+struct serve_loop {
+    pthread_t tid;
+    int listen_fd;
+    int epfd;
+    int wake_fd;                  /* eventfd, written when jobs are done or the loop has to stop */
+    pthread_mutex_t mtx;          /* guards done and stop */
+    struct serve_job* done;       /* jobs back from the miner, newest first */
+    int stop;
+    struct serve_ctx* ctx;
+};
+
 static int match_cmd(char *src, char *cmd);
-static void sigchld_handler(int s);
 static void *get_in_addr(struct sockaddr *sa);
 static int load_wallet(struct kyk_wallet** wallet);
+static int set_nonblocking(int fd);
+static int open_listener(const char* host, const char* port, int reuseport, int* listen_fd);
+static int serve_loop_init(struct serve_loop* loop, struct serve_ctx* ctx);
+static void* serve_loop_run(void* arg);
+static void serve_loop_post(struct serve_loop* loop, struct serve_job* job);
+static void serve_loop_stop(struct serve_loop* loop);
+static int serve_loop_collect(struct serve_loop* loop);
+static void serve_loop_free(struct serve_loop* loop);
+static void serve_shutdown(struct serve_ctx* ctx, struct serve_loop* loops, int opened, int started);
+static int serve_accept(struct serve_loop* loop);
+static void serve_conn_event(struct serve_loop* loop, struct serve_conn* conn, uint32_t events);
+static int serve_conn_read(struct serve_loop* loop, struct serve_conn* conn);
+static int serve_conn_consume(struct serve_loop* loop, struct serve_conn* conn);
+static int serve_conn_arm(struct serve_loop* loop, struct serve_conn* conn);
+static void serve_conn_close(struct serve_loop* loop, struct serve_conn* conn);
+static void serve_conn_free(struct serve_conn* conn);
+static int serve_dispatch(struct serve_loop* loop, struct serve_conn* conn, ptl_message* msg);
+static int serve_miner_start(struct serve_ctx* ctx);
+static int serve_miner_submit(struct serve_loop* loop, struct serve_conn* conn, const ptl_message* msg);
+static void* serve_miner_run(void* arg);
+static int serve_mine(struct serve_node* node, struct serve_job* job);
+static void serve_job_finish(struct serve_loop* loop, struct serve_job* job);
+static void serve_miner_stop(struct serve_miner* miner);
+static void serve_free_job(struct serve_job* job);
+static int serve_node_load(struct serve_node* node);
+static int serve_node_load_chains(struct serve_node* node);
+static void serve_node_free(struct serve_node* node);
 
 
 int kyk_start_serve(const char* host, const char* port)
 {
-    int sockfd, new_fd;                   /* listen on sock_fd, new connection on new_fd */
+    return kyk_start_serve_mt(host, port, 1);
+}
+
+/*
+ * Serve peers on thread_num event loops.
+ * Every loop owns an epoll instance and its own listening socket bound with SO_REUSEPORT,
+ * so the kernel spreads new connections over the loops and a connection never changes thread.
+ * A connection stays open for as many messages as the peer sends.
+ * Txs are mined on a thread of their own, the loops never wait for a block.
+ */
+int kyk_start_serve_mt(const char* host, const char* port, int thread_num)
+{
+    struct serve_ctx ctx;
+    struct serve_loop* loops = NULL;
+    int loaded = 0;
+    int opened = 0;
+    int started = 0;
+    int i = 0;
+    int res = -1;
+
+    check(host, "Failed to kyk_start_serve_mt: host is NULL");
+    check(port, "Failed to kyk_start_serve_mt: port is NULL");
+
+    if(thread_num <= KYK_SERVE_THREADS_AUTO){
+	thread_num = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    if(thread_num < 1){
+	thread_num = 1;
+    }
+
+    if(thread_num > KYK_SERVE_MAX_THREADS){
+	thread_num = KYK_SERVE_MAX_THREADS;
+    }
+
+    /* a peer closing early must not kill the whole server */
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.host = host;
+    ctx.port = port;
+    ctx.reuseport = thread_num > 1;
+
+    res = serve_node_load(&ctx.node);
+    check(res == 0, "Failed to kyk_start_serve_mt: serve_node_load failed");
+    loaded = 1;
+
+    loops = calloc(thread_num, sizeof(*loops));
+    check(loops, "Failed to kyk_start_serve_mt: loops calloc failed");
+
+    for(i = 0; i < thread_num; i++){
+	res = serve_loop_init(loops + i, &ctx);
+	check(res == 0, "Failed to kyk_start_serve_mt: serve_loop_init failed");
+	opened++;
+    }
+
+    res = serve_miner_start(&ctx);
+    check(res == 0, "Failed to kyk_start_serve_mt: serve_miner_start failed");
+
+    printf("server: waiting for connections in %s:%s on %d event loop(s)\n", host, port, thread_num);
+
+    for(i = 1; i < thread_num; i++){
+	res = pthread_create(&loops[i].tid, NULL, serve_loop_run, loops + i);
+	check(res == 0, "Failed to kyk_start_serve_mt: pthread_create failed");
+	started++;
+    }
+
+    /* the calling thread runs the first loop */
+    serve_loop_run(loops);
+
+    serve_shutdown(&ctx, loops, opened, started);
+
+    return 0;
+
+error:
+    if(loaded) serve_shutdown(&ctx, loops, opened, started);
+    return -1;
+}
+
+/* stop and join the loop threads, then the miner, and release the loops and the node */
+void serve_shutdown(struct serve_ctx* ctx, struct serve_loop* loops, int opened, int started)
+{
+    int i = 0;
+
+    for(i = 1; i <= started; i++){
+	serve_loop_stop(loops + i);
+	pthread_join(loops[i].tid, NULL);
+    }
+
+    serve_miner_stop(&ctx -> miner);
+
+    for(i = 0; i < opened; i++){
+	serve_loop_free(loops + i);
+    }
+
+    if(loops) free(loops);
+    serve_node_free(&ctx -> node);
+}
+
+/* the listening socket and the eventfd the miner wakes the loop with */
+int serve_loop_init(struct serve_loop* loop, struct serve_ctx* ctx)
+{
+    int res = -1;
+
+    loop -> ctx = ctx;
+    loop -> listen_fd = -1;
+    loop -> epfd = -1;
+    loop -> wake_fd = -1;
+
+    res = open_listener(ctx -> host, ctx -> port, ctx -> reuseport, &loop -> listen_fd);
+    check(res == 0, "Failed to serve_loop_init: open_listener failed");
+
+    loop -> wake_fd = eventfd(0, EFD_NONBLOCK);
+    check(loop -> wake_fd != -1, "Failed to serve_loop_init: eventfd failed");
+
+    res = pthread_mutex_init(&loop -> mtx, NULL);
+    check(res == 0, "Failed to serve_loop_init: pthread_mutex_init failed");
+
+    return 0;
+
+error:
+    if(loop -> listen_fd != -1) close(loop -> listen_fd);
+    if(loop -> wake_fd != -1) close(loop -> wake_fd);
+    return -1;
+}
+
+void serve_loop_free(struct serve_loop* loop)
+{
+    struct serve_job* job = NULL;
+
+    /* the connections of a stopped loop are gone with the process, only the jobs are released */
+    while(loop -> done){
+	job = loop -> done;
+	loop -> done = job -> next;
+	serve_free_job(job);
+    }
+
+    close(loop -> listen_fd);
+    close(loop -> wake_fd);
+    pthread_mutex_destroy(&loop -> mtx);
+}
+
+int set_nonblocking(int fd)
+{
+    int flags = 0;
+
+    flags = fcntl(fd, F_GETFL, 0);
+    check(flags != -1, "Failed to set_nonblocking: fcntl F_GETFL failed");
+
+    flags = fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    check(flags != -1, "Failed to set_nonblocking: fcntl F_SETFL failed");
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+int open_listener(const char* host, const char* port, int reuseport, int* listen_fd)
+{
     struct addrinfo hints, *servinfo, *p;
-    struct sockaddr_storage their_addr;   /* connector's address information */
-    socklen_t sin_size;
-    struct sigaction sa;
-    int yes=1;
-    char s[INET6_ADDRSTRLEN];
+    int sockfd = -1;
+    int yes = 1;
     int rv;
-    ptl_message* msg = NULL;
-    struct kyk_blk_hd_chain* hd_chain = NULL;
-    struct kyk_wallet* wallet = NULL;
-    int res = -1;
 
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
@@ -55,7 +322,7 @@ int kyk_start_serve(const char* host, const char* port)
 
     if ((rv = getaddrinfo(host, port, &hints, &servinfo)) != 0) {
 	fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-	return 1;
+	return -1;
     }
 
     /* Loop through all the results and bind to the first we can */
@@ -70,7 +337,15 @@ int kyk_start_serve(const char* host, const char* port)
 	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes,
 		       sizeof(int)) == -1) {
 	    perror("setsockopt");
-	    exit(1);
+	    close(sockfd);
+	    continue;
+	}
+
+	if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes,
+				    sizeof(int)) == -1) {
+	    perror("setsockopt SO_REUSEPORT");
+	    close(sockfd);
+	    continue;
 	}
 
 	if (bind(sockfd, p -> ai_addr, p -> ai_addrlen) == -1) {
@@ -86,73 +361,235 @@ int kyk_start_serve(const char* host, const char* port)
 
     if (p == NULL)  {
 	fprintf(stderr, "server: failed to bind\n");
-	exit(1);
+	return -1;
     }
 
     if (listen(sockfd, KYK_SERVE_BACKLOG) == -1) {
 	perror("listen");
-	exit(1);
+	close(sockfd);
+	return -1;
     }
 
-    sa.sa_handler = sigchld_handler; /* reap all dead processes */
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
-    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
-	perror("sigaction");
-	exit(1);
+    if (set_nonblocking(sockfd) == -1) {
+	close(sockfd);
+	return -1;
+    }
+
+    *listen_fd = sockfd;
+
+    return 0;
+}
+
+void* serve_loop_run(void* arg)
+{
+    struct serve_loop* loop = arg;
+    struct serve_conn* conn = NULL;
+    struct epoll_event ev;
+    struct epoll_event events[SERVE_MAX_EVENTS];
+    int woken = 0;
+    int stop = 0;
+    int nfds = 0;
+    int i = 0;
+    int res = -1;
+
+    loop -> epfd = epoll_create1(0);
+    check(loop -> epfd != -1, "Failed to serve_loop_run: epoll_create1 failed");
+
+    /* the listener is the only entry without a connection */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    res = epoll_ctl(loop -> epfd, EPOLL_CTL_ADD, loop -> listen_fd, &ev);
+    check(res == 0, "Failed to serve_loop_run: epoll_ctl failed");
+
+    /* and the eventfd is the one registered with the loop itself */
+    ev.events = EPOLLIN;
+    ev.data.ptr = loop;
+    res = epoll_ctl(loop -> epfd, EPOLL_CTL_ADD, loop -> wake_fd, &ev);
+    check(res == 0, "Failed to serve_loop_run: epoll_ctl failed");
+
+    while(!stop){
+	nfds = epoll_wait(loop -> epfd, events, SERVE_MAX_EVENTS, -1);
+	if(nfds == -1){
+	    if(errno == EINTR) continue;
+	    perror("epoll_wait");
+	    break;
+	}
+
+	woken = 0;
+	for(i = 0; i < nfds; i++){
+	    conn = events[i].data.ptr;
+	    if(conn == NULL){
+		serve_accept(loop);
+		continue;
+	    }
+
+	    if(events[i].data.ptr == loop){
+		woken = 1;
+		continue;
+	    }
+
+	    serve_conn_event(loop, conn, events[i].events);
+	}
+
+	/* after the events, a job can close a connection that has one in this batch */
+	if(woken){
+	    stop = serve_loop_collect(loop);
+	}
     }
 
-    printf("server: waiting for connections in %s:%s\n", host, port);
+    close(loop -> epfd);
+
+    return NULL;
 
-    while(1) {  /* main accept() loop */
+error:
+    if(loop -> epfd != -1) close(loop -> epfd);
+    return NULL;
+}
+
+int serve_accept(struct serve_loop* loop)
+{
+    struct sockaddr_storage their_addr;   /* connector's address information */
+    struct serve_conn* conn = NULL;
+    struct epoll_event ev;
+    socklen_t sin_size;
+    int new_fd = -1;
+
+    while(1){
 	sin_size = sizeof their_addr;
-	new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
+	new_fd = accept(loop -> listen_fd, (struct sockaddr *)&their_addr, &sin_size);
 	if (new_fd == -1) {
-	    perror("accept");
+	    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+		perror("accept");
+	    }
+	    break;
+	}
+
+	if(set_nonblocking(new_fd) == -1){
+	    close(new_fd);
+	    continue;
+	}
+
+	conn = calloc(1, sizeof(*conn));
+	if(conn == NULL){
+	    close(new_fd);
 	    continue;
 	}
 
-	/* convert IPv4 and IPv6 addresses from binary to text form, s will store the converted result */
+	conn -> fd = new_fd;
+	conn -> events = EPOLLIN | EPOLLRDHUP;
+	if(kyk_new_frame_ring(&conn -> ring, KYK_FRAME_RING_SIZE, SERVE_MAX_PLD_LEN) != 0 ||
+	   kyk_new_frame_queue(&conn -> outq, new_fd, KYK_FRAME_QUEUE_MAX) != 0){
+	    close(new_fd);
+	    serve_conn_free(conn);
+	    continue;
+	}
+
+	/* convert IPv4 and IPv6 addresses from binary to text form */
 	inet_ntop(their_addr.ss_family,
 		  get_in_addr((struct sockaddr *)&their_addr),
-		  s, sizeof s);
-	printf("server: got connection from %s\n", s);
-
-	if (!fork()) {     /* this is the child process */
-	    close(sockfd); /* child doesn't need the listener */
-	    res = kyk_recv_ptl_msg(new_fd, &msg, KYK_PL_BUF_SIZE, NULL);
-	    
-	    if (res == -1){
-		perror("recv");
-	    } else {
-		kyk_print_ptl_message(msg);
-		if(match_cmd(msg -> cmd, KYK_MSG_TYPE_PING)){
-		    res = kyk_ptl_pong_rep(new_fd, msg);
-		    if(res == -1) perror("send");
-		} else if(match_cmd(msg -> cmd, KYK_MSG_TYPE_VERSION)){
-		    res = kyk_ptl_version_rep(new_fd, msg);
-		    if(res == -1) perror("send");
-		} else if(match_cmd(msg -> cmd, KYK_MSG_TYPE_GETHEADERS)){
-		    res = load_wallet(&wallet);
-		    res = kyk_load_blk_header_chain(&hd_chain, wallet);
-		    check(res == 0, "Failed to kyk_load_blk_header_chain");
-		    res = kyk_ptl_headers_rep(new_fd, msg, hd_chain);
-		    /* check(res == 0, "Failed to kyk_ptl_headers_rep"); */
-		} else if(match_cmd(msg -> cmd, KYK_MSG_TYPE_GETDATA)){
-		    load_wallet(&wallet);
-		    res = kyk_ptl_blk_rep(new_fd, msg, wallet);
-		    /* check(res == 0, "Failed to kyk_ptl_blk_rep"); */
-		} else if(match_cmd(msg -> cmd, KYK_MSG_TYPE_TX)){
-		    load_wallet(&wallet);
-		    res = kyk_ptl_tx_rep(new_fd, msg, wallet);
-		} else {
-		}
-	    }
-	    
+		  conn -> addr, sizeof conn -> addr);
+	printf("server: got connection from %s\n", conn -> addr);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = conn -> events;
+	ev.data.ptr = conn;
+	if(epoll_ctl(loop -> epfd, EPOLL_CTL_ADD, new_fd, &ev) == -1){
+	    perror("epoll_ctl");
 	    close(new_fd);
-	    exit(0);
+	    serve_conn_free(conn);
+	}
+    }
+
+    return 0;
+}
+
+/* queued replies go out first, requests are only read once they are all out */
+void serve_conn_event(struct serve_loop* loop, struct serve_conn* conn, uint32_t events)
+{
+    int res = 0;
+
+    if(events & EPOLLOUT){
+	res = kyk_frame_queue_flush(conn -> outq);
+    } else if(events & EPOLLIN){
+	res = serve_conn_read(loop, conn);
+    } else if(events & (EPOLLERR | EPOLLHUP)){
+	res = -1;
+    }
+
+    if(res == 0){
+	res = serve_conn_arm(loop, conn);
+    }
+
+    if(res != 0){
+	serve_conn_close(loop, conn);
+    }
+}
+
+/*
+ * Drain the socket, every complete frame is dispatched as soon as it is in.
+ * Reading stops once a reply has to wait in the queue or a tx is with the miner,
+ * the rest stays in the socket.
+ */
+int serve_conn_read(struct serve_loop* loop, struct serve_conn* conn)
+{
+    ssize_t n = 0;
+    int res = -1;
+
+    while(kyk_frame_queue_pending(conn -> outq) == 0 && conn -> jobs == 0){
+	res = kyk_frame_ring_recv(conn -> ring, conn -> fd, &n);
+	check(res == 0, "Failed to serve_conn_read: kyk_frame_ring_recv failed");
+
+	if(n == 0){
+	    /* peer closed, frames already buffered are still served and answered */
+	    conn -> eof = 1;
+	    res = serve_conn_consume(loop, conn);
+	    check(res == 0, "Failed to serve_conn_read: serve_conn_consume failed");
+	    break;
+	}
+
+	if(n == -1){
+	    if(errno == EINTR) continue;
+	    if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+	    perror("recv");
+	    return -1;
+	}
+
+	res = serve_conn_consume(loop, conn);
+	check(res == 0, "Failed to serve_conn_read: serve_conn_consume failed");
+    }
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/*
+ * The handlers get a message borrowing the payload from the ring, nothing is copied.
+ * A tx stops the dispatch, the frames after it are dispatched once its reply is queued.
+ */
+int serve_conn_consume(struct serve_loop* loop, struct serve_conn* conn)
+{
+    struct kyk_frame frame;
+    ptl_message msg;
+    ptl_payload pld;
+    int ready = 0;
+    int res = -1;
+
+    while(conn -> jobs == 0){
+	res = kyk_frame_ring_next(conn -> ring, &frame, &ready);
+	check(res == 0, "Failed to serve_conn_consume: kyk_frame_ring_next failed");
+
+	if(!ready){
+	    break;
 	}
-	close(new_fd);  // parent doesn't need this
+
+	kyk_frame_to_msg_view(&msg, &pld, &frame);
+	res = serve_dispatch(loop, conn, &msg);
+	kyk_frame_ring_consume(conn -> ring, &frame);
+	check(res == 0, "Failed to serve_conn_consume: serve_dispatch failed");
     }
 
     return 0;
@@ -160,18 +597,411 @@ int kyk_start_serve(const char* host, const char* port)
 error:
 
     return -1;
+}
+
+/*
+ * EPOLLOUT while replies are queued, nothing but errors while a tx is with the miner
+ * or the peer has closed, EPOLLIN once the replies are all out.
+ * A closed peer with nothing left to send is done, -1 has the caller drop it.
+ */
+int serve_conn_arm(struct serve_loop* loop, struct serve_conn* conn)
+{
+    struct epoll_event ev;
+    uint32_t events = 0;
+    int res = -1;
+
+    if(conn -> eof && conn -> jobs == 0 && kyk_frame_queue_pending(conn -> outq) == 0){
+	return -1;
+    }
+
+    if(kyk_frame_queue_pending(conn -> outq) > 0){
+	events = EPOLLOUT;
+    } else if(conn -> jobs > 0){
+	events = 0;
+    } else {
+	events = EPOLLIN | EPOLLRDHUP;
+    }
+
+    if(events == conn -> events){
+	return 0;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = conn;
+    res = epoll_ctl(loop -> epfd, EPOLL_CTL_MOD, conn -> fd, &ev);
+    check(res == 0, "Failed to serve_conn_arm: epoll_ctl failed");
+
+    conn -> events = events;
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* a connection still waiting for mining jobs is freed when the last one is back */
+void serve_conn_close(struct serve_loop* loop, struct serve_conn* conn)
+{
+    epoll_ctl(loop -> epfd, EPOLL_CTL_DEL, conn -> fd, NULL);
+    close(conn -> fd);
+    conn -> closed = 1;
+
+    if(conn -> jobs == 0){
+	serve_conn_free(conn);
+    }
+}
+
+void serve_conn_free(struct serve_conn* conn)
+{
+    if(conn -> ring) kyk_free_frame_ring(conn -> ring);
+    if(conn -> outq) kyk_free_frame_queue(conn -> outq);
+    free(conn);
+}
+
+int serve_dispatch(struct serve_loop* loop, struct serve_conn* conn, ptl_message* msg)
+{
+    struct serve_node* node = &loop -> ctx -> node;
+    int res = 0;
+
+    kyk_print_ptl_message(msg);
+
+    if(match_cmd(msg -> cmd, KYK_MSG_TYPE_PING)){
+	res = kyk_ptl_pong_rep(conn -> outq, msg);
+    } else if(match_cmd(msg -> cmd, KYK_MSG_TYPE_VERSION)){
+	res = kyk_ptl_version_rep(conn -> outq, msg);
+    } else if(match_cmd(msg -> cmd, KYK_MSG_TYPE_GETHEADERS)){
+	pthread_rwlock_rdlock(&node -> lock);
+	res = kyk_ptl_headers_rep(conn -> outq, msg, node -> hd_chain, node -> hd_index);
+	pthread_rwlock_unlock(&node -> lock);
+    } else if(match_cmd(msg -> cmd, KYK_MSG_TYPE_GETDATA)){
+	pthread_rwlock_rdlock(&node -> lock);
+	res = kyk_ptl_blk_rep(conn -> outq, msg, node -> wallet);
+	pthread_rwlock_unlock(&node -> lock);
+    } else if(match_cmd(msg -> cmd, KYK_MSG_TYPE_TX)){
+	res = serve_miner_submit(loop, conn, msg);
+    }
+
+    return res;
+}
+
+/* the loop reads the eventfd and takes the jobs the miner is done with */
+int serve_loop_collect(struct serve_loop* loop)
+{
+    struct serve_job* done = NULL;
+    struct serve_job* ordered = NULL;
+    struct serve_job* job = NULL;
+    uint64_t count = 0;
+    int stop = 0;
+
+    while(read(loop -> wake_fd, &count, sizeof(count)) == -1 && errno == EINTR);
 
+    pthread_mutex_lock(&loop -> mtx);
+    done = loop -> done;
+    loop -> done = NULL;
+    stop = loop -> stop;
+    pthread_mutex_unlock(&loop -> mtx);
+
+    /* replies to one connection go out in the order its txs came */
+    while(done){
+	job = done;
+	done = job -> next;
+	job -> next = ordered;
+	ordered = job;
+    }
+
+    while(ordered){
+	job = ordered;
+	ordered = job -> next;
+	serve_job_finish(loop, job);
+    }
+
+    return stop;
 }
 
+void serve_loop_post(struct serve_loop* loop, struct serve_job* job)
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&loop -> mtx);
+    job -> next = loop -> done;
+    loop -> done = job;
+    pthread_mutex_unlock(&loop -> mtx);
+
+    while(write(loop -> wake_fd, &one, sizeof(one)) == -1 && errno == EINTR);
+}
+
+void serve_loop_stop(struct serve_loop* loop)
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&loop -> mtx);
+    loop -> stop = 1;
+    pthread_mutex_unlock(&loop -> mtx);
+
+    while(write(loop -> wake_fd, &one, sizeof(one)) == -1 && errno == EINTR);
+}
+
+/* a failed job drops the connection like a failed handler does */
+void serve_job_finish(struct serve_loop* loop, struct serve_job* job)
+{
+    struct serve_conn* conn = job -> conn;
+    int res = job -> res;
+
+    conn -> jobs--;
+
+    if(conn -> closed){
+	if(conn -> jobs == 0) serve_conn_free(conn);
+	serve_free_job(job);
+	return;
+    }
+
+    if(res == 0){
+	res = kyk_frame_queue_move(conn -> outq, job -> outq);
+    }
+
+    /* the frames that came after the tx go on behind its reply */
+    if(res == 0){
+	res = serve_conn_consume(loop, conn);
+    }
+
+    if(res == 0){
+	res = serve_conn_arm(loop, conn);
+    }
+
+    if(res != 0){
+	serve_conn_close(loop, conn);
+    }
 
-void sigchld_handler(int s)
+    serve_free_job(job);
+}
+
+int serve_miner_start(struct serve_ctx* ctx)
 {
-    // waitpid() might overwrite errno, so we save and restore it:
-    int saved_errno = errno;
+    struct serve_miner* miner = &ctx -> miner;
+    int res = -1;
+
+    res = pthread_mutex_init(&miner -> mtx, NULL);
+    check(res == 0, "Failed to serve_miner_start: pthread_mutex_init failed");
+
+    res = pthread_cond_init(&miner -> cond, NULL);
+    check(res == 0, "Failed to serve_miner_start: pthread_cond_init failed");
 
-    while(waitpid(-1, NULL, WNOHANG) > 0);
+    res = pthread_create(&miner -> tid, NULL, serve_miner_run, ctx);
+    check(res == 0, "Failed to serve_miner_start: pthread_create failed");
 
-    errno = saved_errno;
+    miner -> started = 1;
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* the tx is copied out of the ring, the connection is kept until the job is back */
+int serve_miner_submit(struct serve_loop* loop, struct serve_conn* conn, const ptl_message* msg)
+{
+    struct serve_miner* miner = &loop -> ctx -> miner;
+    struct serve_job* job = NULL;
+    int res = -1;
+
+    job = calloc(1, sizeof(*job));
+    check(job, "Failed to serve_miner_submit: job calloc failed");
+
+    job -> msg = calloc(1, sizeof(*job -> msg));
+    check(job -> msg, "Failed to serve_miner_submit: msg calloc failed");
+
+    *job -> msg = *msg;
+    job -> msg -> pld = NULL;
+    res = kyk_copy_new_ptl_payload(&job -> msg -> pld, msg -> pld);
+    check(res == 0, "Failed to serve_miner_submit: kyk_copy_new_ptl_payload failed");
+
+    res = kyk_new_frame_queue(&job -> outq, -1, KYK_FRAME_QUEUE_MAX);
+    check(res == 0, "Failed to serve_miner_submit: kyk_new_frame_queue failed");
+
+    job -> loop = loop;
+    job -> conn = conn;
+    conn -> jobs++;
+
+    pthread_mutex_lock(&miner -> mtx);
+    if(miner -> tail){
+	miner -> tail -> next = job;
+    } else {
+	miner -> head = job;
+    }
+    miner -> tail = job;
+    pthread_cond_signal(&miner -> cond);
+    pthread_mutex_unlock(&miner -> mtx);
+
+    return 0;
+
+error:
+    if(job) serve_free_job(job);
+    return -1;
+}
+
+void* serve_miner_run(void* arg)
+{
+    struct serve_ctx* ctx = arg;
+    struct serve_miner* miner = &ctx -> miner;
+    struct serve_job* job = NULL;
+
+    while(1){
+	pthread_mutex_lock(&miner -> mtx);
+	while(miner -> head == NULL && !miner -> stop){
+	    pthread_cond_wait(&miner -> cond, &miner -> mtx);
+	}
+
+	if(miner -> stop){
+	    pthread_mutex_unlock(&miner -> mtx);
+	    break;
+	}
+
+	job = miner -> head;
+	miner -> head = job -> next;
+	if(miner -> head == NULL){
+	    miner -> tail = NULL;
+	}
+	pthread_mutex_unlock(&miner -> mtx);
+
+	job -> next = NULL;
+	job -> res = serve_mine(&ctx -> node, job);
+	serve_loop_post(job -> loop, job);
+    }
+
+    return NULL;
+}
+
+/*
+ * The tx is checked and mined on top of the node's chain without the lock,
+ * no other thread changes the chain.
+ * The lock is only taken exclusive to store the block and append its header
+ * to the chain and the index in place.
+ */
+int serve_mine(struct serve_node* node, struct serve_job* job)
+{
+    struct kyk_block* blk = NULL;
+    int res = -1;
+
+    res = kyk_ptl_tx_rep(job -> outq, job -> msg, node -> wallet, node -> hd_chain, NULL, &blk);
+    check(res == 0, "Failed to serve_mine: kyk_ptl_tx_rep failed");
+
+    if(blk == NULL){
+	/* rejected, the reply says why */
+	return 0;
+    }
+
+    pthread_rwlock_wrlock(&node -> lock);
+    res = kyk_wallet_connect_block(node -> wallet, blk);
+    if(res == 0){
+	res = kyk_append_blk_hd_chain(node -> hd_chain, blk -> hd, 1);
+    }
+    if(res == 0){
+	res = kyk_hd_index_append(node -> hd_index, blk -> hd);
+    }
+    pthread_rwlock_unlock(&node -> lock);
+    check(res == 0, "Failed to serve_mine: storing the block failed");
+
+    kyk_free_block(blk);
+
+    return 0;
+
+error:
+    if(blk) kyk_free_block(blk);
+    return -1;
+}
+
+/* jobs not mined yet are dropped, their loops are stopped already */
+void serve_miner_stop(struct serve_miner* miner)
+{
+    struct serve_job* job = NULL;
+
+    if(!miner -> started){
+	return;
+    }
+
+    pthread_mutex_lock(&miner -> mtx);
+    miner -> stop = 1;
+    pthread_cond_signal(&miner -> cond);
+    pthread_mutex_unlock(&miner -> mtx);
+
+    pthread_join(miner -> tid, NULL);
+
+    while(miner -> head){
+	job = miner -> head;
+	miner -> head = job -> next;
+	serve_free_job(job);
+    }
+    miner -> tail = NULL;
+
+    pthread_cond_destroy(&miner -> cond);
+    pthread_mutex_destroy(&miner -> mtx);
+    miner -> started = 0;
+}
+
+void serve_free_job(struct serve_job* job)
+{
+    if(job -> msg) kyk_free_ptl_msg(job -> msg);
+    if(job -> outq) kyk_free_frame_queue(job -> outq);
+    free(job);
+}
+
+int serve_node_load(struct serve_node* node)
+{
+    int res = -1;
+
+    res = pthread_rwlock_init(&node -> lock, NULL);
+    check(res == 0, "Failed to serve_node_load: pthread_rwlock_init failed");
+
+    res = load_wallet(&node -> wallet);
+    check(res == 0, "Failed to serve_node_load: load_wallet failed");
+    check(node -> wallet, "Failed to serve_node_load: wallet is not found, please init the wallet first");
+
+    res = serve_node_load_chains(node);
+    check(res == 0, "Failed to serve_node_load: serve_node_load_chains failed");
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* read the header chain from the wallet files, mined blocks extend it in place after that */
+int serve_node_load_chains(struct serve_node* node)
+{
+    struct kyk_blk_hd_chain* hd_chain = NULL;
+    struct kyk_hd_index* hd_index = NULL;
+    int res = -1;
+
+    res = kyk_load_blk_header_chain(&hd_chain, node -> wallet);
+    check(res == 0, "Failed to serve_node_load_chains: kyk_load_blk_header_chain failed");
+
+    res = kyk_new_hd_index(&hd_index, hd_chain);
+    check(res == 0, "Failed to serve_node_load_chains: kyk_new_hd_index failed");
+
+    if(node -> hd_chain) kyk_free_blk_hd_chain(node -> hd_chain);
+    if(node -> hd_index) kyk_free_hd_index(node -> hd_index);
+
+    node -> hd_chain = hd_chain;
+    node -> hd_index = hd_index;
+
+    return 0;
+
+error:
+    if(hd_chain) kyk_free_blk_hd_chain(hd_chain);
+    if(hd_index) kyk_free_hd_index(hd_index);
+    return -1;
+}
+
+void serve_node_free(struct serve_node* node)
+{
+    if(node -> hd_chain) kyk_free_blk_hd_chain(node -> hd_chain);
+    if(node -> hd_index) kyk_free_hd_index(node -> hd_index);
+    if(node -> wallet) kyk_destroy_wallet(node -> wallet);
+    pthread_rwlock_destroy(&node -> lock);
 }
 
 
@@ -3,6 +3,11 @@
 
 #include "kyk_defs.h"
 
+/* 0 means one event loop per online CPU */
+#define KYK_SERVE_THREADS_AUTO 0
+#define KYK_SERVE_MAX_THREADS  64
+
 int kyk_start_serve(const char* host, const char* port);
+int kyk_start_serve_mt(const char* host, const char* port, int thread_num);
 
 #endif
@@ -3,18 +3,15 @@
 #include <stdlib.h>
 #include "kyk_defs.h"
 #include "kyk_sha.h"
+#include "kyk_utils.h"
 #include "dbg.h"
 
 unsigned char * kyk_sha256(const char *str, size_t len)
 {
     unsigned char *dgst;
-    SHA256_CTX ctx;
 
     dgst = (unsigned char*)malloc(SHA256_DIGEST_LENGTH * sizeof(unsigned char));
-    
-    SHA256_Init(&ctx);
-    SHA256_Update(&ctx, (unsigned char*)str, len);
-    SHA256_Final(dgst, &ctx);
+    kyk_dgst_sha256(dgst, (const uint8_t*)str, len);
 
     return dgst;
 }
@@ -22,15 +19,12 @@ unsigned char * kyk_sha256(const char *str, size_t len)
 
 unsigned char * kyk_dble_sha256(const char *str, size_t len)
 {
-    unsigned char *dg1;
-    unsigned char *dg2;
-    
-    dg1 = kyk_sha256(str, len);
-    dg2 = kyk_sha256((char *)dg1, SHA256_DIGEST_LENGTH);
-    
-    free(dg1);
+    unsigned char *dgst;
 
-    return dg2;
+    dgst = (unsigned char*)malloc(SHA256_DIGEST_LENGTH * sizeof(unsigned char));
+    kyk_dgst_hash256(dgst, (const uint8_t*)str, len);
+
+    return dgst;
 }
 
 int kyk_hash256(uint256* digest, const uint8_t* buf, size_t len)
@@ -58,11 +52,9 @@ void kyk_dgst_rmd160(uint8_t *digest, const uint8_t *message, size_t len)
 /* inverted hash*/
 struct kyk_digst *kyk_inver_hash(const char *src, size_t len)
 {
-    unsigned char *dg;
     struct kyk_digst *ivhash;
     size_t dg_len = SHA256_DIGEST_LENGTH;
 
-    dg = kyk_dble_sha256(src, len);
     ivhash = (struct kyk_digst*) malloc(sizeof(struct kyk_digst));
     ivhash -> len = dg_len;
     ivhash -> body = (unsigned char*)malloc(dg_len * sizeof(unsigned char));
@@ -72,12 +64,7 @@ struct kyk_digst *kyk_inver_hash(const char *src, size_t len)
 	exit(1);
     }
 
-    for(int i=dg_len -1; i >= 0; i--){
-	ivhash->body[dg_len - 1 - i] = dg[i];
-    }
-
-
-    free(dg);
+    kyk_dgst_hash256_rev(ivhash -> body, (const uint8_t*)src, len);
 
     return ivhash;
 }
@@ -104,6 +91,32 @@ void kyk_dgst_hash160(uint8_t *digest, const uint8_t *message, size_t len)
     kyk_dgst_rmd160(digest, tmp, SHA256_DIGEST_LENGTH);
 }
 
+/* hash256 in the reversed (display) byte order used for txids and block hashes */
+void kyk_dgst_hash256_rev(uint8_t *digest, const uint8_t *message, size_t len)
+{
+    kyk_dgst_hash256(digest, message, len);
+    kyk_reverse(digest, SHA256_DIGEST_LENGTH);
+}
+
+void kyk_hash256_init(struct kyk_hash256_ctx *ctx)
+{
+    SHA256_Init(&ctx -> sha);
+}
+
+void kyk_hash256_update(struct kyk_hash256_ctx *ctx, const void *data, size_t len)
+{
+    SHA256_Update(&ctx -> sha, data, len);
+}
+
+/* digest is in the same byte order as kyk_dgst_hash256 */
+void kyk_hash256_final(struct kyk_hash256_ctx *ctx, uint8_t *digest)
+{
+    uint8_t tmp[SHA256_DIGEST_LENGTH];
+
+    SHA256_Final(tmp, &ctx -> sha);
+    kyk_dgst_sha256(digest, tmp, sizeof(tmp));
+}
+
 void kyk_free_digst(struct kyk_digst *dg)
 {
     if(dg != NULL){
@@ -11,6 +11,15 @@ struct kyk_digst{
     unsigned char *body;
 };
 
+/* streaming double SHA-256, serializers write into it piece by piece instead of into a buffer */
+struct kyk_hash256_ctx{
+    SHA256_CTX sha;
+};
+
+/*
+ * the three functions below return heap memory, they are kept for the old bat_codes,
+ * new code uses kyk_dgst_sha256/kyk_dgst_hash256/kyk_dgst_hash256_rev with a caller provided digest
+ */
 unsigned char * kyk_sha256(const char *str, size_t len);
 unsigned char * kyk_dble_sha256(const char *str, size_t len);
 struct kyk_digst *kyk_inver_hash(const char *src, size_t len);
@@ -18,6 +27,10 @@ void kyk_dgst_rmd160(uint8_t *digest, const uint8_t *message, size_t len);
 void kyk_dgst_sha256(uint8_t *digest, const uint8_t *message, size_t len);
 void kyk_dgst_hash256(uint8_t *digest, const uint8_t *message, size_t len);
 void kyk_dgst_hash160(uint8_t *digest, const uint8_t *message, size_t len);
+void kyk_dgst_hash256_rev(uint8_t *digest, const uint8_t *message, size_t len);
+void kyk_hash256_init(struct kyk_hash256_ctx *ctx);
+void kyk_hash256_update(struct kyk_hash256_ctx *ctx, const void *data, size_t len);
+void kyk_hash256_final(struct kyk_hash256_ctx *ctx, uint8_t *digest);
 void kyk_free_digst(struct kyk_digst *dg);
 void kyk_dgst_hash_rmd160(uint8_t* digest, const uint8_t* message, size_t len);
 int kyk_hash256(uint256* digest, const uint8_t* buf, size_t len);
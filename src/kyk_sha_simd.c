@@ -0,0 +1,379 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "kyk_sha.h"
+#include "kyk_sha_simd.h"
+#include "dbg.h"
+
+/*
+ * Multi-lane double SHA-256.
+ * Every lane of a vector register carries one independent message, so one pass of the
+ * compression function hashes 4 (SSE4) or 8 (AVX2) messages.
+ * The kernels are written once with the GCC/clang vector extensions and compiled per
+ * instruction set through the target attribute, the best one is picked at runtime.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KYK_SHA_SIMD_X86 1
+#include <cpuid.h>
+#endif
+
+#define ROTR(x, n)     (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z)    (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z)   (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define BSIG0(x)       (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define BSIG1(x)       (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define SSIG0(x)       (ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define SSIG1(x)       (ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+
+/* padding words of the last block */
+#define SHA_PAD_WORD   0x80000000u
+#define SHA_BITS_32    256u
+#define SHA_BITS_64    512u
+#define SHA_BITS_80    640u
+
+static enum kyk_sha256d_impl forced_impl = KYK_SHA256D_AUTO;
+static enum kyk_sha256d_impl supported_impl = KYK_SHA256D_SCALAR;
+static enum kyk_sha256d_impl auto_impl = KYK_SHA256D_SCALAR;
+static pthread_once_t detect_once = PTHREAD_ONCE_INIT;
+
+#ifdef KYK_SHA_SIMD_X86
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+typedef uint32_t v8u32 __attribute__((vector_size(32)));
+
+static inline uint32_t load_be32(const uint8_t* p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return __builtin_bswap32(v);
+}
+
+static inline void store_be32(uint8_t* p, uint32_t v)
+{
+    v = __builtin_bswap32(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+/* word OFF of every lane, lane l starts at BASE + l * STRIDE */
+#define LANES_LOAD(VT, N, V, BASE, STRIDE, OFF) do {			\
+	uint32_t lw_[N];						\
+	int ll_ = 0;							\
+	for(ll_ = 0; ll_ < (N); ll_++){					\
+	    lw_[ll_] = load_be32((BASE) + ll_ * (STRIDE) + (OFF));	\
+	}								\
+	memcpy(&(V), lw_, sizeof(V));					\
+    } while(0)
+
+#define DEFINE_SHA256D_LANES(PREFIX, VT, N, ATTR)			\
+									\
+    ATTR static void PREFIX##_transform(VT* s, const VT* w)		\
+    {									\
+	VT W[64];							\
+	VT a = s[0], b = s[1], c = s[2], d = s[3];			\
+	VT e = s[4], f = s[5], g = s[6], h = s[7];			\
+	VT t1, t2;							\
+	int t = 0;							\
+									\
+	for(t = 0; t < 16; t++){					\
+	    W[t] = w[t];						\
+	}								\
+	for(t = 16; t < 64; t++){					\
+	    W[t] = SSIG1(W[t - 2]) + W[t - 7] + SSIG0(W[t - 15]) + W[t - 16]; \
+	}								\
+	for(t = 0; t < 64; t++){					\
+	    t1 = h + BSIG1(e) + CH(e, f, g) + sha256_k[t] + W[t];	\
+	    t2 = BSIG0(a) + MAJ(a, b, c);				\
+	    h = g;							\
+	    g = f;							\
+	    f = e;							\
+	    e = d + t1;							\
+	    d = c;							\
+	    c = b;							\
+	    b = a;							\
+	    a = t1 + t2;						\
+	}								\
+									\
+	s[0] += a; s[1] += b; s[2] += c; s[3] += d;			\
+	s[4] += e; s[5] += f; s[6] += g; s[7] += h;			\
+    }									\
+									\
+    ATTR static void PREFIX##_init(VT* s, const uint32_t* st)		\
+    {									\
+	VT zero = {0};							\
+	int j = 0;							\
+	for(j = 0; j < 8; j++){						\
+	    s[j] = zero + st[j];					\
+	}								\
+    }									\
+									\
+    /* pad words LEN/4 .. 15 of a last block holding a BITS-bit message */ \
+    ATTR static void PREFIX##_pad(VT* w, int len, uint32_t bits)	\
+    {									\
+	VT zero = {0};							\
+	int j = 0;							\
+	w[len / 4] = zero + SHA_PAD_WORD;				\
+	for(j = len / 4 + 1; j < 15; j++){				\
+	    w[j] = zero;						\
+	}								\
+	w[15] = zero + bits;						\
+    }									\
+									\
+    /* second SHA-256 over the 32-byte first digest, then store */	\
+    ATTR static void PREFIX##_finish(uint8_t* digests, const VT* s1)	\
+    {									\
+	VT w[16];							\
+	VT s[8];							\
+	int j = 0;							\
+	int l = 0;							\
+									\
+	for(j = 0; j < 8; j++){						\
+	    w[j] = s1[j];						\
+	}								\
+	PREFIX##_pad(w, 32, SHA_BITS_32);				\
+	PREFIX##_init(s, sha256_iv);					\
+	PREFIX##_transform(s, w);					\
+									\
+	for(l = 0; l < (N); l++){					\
+	    for(j = 0; j < 8; j++){					\
+		store_be32(digests + l * 32 + j * 4, s[j][l]);		\
+	    }								\
+	}								\
+    }									\
+									\
+    ATTR static void PREFIX##_hash64(uint8_t* digests, const uint8_t* msgs) \
+    {									\
+	VT w[16];							\
+	VT s[8];							\
+	int j = 0;							\
+									\
+	PREFIX##_init(s, sha256_iv);					\
+	for(j = 0; j < 16; j++){					\
+	    LANES_LOAD(VT, N, w[j], msgs, 64, j * 4);			\
+	}								\
+	PREFIX##_transform(s, w);					\
+	PREFIX##_pad(w, 0, SHA_BITS_64);				\
+	PREFIX##_transform(s, w);					\
+	PREFIX##_finish(digests, s);					\
+    }									\
+									\
+    ATTR static void PREFIX##_hash80(uint8_t* digests, const uint8_t* msgs) \
+    {									\
+	VT w[16];							\
+	VT s[8];							\
+	int j = 0;							\
+									\
+	PREFIX##_init(s, sha256_iv);					\
+	for(j = 0; j < 16; j++){					\
+	    LANES_LOAD(VT, N, w[j], msgs, 80, j * 4);			\
+	}								\
+	PREFIX##_transform(s, w);					\
+	for(j = 0; j < 4; j++){						\
+	    LANES_LOAD(VT, N, w[j], msgs, 80, 64 + j * 4);		\
+	}								\
+	PREFIX##_pad(w, 16, SHA_BITS_80);				\
+	PREFIX##_transform(s, w);					\
+	PREFIX##_finish(digests, s);					\
+    }									\
+									\
+    ATTR static void PREFIX##_hash_mid(uint8_t* digests,		\
+				       const uint32_t* mid,		\
+				       const uint8_t* tails)		\
+    {									\
+	VT w[16];							\
+	VT s[8];							\
+	int j = 0;							\
+									\
+	PREFIX##_init(s, mid);						\
+	for(j = 0; j < 4; j++){						\
+	    LANES_LOAD(VT, N, w[j], tails, 16, j * 4);			\
+	}								\
+	PREFIX##_pad(w, 16, SHA_BITS_80);				\
+	PREFIX##_transform(s, w);					\
+	PREFIX##_finish(digests, s);					\
+    }
+
+DEFINE_SHA256D_LANES(sha256d_x4, v4u32, 4, __attribute__((target("sse4.1"))))
+DEFINE_SHA256D_LANES(sha256d_x8, v8u32, 8, __attribute__((target("avx2"))))
+
+#endif
+
+/*
+ * With the SHA extensions OpenSSL hashes one message faster than the vector lanes do,
+ * so the lanes are only picked by default on CPUs without them.
+ */
+static void detect_impl(void)
+{
+#ifdef KYK_SHA_SIMD_X86
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    int sha_ext = 0;
+
+    if(__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)){
+	sha_ext = (ebx & bit_SHA) ? 1 : 0;
+    }
+
+    if(__builtin_cpu_supports("avx2")){
+	supported_impl = KYK_SHA256D_AVX2;
+    } else if(__builtin_cpu_supports("sse4.1")){
+	supported_impl = KYK_SHA256D_SSE4;
+    }
+
+    auto_impl = sha_ext ? KYK_SHA256D_SCALAR : supported_impl;
+#endif
+}
+
+enum kyk_sha256d_impl kyk_sha256d_get_impl(void)
+{
+    pthread_once(&detect_once, detect_impl);
+
+    if(forced_impl != KYK_SHA256D_AUTO){
+	return forced_impl;
+    }
+
+    return auto_impl;
+}
+
+enum kyk_sha256d_impl kyk_sha256d_set_impl(enum kyk_sha256d_impl impl)
+{
+    pthread_once(&detect_once, detect_impl);
+
+    if(impl == KYK_SHA256D_AUTO){
+	forced_impl = KYK_SHA256D_AUTO;
+	return auto_impl;
+    }
+
+    if(impl > supported_impl){
+	impl = supported_impl;
+    }
+
+    if(impl != KYK_SHA256D_SCALAR && impl != KYK_SHA256D_SSE4 && impl != KYK_SHA256D_AVX2){
+	impl = KYK_SHA256D_SCALAR;
+    }
+
+    forced_impl = impl;
+
+    return impl;
+}
+
+const char* kyk_sha256d_impl_name(enum kyk_sha256d_impl impl)
+{
+    switch(impl){
+    case KYK_SHA256D_AVX2:
+	return "avx2 (8 lanes)";
+    case KYK_SHA256D_SSE4:
+	return "sse4 (4 lanes)";
+    default:
+	return "scalar";
+    }
+}
+
+static void hash256_mid_scalar(uint8_t* digest, const SHA256_CTX* mid_ctx, const uint8_t* tail)
+{
+    SHA256_CTX ctx;
+    uint8_t tmp[SHA256_DIGEST_LENGTH];
+
+    memcpy(&ctx, mid_ctx, sizeof(ctx));
+    SHA256_Update(&ctx, tail, 16);
+    SHA256_Final(tmp, &ctx);
+    kyk_dgst_sha256(digest, tmp, sizeof(tmp));
+}
+
+void kyk_dgst_hash256_64_n(uint8_t* digests, const uint8_t* msgs, size_t n)
+{
+    enum kyk_sha256d_impl impl = kyk_sha256d_get_impl();
+    size_t i = 0;
+
+#ifdef KYK_SHA_SIMD_X86
+    if(impl == KYK_SHA256D_AVX2){
+	for(; i + 8 <= n; i += 8){
+	    sha256d_x8_hash64(digests + i * 32, msgs + i * 64);
+	}
+    }
+
+    if(impl >= KYK_SHA256D_SSE4){
+	for(; i + 4 <= n; i += 4){
+	    sha256d_x4_hash64(digests + i * 32, msgs + i * 64);
+	}
+    }
+#else
+    (void)impl;
+#endif
+
+    for(; i < n; i++){
+	kyk_dgst_hash256(digests + i * 32, msgs + i * 64, 64);
+    }
+}
+
+void kyk_dgst_hash256_80_n(uint8_t* digests, const uint8_t* msgs, size_t n)
+{
+    enum kyk_sha256d_impl impl = kyk_sha256d_get_impl();
+    size_t i = 0;
+
+#ifdef KYK_SHA_SIMD_X86
+    if(impl == KYK_SHA256D_AVX2){
+	for(; i + 8 <= n; i += 8){
+	    sha256d_x8_hash80(digests + i * 32, msgs + i * 80);
+	}
+    }
+
+    if(impl >= KYK_SHA256D_SSE4){
+	for(; i + 4 <= n; i += 4){
+	    sha256d_x4_hash80(digests + i * 32, msgs + i * 80);
+	}
+    }
+#else
+    (void)impl;
+#endif
+
+    for(; i < n; i++){
+	kyk_dgst_hash256(digests + i * 32, msgs + i * 80, 80);
+    }
+}
+
+void kyk_dgst_hash256_mid_n(uint8_t* digests,
+			    const SHA256_CTX* mid_ctx,
+			    const uint8_t* tails,
+			    size_t n)
+{
+    enum kyk_sha256d_impl impl = kyk_sha256d_get_impl();
+    size_t i = 0;
+
+#ifdef KYK_SHA_SIMD_X86
+    if(impl == KYK_SHA256D_AVX2){
+	for(; i + 8 <= n; i += 8){
+	    sha256d_x8_hash_mid(digests + i * 32, mid_ctx -> h, tails + i * 16);
+	}
+    }
+
+    if(impl >= KYK_SHA256D_SSE4){
+	for(; i + 4 <= n; i += 4){
+	    sha256d_x4_hash_mid(digests + i * 32, mid_ctx -> h, tails + i * 16);
+	}
+    }
+#else
+    (void)impl;
+#endif
+
+    for(; i < n; i++){
+	hash256_mid_scalar(digests + i * 32, mid_ctx, tails + i * 16);
+    }
+}
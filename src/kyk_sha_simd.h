@@ -0,0 +1,44 @@
+#ifndef KYK_SHA_SIMD_H__
+#define KYK_SHA_SIMD_H__
+
+#include <openssl/sha.h>
+
+#include "kyk_defs.h"
+
+#define KYK_SHA256D_MAX_LANES 8
+
+enum kyk_sha256d_impl {
+    KYK_SHA256D_AUTO   = 0,  /* picked from the CPU flags */
+    KYK_SHA256D_SCALAR = 1,  /* one message at a time through OpenSSL */
+    KYK_SHA256D_SSE4   = 4,  /* 4 lanes */
+    KYK_SHA256D_AVX2   = 8   /* 8 lanes */
+};
+
+/*
+ * Double SHA-256 of n independent messages, computed KYK_SHA256D_MAX_LANES at a time when the CPU allows.
+ * digests receives n * 32 bytes in the same byte order as kyk_dgst_hash256.
+ * digests may be the same pointer as msgs, which reduces a merkle level in place.
+ */
+void kyk_dgst_hash256_64_n(uint8_t* digests, const uint8_t* msgs, size_t n);
+void kyk_dgst_hash256_80_n(uint8_t* digests, const uint8_t* msgs, size_t n);
+
+/*
+ * 80-byte messages sharing their first 64 bytes: mid_ctx holds the SHA-256 state after that block,
+ * tails holds the n different 16-byte tails.
+ */
+void kyk_dgst_hash256_mid_n(uint8_t* digests,
+			    const SHA256_CTX* mid_ctx,
+			    const uint8_t* tails,
+			    size_t n);
+
+enum kyk_sha256d_impl kyk_sha256d_get_impl(void);
+
+/*
+ * Force an implementation, KYK_SHA256D_AUTO goes back to the CPU based choice.
+ * Falls back to the best supported implementation if impl is not available on this CPU.
+ */
+enum kyk_sha256d_impl kyk_sha256d_set_impl(enum kyk_sha256d_impl impl);
+
+const char* kyk_sha256d_impl_name(enum kyk_sha256d_impl impl);
+
+#endif
@@ -5,17 +5,26 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/time.h>
 
 #include "beej_pack.h"
 #include "kyk_message.h"
 #include "kyk_socket.h"
 #include "kyk_utils.h"
+#include "kyk_sha.h"
 #include "dbg.h"
 
 
 static uint32_t MAX_BUF_SIZE = 1000 * 1024;
 
-static uint32_t read_pld_len(const unsigned char *buf, int pos);
+static int send_all(int sockfd, const uint8_t* buf, size_t buf_len, int flags);
+static int recv_all(int sockfd, uint8_t* buf, size_t buf_len);
+static int wait_writable(int sockfd);
+static int peer_next_frame(struct kyk_peer_conn* conn, ptl_message** new_msg);
+static int peer_stash(struct kyk_peer_conn* conn, ptl_message* msg);
 
 /* struct addrinfo { */
 /*     int              ai_flags; */
@@ -33,22 +42,27 @@ int kyk_send_ptl_msg(const char* node,
 		     const ptl_message* msg,
 		     ptl_message** rep_msg)
 {
-    ptl_msg_buf* msg_buf = NULL;
+    struct kyk_peer_conn* conn = NULL;
     int res = -1;
 
     check(msg, "Failed to kyk_send_ptl_msg: msg is NULL");
     check(rep_msg, "Failed to kyk_send_ptl_msg: rep_msg is NULL");
 
-    res = kyk_new_seri_ptl_message(&msg_buf, msg);
-    check(res == 0, "Failed to kyk_send_ptlc_msg: kyk_new_seri_ptl_message failed");
+    res = kyk_peer_connect(&conn, node, service);
+    check(res == 0, "Failed to kyk_send_ptl_msg: kyk_peer_connect failed");
 
-    res = kyk_send_ptl_msg_buf(node, service, msg_buf, rep_msg);
-    check(res == 0, "Failed to kyk_send_btc_msg");
+    res = kyk_peer_write(conn, msg);
+    check(res == 0, "Failed to kyk_send_ptl_msg: kyk_peer_write failed");
+
+    res = kyk_peer_read(conn, rep_msg);
+    check(res == 0, "Failed to kyk_send_btc_msg: kyk_peer_read failed");
+
+    kyk_peer_close(conn);
 
     return 0;
 
 error:
-
+    if(conn) kyk_peer_close(conn);
     return -1;
 }
 
@@ -106,15 +120,12 @@ error:
 /* write msg to socket fd, when finished don't close the socket fd */
 int kyk_write_ptl_msg(int sfd, const ptl_message* msg)
 {
-    ptl_msg_buf* msg_buf = NULL;
     int res = -1;
 
     check(msg, "Failed to kyk_write_ptl_msg: msg is NULL");
 
-    res = kyk_new_seri_ptl_message(&msg_buf, msg);
-    check(res == 0, "Failed to kyk_write_ptl_msg: kyk_new_seri_ptl_message failed");
-
-    kyk_write_msg_buf(sfd, msg_buf);
+    res = kyk_send_ptl_msgs(sfd, &msg, 1);
+    check(res == 0, "Failed to kyk_write_ptl_msg: kyk_send_ptl_msgs failed");
 
     kyk_print_ptl_message(msg);
 
@@ -149,124 +160,388 @@ int kyk_send_ptl_msg_buf(const char *node,
 			 const ptl_msg_buf* msg_buf,
 			 ptl_message** new_rep_msg)
 {
-    int sfd;
+    struct kyk_peer_conn* conn = NULL;
     ptl_message* rep_msg = NULL;
     int res = -1;
 
-    res = kyk_socket_connect(node, service, &sfd);
-    check(res == 0, "Failed to kyk_send_ptl_msg_buf: kyk_socket_connect failed");
+    res = kyk_peer_connect(&conn, node, service);
+    check(res == 0, "Failed to kyk_send_ptl_msg_buf: kyk_peer_connect failed");
 
-    kyk_write_msg_buf(sfd, msg_buf);
+    res = send_all(conn -> fd, msg_buf -> data, msg_buf -> len, 0);
+    check(res == 0, "Failed to kyk_send_ptl_msg_buf: send_all failed");
 
-    res = kyk_recv_ptl_msg(sfd, &rep_msg, KYK_PL_BUF_SIZE, NULL);
-    check(res == 0, "Failed to kyk_send_btc_msg_buf: kyk_recv_ptl_msg failed");
+    res = kyk_peer_read(conn, &rep_msg);
+    check(res == 0, "Failed to kyk_send_btc_msg_buf: kyk_peer_read failed");
 
     *new_rep_msg = rep_msg;
 
-    close(sfd);
+    kyk_peer_close(conn);
     
     return 0;
 
 error:
+    if(conn) kyk_peer_close(conn);
+    return -1;
+
+}
+
+int kyk_peer_connect(struct kyk_peer_conn** new_conn, const char* node, const char* service)
+{
+    struct kyk_peer_conn* conn = NULL;
+    struct timeval tv;
+    int res = -1;
+
+    check(new_conn, "Failed to kyk_peer_connect: new_conn is NULL");
+
+    conn = calloc(1, sizeof(*conn));
+    check(conn, "Failed to kyk_peer_connect: calloc failed");
+    conn -> fd = -1;
 
+    res = kyk_new_frame_ring(&conn -> ring, KYK_FRAME_RING_SIZE, KYK_PEER_MAX_PLD_LEN);
+    check(res == 0, "Failed to kyk_peer_connect: kyk_new_frame_ring failed");
+
+    res = kyk_socket_connect(node, service, &conn -> fd);
+    check(res == 0, "Failed to kyk_peer_connect: kyk_socket_connect failed");
+
+    /* a peer that stops halfway through a reply fails the read instead of hanging it */
+    tv.tv_sec = KYK_PEER_STALL_MS / 1000;
+    tv.tv_usec = (KYK_PEER_STALL_MS % 1000) * 1000;
+    res = setsockopt(conn -> fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    check(res == 0, "Failed to kyk_peer_connect: setsockopt failed");
+
+    *new_conn = conn;
+
+    return 0;
+
+error:
+    if(conn) kyk_peer_close(conn);
     return -1;
+}
 
+/* queue a request, its reply is not waited for */
+int kyk_peer_write(struct kyk_peer_conn* conn, const ptl_message* msg)
+{
+    return kyk_peer_write_list(conn, &msg, 1);
 }
 
-int kyk_recv_ptl_msg(int sockfd, ptl_message** new_ptl_msg, size_t buf_len, size_t* checksize)
+/* queue several requests with as few syscalls as possible */
+int kyk_peer_write_list(struct kyk_peer_conn* conn, const ptl_message** msg_list, size_t count)
 {
-    ptl_message* ptl_msg = NULL;
-    uint8_t* buf = NULL;
-    uint8_t* larger_buf = NULL;
-    uint8_t* bufp = NULL;
-    size_t recv_len = 0;
-    uint32_t pld_len = 0;
-    int pld_flag = 1;
     int res = -1;
 
-    check(new_ptl_msg, "Failed to kyk_recv_ptl_msg: new_ptl_msg is NULL");
+    check(conn, "Failed to kyk_peer_write_list: conn is NULL");
+    check(msg_list, "Failed to kyk_peer_write_list: msg_list is NULL");
+
+    res = kyk_send_ptl_msgs(conn -> fd, msg_list, count);
+    check(res == 0, "Failed to kyk_peer_write_list: kyk_send_ptl_msgs failed");
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* the next message from the peer, replies stashed by kyk_peer_read_cmd come first */
+int kyk_peer_read(struct kyk_peer_conn* conn, ptl_message** new_msg)
+{
+    int res = -1;
+
+    check(conn, "Failed to kyk_peer_read: conn is NULL");
+    check(new_msg, "Failed to kyk_peer_read: new_msg is NULL");
+
+    if(conn -> stash_len > 0){
+	*new_msg = conn -> stash[0];
+	conn -> stash_len--;
+	memmove(conn -> stash, conn -> stash + 1, conn -> stash_len * sizeof(*conn -> stash));
+	return 0;
+    }
+
+    res = peer_next_frame(conn, new_msg);
+    check(res == 0, "Failed to kyk_peer_read: peer_next_frame failed");
+
+    return 0;
+
+error:
+
+    return -1;
+}
 
-    buf = calloc(buf_len, sizeof(*buf));
-    check(buf, "Failed to kyk_recv_ptl_msg: calloc failed");
+/*
+ * The next message with command cmd, or a reject which answers any request.
+ * Messages of other commands read on the way are kept for later reads.
+ */
+int kyk_peer_read_cmd(struct kyk_peer_conn* conn, const char* cmd, ptl_message** new_msg)
+{
+    ptl_message* msg = NULL;
+    size_t i = 0;
+    int res = -1;
 
-    bufp = buf;
+    check(conn, "Failed to kyk_peer_read_cmd: conn is NULL");
+    check(cmd, "Failed to kyk_peer_read_cmd: cmd is NULL");
+    check(new_msg, "Failed to kyk_peer_read_cmd: new_msg is NULL");
+
+    for(i = 0; i < conn -> stash_len; i++){
+	msg = conn -> stash[i];
+	if(strcmp(msg -> cmd, cmd) == 0 || strcmp(msg -> cmd, KYK_MSG_TYPE_REJECT) == 0){
+	    conn -> stash_len--;
+	    memmove(conn -> stash + i, conn -> stash + i + 1, (conn -> stash_len - i) * sizeof(*conn -> stash));
+	    *new_msg = msg;
+	    return 0;
+	}
+    }
 
     while(1){
-	ssize_t i = recv(sockfd, bufp, buf_len, 0);
-	if(i == -1){
-	    perror("recv");
+	res = peer_next_frame(conn, &msg);
+	check(res == 0, "Failed to kyk_peer_read_cmd: peer_next_frame failed");
+
+	if(strcmp(msg -> cmd, cmd) == 0 || strcmp(msg -> cmd, KYK_MSG_TYPE_REJECT) == 0){
 	    break;
 	}
-	recv_len += i;
-	bufp += i;
-	if(recv_len >= KYK_MSG_HEADER_LEN && pld_flag == 1){
-	    pld_len = read_pld_len(buf, KYK_PLD_LEN_POS);
-	    pld_flag = 0;
+
+	res = peer_stash(conn, msg);
+	check(res == 0, "Failed to kyk_peer_read_cmd: peer_stash failed");
+    }
+
+    *new_msg = msg;
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* 1 if received bytes are waiting to be read as messages, polling the socket would miss them */
+int kyk_peer_buffered(const struct kyk_peer_conn* conn)
+{
+    return conn -> stash_len > 0 || conn -> ring -> tail > conn -> ring -> head;
+}
+
+void kyk_peer_close(struct kyk_peer_conn* conn)
+{
+    size_t i = 0;
+
+    if(conn){
+	if(conn -> fd != -1) close(conn -> fd);
+	kyk_free_frame_ring(conn -> ring);
+	for(i = 0; i < conn -> stash_len; i++){
+	    kyk_free_ptl_msg(conn -> stash[i]);
 	}
-	
-	if(recv_len >= pld_len + KYK_MSG_HEADER_LEN){
+	if(conn -> stash) free(conn -> stash);
+	free(conn);
+    }
+}
+
+/* the next frame from the ring, reading from the socket until a whole one is there */
+int peer_next_frame(struct kyk_peer_conn* conn, ptl_message** new_msg)
+{
+    struct kyk_frame frame;
+    ssize_t n = 0;
+    int ready = 0;
+    int res = -1;
+
+    while(1){
+	res = kyk_frame_ring_next(conn -> ring, &frame, &ready);
+	check(res == 0, "Failed to peer_next_frame: kyk_frame_ring_next failed");
+
+	if(ready){
 	    break;
 	}
 
-	/* need to realloc a larger buffer */
-	if(buf_len < pld_len + KYK_MSG_HEADER_LEN){
-	    size_t total_len = pld_len + KYK_MSG_HEADER_LEN;
-	    larger_buf = realloc(buf, total_len * sizeof(*buf));
-	    check(larger_buf, "Failed to kyk_recv_ptl_msg: realloc failed");
-	    buf = larger_buf;
-	    bufp = buf + recv_len;
+	res = kyk_frame_ring_recv(conn -> ring, conn -> fd, &n);
+	check(res == 0, "Failed to peer_next_frame: kyk_frame_ring_recv failed");
+	if(n == -1 && errno == EINTR){
+	    continue;
 	}
-        
+	check(n != -1, "Failed to peer_next_frame: recv failed");
+	check(n > 0, "Failed to peer_next_frame: peer closed the connection");
+    }
+
+    res = kyk_frame_to_new_ptl_message(new_msg, &frame);
+    check(res == 0, "Failed to peer_next_frame: kyk_frame_to_new_ptl_message failed");
+
+    kyk_frame_ring_consume(conn -> ring, &frame);
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+int peer_stash(struct kyk_peer_conn* conn, ptl_message* msg)
+{
+    ptl_message** larger_stash = NULL;
 
+    if(conn -> stash_len == conn -> stash_cap){
+	larger_stash = realloc(conn -> stash, (conn -> stash_cap * 2 + 4) * sizeof(*conn -> stash));
+	check(larger_stash, "Failed to peer_stash: realloc failed");
+	conn -> stash = larger_stash;
+	conn -> stash_cap = conn -> stash_cap * 2 + 4;
     }
 
-    check(recv_len >= pld_len + KYK_MSG_HEADER_LEN, "Failed to kyk_recv_ptl_msg: invalid received bytes len");
+    conn -> stash[conn -> stash_len++] = msg;
 
-    res = kyk_deseri_new_ptl_message(&ptl_msg, buf, 0);
-    check(res == 0, "Failed to kyk_recv_ptl_msg: kyk_deseri_new_ptl_message failed");
+    return 0;
+
+error:
+    kyk_free_ptl_msg(msg);
+    return -1;
+}
+
+/*
+ * Read exactly one message: the header first, then the payload straight into its own allocation.
+ * Nothing past the message is read, so the next message stays in the socket for the next call.
+ * buf_len is kept for the old callers, connections reading many messages use kyk_peer_conn.
+ */
+int kyk_recv_ptl_msg(int sockfd, ptl_message** new_ptl_msg, size_t buf_len, size_t* checksize)
+{
+    ptl_message* ptl_msg = NULL;
+    uint8_t hd_buf[KYK_MSG_HEADER_LEN];
+    uint8_t* bufp = NULL;
+    int res = -1;
+
+    (void)buf_len;
+
+    check(new_ptl_msg, "Failed to kyk_recv_ptl_msg: new_ptl_msg is NULL");
+
+    res = recv_all(sockfd, hd_buf, sizeof(hd_buf));
+    check(res == 0, "Failed to kyk_recv_ptl_msg: recv_all header failed");
+
+    ptl_msg = calloc(1, sizeof(*ptl_msg));
+    check(ptl_msg, "Failed to kyk_recv_ptl_msg: calloc failed");
+
+    bufp = hd_buf;
+    beej_unpack(bufp, "<L", &ptl_msg -> magic);
+    bufp += sizeof(ptl_msg -> magic);
+
+    memcpy(ptl_msg -> cmd, bufp, sizeof(ptl_msg -> cmd));
+    bufp += sizeof(ptl_msg -> cmd);
+
+    beej_unpack(bufp, "<L", &ptl_msg -> pld_len);
+    bufp += sizeof(ptl_msg -> pld_len);
+
+    memcpy(ptl_msg -> checksum, bufp, sizeof(ptl_msg -> checksum));
+
+    check(ptl_msg -> pld_len <= KYK_PEER_MAX_PLD_LEN, "Failed to kyk_recv_ptl_msg: payload is too large");
+
+    ptl_msg -> pld = calloc(1, sizeof(*ptl_msg -> pld));
+    check(ptl_msg -> pld, "Failed to kyk_recv_ptl_msg: calloc failed");
+
+    ptl_msg -> pld -> len = ptl_msg -> pld_len;
+    ptl_msg -> pld -> data = malloc(ptl_msg -> pld_len > 0 ? ptl_msg -> pld_len : 1);
+    check(ptl_msg -> pld -> data, "Failed to kyk_recv_ptl_msg: malloc failed");
+
+    res = recv_all(sockfd, ptl_msg -> pld -> data, ptl_msg -> pld_len);
+    check(res == 0, "Failed to kyk_recv_ptl_msg: recv_all payload failed");
 
     *new_ptl_msg = ptl_msg;
 
     if(checksize){
-	*checksize = recv_len;
+	*checksize = KYK_MSG_HEADER_LEN + ptl_msg -> pld_len;
     }
 
-    free(buf);
-	
     return 0;
 
 error:
-    if(buf) free(buf);
     if(ptl_msg) kyk_free_ptl_msg(ptl_msg);
     return -1;
 
 }
 
-int kyk_reply_ptl_msg(int sockfd, ptl_message* rep_msg)
+int recv_all(int sockfd, uint8_t* buf, size_t buf_len)
 {
-    ptl_msg_buf* msg_buf = NULL;
-    ssize_t sent_len = 0;
-    ssize_t len = 0;
-    uint8_t* bufp = NULL;
+    size_t recv_len = 0;
+    ssize_t n = 0;
+
+    while(recv_len < buf_len){
+	n = recv(sockfd, buf + recv_len, buf_len - recv_len, 0);
+	if(n == -1 && errno == EINTR){
+	    continue;
+	}
+	check(n != -1, "Failed to recv_all: recv failed");
+	check(n > 0, "Failed to recv_all: peer closed the connection");
+	recv_len += n;
+    }
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/*
+ * The served sockets are non-blocking: what the peer's receive window does not take
+ * stays in the connection's queue and is written once the socket is writable again.
+ */
+int kyk_reply_ptl_msg(struct kyk_frame_queue* outq, ptl_message* rep_msg)
+{
+    const ptl_message* msg = rep_msg;
     int res = -1;
 
     check(rep_msg, "Failed to kyk_reply_ptl_msg: rep_msg is NULL");
 
-    res = kyk_new_seri_ptl_message(&msg_buf, rep_msg);
-    check(res == 0, "Failed to kyk_reply_ptl_msg: kyk_new_seri_ptl_message failed");
+    res = kyk_frame_queue_msgs(outq, &msg, 1);
+    check(res == 0, "Failed to kyk_reply_ptl_msg: kyk_frame_queue_msgs failed");
 
-    bufp = msg_buf -> data;
-    
-    while(1){
-	len = send(sockfd, bufp, KYK_PL_BUF_SIZE, 0);
-	check(len >= 0, "Failed to kyk_reply_ptl_msg: send failed");
-	bufp += len;
-	sent_len += len;
-	if(sent_len >= msg_buf -> len){
-	    break;
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/*
+ * Send count messages with sendmsg, the headers are built in a stack buffer
+ * and the payloads are sent from the messages' own buffers, nothing is serialized into a copy.
+ * Up to KYK_FRAME_IOV_BATCH messages go out per syscall.
+ * A partial write resumes from the first byte the kernel did not take,
+ * a full socket buffer on a non-blocking socket is waited out.
+ */
+int kyk_send_ptl_msgs(int sockfd, const ptl_message** msg_list, size_t count)
+{
+    uint8_t hd_bufs[KYK_FRAME_IOV_BATCH][KYK_MSG_HEADER_LEN];
+    struct iovec iov[KYK_FRAME_IOV_BATCH * 2];
+    struct msghdr mh;
+    size_t done = 0;
+    size_t batch = 0;
+    size_t iov_cnt = 0;
+    size_t iov_idx = 0;
+    ssize_t len = 0;
+    int res = -1;
+
+    check(msg_list, "Failed to kyk_send_ptl_msgs: msg_list is NULL");
+
+    while(done < count){
+	batch = count - done < KYK_FRAME_IOV_BATCH ? count - done : KYK_FRAME_IOV_BATCH;
+	res = kyk_frame_iov_fill(iov, &iov_cnt, hd_bufs, msg_list + done, batch);
+	check(res == 0, "Failed to kyk_send_ptl_msgs: kyk_frame_iov_fill failed");
+
+	iov_idx = 0;
+	while(iov_idx < iov_cnt){
+	    memset(&mh, 0, sizeof(mh));
+	    mh.msg_iov = iov + iov_idx;
+	    mh.msg_iovlen = iov_cnt - iov_idx;
+
+	    len = sendmsg(sockfd, &mh, MSG_NOSIGNAL);
+	    if(len == -1 && errno == EINTR){
+		continue;
+	    }
+
+	    if(len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+		res = wait_writable(sockfd);
+		check(res == 0, "Failed to kyk_send_ptl_msgs: peer is not reading");
+		continue;
+	    }
+
+	    check(len >= 0, "Failed to kyk_send_ptl_msgs: sendmsg failed");
+	    iov_idx = kyk_frame_iov_skip(iov, iov_cnt, iov_idx, len);
 	}
+
+	done += batch;
     }
-    
 
     return 0;
 
@@ -275,16 +550,92 @@ error:
     return -1;
 }
 
-uint32_t read_pld_len(const unsigned char *buf, int pos)
+/* the payload is sent from buf as it is, a block mapped from its file is only copied if it has to wait in the queue */
+int kyk_reply_ptl_buf_msg(struct kyk_frame_queue* outq,
+			  const char* cmd,
+			  uint32_t nt_magic,
+			  const uint8_t* buf,
+			  uint32_t pld_len)
 {
-    uint32_t len = 0;
-    
-    buf += pos;
-    beej_unpack(buf, "<L", &len);
+    ptl_message msg;
+    ptl_payload pld;
+    const ptl_message* msgp = &msg;
+    uint256 digest;
+    size_t cmd_len = 0;
+    int res = -1;
+
+    check(cmd, "Failed to kyk_reply_ptl_buf_msg: cmd is NULL");
+    check(buf, "Failed to kyk_reply_ptl_buf_msg: buf is NULL");
+    cmd_len = strlen(cmd);
+    check(cmd_len < KYK_MSG_TYPE_LEN, "Failed to kyk_reply_ptl_buf_msg: cmd is invalid");
+
+    res = kyk_hash256(&digest, buf, pld_len);
+    check(res == 0, "Failed to kyk_reply_ptl_buf_msg: kyk_hash256 failed");
 
-    return len;
+    pld.len = pld_len;
+    pld.data = (uint8_t*)buf;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.magic = nt_magic;
+    memcpy(msg.cmd, cmd, cmd_len);
+    msg.pld_len = pld_len;
+    memcpy(msg.checksum, digest.data, sizeof(msg.checksum));
+    msg.pld = &pld;
+
+    res = kyk_frame_queue_msgs(outq, &msgp, 1);
+    check(res == 0, "Failed to kyk_reply_ptl_buf_msg: kyk_frame_queue_msgs failed");
+
+    return 0;
+
+error:
+
+    return -1;
 }
 
+int send_all(int sockfd, const uint8_t* buf, size_t buf_len, int flags)
+{
+    size_t sent_len = 0;
+    ssize_t len = 0;
+    int res = -1;
+
+    while(sent_len < buf_len){
+	len = send(sockfd, buf + sent_len, buf_len - sent_len, flags | MSG_NOSIGNAL);
+	if(len == -1 && errno == EINTR){
+	    continue;
+	}
+
+	if(len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+	    res = wait_writable(sockfd);
+	    check(res == 0, "Failed to send_all: peer is not reading");
+	    continue;
+	}
+
+	check(len >= 0, "Failed to send_all: send failed");
+	sent_len += len;
+    }
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+int wait_writable(int sockfd)
+{
+    struct pollfd pfd;
+    int res = -1;
+
+    pfd.fd = sockfd;
+    pfd.events = POLLOUT;
+    do {
+	res = poll(&pfd, 1, KYK_SEND_TIMEOUT_MS);
+    } while(res == -1 && errno == EINTR);
+
+    return res > 0 ? 0 : -1;
+}
+
+
 
 
 
@@ -1,6 +1,41 @@
 #ifndef KYK_SOCKET_H__
 #define KYK_SOCKET_H__
 
+#include <sys/types.h>
+
+#include "kyk_message.h"
+#include "kyk_frame.h"
+
+/* larger frames are a broken or hostile peer */
+#define KYK_PEER_MAX_PLD_LEN (32 * 1024 * 1024)
+
+/*
+ * A connection to one peer kept open across requests.
+ * Requests can be written back to back without waiting for their replies,
+ * replies are read in the order the peer sends them.
+ */
+struct kyk_peer_conn {
+    int fd;
+    struct kyk_frame_ring* ring;   /* received bytes not yet returned as messages */
+    ptl_message** stash;       /* replies read ahead of the one a caller waited for */
+    size_t stash_len;
+    size_t stash_cap;
+};
+
+int kyk_peer_connect(struct kyk_peer_conn** new_conn, const char* node, const char* service);
+
+int kyk_peer_write(struct kyk_peer_conn* conn, const ptl_message* msg);
+
+int kyk_peer_write_list(struct kyk_peer_conn* conn, const ptl_message** msg_list, size_t count);
+
+int kyk_peer_read(struct kyk_peer_conn* conn, ptl_message** new_msg);
+
+int kyk_peer_read_cmd(struct kyk_peer_conn* conn, const char* cmd, ptl_message** new_msg);
+
+int kyk_peer_buffered(const struct kyk_peer_conn* conn);
+
+void kyk_peer_close(struct kyk_peer_conn* conn);
+
 
 int kyk_send_ptl_msg(const char* node,
 		     const char* service,
@@ -12,8 +47,15 @@ int kyk_recv_ptl_msg(int sockfd,
 		     size_t buf_len,
 		     size_t* checksize);
 
-int kyk_reply_ptl_msg(int sockfd, ptl_message* ptl_msg);
+int kyk_reply_ptl_msg(struct kyk_frame_queue* outq, ptl_message* ptl_msg);
+
+int kyk_send_ptl_msgs(int sockfd, const ptl_message** msg_list, size_t count);
 
+int kyk_reply_ptl_buf_msg(struct kyk_frame_queue* outq,
+			  const char* cmd,
+			  uint32_t nt_magic,
+			  const uint8_t* buf,
+			  uint32_t pld_len);
 
 
 int kyk_send_ptl_msg_buf(const char *node,
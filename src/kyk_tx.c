@@ -24,6 +24,8 @@ static int get_txin_size(struct kyk_txin* txin, size_t* txin_size);
 static int get_txout_size(struct kyk_txout* txout, size_t* txout_size);
 static int placehold_txin_with_txout(struct kyk_txin* txin, const struct kyk_txout* txout);
 static int set_all_txins_sc_to_blank(struct kyk_tx* tx);
+static void kyk_hash_txin(struct kyk_hash256_ctx* ctx, const struct kyk_txin* txin);
+static void kyk_hash_txout(struct kyk_hash256_ctx* ctx, const struct kyk_txout* txout);
 
 int kyk_deseri_txin_list(struct kyk_txin* txin_list,
 			 size_t txin_count,
@@ -89,24 +91,14 @@ void kyk_print_txin(const struct kyk_txin* txin)
 
 int kyk_tx_hash256(uint8_t* digest, const struct kyk_tx* tx)
 {
-    uint8_t *buf = NULL;
-    size_t len = 0;
-    size_t tx_size = 0;
-    int res = -1;
+    struct kyk_hash256_ctx ctx;
 
     check(digest, "Failed to kyk_tx_hash256: digest is NULL");
     check(tx, "Failed to kyk_tx_hash256: tx is NULL");
 
-    res = kyk_get_tx_size(tx, &tx_size);
-    check(res == 0, "Failed to kyk_tx_hash256: kyk_get_tx_size failed");
-    check(tx_size > 0, "Failed to kyk_tx_hash256: kyk_get_tx_size failed");
-
-    buf = calloc(tx_size, sizeof(*buf));
-    check(buf, "Failed to kyk_tx_hash256: buf calloc failed");
-    len = kyk_seri_tx((unsigned char*)buf, tx);
-    check(len == tx_size, "Failed to kyk_tx_hash256: kyk_seri_tx failed");
-    
-    kyk_dgst_hash256(digest, buf, tx_size);
+    kyk_hash256_init(&ctx);
+    kyk_hash_tx(&ctx, tx);
+    kyk_hash256_final(&ctx, digest);
     kyk_reverse(digest, SHA256_DIGEST_LENGTH);
 
     return 0;
@@ -116,6 +108,32 @@ error:
     return -1;
 }
 
+/* feed the kyk_seri_tx serialization of tx into ctx without building it in memory */
+void kyk_hash_tx(struct kyk_hash256_ctx* ctx, const struct kyk_tx* tx)
+{
+    uint8_t buf[sizeof(uint32_t) + KYK_VARINT_MAX_LEN];
+    size_t len = 0;
+    varint_t i = 0;
+
+    len = beej_pack(buf, "<L", tx -> version);
+    len += kyk_pack_varint(buf + len, tx -> vin_sz);
+    kyk_hash256_update(ctx, buf, len);
+
+    for(i = 0; i < tx -> vin_sz; i++){
+	kyk_hash_txin(ctx, tx -> txin + i);
+    }
+
+    len = kyk_pack_varint(buf, tx -> vout_sz);
+    kyk_hash256_update(ctx, buf, len);
+
+    for(i = 0; i < tx -> vout_sz; i++){
+	kyk_hash_txout(ctx, tx -> txout + i);
+    }
+
+    len = beej_pack(buf, "<L", tx -> lock_time);
+    kyk_hash256_update(ctx, buf, len);
+}
+
 int kyk_copy_new_tx(struct kyk_tx** new_tx, const struct kyk_tx* src_tx)
 {
     struct kyk_tx* tx = NULL;
@@ -474,6 +492,38 @@ size_t kyk_seri_txin(unsigned char *buf, struct kyk_txin *txin)
     return total;
 }
 
+void kyk_hash_txin(struct kyk_hash256_ctx* ctx, const struct kyk_txin* txin)
+{
+    uint8_t buf[sizeof(txin -> pre_txid) + sizeof(uint32_t) + KYK_VARINT_MAX_LEN];
+    size_t len = 0;
+
+    len = kyk_reverse_pack_chars(buf, txin -> pre_txid, sizeof(txin -> pre_txid));
+    len += beej_pack(buf + len, "<L", txin -> pre_txout_inx);
+    len += kyk_pack_varint(buf + len, txin -> sc_size);
+    kyk_hash256_update(ctx, buf, len);
+
+    if(txin -> sc_size > 0){
+	kyk_hash256_update(ctx, txin -> sc, txin -> sc_size);
+    }
+
+    len = beej_pack(buf, "<L", txin -> seq_no);
+    kyk_hash256_update(ctx, buf, len);
+}
+
+void kyk_hash_txout(struct kyk_hash256_ctx* ctx, const struct kyk_txout* txout)
+{
+    uint8_t buf[sizeof(uint64_t) + KYK_VARINT_MAX_LEN];
+    size_t len = 0;
+
+    len = beej_pack(buf, "<Q", txout -> value);
+    len += kyk_pack_varint(buf + len, txout -> sc_size);
+    kyk_hash256_update(ctx, buf, len);
+
+    if(txout -> sc_size > 0){
+	kyk_hash256_update(ctx, txout -> sc, txout -> sc_size);
+    }
+}
+
 size_t kyk_seri_txout(unsigned char *buf, struct kyk_txout *txout)
 {
     size_t size;
@@ -694,6 +744,52 @@ error:
     return -1;
 }
 
+/*
+ * The coinbase sc is the bits push, the extranonce push and the note push,
+ * the extranonce push starts as the 1 byte of kyk_make_coinbase_sc and becomes 4 bytes on the first roll.
+ */
+int kyk_set_coinbase_extranonce(struct kyk_tx* cb_tx, uint32_t extranonce)
+{
+    struct kyk_txin* txin = NULL;
+    uint8_t sc[MAX_COINBASE_SC_LEN];
+    size_t head_len = 5;
+    size_t tail_off = 0;
+    size_t sc_len = 0;
+    uint8_t* new_sc = NULL;
+
+    check(cb_tx, "Failed to kyk_set_coinbase_extranonce: cb_tx is NULL");
+    check(cb_tx -> vin_sz == 1, "Failed to kyk_set_coinbase_extranonce: cb_tx is not a coinbase");
+
+    txin = cb_tx -> txin;
+    check(txin -> sc_size > head_len + 1, "Failed to kyk_set_coinbase_extranonce: sc is too short");
+
+    tail_off = head_len + 1 + txin -> sc[head_len];
+    check(tail_off <= txin -> sc_size, "Failed to kyk_set_coinbase_extranonce: invalid extranonce push");
+
+    sc_len = head_len + 1 + sizeof(extranonce) + txin -> sc_size - tail_off;
+    check(sc_len < MAX_COINBASE_SC_LEN, "Failed to kyk_set_coinbase_extranonce: over MAX_COINBASE_SC_LEN");
+
+    memcpy(sc, txin -> sc, head_len);
+    sc[head_len] = sizeof(extranonce);
+    beej_pack(sc + head_len + 1, "<L", extranonce);
+    memcpy(sc + head_len + 1 + sizeof(extranonce), txin -> sc + tail_off, txin -> sc_size - tail_off);
+
+    if(sc_len != txin -> sc_size){
+	new_sc = realloc(txin -> sc, sc_len);
+	check(new_sc, "Failed to kyk_set_coinbase_extranonce: realloc failed");
+	txin -> sc = new_sc;
+	txin -> sc_size = sc_len;
+    }
+
+    memcpy(txin -> sc, sc, sc_len);
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
 int kyk_make_coinbase_tx(struct kyk_tx** cb_tx,
 			 const char* note,
 			 uint64_t outValue,
@@ -6,6 +6,7 @@
 struct kyk_bon_buff;
 struct kyk_utxo;
 struct kyk_utxo_chain;
+struct kyk_hash256_ctx;
 
 /* https://bitcoin.org/en/developer-reference#raw-transaction-format */
 struct kyk_tx {
@@ -35,6 +36,7 @@ struct kyk_txout{
 void kyk_print_txout(const struct kyk_txout* txout);
 
 int kyk_tx_hash256(uint8_t* digest, const struct kyk_tx* tx);
+void kyk_hash_tx(struct kyk_hash256_ctx* ctx, const struct kyk_tx* tx);
 
 int kyk_seri_tx_list(struct kyk_bon_buff* buf_list,
 		     const struct kyk_tx* tx_list,
@@ -62,6 +64,8 @@ int kyk_make_coinbase_tx(struct kyk_tx** cb_tx,
 			 const uint8_t* pub,
 			 size_t pub_len);
 
+int kyk_set_coinbase_extranonce(struct kyk_tx* cb_tx, uint32_t extranonce);
+
 
 struct kyk_tx* kyk_create_tx(uint32_t version,
 			     varint_t vin_sz,
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "kyk_utils.h"
+#include "kyk_tx.h"
+#include "kyk_block.h"
+#include "varint.h"
+#include "kyk_txindex.h"
+#include "block_store.h"
+#include "dbg.h"
+
+#define TXINDEX_KEY_LEN (1 + 32)
+#define TXINDEX_VAL_MAX (5 + 10 + 5)
+#define TXINDEX_FLAG_NAME "txindex"
+
+static void txindex_key(char* key, const uint8_t* txid);
+static void txindex_flag_key(char* key);
+
+/* one record per tx of the block stored at nFile, nDataPos */
+int kyk_txindex_batch_block(leveldb_writebatch_t* batch,
+			    const struct kyk_block* blk,
+			    int nFile,
+			    uint64_t nDataPos)
+{
+    const struct kyk_tx* tx = NULL;
+    char key[TXINDEX_KEY_LEN];
+    uint8_t val[TXINDEX_VAL_MAX];
+    uint8_t txid[32];
+    size_t tx_size = 0;
+    size_t len = 0;
+    uint32_t nTxOffset = 0;
+    varint_t i = 0;
+    int res = -1;
+
+    check(batch, "Failed to kyk_txindex_batch_block: batch is NULL");
+    check(blk, "Failed to kyk_txindex_batch_block: blk is NULL");
+
+    nTxOffset = get_varint_size(blk -> tx_count);
+
+    for(i = 0; i < blk -> tx_count; i++){
+	tx = blk -> tx + i;
+
+	res = kyk_tx_hash256(txid, tx);
+	check(res == 0, "Failed to kyk_txindex_batch_block: kyk_tx_hash256 failed");
+
+	res = kyk_get_tx_size(tx, &tx_size);
+	check(res == 0, "Failed to kyk_txindex_batch_block: kyk_get_tx_size failed");
+
+	len = pack_varint(val, (uint32_t)nFile);
+	len += pack_varint64(val + len, nDataPos);
+	len += pack_varint(val + len, nTxOffset);
+
+	txindex_key(key, txid);
+	leveldb_writebatch_put(batch, key, sizeof(key), (const char*)val, len);
+
+	nTxOffset += tx_size;
+    }
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* txid is in the byte order of kyk_tx_hash256 */
+int kyk_txindex_get(struct kyk_block_db* db,
+		    const uint8_t* txid,
+		    struct kyk_disk_tx_pos* pos,
+		    int* found)
+{
+    char key[TXINDEX_KEY_LEN];
+    char* val = NULL;
+    char* errptr = NULL;
+    const uint8_t* bufp = NULL;
+    size_t vlen = 0;
+    size_t len = 0;
+    size_t count = 0;
+    uint32_t nFile = 0;
+
+    check(db, "Failed to kyk_txindex_get: db is NULL");
+    check(txid, "Failed to kyk_txindex_get: txid is NULL");
+    check(pos, "Failed to kyk_txindex_get: pos is NULL");
+    check(found, "Failed to kyk_txindex_get: found is NULL");
+
+    *found = 0;
+
+    txindex_key(key, txid);
+    val = leveldb_get(db -> db, db -> rd_opts, key, sizeof(key), &vlen, &errptr);
+    check(errptr == NULL, "Failed to kyk_txindex_get: leveldb_get failed: %s", errptr);
+
+    if(val == NULL){
+	return 0;
+    }
+
+    bufp = (const uint8_t*)val;
+
+    len = read_varint(bufp, vlen, &nFile);
+    check(len > 0, "Failed to kyk_txindex_get: invalid nFile");
+    count += len;
+
+    len = read_varint64(bufp + count, vlen - count, &pos -> nPos);
+    check(len > 0, "Failed to kyk_txindex_get: invalid nPos");
+    count += len;
+
+    len = read_varint(bufp + count, vlen - count, &pos -> nTxOffset);
+    check(len > 0, "Failed to kyk_txindex_get: invalid nTxOffset");
+
+    pos -> nFile = (int)nFile;
+    *found = 1;
+
+    leveldb_free(val);
+
+    return 0;
+
+error:
+    if(errptr) leveldb_free(errptr);
+    if(val) leveldb_free(val);
+    return -1;
+}
+
+/* *built is 1 once the index has every block of the chain */
+int kyk_txindex_read_flag(struct kyk_block_db* db, int* built)
+{
+    char key[1 + sizeof(TXINDEX_FLAG_NAME) - 1];
+    char* val = NULL;
+    char* errptr = NULL;
+    size_t vlen = 0;
+
+    check(db, "Failed to kyk_txindex_read_flag: db is NULL");
+    check(built, "Failed to kyk_txindex_read_flag: built is NULL");
+
+    txindex_flag_key(key);
+    val = leveldb_get(db -> db, db -> rd_opts, key, sizeof(key), &vlen, &errptr);
+    check(errptr == NULL, "Failed to kyk_txindex_read_flag: leveldb_get failed: %s", errptr);
+
+    *built = val && vlen == 1 && val[0] == '1';
+
+    if(val) leveldb_free(val);
+
+    return 0;
+
+error:
+    if(errptr) leveldb_free(errptr);
+    return -1;
+}
+
+void kyk_txindex_batch_flag(leveldb_writebatch_t* batch, int built)
+{
+    char key[1 + sizeof(TXINDEX_FLAG_NAME) - 1];
+    char val = built ? '1' : '0';
+
+    txindex_flag_key(key);
+    leveldb_writebatch_put(batch, key, sizeof(key), &val, sizeof(val));
+}
+
+/* the key has the txid in internal byte order, like the 'b' key has the block hash */
+void txindex_key(char* key, const uint8_t* txid)
+{
+    key[0] = DB_TXINDEX;
+    memcpy(key + 1, txid, 32);
+    kyk_reverse((uint8_t*)key + 1, 32);
+}
+
+void txindex_flag_key(char* key)
+{
+    key[0] = DB_FLAG;
+    memcpy(key + 1, TXINDEX_FLAG_NAME, sizeof(TXINDEX_FLAG_NAME) - 1);
+}
@@ -0,0 +1,35 @@
+#ifndef KYK_TXINDEX_H__
+#define KYK_TXINDEX_H__
+
+#include <stdint.h>
+
+#include "kyk_ldb.h"
+#include "kyk_block.h"
+
+/*
+ * The tx index in the block index db, Core's layout:
+ * 't' | txid in internal byte order -> varint nFile | varint nPos | varint nTxOffset.
+ * nPos is the nDataPos of the block's 'b' record, the tx starts nTxOffset bytes past the block header.
+ * The 'F' "txindex" flag record is set once every block of the chain is in the index.
+ */
+struct kyk_disk_tx_pos {
+    int nFile;
+    uint64_t nPos;
+    uint32_t nTxOffset;
+};
+
+int kyk_txindex_batch_block(leveldb_writebatch_t* batch,
+			    const struct kyk_block* blk,
+			    int nFile,
+			    uint64_t nDataPos);
+
+int kyk_txindex_get(struct kyk_block_db* db,
+		    const uint8_t* txid,
+		    struct kyk_disk_tx_pos* pos,
+		    int* found);
+
+int kyk_txindex_read_flag(struct kyk_block_db* db, int* built);
+
+void kyk_txindex_batch_flag(leveldb_writebatch_t* batch, int built);
+
+#endif
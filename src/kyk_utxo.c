@@ -11,16 +11,10 @@
 #include "kyk_buff.h"
 #include "kyk_sha.h"
 #include "kyk_utxo.h"
+#include "kyk_utxo_set.h"
 #include "dbg.h"
 
 
-static int kyk_set_spent_utxo_with_txin(struct kyk_utxo_chain* utxo_chain,
-					const struct kyk_txin* txin);
-
-static int kyk_set_spent_utxo_within_tx(struct kyk_utxo_chain* utxo_chain,
-					const struct kyk_tx* tx);
-
-
 int kyk_free_utxo_chain(struct kyk_utxo_chain* utxo_chain)
 {
     struct kyk_utxo* curr;
@@ -59,6 +53,23 @@ int kyk_free_utxo(struct kyk_utxo* utxo)
     return 0;
 }
 
+/* the utxos are in one array, only what they point to is freed one by one */
+void kyk_free_utxo_list(struct kyk_utxo_list* utxo_list)
+{
+    size_t i = 0;
+
+    if(utxo_list){
+	if(utxo_list -> data){
+	    for(i = 0; i < utxo_list -> len; i++){
+		if(utxo_list -> data[i].btc_addr) free(utxo_list -> data[i].btc_addr);
+		if(utxo_list -> data[i].sc) free(utxo_list -> data[i].sc);
+	    }
+	    free(utxo_list -> data);
+	}
+	free(utxo_list);
+    }
+}
+
 int kyk_append_utxo_chain_from_block(struct kyk_utxo_chain* utxo_chain,
 				     const struct kyk_block* blk)
 {
@@ -861,20 +872,28 @@ error:
     return -1;
 }
 
+/* the nodes are shared with src_utxo_chain, the first of each repeated utxo is kept */
 int kyk_remove_repeated_utxo(struct kyk_utxo_chain** new_utxo_chain,
 			     const struct kyk_utxo_chain* src_utxo_chain)
 {
     struct kyk_utxo_chain* utxo_chain = NULL;
+    struct kyk_utxo_set* set = NULL;
     struct kyk_utxo* utxo = NULL;
     int res = -1;
 
+    check(new_utxo_chain, "Failed to kyk_remove_repeated_utxo: new_utxo_chain is NULL");
+    check(src_utxo_chain, "Failed to kyk_remove_repeated_utxo: src_utxo_chain is NULL");
+
     utxo_chain = calloc(1, sizeof(*utxo_chain));
     check(utxo_chain, "Failed to kyk_remove_repeated_utxo: calloc failed");
 
+    res = kyk_new_utxo_set(&set, src_utxo_chain -> len);
+    check(res == 0, "Failed to kyk_remove_repeated_utxo: kyk_new_utxo_set failed");
+
     utxo = src_utxo_chain -> hd;
     while(utxo){
-	res = kyk_utxo_chain_include_utxo(utxo_chain, utxo);
-	check(res >= 0, "Failed to kyk_remove_repeated_utxo: kyk_utxo_chain_include_utxo failed");
+	res = kyk_utxo_set_add(set, utxo);
+	check(res >= 0, "Failed to kyk_remove_repeated_utxo: kyk_utxo_set_add failed");
 	if(res == 0){
 	    res = kyk_utxo_chain_append_force(utxo_chain, utxo);
 	    check(res == 0, "Failed to kyk_remove_repeated_utxo: kyk_utxo_chain_append failed");
@@ -882,11 +901,14 @@ int kyk_remove_repeated_utxo(struct kyk_utxo_chain** new_utxo_chain,
 	utxo = utxo -> next;
     }
 
+    kyk_free_utxo_set(set);
+
     *new_utxo_chain = utxo_chain;
 
     return 0;
 
 error:
+    if(set) kyk_free_utxo_set(set);
     if(utxo_chain) free(utxo_chain);
     return -1;
 }
@@ -985,68 +1007,49 @@ error:
 }
 
 
+/* one pass over the chain against the set of outpoints the block's txins refer to */
 int kyk_set_spent_utxo_within_block(struct kyk_utxo_chain* utxo_chain,
 				    const struct kyk_block* blk)
 {
+    struct kyk_utxo_set* set = NULL;
+    struct kyk_utxo* utxo = NULL;
     const struct kyk_tx* tx = NULL;
+    const struct kyk_txin* txin = NULL;
     varint_t i = 0;
+    varint_t j = 0;
     int res = -1;
     
     check(utxo_chain, "Failed to kyk_set_spent_utxo_within_block: utxo_chain is NULL");
     check(utxo_chain -> hd, "Failed to kyk_set_spent_utxo_within_block: utxo_chain -> hd is NULL");
     check(blk, "Failed to kyk_set_spent_utxo_within_block: blk is NULL");
 
+    res = kyk_new_utxo_set(&set, 0);
+    check(res == 0, "Failed to kyk_set_spent_utxo_within_block: kyk_new_utxo_set failed");
+
     for(i = 0; i < blk -> tx_count; i++){
 	tx = blk -> tx + i;
-	res = kyk_set_spent_utxo_within_tx(utxo_chain, tx);
-	check(res == 0, "Failed to kyk_set_spent_utxo_within_block: kyk_set_spent_utxo_within_tx failed");
-    }
-
-    return 0;
-
-error:
-
-    return -1;
-}
-
-static int kyk_set_spent_utxo_within_tx(struct kyk_utxo_chain* utxo_chain,
-					const struct kyk_tx* tx)
-{    
-    const struct kyk_txin* txin = NULL;
-    varint_t i = 0;
-    
-    check(utxo_chain, "Failed to kyk_set_spent_utxo_within_tx: utxo_chain is NULL");
-    check(utxo_chain -> hd, "Failed to kyk_set_spent_utxo_within_tx: utxo_chain -> hd is NULL");
-    check(tx, "Failed to kyk_set_spent_utxo_within_tx: tx is NULL");
-
-    for(i = 0; i < tx -> vin_sz; i++){
-	txin = tx -> txin + i;
-	kyk_set_spent_utxo_with_txin(utxo_chain, txin);
+	for(j = 0; j < tx -> vin_sz; j++){
+	    txin = tx -> txin + j;
+	    res = kyk_utxo_set_add_outpoint(set, txin -> pre_txid, txin -> pre_txout_inx);
+	    check(res >= 0, "Failed to kyk_set_spent_utxo_within_block: kyk_utxo_set_add_outpoint failed");
+	}
     }
 
-    return 0;
-    
-error:
-
-    return -1;
-}
-
-static int kyk_set_spent_utxo_with_txin(struct kyk_utxo_chain* utxo_chain,
-					const struct kyk_txin* txin)
-{
-    struct kyk_utxo* utxo = NULL;
-    int res = -1;
-
     utxo = utxo_chain -> hd;
     while(utxo){
-	res = kyk_utxo_match_txin(utxo, txin);
-	if(res == 0){
+	if(kyk_utxo_set_find(set, utxo -> txid, utxo -> outidx)){
 	    utxo -> spent = 1;
 	}
 	utxo = utxo -> next;
     }
 
+    kyk_free_utxo_set(set);
+
     return 0;
+
+error:
+    if(set) kyk_free_utxo_set(set);
+    return -1;
 }
 
 int kyk_utxo_match_txin(const struct kyk_utxo* utxo,
@@ -29,6 +29,7 @@ struct kyk_utxo_list {
 
 int kyk_free_utxo_chain(struct kyk_utxo_chain* utxo_chain);
 int kyk_free_utxo(struct kyk_utxo* utxo);
+void kyk_free_utxo_list(struct kyk_utxo_list* utxo_list);
 
 int kyk_deseri_utxo(struct kyk_utxo** new_utxo,
 		    const uint8_t* buf,
@@ -0,0 +1,546 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "kyk_utils.h"
+#include "kyk_utxo_set.h"
+#include "dbg.h"
+
+#define UTXO_SET_MIN_CAP 16
+
+static uint64_t utxo_set_hash(const uint8_t* txid, uint32_t outidx);
+static int utxo_set_reserve(struct kyk_utxo_set* set);
+static int utxo_set_rebuild_slots(struct kyk_utxo_set* set, size_t slot_count);
+static int utxo_set_arena_push(struct kyk_utxo_set* set, const void* data, size_t len, size_t* off);
+static struct kyk_utxo_entry* utxo_set_lookup(const struct kyk_utxo_set* set,
+					      const uint8_t* txid,
+					      const uint8_t* blkhash,
+					      uint32_t outidx,
+					      int with_spent);
+static int utxo_set_insert(struct kyk_utxo_set* set,
+			   const struct kyk_utxo_entry* src,
+			   const uint8_t* sc,
+			   const char* btc_addr);
+
+int kyk_new_utxo_set(struct kyk_utxo_set** new_set, size_t cap)
+{
+    struct kyk_utxo_set* set = NULL;
+    size_t slot_count = 1;
+    int res = -1;
+
+    check(new_set, "Failed to kyk_new_utxo_set: new_set is NULL");
+
+    if(cap < UTXO_SET_MIN_CAP) cap = UTXO_SET_MIN_CAP;
+    while(slot_count < cap * 2) slot_count <<= 1;
+
+    set = calloc(1, sizeof(*set));
+    check(set, "Failed to kyk_new_utxo_set: calloc failed");
+
+    set -> entries = calloc(cap, sizeof(*set -> entries));
+    check(set -> entries, "Failed to kyk_new_utxo_set: entries calloc failed");
+    set -> cap = cap;
+
+    res = utxo_set_rebuild_slots(set, slot_count);
+    check(res == 0, "Failed to kyk_new_utxo_set: utxo_set_rebuild_slots failed");
+
+    *new_set = set;
+
+    return 0;
+
+error:
+    if(set) kyk_free_utxo_set(set);
+    return -1;
+}
+
+void kyk_free_utxo_set(struct kyk_utxo_set* set)
+{
+    if(set){
+	if(set -> entries) free(set -> entries);
+	if(set -> slots) free(set -> slots);
+	if(set -> arena) free(set -> arena);
+	free(set);
+    }
+}
+
+/* 0 if the utxo is added, 1 if the set has it already */
+int kyk_utxo_set_add(struct kyk_utxo_set* set, struct kyk_utxo* utxo)
+{
+    struct kyk_utxo_entry entry;
+
+    check(set, "Failed to kyk_utxo_set_add: set is NULL");
+    check(utxo, "Failed to kyk_utxo_set_add: utxo is NULL");
+
+    memset(&entry, 0, sizeof(entry));
+    memcpy(entry.txid, utxo -> txid, sizeof(entry.txid));
+    memcpy(entry.blkhash, utxo -> blkhash, sizeof(entry.blkhash));
+    entry.outidx = utxo -> outidx;
+    entry.spent = utxo -> spent;
+    entry.addr_len = utxo -> btc_addr ? utxo -> addr_len : 0;
+    entry.sc_size = utxo -> sc ? utxo -> sc_size : 0;
+    entry.value = utxo -> value;
+    entry.node = utxo;
+
+    return utxo_set_insert(set, &entry, utxo -> sc, utxo -> btc_addr);
+
+error:
+
+    return -1;
+}
+
+/* a bare outpoint, for sets that are only asked whether an output is referred to */
+int kyk_utxo_set_add_outpoint(struct kyk_utxo_set* set,
+			      const uint8_t* txid,
+			      uint32_t outidx)
+{
+    struct kyk_utxo_entry entry;
+
+    check(set, "Failed to kyk_utxo_set_add_outpoint: set is NULL");
+    check(txid, "Failed to kyk_utxo_set_add_outpoint: txid is NULL");
+
+    memset(&entry, 0, sizeof(entry));
+    memcpy(entry.txid, txid, sizeof(entry.txid));
+    entry.outidx = outidx;
+
+    return utxo_set_insert(set, &entry, NULL, NULL);
+
+error:
+
+    return -1;
+}
+
+/* the first unspent entry added for the outpoint, whatever its block */
+struct kyk_utxo_entry* kyk_utxo_set_find(const struct kyk_utxo_set* set,
+					 const uint8_t* txid,
+					 uint32_t outidx)
+{
+    return utxo_set_lookup(set, txid, NULL, outidx, 0);
+}
+
+/* the first entry added for the outpoint, spent or not */
+struct kyk_utxo_entry* kyk_utxo_set_find_outpoint(const struct kyk_utxo_set* set,
+						  const uint8_t* txid,
+						  uint32_t outidx)
+{
+    return utxo_set_lookup(set, txid, NULL, outidx, 1);
+}
+
+struct kyk_utxo_entry* kyk_utxo_set_find_utxo(const struct kyk_utxo_set* set,
+					      const struct kyk_utxo* utxo)
+{
+    return utxo_set_lookup(set, utxo -> txid, utxo -> blkhash, utxo -> outidx, 0);
+}
+
+/* the entry for the utxo even if it is spent */
+struct kyk_utxo_entry* kyk_utxo_set_find_entry(const struct kyk_utxo_set* set,
+					       const struct kyk_utxo* utxo)
+{
+    return utxo_set_lookup(set, utxo -> txid, utxo -> blkhash, utxo -> outidx, 1);
+}
+
+/* marks every unspent copy of the outpoint spent, returns how many there were */
+int kyk_utxo_set_spend(struct kyk_utxo_set* set,
+		       const uint8_t* txid,
+		       uint32_t outidx)
+{
+    struct kyk_utxo_entry* entry = NULL;
+    size_t mask = 0;
+    size_t i = 0;
+    int count = 0;
+
+    check(set, "Failed to kyk_utxo_set_spend: set is NULL");
+    check(txid, "Failed to kyk_utxo_set_spend: txid is NULL");
+
+    mask = set -> slot_count - 1;
+    for(i = utxo_set_hash(txid, outidx) & mask; set -> slots[i]; i = (i + 1) & mask){
+	entry = set -> entries + set -> slots[i] - 1;
+	if(entry -> spent || entry -> outidx != outidx) continue;
+	if(memcmp(entry -> txid, txid, sizeof(entry -> txid)) != 0) continue;
+	entry -> spent = 1;
+	set -> spent_count++;
+	count++;
+    }
+
+    return count;
+
+error:
+
+    return -1;
+}
+
+/* spends the one entry, returns 0 if it was spent already */
+int kyk_utxo_set_spend_entry(struct kyk_utxo_set* set, struct kyk_utxo_entry* entry)
+{
+    check(set, "Failed to kyk_utxo_set_spend_entry: set is NULL");
+    check(entry >= set -> entries && entry < set -> entries + set -> len, "Failed to kyk_utxo_set_spend_entry: entry is not in the set");
+
+    if(entry -> spent){
+	return 0;
+    }
+
+    entry -> spent = 1;
+    set -> spent_count++;
+
+    return 1;
+
+error:
+
+    return -1;
+}
+
+/* every output of every tx in the block, in block order */
+int kyk_utxo_set_add_block(struct kyk_utxo_set* set, const struct kyk_block* blk)
+{
+    struct kyk_utxo_entry entry;
+    const struct kyk_tx* tx = NULL;
+    const struct kyk_txout* txout = NULL;
+    char* btc_addr = NULL;
+    varint_t i = 0;
+    varint_t j = 0;
+    int res = -1;
+
+    check(set, "Failed to kyk_utxo_set_add_block: set is NULL");
+    check(blk, "Failed to kyk_utxo_set_add_block: blk is NULL");
+    check(blk -> hd, "Failed to kyk_utxo_set_add_block: blk -> hd is NULL");
+
+    memset(&entry, 0, sizeof(entry));
+
+    res = kyk_blk_hash256(entry.blkhash, blk -> hd);
+    check(res == 0, "Failed to kyk_utxo_set_add_block: kyk_blk_hash256 failed");
+
+    for(i = 0; i < blk -> tx_count; i++){
+	tx = blk -> tx + i;
+	res = kyk_tx_hash256(entry.txid, tx);
+	check(res == 0, "Failed to kyk_utxo_set_add_block: kyk_tx_hash256 failed");
+
+	for(j = 0; j < tx -> vout_sz; j++){
+	    txout = tx -> txout + j;
+	    res = kyk_get_addr_from_txout(&btc_addr, txout);
+	    check(res == 0, "Failed to kyk_utxo_set_add_block: kyk_get_addr_from_txout failed");
+
+	    entry.outidx = j;
+	    entry.addr_len = strlen(btc_addr);
+	    entry.sc_size = txout -> sc_size;
+	    entry.value = txout -> value;
+
+	    res = utxo_set_insert(set, &entry, txout -> sc, btc_addr);
+	    check(res >= 0, "Failed to kyk_utxo_set_add_block: utxo_set_insert failed");
+
+	    free(btc_addr);
+	    btc_addr = NULL;
+	}
+    }
+
+    return 0;
+
+error:
+    if(btc_addr) free(btc_addr);
+    return -1;
+}
+
+/* spends the outputs the block's txins refer to */
+int kyk_utxo_set_spend_block(struct kyk_utxo_set* set, const struct kyk_block* blk)
+{
+    const struct kyk_tx* tx = NULL;
+    const struct kyk_txin* txin = NULL;
+    varint_t i = 0;
+    varint_t j = 0;
+    int res = -1;
+
+    check(set, "Failed to kyk_utxo_set_spend_block: set is NULL");
+    check(blk, "Failed to kyk_utxo_set_spend_block: blk is NULL");
+
+    for(i = 0; i < blk -> tx_count; i++){
+	tx = blk -> tx + i;
+	for(j = 0; j < tx -> vin_sz; j++){
+	    txin = tx -> txin + j;
+	    res = kyk_utxo_set_spend(set, txin -> pre_txid, txin -> pre_txout_inx);
+	    check(res >= 0, "Failed to kyk_utxo_set_spend_block: kyk_utxo_set_spend failed");
+	}
+    }
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* entries point back to the chain nodes, repeated utxos are added once */
+int kyk_utxo_set_from_chain(struct kyk_utxo_set* set, const struct kyk_utxo_chain* utxo_chain)
+{
+    struct kyk_utxo* utxo = NULL;
+    size_t i = 0;
+    int res = -1;
+
+    check(set, "Failed to kyk_utxo_set_from_chain: set is NULL");
+    check(utxo_chain, "Failed to kyk_utxo_set_from_chain: utxo_chain is NULL");
+
+    utxo = utxo_chain -> hd;
+    for(i = 0; i < utxo_chain -> len && utxo; i++){
+	res = kyk_utxo_set_add(set, utxo);
+	check(res >= 0, "Failed to kyk_utxo_set_from_chain: kyk_utxo_set_add failed");
+	utxo = utxo -> next;
+    }
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* a new chain of fresh nodes holding the unspent entries in the order they were added */
+int kyk_utxo_set_to_new_chain(struct kyk_utxo_chain** new_utxo_chain, const struct kyk_utxo_set* set)
+{
+    struct kyk_utxo_chain* utxo_chain = NULL;
+    struct kyk_utxo* utxo = NULL;
+    const struct kyk_utxo_entry* entry = NULL;
+    size_t i = 0;
+    int res = -1;
+
+    check(new_utxo_chain, "Failed to kyk_utxo_set_to_new_chain: new_utxo_chain is NULL");
+    check(set, "Failed to kyk_utxo_set_to_new_chain: set is NULL");
+
+    utxo_chain = calloc(1, sizeof(*utxo_chain));
+    check(utxo_chain, "Failed to kyk_utxo_set_to_new_chain: calloc failed");
+    kyk_init_utxo_chain(utxo_chain);
+
+    for(i = 0; i < set -> len; i++){
+	entry = set -> entries + i;
+	if(entry -> spent) continue;
+
+	utxo = calloc(1, sizeof(*utxo));
+	check(utxo, "Failed to kyk_utxo_set_to_new_chain: utxo calloc failed");
+
+	res = kyk_utxo_entry_to_utxo(utxo, set, entry);
+	check(res == 0, "Failed to kyk_utxo_set_to_new_chain: kyk_utxo_entry_to_utxo failed");
+
+	res = kyk_utxo_chain_append(utxo_chain, utxo);
+	check(res == 0, "Failed to kyk_utxo_set_to_new_chain: kyk_utxo_chain_append failed");
+	utxo = NULL;
+    }
+
+    *new_utxo_chain = utxo_chain;
+
+    return 0;
+
+error:
+    if(utxo) kyk_free_utxo(utxo);
+    if(utxo_chain) kyk_free_utxo_chain(utxo_chain);
+    return -1;
+}
+
+int kyk_utxo_entry_to_utxo(struct kyk_utxo* utxo,
+			   const struct kyk_utxo_set* set,
+			   const struct kyk_utxo_entry* entry)
+{
+    check(utxo, "Failed to kyk_utxo_entry_to_utxo: utxo is NULL");
+    check(utxo -> btc_addr == NULL, "Failed to kyk_utxo_entry_to_utxo: utxo -> btc_addr should be NULL");
+    check(utxo -> sc == NULL, "Failed to kyk_utxo_entry_to_utxo: utxo -> sc should be NULL");
+    check(set, "Failed to kyk_utxo_entry_to_utxo: set is NULL");
+    check(entry, "Failed to kyk_utxo_entry_to_utxo: entry is NULL");
+
+    memcpy(utxo -> txid, entry -> txid, sizeof(utxo -> txid));
+    memcpy(utxo -> blkhash, entry -> blkhash, sizeof(utxo -> blkhash));
+
+    utxo -> addr_len = entry -> addr_len;
+    utxo -> btc_addr = calloc(utxo -> addr_len + 1, sizeof(*utxo -> btc_addr));
+    check(utxo -> btc_addr, "Failed to kyk_utxo_entry_to_utxo: utxo -> btc_addr calloc failed");
+    memcpy(utxo -> btc_addr, set -> arena + entry -> addr_off, utxo -> addr_len);
+
+    utxo -> outidx = entry -> outidx;
+    utxo -> value = entry -> value;
+
+    utxo -> sc_size = entry -> sc_size;
+    utxo -> sc = calloc(utxo -> sc_size + 1, sizeof(*utxo -> sc));
+    check(utxo -> sc, "Failed to kyk_utxo_entry_to_utxo: utxo -> sc calloc failed");
+    memcpy(utxo -> sc, set -> arena + entry -> sc_off, utxo -> sc_size);
+
+    utxo -> spent = entry -> spent;
+    utxo -> next = NULL;
+    utxo -> refer_to = NULL;
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* txids are hashes already, their leading bytes spread well enough */
+uint64_t utxo_set_hash(const uint8_t* txid, uint32_t outidx)
+{
+    uint64_t h = 0;
+
+    memcpy(&h, txid, sizeof(h));
+
+    return h ^ ((uint64_t)outidx * 0x9E3779B97F4A7C15ULL);
+}
+
+/* blkhash NULL matches any block */
+struct kyk_utxo_entry* utxo_set_lookup(const struct kyk_utxo_set* set,
+				       const uint8_t* txid,
+				       const uint8_t* blkhash,
+				       uint32_t outidx,
+				       int with_spent)
+{
+    struct kyk_utxo_entry* entry = NULL;
+    size_t mask = 0;
+    size_t i = 0;
+
+    if(set == NULL || txid == NULL) return NULL;
+
+    mask = set -> slot_count - 1;
+    for(i = utxo_set_hash(txid, outidx) & mask; set -> slots[i]; i = (i + 1) & mask){
+	entry = set -> entries + set -> slots[i] - 1;
+	if((entry -> spent && !with_spent) || entry -> outidx != outidx) continue;
+	if(memcmp(entry -> txid, txid, sizeof(entry -> txid)) != 0) continue;
+	if(blkhash && memcmp(entry -> blkhash, blkhash, sizeof(entry -> blkhash)) != 0) continue;
+	return entry;
+    }
+
+    return NULL;
+}
+
+/* 0 if added, 1 if the set has it already, spent or not */
+int utxo_set_insert(struct kyk_utxo_set* set,
+		    const struct kyk_utxo_entry* src,
+		    const uint8_t* sc,
+		    const char* btc_addr)
+{
+    struct kyk_utxo_entry* entry = NULL;
+    size_t mask = 0;
+    size_t i = 0;
+    int res = -1;
+
+    if(utxo_set_lookup(set, src -> txid, src -> blkhash, src -> outidx, 1)){
+	return 1;
+    }
+
+    res = utxo_set_reserve(set);
+    check(res == 0, "Failed to utxo_set_insert: utxo_set_reserve failed");
+
+    entry = set -> entries + set -> len;
+    *entry = *src;
+
+    res = utxo_set_arena_push(set, sc, entry -> sc_size, &entry -> sc_off);
+    check(res == 0, "Failed to utxo_set_insert: utxo_set_arena_push failed");
+
+    res = utxo_set_arena_push(set, btc_addr, entry -> addr_len, &entry -> addr_off);
+    check(res == 0, "Failed to utxo_set_insert: utxo_set_arena_push failed");
+
+    mask = set -> slot_count - 1;
+    for(i = utxo_set_hash(entry -> txid, entry -> outidx) & mask; set -> slots[i]; i = (i + 1) & mask);
+    set -> slots[i] = (uint32_t)(set -> len + 1);
+
+    if(entry -> spent) set -> spent_count++;
+    set -> len++;
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/*
+ * Room for one more entry.
+ * A full array is compacted when half of it is spent, otherwise it doubles.
+ */
+int utxo_set_reserve(struct kyk_utxo_set* set)
+{
+    struct kyk_utxo_entry* entries = NULL;
+    size_t cap = 0;
+    size_t len = 0;
+    size_t i = 0;
+    int res = -1;
+
+    if(set -> len < set -> cap){
+	return 0;
+    }
+
+    if(!set -> keep_spent && set -> spent_count * 2 >= set -> len){
+	for(i = 0; i < set -> len; i++){
+	    if(set -> entries[i].spent) continue;
+	    set -> entries[len++] = set -> entries[i];
+	}
+	set -> len = len;
+	set -> spent_count = 0;
+	return utxo_set_rebuild_slots(set, set -> slot_count);
+    }
+
+    cap = set -> cap * 2;
+    check(cap < UINT32_MAX, "Failed to utxo_set_reserve: set is too large");
+
+    entries = realloc(set -> entries, cap * sizeof(*entries));
+    check(entries, "Failed to utxo_set_reserve: realloc failed");
+    set -> entries = entries;
+    set -> cap = cap;
+
+    res = utxo_set_rebuild_slots(set, set -> slot_count * 2);
+    check(res == 0, "Failed to utxo_set_reserve: utxo_set_rebuild_slots failed");
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/* entries go back in insertion order, so equal outpoints keep their probe order */
+int utxo_set_rebuild_slots(struct kyk_utxo_set* set, size_t slot_count)
+{
+    uint32_t* slots = NULL;
+    size_t mask = slot_count - 1;
+    size_t i = 0;
+    size_t j = 0;
+
+    slots = calloc(slot_count, sizeof(*slots));
+    check(slots, "Failed to utxo_set_rebuild_slots: calloc failed");
+
+    for(i = 0; i < set -> len; i++){
+	for(j = utxo_set_hash(set -> entries[i].txid, set -> entries[i].outidx) & mask; slots[j]; j = (j + 1) & mask);
+	slots[j] = (uint32_t)(i + 1);
+    }
+
+    if(set -> slots) free(set -> slots);
+    set -> slots = slots;
+    set -> slot_count = slot_count;
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+int utxo_set_arena_push(struct kyk_utxo_set* set, const void* data, size_t len, size_t* off)
+{
+    uint8_t* arena = NULL;
+    size_t cap = 0;
+
+    *off = set -> arena_len;
+
+    if(len == 0){
+	return 0;
+    }
+
+    if(set -> arena_len + len > set -> arena_cap){
+	cap = set -> arena_cap ? set -> arena_cap : 1024;
+	while(cap < set -> arena_len + len) cap *= 2;
+	arena = realloc(set -> arena, cap);
+	check(arena, "Failed to utxo_set_arena_push: realloc failed");
+	set -> arena = arena;
+	set -> arena_cap = cap;
+    }
+
+    memcpy(set -> arena + set -> arena_len, data, len);
+    set -> arena_len += len;
+
+    return 0;
+
+error:
+
+    return -1;
+}
@@ -0,0 +1,90 @@
+#ifndef KYK_UTXO_SET_H__
+#define KYK_UTXO_SET_H__
+
+#include "varint.h"
+#include "kyk_tx.h"
+#include "kyk_block.h"
+#include "kyk_utxo.h"
+
+/*
+ * One output in a utxo set, stored inline.
+ * The script and the address live in the set's arena.
+ */
+struct kyk_utxo_entry {
+    uint8_t  txid[32];
+    uint8_t  blkhash[32];
+    uint32_t outidx;
+    uint8_t  spent;
+    uint8_t  addr_len;
+    uint32_t sc_size;
+    uint64_t value;
+    size_t   sc_off;
+    size_t   addr_off;
+    struct kyk_utxo* node;   /* the chain node the entry was added from, NULL if none */
+};
+
+/*
+ * Utxo set, an entry is the same utxo as kyk_cmp_utxo says: same txid, blkhash and outidx.
+ * Entries are kept in insertion order in one array, slots is a linear probing
+ * index into it hashed on (txid, outidx) only, so the copies of a coinbase output
+ * found in several blocks sit in one probe run and a txin reaches all of them.
+ * A spent entry stays in place and is skipped, it is dropped the next time the array is compacted
+ * unless keep_spent is set.
+ * Entry pointers are only good until the next add.
+ */
+struct kyk_utxo_set {
+    struct kyk_utxo_entry* entries;
+    size_t len;              /* entries used, spent ones included */
+    size_t cap;
+    size_t spent_count;
+    int keep_spent;          /* spent entries are kept until the set is freed, the array only grows */
+    uint32_t* slots;         /* entry index + 1, 0 is an empty slot */
+    size_t slot_count;       /* a power of two, at least twice cap */
+    uint8_t* arena;
+    size_t arena_len;
+    size_t arena_cap;
+};
+
+int kyk_new_utxo_set(struct kyk_utxo_set** new_set, size_t cap);
+
+void kyk_free_utxo_set(struct kyk_utxo_set* set);
+
+int kyk_utxo_set_add(struct kyk_utxo_set* set, struct kyk_utxo* utxo);
+
+int kyk_utxo_set_add_outpoint(struct kyk_utxo_set* set,
+			      const uint8_t* txid,
+			      uint32_t outidx);
+
+struct kyk_utxo_entry* kyk_utxo_set_find(const struct kyk_utxo_set* set,
+					 const uint8_t* txid,
+					 uint32_t outidx);
+
+struct kyk_utxo_entry* kyk_utxo_set_find_outpoint(const struct kyk_utxo_set* set,
+						  const uint8_t* txid,
+						  uint32_t outidx);
+
+struct kyk_utxo_entry* kyk_utxo_set_find_utxo(const struct kyk_utxo_set* set,
+					      const struct kyk_utxo* utxo);
+
+struct kyk_utxo_entry* kyk_utxo_set_find_entry(const struct kyk_utxo_set* set,
+					       const struct kyk_utxo* utxo);
+
+int kyk_utxo_set_spend(struct kyk_utxo_set* set,
+		       const uint8_t* txid,
+		       uint32_t outidx);
+
+int kyk_utxo_set_spend_entry(struct kyk_utxo_set* set, struct kyk_utxo_entry* entry);
+
+int kyk_utxo_set_add_block(struct kyk_utxo_set* set, const struct kyk_block* blk);
+
+int kyk_utxo_set_spend_block(struct kyk_utxo_set* set, const struct kyk_block* blk);
+
+int kyk_utxo_set_from_chain(struct kyk_utxo_set* set, const struct kyk_utxo_chain* utxo_chain);
+
+int kyk_utxo_set_to_new_chain(struct kyk_utxo_chain** new_utxo_chain, const struct kyk_utxo_set* set);
+
+int kyk_utxo_entry_to_utxo(struct kyk_utxo* utxo,
+			   const struct kyk_utxo_set* set,
+			   const struct kyk_utxo_entry* entry);
+
+#endif
@@ -81,24 +81,21 @@ error:
 
 int validate_hd_bts(const struct kyk_blk_header* hd)
 {
-    mpz_t tg, hs;
+    struct kyk_target tg;
+    struct kyk_blk_hd_hasher hasher;
     uint8_t digest[SHA256_DIGEST_LENGTH];
     int res = -1;
 
-    mpz_init(tg);
-    mpz_set_ui(tg, 0);
-
-    mpz_init(hs);
-    mpz_set_ui(hs, 0);
-
     /* bts to target */
-    kyk_bts2target(hd -> bts, tg);
+    res = kyk_bts2target256(hd -> bts, &tg);
+    check(res == 0, "Failed to validate_hd_bts: kyk_bts2target256 failed");
+
+    res = kyk_init_blk_hd_hasher(&hasher, hd);
+    check(res == 0, "Failed to validate_hd_bts: kyk_init_blk_hd_hasher failed");
 
-    res = kyk_blk_hash256(digest, hd);
-    check(res == 0, "Failed to validate_hd_bts: kyk_blk_hash256 failed");
+    kyk_blk_hd_hasher_hash(&hasher, digest, hd -> nonce);
 
-    mpz_import(hs, sizeof(digest), 1, 1, 1, 0, digest);
-    check(mpz_cmp(hs, tg) <= 0, "Failed to validate_hd_bts: block hash dosen't reach target");
+    check(kyk_digest_meets_target(digest, &tg), "Failed to validate_hd_bts: block hash dosen't reach target");
 
     return 0;
     
@@ -112,7 +109,6 @@ int validate_hd_mkl_root(const struct kyk_blk_header* hd,
 			 const struct kyk_tx* tx_list,
 			 varint_t tx_count)
 {
-    struct kyk_mkltree_level* mkl_root = NULL;
     uint8_t digest[MKL_NODE_BODY_LEN];
     int res = -1;
 
@@ -120,20 +116,16 @@ int validate_hd_mkl_root(const struct kyk_blk_header* hd,
     check(tx_list, "Failed to validate_hd_mkl_root: tx_list is NULL");
     check(tx_count >= 1, "Failed to validate_hd_mkl_root: tx_count is invalid");
 
-    mkl_root = kyk_make_mkl_tree_root_from_tx_list(tx_list, tx_count);
-    check(mkl_root, "Failed to validate_hd_mkl_root: kyk_make_mkl_tree_root_from_tx_list failed");
-
-    kyk_cpy_mkl_root_value(digest, mkl_root);
+    res = kyk_mkl_root_from_tx_list(digest, tx_list, tx_count);
+    check(res == 0, "Failed to validate_hd_mkl_root: kyk_mkl_root_from_tx_list failed");
 
     res = kyk_digest_eq(hd -> mrk_root_hash, digest, sizeof(digest));
     check(res == 1, "Failed to validate_hd_mkl_root: hd -> mrk_root_hash is invalide");
 
-    kyk_free_mkl_tree(mkl_root);
-    
     return 0;
     
 error:
-    if(mkl_root) kyk_free_mkl_tree(mkl_root);
+
     return -1;
 }
 
@@ -5,12 +5,12 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 
 #include "kyk_utils.h"
 #include "gens_block.h"
 #include "block_store.h"
 #include "kyk_ldb.h"
-#include "kyk_blk_file.h"
 #include "kyk_ser.h"
 #include "kyk_buff.h"
 #include "kyk_key.h"
@@ -18,22 +18,40 @@
 #include "kyk_config.h"
 #include "beej_pack.h"
 #include "kyk_utxo.h"
+#include "kyk_utxo_set.h"
+#include "kyk_chainstate.h"
+#include "kyk_hd_file.h"
+#include "kyk_blk_reader.h"
+#include "kyk_blk_writer.h"
+#include "kyk_txindex.h"
 #include "kyk_wallet.h"
 #include "kyk_validate.h"
+#include "kyk_hash_nonce.h"
+#include "kyk_script.h"
+#include "kyk_message.h"
 #include "dbg.h"
 
 #define WCFG_NUM_KEYS "numKeys"
+#define WCFG_MINER_THREADS "minerThreads"
+#define WCFG_LDB_CACHE_SIZE "ldbCacheSize"
+#define WCFG_LDB_BLOOM_BITS "ldbBloomBits"
+#define WCFG_LDB_COMPRESSION "ldbCompression"
+#define WCFG_LDB_WRITE_BUFFER_SIZE "ldbWriteBufferSize"
+#define WCFG_LDB_MAX_OPEN_FILES "ldbMaxOpenFiles"
+#define WCFG_LDB_VERIFY_CHECKSUMS "ldbVerifyChecksums"
+#define WCFG_LDB_FILL_CACHE "ldbFillCache"
+#define WCFG_LDB_BULK_LOAD "ldbBulkLoad"
+#define WCFG_TXINDEX "txIndex"
 #define MAIN_ADDR_LABEL "Main Miner Address"
 
 static void set_init_bval(struct kyk_bkey_val *bval,
 			  const struct kyk_block* blk,
-			  const struct kyk_blk_file* blk_file);
+			  int nFile,
+			  uint64_t nDataPos);
 
 static int kyk_load_wallet_cfg(struct kyk_wallet* wallet);
 
 static int save_setup_data_to_wallet(struct kyk_wallet *wallet);
-static int kyk_save_blk_to_file(struct kyk_blk_file* blk_file,
-				const struct kyk_block* blk);
 
 static int kyk_setup_main_address(struct kyk_wallet* wallet);
 
@@ -43,6 +61,16 @@ static int get_address(const struct KeyValuePair* ev, char** new_addr);
 
 static void free_addr_list(char** addr_list, size_t len);
 
+static int kyk_wallet_load_miner_threads(const struct kyk_wallet* wallet);
+
+static int kyk_wallet_load_db_opts(const struct kyk_wallet* wallet, struct kyk_db_opts* opts, int* txindex);
+
+static int kyk_wallet_init_chainstate(struct kyk_wallet* wallet);
+static int kyk_wallet_recover_chainstate(struct kyk_wallet* wallet);
+static int kyk_wallet_init_txindex(struct kyk_wallet* wallet);
+static int kyk_load_utxo_chain_from_file(struct kyk_utxo_chain** new_utxo_chain,
+					 const struct kyk_wallet* wallet);
+
 int kyk_setup_spv_wallet(struct kyk_wallet** new_wallet, const char* wdir)
 {
     int res = -1;
@@ -153,18 +181,39 @@ int kyk_init_wallet(struct kyk_wallet* wallet)
     int res = -1;
 
     struct kyk_block_db* blk_inx_db = NULL;
+    struct kyk_db_opts db_opts;
+    int txindex = 0;
 
     check(wallet, "Failed to kyk_init_wallet: wallet is NULL");
     check(wallet -> wdir, "Failed to kyk_init_wallet: wallet -> wdir is NULL");
     check(wallet -> idx_db_path, "Failed to kyk_init_wallet: wallet -> idx_db_path is NULL");
 
+    res = kyk_wallet_load_db_opts(wallet, &db_opts, &txindex);
+    check(res == 0, "Failed to kyk_init_wallet: kyk_wallet_load_db_opts failed");
+
     blk_inx_db = calloc(1, sizeof *blk_inx_db);
     check(blk_inx_db, "Failed to kyk_init_wallet: blk_inx_db calloc failed");
 
     wallet -> blk_index_db = blk_inx_db;
-    res = kyk_init_store_db(wallet -> blk_index_db, wallet -> idx_db_path);
-    check(res == 0, "Failed to kyk_init_wallet: kyk_init_store_db failed");
+    res = kyk_open_store_db(wallet -> blk_index_db, wallet -> idx_db_path, &db_opts);
+    check(res == 0, "Failed to kyk_init_wallet: kyk_open_store_db failed");
     check(wallet -> blk_index_db -> errptr == NULL, "failed to init block index db");
+    wallet -> blk_index_db -> txindex = txindex;
+
+    res = kyk_wallet_init_chainstate(wallet);
+    check(res == 0, "Failed to kyk_init_wallet: kyk_wallet_init_chainstate failed");
+
+    res = kyk_new_blk_reader(&wallet -> blk_reader, wallet -> blk_dir, KYK_BLK_CACHE_MAX);
+    check(res == 0, "Failed to kyk_init_wallet: kyk_new_blk_reader failed");
+
+    res = kyk_new_blk_writer(&wallet -> blk_writer, wallet -> blk_dir, wallet -> blk_index_db, KYK_BLK_FILE_MAX, KYK_BLK_FILE_CHUNK);
+    check(res == 0, "Failed to kyk_init_wallet: kyk_new_blk_writer failed");
+
+    res = kyk_wallet_recover_chainstate(wallet);
+    check(res == 0, "Failed to kyk_init_wallet: kyk_wallet_recover_chainstate failed");
+
+    res = kyk_wallet_init_txindex(wallet);
+    check(res == 0, "Failed to kyk_init_wallet: kyk_wallet_init_txindex failed");
 
     res = kyk_load_wallet_cfg(wallet);
     check(res == 0, "Failed to kyk_init_wallet: kyk_load_wallet_cfg failed");
@@ -176,6 +225,270 @@ error:
     return -1;
 }
 
+/*
+ * The utxo set lives in the block index db from now on,
+ * a wallet that has no best block record there yet gets the coins of its utxo.dat imported once,
+ * as the coins at the tip of its header chain.
+ */
+int kyk_wallet_init_chainstate(struct kyk_wallet* wallet)
+{
+    struct kyk_chainstate* cs = NULL;
+    struct kyk_utxo_chain* utxo_chain = NULL;
+    struct kyk_blk_hd_chain* hd_chain = NULL;
+    struct stat st;
+    int bulk_load = wallet -> blk_index_db -> opts.bulk_load;
+    int res = -1;
+
+    res = kyk_new_chainstate(&cs, wallet -> blk_index_db, KYK_COINS_CACHE_MAX, KYK_COINS_FLUSH_BLOCKS);
+    check(res == 0, "Failed to kyk_wallet_init_chainstate: kyk_new_chainstate failed");
+
+    if(cs -> has_best == 0){
+	res = kyk_load_utxo_chain_from_file(&utxo_chain, wallet);
+	check(res == 0, "Failed to kyk_wallet_init_chainstate: kyk_load_utxo_chain_from_file failed");
+
+	/* a new wallet has no headers yet, its coins are the ones before block 1 */
+	if(stat(wallet -> blk_hd_chain_path, &st) == 0 && st.st_size >= KYK_BLK_HD_LEN){
+	    res = kyk_load_blk_header_chain(&hd_chain, wallet);
+	    check(res == 0, "Failed to kyk_wallet_init_chainstate: kyk_load_blk_header_chain failed");
+	    kyk_blk_hash256(cs -> best_hash, hd_chain -> hd_list + hd_chain -> len - 1);
+	    kyk_free_blk_hd_chain(hd_chain);
+	    hd_chain = NULL;
+	}
+
+	if(utxo_chain -> len > 0){
+	    res = kyk_store_db_set_bulk_load(wallet -> blk_index_db, 1);
+	    check(res == 0, "Failed to kyk_wallet_init_chainstate: kyk_store_db_set_bulk_load failed");
+	}
+
+	res = kyk_chainstate_replace_utxo_chain(cs, utxo_chain);
+	check(res == 0, "Failed to kyk_wallet_init_chainstate: kyk_chainstate_replace_utxo_chain failed");
+
+	res = kyk_store_db_set_bulk_load(wallet -> blk_index_db, bulk_load);
+	check(res == 0, "Failed to kyk_wallet_init_chainstate: kyk_store_db_set_bulk_load failed");
+
+	kyk_free_utxo_chain(utxo_chain);
+	utxo_chain = NULL;
+    }
+
+    wallet -> chainstate = cs;
+
+    return 0;
+
+error:
+    kyk_store_db_set_bulk_load(wallet -> blk_index_db, bulk_load);
+    if(utxo_chain) kyk_free_utxo_chain(utxo_chain);
+    if(hd_chain) kyk_free_blk_hd_chain(hd_chain);
+    if(cs) kyk_free_chainstate(cs);
+    return -1;
+}
+
+/*
+ * The 'H' record names the last block kyk_wallet_connect_block wrote,
+ * the chainstate flushes less often and its best block may be behind it.
+ * The blocks in between are connected again from the blk files,
+ * a header that did not make it to the header file after its batch is appended.
+ * Wallets that never connected a block, like the spv ones, have no 'H' record.
+ */
+int kyk_wallet_recover_chainstate(struct kyk_wallet* wallet)
+{
+    struct kyk_blk_hd_chain* hd_chain = NULL;
+    struct kyk_hd_index* hd_index = NULL;
+    struct kyk_bkey_val* bval = NULL;
+    struct kyk_block* blk = NULL;
+    struct kyk_chainstate* cs = wallet -> chainstate;
+    uint8_t head_hash[32];
+    uint8_t zero_hash[32];
+    uint8_t digest[32];
+    char* errptr = NULL;
+    int bulk_load = wallet -> blk_index_db -> opts.bulk_load;
+    size_t head_height = 0;
+    size_t height = 0;
+    size_t i = 0;
+    int found = 0;
+    int res = -1;
+
+    res = kyk_read_head_block(wallet -> blk_index_db, head_hash, &found);
+    check(res == 0, "Failed to kyk_wallet_recover_chainstate: kyk_read_head_block failed");
+
+    if(found == 0 || kyk_digest_eq(head_hash, cs -> best_hash, sizeof(head_hash))){
+	return 0;
+    }
+
+    res = kyk_load_blk_header_chain(&hd_chain, wallet);
+    check(res == 0, "Failed to kyk_wallet_recover_chainstate: kyk_load_blk_header_chain failed");
+
+    kyk_blk_hash256(digest, hd_chain -> hd_list + hd_chain -> len - 1);
+    if(!kyk_digest_eq(digest, head_hash, sizeof(digest))){
+	bval = kyk_read_block(wallet -> blk_index_db, (char*)head_hash, &errptr);
+	check(errptr == NULL, "Failed to kyk_wallet_recover_chainstate: kyk_read_block failed");
+	if(bval && kyk_digest_eq(bval -> blk_hd -> pre_blk_hash, digest, sizeof(digest))){
+	    res = kyk_wallet_append_blk_header(wallet, bval -> blk_hd);
+	    check(res == 0, "Failed to kyk_wallet_recover_chainstate: kyk_wallet_append_blk_header failed");
+	    res = kyk_append_blk_hd_chain(hd_chain, bval -> blk_hd, 1);
+	    check(res == 0, "Failed to kyk_wallet_recover_chainstate: kyk_append_blk_hd_chain failed");
+	}
+	if(bval){
+	    kyk_free_bval(bval);
+	    bval = NULL;
+	}
+    }
+
+    res = kyk_new_hd_index(&hd_index, hd_chain);
+    check(res == 0, "Failed to kyk_wallet_recover_chainstate: kyk_new_hd_index failed");
+
+    if(kyk_hd_index_find(hd_index, head_hash, &head_height) == 0){
+	log_warn("kyk_wallet_recover_chainstate: the head block is not in the header chain");
+	goto done;
+    }
+
+    memset(zero_hash, 0, sizeof(zero_hash));
+    if(kyk_digest_eq(cs -> best_hash, zero_hash, sizeof(zero_hash))){
+	height = 0;
+    } else if(kyk_hd_index_find(hd_index, cs -> best_hash, &height) == 0){
+	log_warn("kyk_wallet_recover_chainstate: the chainstate best block is not in the header chain");
+	goto done;
+    }
+
+    /* more than the usual flush lag, the chainstate is rebuilt */
+    if(head_height - height > KYK_COINS_FLUSH_BLOCKS){
+	res = kyk_store_db_set_bulk_load(wallet -> blk_index_db, 1);
+	check(res == 0, "Failed to kyk_wallet_recover_chainstate: kyk_store_db_set_bulk_load failed");
+    }
+
+    for(i = height + 1; i <= head_height; i++){
+	bval = kyk_read_block(wallet -> blk_index_db, (char*)hd_index -> hashes + i * 32, &errptr);
+	check(errptr == NULL, "Failed to kyk_wallet_recover_chainstate: kyk_read_block failed");
+	check(bval, "Failed to kyk_wallet_recover_chainstate: block %zu is not in the block index", i);
+
+	res = kyk_wallet_get_new_block_from_bval(wallet, bval, &blk);
+	check(res == 0, "Failed to kyk_wallet_recover_chainstate: kyk_wallet_get_new_block_from_bval failed");
+
+	res = kyk_chainstate_connect_block(cs, blk);
+	check(res == 0, "Failed to kyk_wallet_recover_chainstate: kyk_chainstate_connect_block failed");
+
+	kyk_free_block(blk);
+	blk = NULL;
+	kyk_free_bval(bval);
+	bval = NULL;
+    }
+
+    res = kyk_chainstate_flush(cs);
+    check(res == 0, "Failed to kyk_wallet_recover_chainstate: kyk_chainstate_flush failed");
+
+    res = kyk_store_db_set_bulk_load(wallet -> blk_index_db, bulk_load);
+    check(res == 0, "Failed to kyk_wallet_recover_chainstate: kyk_store_db_set_bulk_load failed");
+
+done:
+    kyk_free_hd_index(hd_index);
+    kyk_free_blk_hd_chain(hd_chain);
+
+    return 0;
+
+error:
+    kyk_store_db_set_bulk_load(wallet -> blk_index_db, bulk_load);
+    if(errptr) leveldb_free(errptr);
+    if(blk) kyk_free_block(blk);
+    if(bval) kyk_free_bval(bval);
+    if(hd_index) kyk_free_hd_index(hd_index);
+    if(hd_chain) kyk_free_blk_hd_chain(hd_chain);
+    return -1;
+}
+
+/*
+ * A chain that was there before the tx index was turned on gets its blocks indexed once,
+ * in batches of KYK_TXINDEX_BUILD_BLOCKS blocks, the last one sets the 'F' txindex flag.
+ * Turning the index off clears the flag, so turning it on again builds it again.
+ * Headers without a stored block have nothing to index.
+ */
+int kyk_wallet_init_txindex(struct kyk_wallet* wallet)
+{
+    struct kyk_blk_hd_chain* hd_chain = NULL;
+    struct kyk_hd_index* hd_index = NULL;
+    struct kyk_bkey_val* bval = NULL;
+    struct kyk_block* blk = NULL;
+    leveldb_writebatch_t* batch = NULL;
+    struct kyk_block_db* db = wallet -> blk_index_db;
+    struct stat st;
+    int bulk_load = db -> opts.bulk_load;
+    char* errptr = NULL;
+    size_t batch_blocks = 0;
+    size_t i = 0;
+    int built = 0;
+    int res = -1;
+
+    res = kyk_txindex_read_flag(db, &built);
+    check(res == 0, "Failed to kyk_wallet_init_txindex: kyk_txindex_read_flag failed");
+
+    if(built == (db -> txindex != 0)){
+	return 0;
+    }
+
+    batch = leveldb_writebatch_create();
+    check(batch, "Failed to kyk_wallet_init_txindex: leveldb_writebatch_create failed");
+
+    if(db -> txindex && stat(wallet -> blk_hd_chain_path, &st) == 0 && st.st_size >= KYK_BLK_HD_LEN){
+	res = kyk_load_blk_header_chain(&hd_chain, wallet);
+	check(res == 0, "Failed to kyk_wallet_init_txindex: kyk_load_blk_header_chain failed");
+
+	res = kyk_new_hd_index(&hd_index, hd_chain);
+	check(res == 0, "Failed to kyk_wallet_init_txindex: kyk_new_hd_index failed");
+
+	res = kyk_store_db_set_bulk_load(db, 1);
+	check(res == 0, "Failed to kyk_wallet_init_txindex: kyk_store_db_set_bulk_load failed");
+
+	for(i = 0; i < hd_index -> len; i++){
+	    res = kyk_find_block(db, (char*)hd_index -> hashes + i * 32, &bval);
+	    check(res == 0, "Failed to kyk_wallet_init_txindex: kyk_find_block failed");
+	    if(bval == NULL){
+		continue;
+	    }
+
+	    res = kyk_wallet_get_new_block_from_bval(wallet, bval, &blk);
+	    check(res == 0, "Failed to kyk_wallet_init_txindex: kyk_wallet_get_new_block_from_bval failed");
+
+	    res = kyk_txindex_batch_block(batch, blk, bval -> nFile, bval -> nDataPos);
+	    check(res == 0, "Failed to kyk_wallet_init_txindex: kyk_txindex_batch_block failed");
+
+	    kyk_free_block(blk);
+	    blk = NULL;
+	    kyk_free_bval(bval);
+	    bval = NULL;
+
+	    if(++batch_blocks == KYK_TXINDEX_BUILD_BLOCKS){
+		leveldb_write(db -> db, db -> wr_opts, batch, &errptr);
+		check(errptr == NULL, "Failed to kyk_wallet_init_txindex: leveldb_write failed: %s", errptr);
+		leveldb_writebatch_clear(batch);
+		batch_blocks = 0;
+	    }
+	}
+    }
+
+    kyk_txindex_batch_flag(batch, db -> txindex);
+
+    leveldb_write(db -> db, db -> wr_opts, batch, &errptr);
+    check(errptr == NULL, "Failed to kyk_wallet_init_txindex: leveldb_write failed: %s", errptr);
+
+    leveldb_writebatch_destroy(batch);
+    batch = NULL;
+
+    res = kyk_store_db_set_bulk_load(db, bulk_load);
+    check(res == 0, "Failed to kyk_wallet_init_txindex: kyk_store_db_set_bulk_load failed");
+
+    if(hd_index) kyk_free_hd_index(hd_index);
+    if(hd_chain) kyk_free_blk_hd_chain(hd_chain);
+
+    return 0;
+
+error:
+    kyk_store_db_set_bulk_load(db, bulk_load);
+    if(errptr) leveldb_free(errptr);
+    if(blk) kyk_free_block(blk);
+    if(bval) kyk_free_bval(bval);
+    if(batch) leveldb_writebatch_destroy(batch);
+    if(hd_index) kyk_free_hd_index(hd_index);
+    if(hd_chain) kyk_free_blk_hd_chain(hd_chain);
+    return -1;
+}
 
 
 /* wallet config */
@@ -338,62 +651,144 @@ int kyk_wallet_get_new_block_from_bval(const struct kyk_wallet* wallet,
 				       struct kyk_block** new_blk)
 {
     struct kyk_block* blk = NULL;
-    char* blk_file_path = NULL;
-    uint8_t buf[8];
-    uint8_t* bufp = NULL;
-    uint8_t* blk_buf = NULL;
-    FILE* fp = NULL;
+    const uint8_t* blk_buf = NULL;
+    uint32_t blk_size = 0;
     size_t checksize = 0;
     int res = -1;
-    size_t ret_code;
 
     check(wallet, "Failed to kyk_wallet_get_new_block_from_bval: wallet is NULL");
     check(bval, "Failed to kyk_wallet_get_new_block_from_bval: bval is NULL");
 
+    res = kyk_wallet_get_block_view(wallet, bval, &blk_buf, &blk_size);
+    check(res == 0, "Failed to kyk_wallet_get_new_block_from_bval: kyk_wallet_get_block_view failed");
+
     blk = calloc(1, sizeof(*blk));
     check(blk, "Failed to kyk_wallet_get_new_block_from_bval: calloc failed");
 
-    blk_file_path = kyk_asprintf("%s/blk%05d.dat", wallet -> blk_dir, bval -> nFile);
-    fp = fopen(blk_file_path, "rb");
-    check(fp, "Failed to kyk_wallet_get_new_block_from_bval: fopen failed");
+    beej_unpack(blk_buf - 8, "<L", &blk -> magic_no);
 
-    res = fseek(fp, bval -> nDataPos - 8, SEEK_SET);
-    check(res == 0, "Failed to kyk_wallet_get_new_block_from_bval: fseek failed");
+    res = kyk_deseri_block(blk, blk_buf, &checksize);
+    check(res == 0, "Failed to kyk_wallet_get_new_block_from_bval: kyk_deseri_block failed");
+    check(checksize == blk_size, "Failed to kyk_wallet_get_new_block_from_bval: block size does not match");
 
-    bufp = buf;
+    *new_blk = blk;
 
-    fread(bufp, sizeof(blk -> magic_no), 1, fp);
-    bufp += sizeof(blk -> magic_no);
+    return 0;
 
-    fread(bufp, sizeof(blk -> blk_size), 1, fp);
-    bufp += sizeof(blk -> blk_size);
+error:
+    if(blk) kyk_free_block(blk);
+    return -1;
+}
 
-    bufp = buf;
-    beej_unpack(bufp, "<L", &blk -> magic_no);
-    bufp += sizeof(blk -> magic_no);
+/*
+ * The serialized bytes of the tx, read only in the mapped blk*.dat file like the block view,
+ * they are exactly the 'tx' message payload.
+ * *new_buf is NULL if the tx index has no such tx.
+ */
+int kyk_wallet_get_tx_view(const struct kyk_wallet* wallet,
+			   const uint8_t* txid,
+			   const uint8_t** new_buf,
+			   size_t* tx_size)
+{
+    struct kyk_disk_tx_pos pos;
+    struct kyk_tx* tx = NULL;
+    const uint8_t* blk_buf = NULL;
+    uint32_t blk_size = 0;
+    size_t len = 0;
+    int found = 0;
+    int res = -1;
 
-    beej_unpack(bufp, "<L", &blk -> blk_size);
+    check(wallet, "Failed to kyk_wallet_get_tx_view: wallet is NULL");
+    check(wallet -> blk_reader, "Failed to kyk_wallet_get_tx_view: wallet -> blk_reader is NULL");
+    check(txid, "Failed to kyk_wallet_get_tx_view: txid is NULL");
+    check(new_buf, "Failed to kyk_wallet_get_tx_view: new_buf is NULL");
+    check(tx_size, "Failed to kyk_wallet_get_tx_view: tx_size is NULL");
 
-    blk_buf = calloc(blk -> blk_size, sizeof(*blk_buf));
-    check(blk_buf, "Failed to kyk_wallet_get_new_block_from_bval: calloc failed");
+    *new_buf = NULL;
+    *tx_size = 0;
 
-    ret_code = fread(blk_buf, sizeof(*blk_buf), blk -> blk_size, fp);
-    check(ret_code == blk -> blk_size, "Failed to kyk_wallet_get_new_block_from_bval: fread failed");
+    if(wallet -> blk_index_db -> txindex == 0){
+	return 0;
+    }
 
-    res = kyk_deseri_block(blk, blk_buf, &checksize);
-    check(res == 0, "Failed to kyk_wallet_get_new_block_from_bval: kyk_deseri_block failed");
+    res = kyk_txindex_get(wallet -> blk_index_db, txid, &pos, &found);
+    check(res == 0, "Failed to kyk_wallet_get_tx_view: kyk_txindex_get failed");
 
+    if(found == 0){
+	return 0;
+    }
+
+    res = kyk_blk_reader_get_view(wallet -> blk_reader, pos.nFile, pos.nPos, &blk_buf, &blk_size);
+    check(res == 0, "Failed to kyk_wallet_get_tx_view: kyk_blk_reader_get_view failed");
+    check(KYK_BLK_HD_LEN + (uint64_t)pos.nTxOffset < blk_size, "Failed to kyk_wallet_get_tx_view: invalid nTxOffset");
+
+    /* the record has no tx size, the tx is parsed to find its end */
+    res = kyk_deseri_new_tx(&tx, blk_buf + KYK_BLK_HD_LEN + pos.nTxOffset, &len);
+    check(res == 0, "Failed to kyk_wallet_get_tx_view: kyk_deseri_new_tx failed");
+    check(KYK_BLK_HD_LEN + pos.nTxOffset + len <= blk_size, "Failed to kyk_wallet_get_tx_view: tx runs past its block");
+
+    kyk_free_tx(tx);
+
+    *new_buf = blk_buf + KYK_BLK_HD_LEN + pos.nTxOffset;
+    *tx_size = len;
 
-    *new_blk = blk;
-    
-    fclose(fp);
-    free(blk_buf);
-    
     return 0;
 
 error:
-    if(fp) fclose(fp);
-    if(blk_buf) free(blk_buf);
+    if(tx) kyk_free_tx(tx);
+    return -1;
+}
+
+/* *new_tx is NULL if the tx index has no such tx */
+int kyk_wallet_query_tx(const struct kyk_wallet* wallet,
+			const uint8_t* txid,
+			struct kyk_tx** new_tx)
+{
+    const uint8_t* buf = NULL;
+    size_t tx_size = 0;
+    int res = -1;
+
+    check(new_tx, "Failed to kyk_wallet_query_tx: new_tx is NULL");
+
+    *new_tx = NULL;
+
+    res = kyk_wallet_get_tx_view(wallet, txid, &buf, &tx_size);
+    check(res == 0, "Failed to kyk_wallet_query_tx: kyk_wallet_get_tx_view failed");
+
+    if(buf){
+	res = kyk_deseri_new_tx(new_tx, buf, NULL);
+	check(res == 0, "Failed to kyk_wallet_query_tx: kyk_deseri_new_tx failed");
+    }
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+/*
+ * The serialized bytes of the block indexed by bval, read only in the mapped blk*.dat file,
+ * they are exactly the 'block' message payload.
+ */
+int kyk_wallet_get_block_view(const struct kyk_wallet* wallet,
+			      const struct kyk_bkey_val* bval,
+			      const uint8_t** new_buf,
+			      uint32_t* blk_size)
+{
+    int res = -1;
+
+    check(wallet, "Failed to kyk_wallet_get_block_view: wallet is NULL");
+    check(wallet -> blk_reader, "Failed to kyk_wallet_get_block_view: wallet -> blk_reader is NULL");
+    check(bval, "Failed to kyk_wallet_get_block_view: bval is NULL");
+
+    res = kyk_blk_reader_get_view(wallet -> blk_reader, bval -> nFile, bval -> nDataPos, new_buf, blk_size);
+    check(res == 0, "Failed to kyk_wallet_get_block_view: kyk_blk_reader_get_view failed");
+
+    return 0;
+
+error:
+
     return -1;
 }
 
@@ -445,6 +840,24 @@ void kyk_destroy_wallet(struct kyk_wallet* wallet)
 	}
 	
 	
+	if(wallet -> chainstate) {
+	    if(kyk_chainstate_flush(wallet -> chainstate) != 0){
+		log_warn("Failed to kyk_destroy_wallet: kyk_chainstate_flush failed, the coins since the last flush are lost");
+	    }
+	    kyk_free_chainstate(wallet -> chainstate);
+	    wallet -> chainstate = NULL;
+	}
+
+	if(wallet -> blk_writer) {
+	    kyk_free_blk_writer(wallet -> blk_writer);
+	    wallet -> blk_writer = NULL;
+	}
+
+	if(wallet -> blk_reader) {
+	    kyk_free_blk_reader(wallet -> blk_reader);
+	    wallet -> blk_reader = NULL;
+	}
+
 	if(wallet -> blk_index_db) {
 	    kyk_free_block_db(wallet -> blk_index_db);
 	    wallet -> blk_index_db = NULL;
@@ -459,61 +872,148 @@ void kyk_destroy_wallet(struct kyk_wallet* wallet)
     }
 }
 
+/* the block index record and the blk file records go in one batch */
 int kyk_wallet_save_block(const struct kyk_wallet* wallet, const struct kyk_block* blk)
 {
-    struct kyk_blk_file* blk_file = NULL;
+    leveldb_writebatch_t* batch = NULL;
     struct kyk_bkey_val bval;
-    int fileNo;
+    uint64_t nDataPos = 0;
+    int nFile = 0;
     char *errptr = NULL;    
     int res = -1;
     
     check(wallet, "Failed to kyk_wallet_save_block: wallet is NULL");
-    check(wallet -> blk_dir, "Failed to kyk_wallet_save_block: wallet -> blk_dir is NULL");
+    check(wallet -> blk_writer, "Failed to kyk_wallet_save_block: wallet -> blk_writer is NULL");
     check(blk, "Failed to kyk_wallet_save_block: blk is NULL");
 
-    fileNo = 0;
-    blk_file = kyk_create_blk_file(fileNo, wallet -> blk_dir, "ab");
-    check(blk_file, "Failed to kyk_wallet_save_block: kyk_create_blk_file failed");
+    batch = leveldb_writebatch_create();
+    check(batch, "Failed to kyk_wallet_save_block: leveldb_writebatch_create failed");
 
-    res = kyk_save_blk_to_file(blk_file, blk);
-    check(res == 0, "Failed to kyk_wallet_save_block: kyk_save_blk_to_file failed");
+    res = kyk_blk_writer_write(wallet -> blk_writer, blk, batch, &nFile, &nDataPos);
+    check(res == 0, "Failed to kyk_wallet_save_block: kyk_blk_writer_write failed");
 
-    set_init_bval(&bval, blk, blk_file);
-    kyk_store_block(wallet -> blk_index_db, &bval, &errptr);
-    check(errptr == NULL, "Failed to kyk_wallet_save_block: kyk_store_block failed");
-    
+    set_init_bval(&bval, blk, nFile, nDataPos);
+    kyk_batch_store_block(batch, &bval);
+
+    if(wallet -> blk_index_db -> txindex){
+	res = kyk_txindex_batch_block(batch, blk, nFile, nDataPos);
+	check(res == 0, "Failed to kyk_wallet_save_block: kyk_txindex_batch_block failed");
+    }
 
-    kyk_close_blk_file(blk_file);
+    leveldb_write(wallet -> blk_index_db -> db, wallet -> blk_index_db -> wr_opts, batch, &errptr);
+    check(errptr == NULL, "Failed to kyk_wallet_save_block: leveldb_write failed: %s", errptr);
+
+    leveldb_writebatch_destroy(batch);
     
     return 0;
 
 error:
+    if(errptr) leveldb_free(errptr);
+    if(batch) leveldb_writebatch_destroy(batch);
+    return -1;
+}
+
+/*
+ * Connects a block that extends the chain.
+ * Its block index record, the blk file records, its tx index records, the chainstate flush
+ * when one is due and the 'H' head block record are written in one leveldb batch,
+ * synced when KYK_CONNECT_SYNC is set, after the block data itself is synced.
+ * The header file is appended once the batch is in, a crash in between
+ * is made up for by kyk_wallet_recover_chainstate on the next open.
+ * If the batch is not written the blk writer is rewound and the chainstate discarded.
+ */
+int kyk_wallet_connect_block(const struct kyk_wallet* wallet, const struct kyk_block* blk)
+{
+    leveldb_writebatch_t* batch = NULL;
+    struct kyk_bkey_val bval;
+    struct kyk_blk_file_info info;
+    uint8_t digest[32];
+    uint64_t nDataPos = 0;
+    int nFile = 0;
+    int prev_nFile = 0;
+    int staged = 0;
+    int written = 0;
+    int connected = 0;
+    char* errptr = NULL;
+    int res = -1;
+
+    check(wallet, "Failed to kyk_wallet_connect_block: wallet is NULL");
+    check(wallet -> blk_writer, "Failed to kyk_wallet_connect_block: wallet -> blk_writer is NULL");
+    check(wallet -> chainstate, "Failed to kyk_wallet_connect_block: wallet -> chainstate is NULL");
+    check(blk, "Failed to kyk_wallet_connect_block: blk is NULL");
+
+    batch = leveldb_writebatch_create();
+    check(batch, "Failed to kyk_wallet_connect_block: leveldb_writebatch_create failed");
+
+    /* kyk_blk_writer_write moves the writer on before the batch is in */
+    prev_nFile = wallet -> blk_writer -> nFile;
+    info = wallet -> blk_writer -> info;
+    written = 1;
+
+    res = kyk_blk_writer_write(wallet -> blk_writer, blk, batch, &nFile, &nDataPos);
+    check(res == 0, "Failed to kyk_wallet_connect_block: kyk_blk_writer_write failed");
+
+    set_init_bval(&bval, blk, nFile, nDataPos);
+    kyk_batch_store_block(batch, &bval);
+
+    if(wallet -> blk_index_db -> txindex){
+	res = kyk_txindex_batch_block(batch, blk, nFile, nDataPos);
+	check(res == 0, "Failed to kyk_wallet_connect_block: kyk_txindex_batch_block failed");
+    }
+
+    connected = 1;
+    res = kyk_chainstate_connect_block_to_batch(wallet -> chainstate, blk, batch, &staged);
+    check(res == 0, "Failed to kyk_wallet_connect_block: kyk_chainstate_connect_block_to_batch failed");
 
-    if(blk_file) kyk_close_blk_file(blk_file);
+    res = kyk_blk_hash256(digest, blk -> hd);
+    check(res == 0, "Failed to kyk_wallet_connect_block: kyk_blk_hash256 failed");
+    kyk_batch_store_head_block(batch, digest);
+
+    if(KYK_CONNECT_SYNC){
+	res = kyk_blk_writer_sync(wallet -> blk_writer);
+	check(res == 0, "Failed to kyk_wallet_connect_block: kyk_blk_writer_sync failed");
+    }
+
+    leveldb_write(wallet -> blk_index_db -> db,
+		  KYK_CONNECT_SYNC ? wallet -> blk_index_db -> sync_wr_opts : wallet -> blk_index_db -> wr_opts,
+		  batch,
+		  &errptr);
+    check(errptr == NULL, "Failed to kyk_wallet_connect_block: leveldb_write failed: %s", errptr);
+
+    leveldb_writebatch_destroy(batch);
+    batch = NULL;
+    written = 0;
+    connected = 0;
+
+    if(staged){
+	res = kyk_chainstate_flushed(wallet -> chainstate);
+	check(res == 0, "Failed to kyk_wallet_connect_block: kyk_chainstate_flushed failed");
+    }
+
+    res = kyk_wallet_append_blk_header(wallet, blk -> hd);
+    check(res == 0, "Failed to kyk_wallet_connect_block: kyk_wallet_append_blk_header failed");
+
+    return 0;
+
+error:
+    if(errptr) leveldb_free(errptr);
+    if(written) kyk_blk_writer_rewind(wallet -> blk_writer, prev_nFile, &info);
+    if(connected) kyk_chainstate_discard(wallet -> chainstate);
+    if(batch) leveldb_writebatch_destroy(batch);
     return -1;
 }
 
 int save_setup_data_to_wallet(struct kyk_wallet *wallet)
 {
     struct kyk_block *blk = NULL;
-    struct kyk_bkey_val bval;
-    struct kyk_blk_file* blk_file = NULL;
     struct kyk_blk_hd_chain* hd_chain = NULL;
     int res = -1;
-    char *errptr = NULL;
     
     blk = make_gens_block();
     check(blk != NULL, "failed to make gens block");
 
-    blk_file = kyk_create_blk_file(0, wallet -> blk_dir, "ab");
-    check(blk_file != NULL, "failed to create block file");
-
-    res = kyk_save_blk_to_file(blk_file, blk);
-    check(res == 0, "failed to save block to file");
-    
-    set_init_bval(&bval, blk, blk_file);
-    kyk_store_block(wallet -> blk_index_db, &bval, &errptr);
-    check(errptr == NULL, "failed to store b key value");
+    res = kyk_wallet_save_block(wallet, blk);
+    check(res == 0, "Failed to save_setup_data_to_wallet: kyk_wallet_save_block failed");
 
     res = kyk_init_blk_hd_chain(&hd_chain);
     check(res == 0, "Failed to save_setup_data_to_wallet: kyk_init_blk_hd_chain failed");
@@ -525,77 +1025,31 @@ int save_setup_data_to_wallet(struct kyk_wallet *wallet)
     check(res == 0, "Failed to save_setup_data_to_wallet: kyk_save_blk_header_chain failed");
 
     kyk_free_block(blk);
-    kyk_close_blk_file(blk_file);
     
     return 0;
 
 error:
     if(blk) kyk_free_block(blk);
-    if(blk_file) kyk_close_blk_file(blk_file);
     if(hd_chain) kyk_free_blk_hd_chain(hd_chain);
     return -1;
 }
 
 void set_init_bval(struct kyk_bkey_val *bval,
 		   const struct kyk_block* blk,
-		   const struct kyk_blk_file* blk_file
+		   int nFile,
+		   uint64_t nDataPos
     )
 {
     bval -> wVersion = 1;
     bval -> nHeight = 0;
     bval -> nStatus = BLOCK_HAVE_MASK;
     bval -> nTx = blk -> tx_count;
-    bval -> nFile = blk_file -> nFile;
-    bval -> nDataPos = blk_file -> nStartPos;
+    bval -> nFile = nFile;
+    bval -> nDataPos = nDataPos;
     bval -> nUndoPos = 0;
     bval -> blk_hd = blk -> hd;
 }
 
-int kyk_save_blk_to_file(struct kyk_blk_file* blk_file,
-			   const struct kyk_block* blk
-    )
-{
-    uint8_t* buf = NULL;
-    size_t blk_size = 0;
-    size_t buf_len = 0;
-    size_t len = 0;
-    long int pos = 0;
-    int res = -1;
-
-    check(blk_file, "Failed to kyk_save_blk_to_file: blk_file is NULL");
-    check(blk, "Failed to kyk_save_blk_to_file: blk is NULL");
-
-    res = kyk_get_blkself_size(blk, &blk_size);
-    check(res == 0, "Failed to kyk_save_blk_to_file: kyk_get_blk_size failed");
-    check(blk_size > 0, "Failed to kyk_save_blk_to_file: blk_size is invalid");
-
-    buf_len += blk_size;
-    buf = calloc(buf_len, sizeof(*buf));
-    check(buf, "Failed to kyk_save_blk_to_file: buf calloc failed");
-
-    res = kyk_seri_blkself(buf, blk, &len);
-    check(res == 0, "Failed to kyk_save_blk_to_file: kyk_seri_blkself failed");
-    
-    pos = ftell(blk_file -> fp);
-    check(pos != -1L, "failed to get the block dat file pos");
-
-    blk_file -> nOffsetPos = sizeof(blk -> magic_no) + sizeof(blk -> blk_size);
-    
-    blk_file -> nStartPos = (unsigned int)pos + blk_file -> nOffsetPos;
-    
-    len = fwrite(buf, sizeof(*buf), buf_len, blk_file -> fp);
-    check(len == buf_len, "failed to save block to file");
-    blk_file -> nEndPos = len;
-    
-    free(buf);
-    
-    return 0;
-    
-error:
-    if(buf) free(buf);
-    return -1;
-}
-
 struct kyk_wallet_key* kyk_create_wallet_key(uint32_t cfg_idx,
 					     const char* desc
     )
@@ -802,82 +1256,66 @@ void kyk_destroy_wallet_key(struct kyk_wallet_key* k)
 
 
 /* save block header chain */
+/* mode "ab" appends the chain to the header file, anything else rewrites the file with it */
 int kyk_save_blk_header_chain(const struct kyk_wallet* wallet,
 			      const struct kyk_blk_hd_chain* hd_chain,
 			      const char* mode)
 {
-    FILE* fp = NULL;
-    const struct kyk_blk_hd_chain* hdc = NULL;
-    struct kyk_bon_buff* bbuf = NULL;
-    size_t len = 0;
     int res = -1;
-    
 
     check(wallet, "Failed to kyk_save_blk_head_chain: wallet is NULL");
     check(wallet -> blk_hd_chain_path, "Failed to kyk_save_blk_head_chain: wallet -> blk_hd_chain_path is NULL");
     check(hd_chain, "Failed to kyk_save_blk_head_chain: hd_chain is NULL");
 
-    if(mode == NULL){
-	fp = fopen(wallet -> blk_hd_chain_path, "wb");
+    if(mode && strcmp(mode, "ab") == 0){
+	res = kyk_append_hd_file(wallet -> blk_hd_chain_path, hd_chain -> hd_list, hd_chain -> len);
+	check(res == 0, "Failed to kyk_save_blk_head_chain: kyk_append_hd_file failed");
     } else {
-	fp = fopen(wallet -> blk_hd_chain_path, mode);
+	res = kyk_save_hd_file(wallet -> blk_hd_chain_path, hd_chain);
+	check(res == 0, "Failed to kyk_save_blk_head_chain: kyk_save_hd_file failed");
     }
     
-    check(fp, "Failed to kyk_save_blk_head_chain: fopen failed");
+    return 0;
+    
+error:
 
-    hdc = hd_chain;
+    return -1;
+}
 
-    res = kyk_seri_blk_hd_chain(&bbuf, hdc);
-    check(res == 0, "Failed to kyk_save_blk_head_chain: kyk_seri_blk_hd_chain failed");
-    check(bbuf -> base, "Failed to kyk_save_blk_head_chain: kyk_seri_blk_hd_chain failed");
+/* writes the one header record, hd extends the chain in the file */
+int kyk_wallet_append_blk_header(const struct kyk_wallet* wallet, const struct kyk_blk_header* hd)
+{
+    int res = -1;
 
-    len = fwrite(bbuf -> base, sizeof(*bbuf -> base), bbuf -> len, fp);
-    check(len == bbuf -> len, "Failed to kyk_save_blk_head_chain: fwrite failed");
+    check(wallet, "Failed to kyk_wallet_append_blk_header: wallet is NULL");
+    check(wallet -> blk_hd_chain_path, "Failed to kyk_wallet_append_blk_header: wallet -> blk_hd_chain_path is NULL");
+    check(hd, "Failed to kyk_wallet_append_blk_header: hd is NULL");
+
+    res = kyk_append_hd_file(wallet -> blk_hd_chain_path, hd, 1);
+    check(res == 0, "Failed to kyk_wallet_append_blk_header: kyk_append_hd_file failed");
 
-    free_kyk_bon_buff(bbuf);
-    fclose(fp);
-    
     return 0;
-    
+
 error:
-    if(bbuf) free_kyk_bon_buff(bbuf);
-    if(fp) fclose(fp);
+
     return -1;
 }
 
-
 int kyk_load_blk_header_chain(struct kyk_blk_hd_chain** hd_chain,
 			      const struct kyk_wallet* wallet)
 {
-    struct kyk_blk_hd_chain* hdc = NULL;
-    uint8_t* buf = NULL;
-    FILE* fp = NULL;
-    size_t len = 0;
     int res = -1;
 
     check(hd_chain, "Failed to kyk_load_blk_head_chain: hd_chain is NULL");
     check(wallet, "Failed to kyk_load_blk_head_chain: wallet is NULL");
 
-    fp = fopen(wallet -> blk_hd_chain_path, "rb");
-    check(fp, "Failed to kyk_load_blk_head_chain: fopen failed");
-
-    res = kyk_file_read_all(&buf, fp, &len);
-    check(res == 0, "Failed to kyk_load_blk_head_chain: kyk_file_read all failed");
+    res = kyk_load_hd_file(hd_chain, wallet -> blk_hd_chain_path);
+    check(res == 0, "Failed to kyk_load_blk_head_chain: kyk_load_hd_file failed");
 
-    res = kyk_deseri_blk_hd_chain(&hdc, buf, len);
-    check(res == 0, "Failed to kyk_load_blk_head_chain: kyk_deseri_blk_hd_chain failed");
-
-    *hd_chain = hdc;
-    
-    fclose(fp);
-    free(buf);
-    
     return 0;
 
 error:
-    if(fp) fclose(fp);
-    if(buf) free(buf);
-    if(hdc) kyk_free_blk_hd_chain(hdc);
+
     return -1;
 }
 
@@ -914,31 +1352,52 @@ error:
 
 }
 
+/* every unspent coin, a wallet without a chainstate reads its utxo.dat */
 int kyk_load_utxo_chain(struct kyk_utxo_chain** new_utxo_chain,
 			const struct kyk_wallet* wallet)
 {
-    struct kyk_utxo_chain* utxo_chain = NULL;
-    uint8_t* buf = NULL;
-    FILE* fp = NULL;
     int res = -1;
 
     check(new_utxo_chain, "Failed to kyk_load_utxo_chain: utxo_chain is NULL");
     check(wallet, "Failed to kyk_load_utxo_chain: wallet is NULL");
 
+    if(wallet -> chainstate){
+	res = kyk_chainstate_load_utxo_chain(wallet -> chainstate, new_utxo_chain);
+	check(res == 0, "Failed to kyk_load_utxo_chain: kyk_chainstate_load_utxo_chain failed");
+    } else {
+	res = kyk_load_utxo_chain_from_file(new_utxo_chain, wallet);
+	check(res == 0, "Failed to kyk_load_utxo_chain: kyk_load_utxo_chain_from_file failed");
+    }
+
+    return 0;
+
+error:
+
+    return -1;
+}
+
+int kyk_load_utxo_chain_from_file(struct kyk_utxo_chain** new_utxo_chain,
+				  const struct kyk_wallet* wallet)
+{
+    struct kyk_utxo_chain* utxo_chain = NULL;
+    uint8_t* buf = NULL;
+    FILE* fp = NULL;
+    int res = -1;
+
     fp = fopen(wallet -> utxo_path, "rb");
-    check(fp, "Failed to kyk_load_utxo_chain: fopen failed");
+    check(fp, "Failed to kyk_load_utxo_chain_from_file: fopen failed");
 
     utxo_chain = calloc(1, sizeof(*utxo_chain));
-    check(utxo_chain, "Failed to kyk_deseri_utxo_chain: utxo_chain calloc failed");
+    check(utxo_chain, "Failed to kyk_load_utxo_chain_from_file: utxo_chain calloc failed");
     kyk_init_utxo_chain(utxo_chain);
 
 
     res = kyk_file_read_all(&buf, fp, NULL);
-    check(res == 0, "Failed to kyk_load_utxo_chain: kyk_file_read_all failed");
+    check(res == 0, "Failed to kyk_load_utxo_chain_from_file: kyk_file_read_all failed");
 
     if(buf){
 	res = kyk_load_utxo_chain_from_chainfile_buf(utxo_chain, buf, 0);
-    	check(res == 0, "Failed to kyk_load_utxo_chain: kyk_load_utxo_chain_from_chainfile_buf failed");
+    	check(res == 0, "Failed to kyk_load_utxo_chain_from_file: kyk_load_utxo_chain_from_chainfile_buf failed");
     }
 
     *new_utxo_chain = utxo_chain;
@@ -955,6 +1414,7 @@ error:
     return -1;
 }
 
+/* makes utxo_chain the wallet's whole utxo set */
 int kyk_wallet_save_utxo_chain(const struct kyk_wallet* wallet, const struct kyk_utxo_chain* utxo_chain)
 {
     FILE* fp = NULL;
@@ -966,9 +1426,16 @@ int kyk_wallet_save_utxo_chain(const struct kyk_wallet* wallet, const struct kyk
     int res = -1;
 
     check(wallet, "Failed to kyk_wallet_save_utxo_chain: wallet is NULL");
-    check(wallet -> utxo_path, "Failed to kyk_wallet_save_utxo_chain: wallet -> utxo_path is NULL");
     check(utxo_chain, "Failed to kyk_wallet_save_utxo_chain: utxo_chain is NULL");
 
+    if(wallet -> chainstate){
+	res = kyk_chainstate_replace_utxo_chain(wallet -> chainstate, utxo_chain);
+	check(res == 0, "Failed to kyk_wallet_save_utxo_chain: kyk_chainstate_replace_utxo_chain failed");
+	return 0;
+    }
+
+    check(wallet -> utxo_path, "Failed to kyk_wallet_save_utxo_chain: wallet -> utxo_path is NULL");
+
     fp = fopen(wallet -> utxo_path, "wb");
     check(fp, "Failed to kyk_wallet_save_utxo_chain: fopen %s failed", wallet -> utxo_path);
 
@@ -1042,6 +1509,52 @@ error:
     return -1;
 }
 
+/* pubkey hashes of all the wallet addresses, asked for in filtered blocks */
+int kyk_wallet_build_pkh_filter(const struct kyk_wallet* wallet,
+				struct ptl_pkh_filter** new_filter)
+{
+    struct ptl_pkh_filter* filter = NULL;
+    char** addr_list = NULL;
+    size_t addr_list_len = 0;
+    uint8_t* sc = NULL;
+    size_t sc_size = 0;
+    size_t i = 0;
+    int res = -1;
+
+    check(wallet, "Failed to kyk_wallet_build_pkh_filter: wallet is NULL");
+    check(new_filter, "Failed to kyk_wallet_build_pkh_filter: new_filter is NULL");
+
+    res = kyk_wallet_load_addr_list(wallet, &addr_list, &addr_list_len);
+    check(res == 0, "Failed to kyk_wallet_build_pkh_filter: kyk_wallet_load_addr_list failed");
+
+    filter = calloc(1, sizeof(*filter));
+    check(filter, "Failed to kyk_wallet_build_pkh_filter: filter calloc failed");
+
+    filter -> pkhs = calloc(addr_list_len + 1, RIPEMD160_DIGEST_LENGTH);
+    check(filter -> pkhs, "Failed to kyk_wallet_build_pkh_filter: pkhs calloc failed");
+
+    for(i = 0; i < addr_list_len; i++){
+	res = kyk_build_p2pkh_sc_from_address(addr_list[i], strlen(addr_list[i]), &sc, &sc_size);
+	check(res == 0, "Failed to kyk_wallet_build_pkh_filter: kyk_build_p2pkh_sc_from_address failed");
+	/* OP_DUP OP_HASH160 <20 bytes pkh> OP_EQUALVERIFY OP_CHECKSIG */
+	memcpy(filter -> pkhs + filter -> count * RIPEMD160_DIGEST_LENGTH, sc + 3, RIPEMD160_DIGEST_LENGTH);
+	filter -> count++;
+	free(sc);
+	sc = NULL;
+    }
+
+    *new_filter = filter;
+
+    free_addr_list(addr_list, addr_list_len);
+
+    return 0;
+
+error:
+    if(filter) kyk_free_pkh_filter(filter);
+    if(addr_list) free_addr_list(addr_list, addr_list_len);
+    return -1;
+}
+
 void free_addr_list(char** addr_list, size_t len)
 {
     size_t i = 0;
@@ -1541,7 +2054,6 @@ int kyk_wallet_make_coinbase_block(struct kyk_block** new_blk, const struct kyk_
     uint8_t* pubkey = NULL;
     size_t pbk_len = 0;
     struct kyk_block* blk = NULL;
-    struct kyk_utxo_chain* utxo_chain = NULL;
     int res = -1;
     uint8_t digest[32];
 
@@ -1551,6 +2063,9 @@ int kyk_wallet_make_coinbase_block(struct kyk_block** new_blk, const struct kyk_
     res = kyk_load_blk_header_chain(&hd_chain, wallet);
     check(res == 0, "Failed to kyk_wallet_make_coinbase_block: kyk_load_blk_header_chain failed");
 
+    res = kyk_wallet_load_miner_threads(wallet);
+    check(res == 0, "Failed to kyk_wallet_make_coinbase_block: kyk_wallet_load_miner_threads failed");
+
     res = kyk_make_coinbase_block(&blk, hd_chain, note, pubkey, pbk_len);
     check(res == 0, "Failed to kyk_wallet_make_coinbase_block: kyk_make_conibase_block failed");
 
@@ -1560,20 +2075,8 @@ int kyk_wallet_make_coinbase_block(struct kyk_block** new_blk, const struct kyk_
     res = kyk_append_blk_hd_chain(hd_chain, blk -> hd, 1);
     check(res == 0, "Failed to kyk_wallet_make_coinbase_block: kyk_append_blk_hd_chain failed");
 
-    res = kyk_load_utxo_chain(&utxo_chain, wallet);
-    check(res == 0, "Failed to kyk_wallet_make_coinbase_block: kyk_load_utxo_chain failed");
-
-    res = kyk_append_utxo_chain_from_block(utxo_chain, blk);
-    check(res == 0, "Failed to kyk_wallet_make_coinbase_block: kyk_append_utxo_chain_from_block failed");
-
-    res = kyk_wallet_save_utxo_chain(wallet, utxo_chain);
-    check(res == 0, "Failed to kyk_wallet_make_coinbase_block: kyk_wallet_save_utxo_chain failed");
-
-    res = kyk_save_blk_header_chain(wallet, hd_chain, NULL);
-    check(res == 0, "Failed to kyk_wallet_make_coinbase_block: kyk_save_blk_header_chain failed");
-
-    res = kyk_wallet_save_block(wallet, blk);
-    check(res == 0, "Failed to kyk_wallet_make_coinbase_block: kyk_wallet_save_block failed");
+    res = kyk_wallet_connect_block(wallet, blk);
+    check(res == 0, "Failed to kyk_wallet_make_coinbase_block: kyk_wallet_connect_block failed");
 
     kyk_blk_hash256(digest, blk -> hd);
     kyk_print_hex("maked a new block", digest, sizeof(digest));
@@ -1585,60 +2088,44 @@ int kyk_wallet_make_coinbase_block(struct kyk_block** new_blk, const struct kyk_
     }
 
     free(pubkey);
-    kyk_free_utxo_chain(utxo_chain);
     
     return 0;
 
 error:
     if(pubkey) free(pubkey);
     if(blk) kyk_free_block(blk);
-    if(utxo_chain) kyk_free_utxo_chain(utxo_chain);
     return -1;
 
 }
 
+/*
+ * Connects the blocks in order, a block connected before only writes its coins again,
+ * the blocks after it spend them again.
+ */
 int kyk_wallet_update_utxo_chain_with_block_list(const struct kyk_wallet* wallet,
 						 const struct kyk_block_list* blk_list)
 {
-    struct kyk_utxo_chain* utxo_chain = NULL;
-    struct kyk_utxo_chain* utxo_chain1 = NULL;
-    struct kyk_utxo_chain* newly_utxo_chain = NULL;
     struct kyk_block* blk = NULL;
     size_t i = 0;
     int res = -1;
 
-    res = kyk_load_utxo_chain(&utxo_chain, wallet);
-    check(res == 0, "Failed to kyk_wallet_update_utxo_chain_with_block_list: kyk_load_utxo_chain failed");
+    check(wallet, "Failed to kyk_wallet_update_utxo_chain_with_block_list: wallet is NULL");
+    check(wallet -> chainstate, "Failed to kyk_wallet_update_utxo_chain_with_block_list: wallet -> chainstate is NULL");
+    check(blk_list, "Failed to kyk_wallet_update_utxo_chain_with_block_list: blk_list is NULL");
 
     for(i = 0; i < blk_list -> len; i++){
 	blk = blk_list -> data + i;
-	res = kyk_append_utxo_chain_from_block(utxo_chain, blk);
-	check(res == 0, "Failed to kyk_wallet_update_utxo_chain_with_block_list: kyk_append_utxo_chain_from_block failed");
+	res = kyk_chainstate_connect_block(wallet -> chainstate, blk);
+	check(res == 0, "Failed to kyk_wallet_update_utxo_chain_with_block_list: kyk_chainstate_connect_block failed");
     }
 
-    for(i = 0; i < blk_list -> len; i++){
-	blk = blk_list -> data + i;
-	res = kyk_set_spent_utxo_within_block(utxo_chain, blk);
-	check(res == 0, "Failed to kyk_wallet_update_utxo_chain_with_block_list: kyk_set_spent_utxo failed");
-    }
-
-    res = kyk_remove_spent_utxo(&utxo_chain1, utxo_chain);
-    check(res == 0, "Failed to kyk_wallet_update_utxo_chain_with_block_list: kyk_remove_spent_utxo failed");
-
-    kyk_print_utxo_chain(utxo_chain);
+    res = kyk_chainstate_flush(wallet -> chainstate);
+    check(res == 0, "Failed to kyk_wallet_update_utxo_chain_with_block_list: kyk_chainstate_flush failed");
 
-    res = kyk_remove_repeated_utxo(&newly_utxo_chain, utxo_chain1);
-    check(res == 0, "Failed to kyk_wallet_update_utxo_chain_with_block_list: kyk_remove_repeated_utxo failed");
-
-    res = kyk_wallet_save_utxo_chain(wallet, newly_utxo_chain);
-    check(res == 0, "Failed to kyk_wallet_update_utxo_chain_with_block_list: kyk_wallet_save_utxo_chain failed");
-
-    kyk_free_utxo_chain(utxo_chain);
     return 0;
     
 error:
-    
-    if(utxo_chain) kyk_free_utxo_chain(utxo_chain);
+
     return -1;
     
 }
@@ -1650,7 +2137,6 @@ int kyk_wallet_cmd_make_tx( struct kyk_block** new_blk,
 {
     struct kyk_blk_hd_chain* hd_chain = NULL;
     struct kyk_utxo_chain* wallet_utxo_chain = NULL;
-    struct kyk_utxo_chain* updated_utxo_chain = NULL;
     struct kyk_utxo_chain* tx_utxo_chain = NULL;
     struct kyk_block* blk = NULL;
     struct kyk_tx* tx = NULL;
@@ -1689,6 +2175,9 @@ int kyk_wallet_cmd_make_tx( struct kyk_block** new_blk,
     res = kyk_wallet_get_mfee(tx, tx_utxo_chain, &mfee);
     check(res == 0, "Failed to kyk_wallet_cmd_make_tx: kyk_wallet_get_mfee failed");
 
+    res = kyk_wallet_load_miner_threads(wallet);
+    check(res == 0, "Failed to kyk_wallet_cmd_make_tx: kyk_wallet_load_miner_threads failed");
+
     res = kyk_make_tx_block(&blk, hd_chain, tx, mfee, 1, KYK_DEFAULT_NOTE, pubkey, pub_len);
     check(res == 0, "Failed to kyk_wallet_cmd_make_tx: kyk_make_tx_block failed");
 
@@ -1698,24 +2187,8 @@ int kyk_wallet_cmd_make_tx( struct kyk_block** new_blk,
     res = kyk_append_blk_hd_chain(hd_chain, blk -> hd, 1);
     check(res == 0, "Failed to kyk_wallet_make_coinbase_block: kyk_append_blk_hd_chain failed");
 
-    res = kyk_append_utxo_chain_from_block(wallet_utxo_chain, blk);
-    check(res == 0, "Failed to kyk_wallet_cmd_make_tx: kyk_append_utxo_chain_from_block failed");
-
-    kyk_wallet_set_utxo_chain_spent(tx_utxo_chain);
-
-    res = kyk_remove_spent_utxo(&updated_utxo_chain, wallet_utxo_chain);
-    check(res == 0, "Failed to kyk_wallet_cmd_make_tx: kyk_remove_spent_utxo failed");
-
-    kyk_print_utxo_chain(updated_utxo_chain);
-
-    res = kyk_wallet_save_utxo_chain(wallet, updated_utxo_chain);
-    check(res == 0, "Failed to kyk_wallet_cmd_make_tx: kyk_wallet_save_utxo_chain failed");
-
-    res = kyk_save_blk_header_chain(wallet, hd_chain, NULL);
-    check(res == 0, "Failed to kyk_wallet_cmd_make_tx: kyk_save_blk_header_chain failed");
-
-    res = kyk_wallet_save_block(wallet, blk);
-    check(res == 0, "Failed to kyk_wallet_cmd_make_tx: kyk_wallet_save_block failed");
+    res = kyk_wallet_connect_block(wallet, blk);
+    check(res == 0, "Failed to kyk_wallet_cmd_make_tx: kyk_wallet_connect_block failed");
 
     if(new_blk){
 	*new_blk = blk;
@@ -1726,7 +2199,6 @@ int kyk_wallet_cmd_make_tx( struct kyk_block** new_blk,
     free(pubkey);
     kyk_free_utxo_chain(tx_utxo_chain);
     kyk_free_utxo_chain(wallet_utxo_chain);
-    free(updated_utxo_chain);
 
     return 0;
 
@@ -1736,7 +2208,6 @@ error:
 
     if(tx_utxo_chain) kyk_free_utxo_chain(tx_utxo_chain);
     if(wallet_utxo_chain) kyk_free_utxo_chain(wallet_utxo_chain);
-    if(updated_utxo_chain) free(updated_utxo_chain);
     
 
     return -1;
@@ -1873,19 +2344,17 @@ error:
 }
 
 
+/* looks every txin up in the chainstate, the coins are not all loaded */
 int kyk_wallet_find_utxo_list_for_tx(const struct kyk_wallet* wallet,
 				     const struct kyk_tx* tx,
 				     struct kyk_utxo_list* utxo_list)
 {
     struct kyk_utxo* utxo = NULL;
-    struct kyk_utxo* dest_utxo = NULL;
-    struct kyk_utxo_chain* wallet_utxo_chain = NULL;
     size_t i = 0;
-    size_t j = 0;
-    
     int res = -1;
     
     check(wallet, "Failed to kyk_wallet_find_utxo_list_for_tx: wallet is NULL");
+    check(wallet -> chainstate, "Failed to kyk_wallet_find_utxo_list_for_tx: wallet -> chainstate is NULL");
     check(tx, "Failed to kyk_wallet_find_utxo_list_for_tx: tx is NULL");
     check(tx -> vin_sz > 0, "Failed to kyk_wallet_find_utxo_list_for_tx: tx -> vin_sz is invalid");
     check(utxo_list, "Failed to kyk_wallet_find_utxo_list_for_tx: utxo_list is NULL");
@@ -1896,45 +2365,97 @@ int kyk_wallet_find_utxo_list_for_tx(const struct kyk_wallet* wallet,
     utxo_list -> data = calloc(tx -> vin_sz, sizeof(*utxo_list -> data));
     check(utxo_list -> data, "Failed to kyk_wallet_find_utxo_list_for_tx: calloc failed");
 
-    res = kyk_load_utxo_chain(&wallet_utxo_chain, wallet);
-    check(res == 0, "Failed to kyk_wallet_find_utxo_list_for_tx: kyk_load_utxo_chain failed");
+    for(i = 0; i < tx -> vin_sz; i++){
+	res = kyk_chainstate_get_utxo(wallet -> chainstate, tx -> txin[i].pre_txid, tx -> txin[i].pre_txout_inx, &utxo);
+	check(res == 0, "Failed to kyk_wallet_find_utxo_list_for_tx: kyk_chainstate_get_utxo failed");
+	check(utxo, "Failed to kyk_wallet_find_utxo_list_for_tx: no matched utxo for txin: %zu", i);
+
+	kyk_copy_utxo(utxo_list -> data + i, utxo);
+	utxo_list -> len += 1;
+
+	kyk_free_utxo(utxo);
+	utxo = NULL;
+    }
+    
+    return 0;
+    
+error:
+    if(utxo) kyk_free_utxo(utxo);
+    if(utxo_list && utxo_list -> data){
+	free(utxo_list -> data);
+	utxo_list -> data = NULL;
+    }
+    return -1;
+}
+
+/* same as kyk_wallet_find_utxo_list_for_tx, against a utxo chain the caller holds */
+int kyk_find_utxo_list_for_tx(const struct kyk_utxo_chain* utxo_chain,
+			      const struct kyk_tx* tx,
+			      struct kyk_utxo_list* utxo_list)
+{
+    struct kyk_utxo_set* set = NULL;
+    struct kyk_utxo_entry* entry = NULL;
+    struct kyk_utxo* dest_utxo = NULL;
+    size_t i = 0;
+    
+    int res = -1;
+    
+    check(utxo_chain, "Failed to kyk_find_utxo_list_for_tx: utxo_chain is NULL");
+    check(tx, "Failed to kyk_find_utxo_list_for_tx: tx is NULL");
+    check(tx -> vin_sz > 0, "Failed to kyk_find_utxo_list_for_tx: tx -> vin_sz is invalid");
+    check(utxo_list, "Failed to kyk_find_utxo_list_for_tx: utxo_list is NULL");
+    check(utxo_list -> data == NULL, "Failed to kyk_find_utxo_list_for_tx: utxo_list -> data should be NULL");
+
+    utxo_list -> len = 0;
+
+    utxo_list -> data = calloc(tx -> vin_sz, sizeof(*utxo_list -> data));
+    check(utxo_list -> data, "Failed to kyk_find_utxo_list_for_tx: calloc failed");
+
+    res = kyk_new_utxo_set(&set, utxo_chain -> len);
+    check(res == 0, "Failed to kyk_find_utxo_list_for_tx: kyk_new_utxo_set failed");
+
+    res = kyk_utxo_set_from_chain(set, utxo_chain);
+    check(res == 0, "Failed to kyk_find_utxo_list_for_tx: kyk_utxo_set_from_chain failed");
 
     for(i = 0; i < tx -> vin_sz; i++){
-	utxo = wallet_utxo_chain -> hd;
-	for(j = 0; j < wallet_utxo_chain -> len; j++){
-	    /* kyk_print_utxo(utxo); */
-	    res = kyk_utxo_match_txin(utxo, tx -> txin + i);
-	    if(res == 0){
-		dest_utxo = utxo_list -> data + i;
-		kyk_copy_utxo(dest_utxo, utxo);
-		utxo_list -> len += 1;
-		break;
-	    }
-	    utxo = utxo -> next;
+	entry = kyk_utxo_set_find(set, tx -> txin[i].pre_txid, tx -> txin[i].pre_txout_inx);
+	if(entry){
+	    dest_utxo = utxo_list -> data + i;
+	    kyk_copy_utxo(dest_utxo, entry -> node);
+	    utxo_list -> len += 1;
 	}
 
 	/* didn't find matched utxo for txin */
-	check(utxo_list -> len == i+1, "Failed to kyk_wallet_find_utxo_list_for_tx: no matched utxo for txin: %zu", i);
+	check(utxo_list -> len == i+1, "Failed to kyk_find_utxo_list_for_tx: no matched utxo for txin: %zu", i);
     }
+
+    kyk_free_utxo_set(set);
     
     return 0;
     
 error:
-    if(utxo_list -> data) free(utxo_list -> data);
+    if(set) kyk_free_utxo_set(set);
+    if(utxo_list && utxo_list -> data){
+	free(utxo_list -> data);
+	utxo_list -> data = NULL;
+    }
     return -1;
 }
 
-
+/*
+ * Mine a block with tx on top of hd_chain, the chain the caller keeps of the wallet's headers,
+ * and validate it.
+ * The block is not stored, the caller connects it with kyk_wallet_connect_block
+ * so that only storing it has to exclude the readers of the chain.
+ */
 int kyk_wallet_mining_block(struct kyk_block** new_blk,
 			    const struct kyk_tx* tx,
 			    struct kyk_utxo_list* utxo_list,
-			    struct kyk_wallet* wallet)
+			    struct kyk_wallet* wallet,
+			    const struct kyk_blk_hd_chain* hd_chain)
 {
     struct kyk_block* blk = NULL;
-    struct kyk_blk_hd_chain* hd_chain = NULL;
-    struct kyk_utxo_chain* wallet_utxo_chain = NULL;
     struct kyk_utxo_chain* tx_utxo_chain = NULL;
-    struct kyk_utxo_chain* updated_utxo_chain = NULL;
     uint8_t* pubkey = NULL;
     size_t pub_len = 0;
     uint64_t mfee = 0;
@@ -1944,60 +2465,30 @@ int kyk_wallet_mining_block(struct kyk_block** new_blk,
     check(tx, "Failed to kyk_wallet_mining_block: tx_list is NULL");
     check(utxo_list, "Failed to kyk_wallet_mining_block: utxo_list is NULL");
     check(utxo_list -> data, "Failed to kyk_wallet_mining_block: utxo_list -> data is NULL");
+    check(hd_chain, "Failed to kyk_wallet_mining_block: hd_chain is NULL");
 
     res = kyk_wallet_get_pubkey(&pubkey, &pub_len, wallet, KYK_DEFAULT_PUBKEY_NAME);
     check(res == 0, "Failed to kyk_wallet_mining_block: kyk_wallet_get_pubkey failed");
 
-    res = kyk_load_blk_header_chain(&hd_chain, wallet);
-    check(res == 0, "Failed to kyk_wallet_mining_block: kyk_load_blk_header_chain failed");
-
-    res = kyk_load_utxo_chain(&wallet_utxo_chain, wallet);
-    check(res == 0, "Failed to kyk_wallet_mining_block: kyk_load_utxo_chain failed");    
-
     res = kyk_utxo_list_to_chain(utxo_list, &tx_utxo_chain);
     check(res == 0, "Failed to kyk_wallet_mining_block: kyk_utxo_list_to_chain failed");
 
     res = kyk_wallet_get_mfee(tx, tx_utxo_chain, &mfee);
     check(res == 0, "Failed to kyk_wallet_mining_block: kyk_wallet_get_mfee failed");
 
+    res = kyk_wallet_load_miner_threads(wallet);
+    check(res == 0, "Failed to kyk_wallet_mining_block: kyk_wallet_load_miner_threads failed");
+
     res = kyk_make_tx_block(&blk, hd_chain, tx, mfee, 1, KYK_DEFAULT_NOTE, pubkey, pub_len);
     check(res == 0, "Failed to kyk_wallet_mining_block: kyk_make_tx_block failed");
 
     res = kyk_validate_block(hd_chain, blk);
     check(res == 0, "Failed to kyk_wallet_mining_block: kyk_validate_block failed");
 
-    res = kyk_append_blk_hd_chain(hd_chain, blk -> hd, 1);
-    check(res == 0, "Failed to kyk_wallet_mining_block: kyk_append_blk_hd_chain failed");
-
-    res = kyk_append_utxo_chain_from_block(wallet_utxo_chain, blk);
-    check(res == 0, "Failed to kyk_wallet_mining_block: kyk_append_utxo_chain_from_block failed");
-
-    /* kyk_wallet_set_utxo_chain_spent(tx_utxo_chain); */
-
-    kyk_wallet_consume_utxo_chain(tx_utxo_chain, wallet_utxo_chain);
-
-    res = kyk_remove_spent_utxo(&updated_utxo_chain, wallet_utxo_chain);
-    check(res == 0, "Failed to kyk_wallet_mining_block: kyk_remove_spent_utxo failed");
-
-    res = kyk_wallet_save_utxo_chain(wallet, updated_utxo_chain);
-    check(res == 0, "Failed to kyk_wallet_mining_block: kyk_wallet_save_utxo_chain failed");
-
-    res = kyk_save_blk_header_chain(wallet, hd_chain, NULL);
-    check(res == 0, "Failed to kyk_wallet_mining_block: kyk_save_blk_header_chain failed");
-
-    res = kyk_wallet_save_block(wallet, blk);
-    check(res == 0, "Failed to kyk_wallet_mining_block: kyk_wallet_save_block failed");
-    
-    if(new_blk){
-	*new_blk = blk;
-    } else {
-	kyk_free_block(blk);
-    }
+    *new_blk = blk;
 
     free(pubkey);
     kyk_free_utxo_chain(tx_utxo_chain);
-    kyk_free_utxo_chain(wallet_utxo_chain);
-    free(updated_utxo_chain);
     
     return 0;
     
@@ -2007,8 +2498,6 @@ error:
     if(blk) kyk_free_block(blk);
 
     if(tx_utxo_chain) kyk_free_utxo_chain(tx_utxo_chain);
-    if(wallet_utxo_chain) kyk_free_utxo_chain(wallet_utxo_chain);
-    if(updated_utxo_chain) free(updated_utxo_chain);
 
     return -1;
 }
@@ -2017,28 +2506,126 @@ error:
 int kyk_wallet_consume_utxo_chain(const struct kyk_utxo_chain* tx_utxo_chain,
 				  struct kyk_utxo_chain* wallet_utxo_chain)
 {
-    struct kyk_utxo* tx_utxo = NULL;
+    struct kyk_utxo_set* set = NULL;
+    struct kyk_utxo_entry* entry = NULL;
     struct kyk_utxo* w_utxo = NULL;
     size_t i = 0;
-    size_t j = 0;
     int res = -1;
 
+    check(tx_utxo_chain, "Failed to kyk_wallet_consume_utxo_chain: tx_utxo_chain is NULL");
+    check(wallet_utxo_chain, "Failed to kyk_wallet_consume_utxo_chain: wallet_utxo_chain is NULL");
+
+    res = kyk_new_utxo_set(&set, tx_utxo_chain -> len);
+    check(res == 0, "Failed to kyk_wallet_consume_utxo_chain: kyk_new_utxo_set failed");
+
+    res = kyk_utxo_set_from_chain(set, tx_utxo_chain);
+    check(res == 0, "Failed to kyk_wallet_consume_utxo_chain: kyk_utxo_set_from_chain failed");
+
     w_utxo = wallet_utxo_chain -> hd;
     for(i = 0; i < wallet_utxo_chain -> len; i++){
-	tx_utxo = tx_utxo_chain -> hd;
-	for(j = 0; j < tx_utxo_chain -> len; j++){
-	    res = kyk_cmp_utxo(tx_utxo, w_utxo);
-	    if(res == 0){
-		tx_utxo -> refer_to = w_utxo;
-		tx_utxo -> spent = 1;
-		w_utxo -> spent = 1;
-	    }
-	    tx_utxo = tx_utxo -> next;
+	entry = kyk_utxo_set_find_utxo(set, w_utxo);
+	if(entry){
+	    entry -> node -> refer_to = w_utxo;
+	    entry -> node -> spent = 1;
+	    w_utxo -> spent = 1;
 	}
-	
 	w_utxo = w_utxo -> next;
     }
 
+    kyk_free_utxo_set(set);
+
+    return 0;
+
+error:
+    if(set) kyk_free_utxo_set(set);
+    return -1;
+}
+
+/* number of mining workers, 0 means one worker per online CPU */
+int kyk_wallet_load_miner_threads(const struct kyk_wallet* wallet)
+{
+    int64_t thread_num = KYK_MINER_THREADS_AUTO;
+    int res = -1;
+
+    check(wallet, "Failed to kyk_wallet_load_miner_threads: wallet is NULL");
+
+    if(wallet -> wallet_cfg){
+	res = kyk_config_getint64(wallet -> wallet_cfg, &thread_num, KYK_MINER_THREADS_AUTO, WCFG_MINER_THREADS);
+	check(res == 0, "Failed to kyk_wallet_load_miner_threads: kyk_config_getint64 failed");
+    }
+
+    kyk_set_miner_threads((int)thread_num);
+
     return 0;
+
+error:
+
+    return -1;
 }
 
+/*
+ * The index db options of the wallet config, the defaults of kyk_init_db_opts for what it does not set,
+ * and whether the db keeps the tx index, KYK_TXINDEX if it does not say.
+ * Read from a config of their own, a missing key is added to the config it is read from
+ * and the wallet config takes the next key index from its last key.
+ */
+int kyk_wallet_load_db_opts(const struct kyk_wallet* wallet, struct kyk_db_opts* opts, int* txindex)
+{
+    struct config* cfg = NULL;
+    int64_t val = 0;
+    int res = -1;
+
+    check(wallet, "Failed to kyk_wallet_load_db_opts: wallet is NULL");
+    check(wallet -> wallet_cfg_path, "Failed to kyk_wallet_load_db_opts: wallet -> wallet_cfg_path is NULL");
+    check(opts, "Failed to kyk_wallet_load_db_opts: opts is NULL");
+    check(txindex, "Failed to kyk_wallet_load_db_opts: txindex is NULL");
+
+    kyk_init_db_opts(opts);
+
+    res = kyk_config_load(wallet -> wallet_cfg_path, &cfg);
+    check(res == 0, "Failed to kyk_wallet_load_db_opts: kyk_config_load failed");
+
+    res = kyk_config_getint64(cfg, &val, (int64_t)opts -> cache_size, WCFG_LDB_CACHE_SIZE);
+    check(res == 0 && val >= 0, "Failed to kyk_wallet_load_db_opts: invalid %s", WCFG_LDB_CACHE_SIZE);
+    opts -> cache_size = (size_t)val;
+
+    res = kyk_config_getint64(cfg, &val, opts -> bloom_bits, WCFG_LDB_BLOOM_BITS);
+    check(res == 0 && val >= 0, "Failed to kyk_wallet_load_db_opts: invalid %s", WCFG_LDB_BLOOM_BITS);
+    opts -> bloom_bits = (int)val;
+
+    res = kyk_config_getint64(cfg, &val, opts -> compression, WCFG_LDB_COMPRESSION);
+    check(res == 0, "Failed to kyk_wallet_load_db_opts: invalid %s", WCFG_LDB_COMPRESSION);
+    opts -> compression = val != 0;
+
+    res = kyk_config_getint64(cfg, &val, (int64_t)opts -> write_buffer_size, WCFG_LDB_WRITE_BUFFER_SIZE);
+    check(res == 0 && val > 0, "Failed to kyk_wallet_load_db_opts: invalid %s", WCFG_LDB_WRITE_BUFFER_SIZE);
+    opts -> write_buffer_size = (size_t)val;
+
+    res = kyk_config_getint64(cfg, &val, opts -> max_open_files, WCFG_LDB_MAX_OPEN_FILES);
+    check(res == 0 && val > 0, "Failed to kyk_wallet_load_db_opts: invalid %s", WCFG_LDB_MAX_OPEN_FILES);
+    opts -> max_open_files = (int)val;
+
+    res = kyk_config_getint64(cfg, &val, opts -> verify_checksums, WCFG_LDB_VERIFY_CHECKSUMS);
+    check(res == 0, "Failed to kyk_wallet_load_db_opts: invalid %s", WCFG_LDB_VERIFY_CHECKSUMS);
+    opts -> verify_checksums = val != 0;
+
+    res = kyk_config_getint64(cfg, &val, opts -> fill_cache, WCFG_LDB_FILL_CACHE);
+    check(res == 0, "Failed to kyk_wallet_load_db_opts: invalid %s", WCFG_LDB_FILL_CACHE);
+    opts -> fill_cache = val != 0;
+
+    res = kyk_config_getint64(cfg, &val, opts -> bulk_load, WCFG_LDB_BULK_LOAD);
+    check(res == 0, "Failed to kyk_wallet_load_db_opts: invalid %s", WCFG_LDB_BULK_LOAD);
+    opts -> bulk_load = val != 0;
+
+    res = kyk_config_getint64(cfg, &val, KYK_TXINDEX, WCFG_TXINDEX);
+    check(res == 0, "Failed to kyk_wallet_load_db_opts: invalid %s", WCFG_TXINDEX);
+    *txindex = val != 0;
+
+    kyk_config_free(cfg);
+
+    return 0;
+
+error:
+    if(cfg) kyk_config_free(cfg);
+    return -1;
+}
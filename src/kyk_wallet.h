@@ -2,12 +2,18 @@
 #define KYK_WALLET_H__
 
 #include <time.h>
+#include <sys/types.h>
 #include "kyk_defs.h"
 #include "kyk_ldb.h"
 
 struct kyk_blk_hd_chain;
+struct kyk_blk_header;
 struct kyk_utxo_chain;
+struct kyk_chainstate;
+struct kyk_blk_reader;
+struct kyk_blk_writer;
 struct kyk_utxo_list;
+struct ptl_pkh_filter;
 
 struct kyk_wallet_key {
     struct kyk_key* key;
@@ -42,6 +48,9 @@ struct kyk_wallet {
     char* blk_hd_chain_path;
     char* utxo_path;
     struct kyk_block_db* blk_index_db;
+    struct kyk_chainstate* chainstate;
+    struct kyk_blk_reader* blk_reader;
+    struct kyk_blk_writer* blk_writer;
     struct config* wallet_cfg;
 };
 
@@ -75,6 +84,8 @@ int kyk_save_blk_header_chain(const struct kyk_wallet* wallet,
 			      const struct kyk_blk_hd_chain* hd_chain,
 			      const char* mode);
 
+int kyk_wallet_append_blk_header(const struct kyk_wallet* wallet, const struct kyk_blk_header* hd);
+
 int kyk_load_blk_header_chain(struct kyk_blk_hd_chain** hd_chain,
 			      const struct kyk_wallet* wallet);
 
@@ -88,6 +99,8 @@ int kyk_wallet_get_pubkey(uint8_t** pubkey,
 
 int kyk_wallet_save_block(const struct kyk_wallet* wallet, const struct kyk_block* blk);
 
+int kyk_wallet_connect_block(const struct kyk_wallet* wallet, const struct kyk_block* blk);
+
 int kyk_load_utxo_chain(struct kyk_utxo_chain** new_utxo_chain,
 			const struct kyk_wallet* wallet);
 
@@ -106,6 +119,9 @@ int kyk_wallet_load_addr_list(const struct kyk_wallet* wallet,
 			      char** new_addr_list[],
 			      size_t* nlen);
 
+int kyk_wallet_build_pkh_filter(const struct kyk_wallet* wallet,
+				struct ptl_pkh_filter** new_filter);
+
 int kyk_wallet_query_total_balance(const struct kyk_wallet* wallet, uint64_t* balance);
 
 
@@ -174,6 +190,20 @@ int kyk_wallet_query_block_by_hashbytes(const struct kyk_wallet* wallet,
 					const uint8_t* blk_hash,
 					struct kyk_block** new_blk);
 
+int kyk_wallet_get_tx_view(const struct kyk_wallet* wallet,
+			   const uint8_t* txid,
+			   const uint8_t** new_buf,
+			   size_t* tx_size);
+
+int kyk_wallet_query_tx(const struct kyk_wallet* wallet,
+			const uint8_t* txid,
+			struct kyk_tx** new_tx);
+
+int kyk_wallet_get_block_view(const struct kyk_wallet* wallet,
+			      const struct kyk_bkey_val* bval,
+			      const uint8_t** new_buf,
+			      uint32_t* blk_size);
+
 int kyk_wallet_update_utxo_chain_with_block_list(const struct kyk_wallet* wallet,
 						 const struct kyk_block_list* blk_list);
 
@@ -186,6 +216,10 @@ int kyk_wallet_find_utxo_list_for_tx(const struct kyk_wallet* wallet,
 				     const struct kyk_tx* tx,
 				     struct kyk_utxo_list* utxo_list);
 
+int kyk_find_utxo_list_for_tx(const struct kyk_utxo_chain* utxo_chain,
+			      const struct kyk_tx* tx,
+			      struct kyk_utxo_list* utxo_list);
+
 int kyk_wallet_filter_utxo_chain(struct kyk_utxo_chain** new_utxo_chain,
 				 struct kyk_utxo_chain* src_utxo_chain,
 				 const struct kyk_wallet* wallet);
@@ -194,7 +228,8 @@ int kyk_wallet_filter_utxo_chain(struct kyk_utxo_chain** new_utxo_chain,
 int kyk_wallet_mining_block(struct kyk_block** new_blk,
 			    const struct kyk_tx* tx,
 			    struct kyk_utxo_list* utxo_list,
-			    struct kyk_wallet* wallet);
+			    struct kyk_wallet* wallet,
+			    const struct kyk_blk_hd_chain* hd_chain);
 
 int kyk_wallet_consume_utxo_chain(const struct kyk_utxo_chain* tx_utxo_chain,
 				  struct kyk_utxo_chain* wallet_utxo_chain);
@@ -73,6 +73,19 @@ size_t get_varint_size(const varint_t v)
     return res;
 }
 
+size_t get_varint_len_by_prefix(uint8_t prefix)
+{
+    switch (prefix) {
+    case 0xfd:
+	return 3;
+    case 0xfe:
+	return 5;
+    case 0xff:
+	return 9;
+    default:
+	return 1;
+    }
+}
 
 size_t get_var_str_size(const var_str* vstr)
 {
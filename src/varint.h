@@ -5,6 +5,8 @@
 
 #define varint_t uint64_t
 
+#define KYK_VARINT_MAX_LEN 9
+
 typedef struct var_str {
     varint_t len;
     char* data;
@@ -18,6 +20,9 @@ size_t kyk_unpack_varint(const unsigned char *buf, varint_t *val);
 
 size_t get_varint_size(const varint_t v);
 
+/* Returns bytes the varint starting with this byte takes */
+size_t get_varint_len_by_prefix(uint8_t prefix);
+
 size_t get_var_str_size(const var_str* vstr);
 
 size_t kyk_pack_var_str(uint8_t* buf, const var_str* vstr);
@@ -37,12 +37,44 @@ char *test_block_hash()
     return NULL;
 }
 
+char *test_blk_hd_hasher()
+{
+    struct kyk_blk_header blk_hd;
+    struct kyk_blk_hd_hasher hasher;
+    uint8_t dgst[SHA256_DIGEST_LENGTH];
+    uint8_t dgst2[SHA256_DIGEST_LENGTH];
+    uint8_t target_hsh[SHA256_DIGEST_LENGTH];
+    int res = -1;
+
+    blk_hd.version = 1;
+    kyk_parse_hex(blk_hd.pre_blk_hash, "0000000000000000000000000000000000000000000000000000000000000000");
+    kyk_parse_hex(blk_hd.mrk_root_hash, "4a5e1e4baab89f3a32518a88c31bc87f618f76673e2cc77ab2127b7afdeda33b");
+    blk_hd.tts = 1231006505;
+    blk_hd.bts = 486604799;
+    blk_hd.nonce = 0;
+
+    res = kyk_init_blk_hd_hasher(&hasher, &blk_hd);
+    mu_assert(res == 0, "Failed to test_blk_hd_hasher: kyk_init_blk_hd_hasher failed");
+
+    kyk_blk_hd_hasher_hash(&hasher, dgst, 2083236893);
+    kyk_parse_hex(target_hsh, "000000000019d6689c085ae165831e934ff763ae46a2a6c172b3f1b60a8ce26f");
+    mu_assert(kyk_digest_eq(dgst, target_hsh, sizeof(dgst)), "Failed to test_blk_hd_hasher: invalid genesis block hash");
+
+    /* the cached midstate can be reused for other nonces */
+    kyk_blk_hd_hasher_hash(&hasher, dgst, 12345);
+    blk_hd.nonce = 12345;
+    kyk_blk_hash256(dgst2, &blk_hd);
+    mu_assert(kyk_digest_eq(dgst, dgst2, sizeof(dgst)), "Failed to test_blk_hd_hasher: digest is not equal to kyk_blk_hash256");
+
+    return NULL;
+}
 
 char *all_tests()
 {
     mu_suite_start();
     
     mu_run_test(test_block_hash);
+    mu_run_test(test_blk_hd_hasher);
     
     return NULL;
 }
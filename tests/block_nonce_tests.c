@@ -7,6 +7,7 @@
 #include "kyk_utils.h"
 #include "kyk_sha.h"
 #include "kyk_difficulty.h"
+#include "kyk_hash_nonce.h"
 #include "beej_pack.h"
 #include "mu_unit.h"
 
@@ -72,11 +73,66 @@ char *test_block_nonce()
 
 }
 
+char *test_kyk_hash_nonce_mt()
+{
+    struct kyk_blk_header blk_hd;
+    uint8_t digest[32];
+    mpz_t tg, hs;
+    int res = -1;
+
+    blk_hd.version = 1;
+    kyk_parse_hex(blk_hd.pre_blk_hash, "000000000019d6689c085ae165831e934ff763ae46a2a6c172b3f1b60a8ce26f");
+    kyk_parse_hex(blk_hd.mrk_root_hash, "4a5e1e4baab89f3a32518a88c31bc87f618f76673e2cc77ab2127b7afdeda33b");
+    blk_hd.tts = 1504483200;
+    blk_hd.bts = 0x1f00ffff;
+    blk_hd.nonce = 0;
+
+    res = kyk_hash_nonce_mt(&blk_hd, 4);
+    mu_assert(res == 0, "Failed to test_kyk_hash_nonce_mt");
+    mu_assert(blk_hd.tts == 1504483200, "Failed to test_kyk_hash_nonce_mt: tts should not be rolled");
+
+    kyk_blk_hash256(digest, &blk_hd);
+    mu_assert(kyk_digest_eq(digest, blk_hd.blk_hash, sizeof(digest)), "Failed to test_kyk_hash_nonce_mt: invalid blk_hash");
+
+    mpz_init(tg);
+    mpz_init(hs);
+    kyk_bts2target(blk_hd.bts, tg);
+    mpz_import(hs, sizeof(digest), 1, 1, 1, 0, digest);
+    mu_assert(mpz_cmp(hs, tg) <= 0, "Failed to test_kyk_hash_nonce_mt: block hash dosen't reach target");
+    mpz_clear(tg);
+    mpz_clear(hs);
+
+    return NULL;
+}
+
+char *test_hash_nonce_target_overflow()
+{
+    struct kyk_blk_header blk_hd;
+    int res = -1;
+
+    memset(&blk_hd, 0, sizeof(blk_hd));
+    blk_hd.version = 1;
+    blk_hd.tts = 1504483200;
+    /* 0x23 bytes doesn't fit in 256 bits, the search must fail instead of spinning */
+    blk_hd.bts = 0x23123456;
+
+    res = kyk_hash_nonce(&blk_hd);
+    mu_assert(res == -1, "Failed to test_hash_nonce_target_overflow: kyk_hash_nonce should fail");
+
+    res = kyk_hash_nonce_mt(&blk_hd, 4);
+    mu_assert(res == -1, "Failed to test_hash_nonce_target_overflow: kyk_hash_nonce_mt should fail");
+    mu_assert(blk_hd.tts == 1504483200, "Failed to test_hash_nonce_target_overflow: tts should not be rolled");
+
+    return NULL;
+}
+
 char *all_tests()
 {
     mu_suite_start();
     
     mu_run_test(test_block_nonce);
+    mu_run_test(test_kyk_hash_nonce_mt);
+    mu_run_test(test_hash_nonce_target_overflow);
     
     return NULL;
 }
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "test_data.h"
+#include "beej_pack.h"
+#include "kyk_block.h"
+#include "kyk_blk_reader.h"
+#include "mu_unit.h"
+
+#define BLK_READER_TEST_DIR "/tmp/test_kyk_blk_reader"
+#define BLK_READER_TEST_FILE BLK_READER_TEST_DIR "/blk00000.dat"
+
+/* appends buf the way blocks are stored, returns the nDataPos of it */
+static unsigned int append_test_blk(const uint8_t* buf, uint32_t len)
+{
+    FILE* fp = NULL;
+    uint8_t prefix[8];
+    long int pos = 0;
+
+    fp = fopen(BLK_READER_TEST_FILE, "ab");
+    if(fp == NULL) return 0;
+
+    pos = ftell(fp);
+    beej_pack(prefix, "<L", 0xD9B4BEF9);
+    beej_pack(prefix + 4, "<L", len);
+    fwrite(prefix, 1, sizeof(prefix), fp);
+    fwrite(buf, 1, len, fp);
+    fclose(fp);
+
+    return (unsigned int)pos + sizeof(prefix);
+}
+
+static void reset_test_dir()
+{
+    mkdir(BLK_READER_TEST_DIR, 0755);
+    unlink(BLK_READER_TEST_FILE);
+}
+
+char* test_kyk_blk_reader_get_view()
+{
+    struct kyk_blk_reader* reader = NULL;
+    const uint8_t* buf = NULL;
+    uint32_t blk_size = 0;
+    unsigned int pos1 = 0;
+    unsigned int pos2 = 0;
+    int res = -1;
+
+    reset_test_dir();
+
+    pos1 = append_test_blk(BLOCK_BUF, sizeof(BLOCK_BUF));
+    mu_assert(pos1 > 0, "Failed to test_kyk_blk_reader_get_view: append_test_blk failed");
+
+    res = kyk_new_blk_reader(&reader, BLK_READER_TEST_DIR, 1024 * 1024);
+    mu_assert(res == 0, "Failed to test_kyk_blk_reader_get_view: kyk_new_blk_reader failed");
+
+    res = kyk_blk_reader_get_view(reader, 0, pos1, &buf, &blk_size);
+    mu_assert(res == 0, "Failed to test_kyk_blk_reader_get_view: kyk_blk_reader_get_view failed");
+    mu_assert(blk_size == sizeof(BLOCK_BUF), "Failed to test_kyk_blk_reader_get_view");
+    mu_assert(memcmp(buf, BLOCK_BUF, blk_size) == 0, "Failed to test_kyk_blk_reader_get_view");
+
+    /* a block appended after the file is mapped */
+    pos2 = append_test_blk(BLOCK2_BUF, sizeof(BLOCK2_BUF));
+    mu_assert(pos2 > pos1, "Failed to test_kyk_blk_reader_get_view: append_test_blk failed");
+
+    res = kyk_blk_reader_get_view(reader, 0, pos2, &buf, &blk_size);
+    mu_assert(res == 0, "Failed to test_kyk_blk_reader_get_view: kyk_blk_reader_get_view failed");
+    mu_assert(blk_size == sizeof(BLOCK2_BUF), "Failed to test_kyk_blk_reader_get_view");
+    mu_assert(memcmp(buf, BLOCK2_BUF, blk_size) == 0, "Failed to test_kyk_blk_reader_get_view");
+
+    res = kyk_blk_reader_get_view(reader, 0, pos2 + 16, &buf, &blk_size);
+    mu_assert(res == -1, "Failed to test_kyk_blk_reader_get_view: a view out of the file is given");
+
+    res = kyk_blk_reader_get_view(reader, 1, pos1, &buf, &blk_size);
+    mu_assert(res == -1, "Failed to test_kyk_blk_reader_get_view: a view of a missing file is given");
+
+    kyk_free_blk_reader(reader);
+
+    return NULL;
+}
+
+char* test_kyk_blk_reader_get_block()
+{
+    struct kyk_blk_reader* reader = NULL;
+    struct kyk_cached_blk* cblk = NULL;
+    struct kyk_cached_blk* cblk2 = NULL;
+    struct kyk_block* blk = NULL;
+    unsigned int pos = 0;
+    int res = -1;
+
+    reset_test_dir();
+
+    pos = append_test_blk(BLOCK_BUF, sizeof(BLOCK_BUF));
+    mu_assert(pos > 0, "Failed to test_kyk_blk_reader_get_block: append_test_blk failed");
+
+    res = kyk_deseri_new_block(&blk, BLOCK_BUF, NULL);
+    mu_assert(res == 0, "Failed to test_kyk_blk_reader_get_block: kyk_deseri_new_block failed");
+
+    res = kyk_new_blk_reader(&reader, BLK_READER_TEST_DIR, 1024 * 1024);
+    mu_assert(res == 0, "Failed to test_kyk_blk_reader_get_block: kyk_new_blk_reader failed");
+
+    res = kyk_blk_reader_get_block(reader, 0, pos, &cblk);
+    mu_assert(res == 0, "Failed to test_kyk_blk_reader_get_block: kyk_blk_reader_get_block failed");
+    mu_assert(kyk_eq_blk_hd(cblk -> blk -> hd, blk -> hd), "Failed to test_kyk_blk_reader_get_block");
+    mu_assert(cblk -> blk -> tx_count == blk -> tx_count, "Failed to test_kyk_blk_reader_get_block");
+    mu_assert(reader -> cache_bytes == sizeof(BLOCK_BUF), "Failed to test_kyk_blk_reader_get_block");
+
+    /* the second get is served from the cache */
+    res = kyk_blk_reader_get_block(reader, 0, pos, &cblk2);
+    mu_assert(res == 0, "Failed to test_kyk_blk_reader_get_block: kyk_blk_reader_get_block failed");
+    mu_assert(cblk2 == cblk && cblk -> refs == 2, "Failed to test_kyk_blk_reader_get_block");
+
+    kyk_blk_reader_put_block(reader, cblk);
+    kyk_blk_reader_put_block(reader, cblk2);
+    mu_assert(reader -> lru_hd == cblk, "Failed to test_kyk_blk_reader_get_block");
+
+    kyk_free_blk_reader(reader);
+    kyk_free_block(blk);
+
+    return NULL;
+}
+
+/* the cache holds about cache_max bytes, pinned blocks stay */
+char* test_kyk_blk_reader_evict()
+{
+    struct kyk_blk_reader* reader = NULL;
+    struct kyk_cached_blk* cblk = NULL;
+    struct kyk_cached_blk* cblk2 = NULL;
+    unsigned int pos1 = 0;
+    unsigned int pos2 = 0;
+    int res = -1;
+
+    reset_test_dir();
+
+    pos1 = append_test_blk(BLOCK_BUF, sizeof(BLOCK_BUF));
+    pos2 = append_test_blk(BLOCK2_BUF, sizeof(BLOCK2_BUF));
+
+    res = kyk_new_blk_reader(&reader, BLK_READER_TEST_DIR, sizeof(BLOCK_BUF));
+    mu_assert(res == 0, "Failed to test_kyk_blk_reader_evict: kyk_new_blk_reader failed");
+
+    res = kyk_blk_reader_get_block(reader, 0, pos1, &cblk);
+    mu_assert(res == 0, "Failed to test_kyk_blk_reader_evict: kyk_blk_reader_get_block failed");
+
+    res = kyk_blk_reader_get_block(reader, 0, pos2, &cblk2);
+    mu_assert(res == 0, "Failed to test_kyk_blk_reader_evict: kyk_blk_reader_get_block failed");
+    mu_assert(reader -> cache_bytes == sizeof(BLOCK_BUF) + sizeof(BLOCK2_BUF), "Failed to test_kyk_blk_reader_evict");
+
+    /* the first block is the least recently used, it goes once it is put */
+    kyk_blk_reader_put_block(reader, cblk);
+    mu_assert(reader -> cache_bytes == sizeof(BLOCK2_BUF), "Failed to test_kyk_blk_reader_evict");
+    mu_assert(reader -> lru_hd == cblk2 && reader -> lru_tail == cblk2, "Failed to test_kyk_blk_reader_evict");
+
+    kyk_blk_reader_put_block(reader, cblk2);
+    mu_assert(reader -> cache_bytes <= reader -> cache_max, "Failed to test_kyk_blk_reader_evict");
+
+    kyk_free_blk_reader(reader);
+
+    return NULL;
+}
+
+char *all_tests()
+{
+    mu_suite_start();
+
+    mu_run_test(test_kyk_blk_reader_get_view);
+    mu_run_test(test_kyk_blk_reader_get_block);
+    mu_run_test(test_kyk_blk_reader_evict);
+
+    return NULL;
+}
+
+MU_RUN_TESTS(all_tests);
@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "test_data.h"
+#include "kyk_block.h"
+#include "kyk_ldb.h"
+#include "kyk_blk_writer.h"
+#include "mu_unit.h"
+
+#define BLK_WRITER_TEST_DIR "/tmp/test_kyk_blk_writer"
+#define BLK_WRITER_TEST_DB BLK_WRITER_TEST_DIR "/index"
+
+static off_t test_blk_file_size(int nFile)
+{
+    char path[128];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/blk%05d.dat", BLK_WRITER_TEST_DIR, nFile);
+    if(stat(path, &st) != 0) return -1;
+
+    return st.st_size;
+}
+
+/* an empty blocks dir and index db */
+static int reset_test_dir()
+{
+    char* cmd = "rm -rf " BLK_WRITER_TEST_DIR;
+
+    if(system(cmd) != 0) return -1;
+
+    return mkdir(BLK_WRITER_TEST_DIR, 0755);
+}
+
+static int make_test_blk(struct kyk_block** new_blk, size_t* blkself_size)
+{
+    int res = -1;
+
+    res = kyk_deseri_new_block(new_blk, BLOCK_BUF, NULL);
+    if(res != 0) return -1;
+
+    res = kyk_set_blkself_info(*new_blk);
+    if(res != 0) return -1;
+
+    return kyk_get_blkself_size(*new_blk, blkself_size);
+}
+
+char* test_kyk_blk_writer_write()
+{
+    struct kyk_block_db db;
+    struct kyk_blk_writer* writer = NULL;
+    struct kyk_blk_file_info info;
+    struct kyk_block* blk = NULL;
+    size_t blkself_size = 0;
+    uint64_t nDataPos = 0;
+    int nFile = -1;
+    int res = -1;
+
+    res = reset_test_dir();
+    mu_assert(res == 0, "Failed to test_kyk_blk_writer_write: reset_test_dir failed");
+
+    res = make_test_blk(&blk, &blkself_size);
+    mu_assert(res == 0, "Failed to test_kyk_blk_writer_write: make_test_blk failed");
+
+    res = kyk_init_store_db(&db, BLK_WRITER_TEST_DB);
+    mu_assert(res == 0 && db.errptr == NULL, "Failed to test_kyk_blk_writer_write: kyk_init_store_db failed");
+
+    res = kyk_new_blk_writer(&writer, BLK_WRITER_TEST_DIR, &db, 1024 * 1024, 64 * 1024);
+    mu_assert(res == 0, "Failed to test_kyk_blk_writer_write: kyk_new_blk_writer failed");
+
+    res = kyk_blk_writer_write(writer, blk, NULL, &nFile, &nDataPos);
+    mu_assert(res == 0, "Failed to test_kyk_blk_writer_write: kyk_blk_writer_write failed");
+    mu_assert(nFile == 0 && nDataPos == 8, "Failed to test_kyk_blk_writer_write");
+
+    res = kyk_blk_writer_write(writer, blk, NULL, &nFile, &nDataPos);
+    mu_assert(res == 0, "Failed to test_kyk_blk_writer_write: kyk_blk_writer_write failed");
+    mu_assert(nFile == 0 && nDataPos == blkself_size + 8, "Failed to test_kyk_blk_writer_write");
+
+    /* preallocated past the blocks */
+    mu_assert(test_blk_file_size(0) >= (off_t)(2 * blkself_size), "Failed to test_kyk_blk_writer_write");
+
+    res = kyk_read_blk_file_info(&db, 0, &info);
+    mu_assert(res == 0, "Failed to test_kyk_blk_writer_write: kyk_read_blk_file_info failed");
+    mu_assert(info.nBlocks == 2, "Failed to test_kyk_blk_writer_write");
+    mu_assert(info.nSize == 2 * blkself_size, "Failed to test_kyk_blk_writer_write");
+    mu_assert(info.nTimeFirst == blk -> hd -> tts && info.nTimeLast == blk -> hd -> tts, "Failed to test_kyk_blk_writer_write");
+
+    /* a new writer goes on after the blocks, not after the preallocation */
+    kyk_free_blk_writer(writer);
+    res = kyk_new_blk_writer(&writer, BLK_WRITER_TEST_DIR, &db, 1024 * 1024, 64 * 1024);
+    mu_assert(res == 0, "Failed to test_kyk_blk_writer_write: kyk_new_blk_writer failed");
+
+    res = kyk_blk_writer_write(writer, blk, NULL, &nFile, &nDataPos);
+    mu_assert(res == 0, "Failed to test_kyk_blk_writer_write: kyk_blk_writer_write failed");
+    mu_assert(nFile == 0 && nDataPos == 2 * blkself_size + 8, "Failed to test_kyk_blk_writer_write");
+
+    kyk_free_blk_writer(writer);
+    kyk_free_block_db(&db);
+    kyk_free_block(blk);
+
+    return NULL;
+}
+
+char* test_kyk_blk_writer_rotate()
+{
+    struct kyk_block_db db;
+    struct kyk_blk_writer* writer = NULL;
+    struct kyk_blk_file_info info;
+    struct kyk_block* blk = NULL;
+    size_t blkself_size = 0;
+    uint64_t nDataPos = 0;
+    int nFile = -1;
+    int i = 0;
+    int res = -1;
+
+    res = reset_test_dir();
+    mu_assert(res == 0, "Failed to test_kyk_blk_writer_rotate: reset_test_dir failed");
+
+    res = make_test_blk(&blk, &blkself_size);
+    mu_assert(res == 0, "Failed to test_kyk_blk_writer_rotate: make_test_blk failed");
+
+    res = kyk_init_store_db(&db, BLK_WRITER_TEST_DB);
+    mu_assert(res == 0 && db.errptr == NULL, "Failed to test_kyk_blk_writer_rotate: kyk_init_store_db failed");
+
+    /* two blocks fit in a file */
+    res = kyk_new_blk_writer(&writer, BLK_WRITER_TEST_DIR, &db, 2 * blkself_size + 1, 4096);
+    mu_assert(res == 0, "Failed to test_kyk_blk_writer_rotate: kyk_new_blk_writer failed");
+
+    for(i = 0; i < 5; i++){
+	res = kyk_blk_writer_write(writer, blk, NULL, &nFile, &nDataPos);
+	mu_assert(res == 0, "Failed to test_kyk_blk_writer_rotate: kyk_blk_writer_write failed");
+	mu_assert(nFile == i / 2, "Failed to test_kyk_blk_writer_rotate: invalid nFile");
+	mu_assert(nDataPos == (i % 2) * blkself_size + 8, "Failed to test_kyk_blk_writer_rotate: invalid nDataPos");
+    }
+
+    /* a finished file is cut back to its blocks */
+    mu_assert(test_blk_file_size(0) == (off_t)(2 * blkself_size), "Failed to test_kyk_blk_writer_rotate");
+    mu_assert(test_blk_file_size(1) == (off_t)(2 * blkself_size), "Failed to test_kyk_blk_writer_rotate");
+
+    res = kyk_read_blk_file_info(&db, 2, &info);
+    mu_assert(res == 0, "Failed to test_kyk_blk_writer_rotate: kyk_read_blk_file_info failed");
+    mu_assert(info.nBlocks == 1 && info.nSize == blkself_size, "Failed to test_kyk_blk_writer_rotate");
+
+    kyk_free_blk_writer(writer);
+
+    /* the 'l' record names the file to go on with */
+    res = kyk_new_blk_writer(&writer, BLK_WRITER_TEST_DIR, &db, 2 * blkself_size + 1, 4096);
+    mu_assert(res == 0, "Failed to test_kyk_blk_writer_rotate: kyk_new_blk_writer failed");
+    mu_assert(writer -> nFile == 2 && writer -> info.nSize == blkself_size, "Failed to test_kyk_blk_writer_rotate");
+
+    kyk_free_blk_writer(writer);
+    kyk_free_block_db(&db);
+    kyk_free_block(blk);
+
+    return NULL;
+}
+
+char* test_kyk_blk_writer_rewind()
+{
+    struct kyk_block_db db;
+    struct kyk_blk_writer* writer = NULL;
+    struct kyk_blk_file_info info;
+    struct kyk_block* blk = NULL;
+    size_t blkself_size = 0;
+    uint64_t nDataPos = 0;
+    int nFile = -1;
+    int prev_nFile = -1;
+    int res = -1;
+
+    res = reset_test_dir();
+    mu_assert(res == 0, "Failed to test_kyk_blk_writer_rewind: reset_test_dir failed");
+
+    res = make_test_blk(&blk, &blkself_size);
+    mu_assert(res == 0, "Failed to test_kyk_blk_writer_rewind: make_test_blk failed");
+
+    res = kyk_init_store_db(&db, BLK_WRITER_TEST_DB);
+    mu_assert(res == 0 && db.errptr == NULL, "Failed to test_kyk_blk_writer_rewind: kyk_init_store_db failed");
+
+    /* two blocks fit in a file */
+    res = kyk_new_blk_writer(&writer, BLK_WRITER_TEST_DIR, &db, 2 * blkself_size + 1, 4096);
+    mu_assert(res == 0, "Failed to test_kyk_blk_writer_rewind: kyk_new_blk_writer failed");
+
+    res = kyk_blk_writer_write(writer, blk, NULL, &nFile, &nDataPos);
+    mu_assert(res == 0, "Failed to test_kyk_blk_writer_rewind: kyk_blk_writer_write failed");
+
+    /* a block dropped within the file is written over */
+    prev_nFile = writer -> nFile;
+    info = writer -> info;
+    res = kyk_blk_writer_write(writer, blk, NULL, &nFile, &nDataPos);
+    mu_assert(res == 0, "Failed to test_kyk_blk_writer_rewind: kyk_blk_writer_write failed");
+    kyk_blk_writer_rewind(writer, prev_nFile, &info);
+
+    res = kyk_blk_writer_write(writer, blk, NULL, &nFile, &nDataPos);
+    mu_assert(res == 0, "Failed to test_kyk_blk_writer_rewind: kyk_blk_writer_write failed");
+    mu_assert(nFile == 0 && nDataPos == blkself_size + 8, "Failed to test_kyk_blk_writer_rewind");
+    mu_assert(writer -> info.nBlocks == 2, "Failed to test_kyk_blk_writer_rewind");
+
+    /* a block dropped after moving on to the next file */
+    prev_nFile = writer -> nFile;
+    info = writer -> info;
+    res = kyk_blk_writer_write(writer, blk, NULL, &nFile, &nDataPos);
+    mu_assert(res == 0 && nFile == 1, "Failed to test_kyk_blk_writer_rewind: kyk_blk_writer_write failed");
+    kyk_blk_writer_rewind(writer, prev_nFile, &info);
+    mu_assert(writer -> nFile == 0 && writer -> fd == -1, "Failed to test_kyk_blk_writer_rewind");
+
+    res = kyk_blk_writer_write(writer, blk, NULL, &nFile, &nDataPos);
+    mu_assert(res == 0, "Failed to test_kyk_blk_writer_rewind: kyk_blk_writer_write failed");
+    mu_assert(nFile == 1 && nDataPos == 8, "Failed to test_kyk_blk_writer_rewind");
+    mu_assert(test_blk_file_size(0) == (off_t)(2 * blkself_size), "Failed to test_kyk_blk_writer_rewind");
+
+    kyk_free_blk_writer(writer);
+    kyk_free_block_db(&db);
+    kyk_free_block(blk);
+
+    return NULL;
+}
+
+char *all_tests()
+{
+    mu_suite_start();
+
+    mu_run_test(test_kyk_blk_writer_write);
+    mu_run_test(test_kyk_blk_writer_rotate);
+    mu_run_test(test_kyk_blk_writer_rewind);
+
+    return NULL;
+}
+
+MU_RUN_TESTS(all_tests);
@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test_data.h"
+#include "kyk_tx.h"
+#include "kyk_block.h"
+#include "kyk_ldb.h"
+#include "kyk_utxo.h"
+#include "kyk_chainstate.h"
+#include "kyk_utils.h"
+#include "mu_unit.h"
+
+#define CHAINSTATE_TEST_DB "/tmp/test_kyk_chainstate"
+
+/* the db starts without coins, whatever an earlier run left in it */
+static int open_test_chainstate(struct kyk_block_db* db,
+				struct kyk_chainstate** new_cs,
+				size_t cache_max,
+				size_t flush_blocks)
+{
+    struct kyk_utxo_chain empty_chain;
+    int res = -1;
+
+    res = kyk_init_store_db(db, CHAINSTATE_TEST_DB);
+    if(res != 0 || db -> errptr) return -1;
+
+    res = kyk_new_chainstate(new_cs, db, cache_max, flush_blocks);
+    if(res != 0) return -1;
+
+    kyk_init_utxo_chain(&empty_chain);
+
+    return kyk_chainstate_replace_utxo_chain(*new_cs, &empty_chain);
+}
+
+static size_t chainstate_coin_count(struct kyk_chainstate* cs)
+{
+    struct kyk_utxo_chain* utxo_chain = NULL;
+    size_t len = 0;
+
+    if(kyk_chainstate_load_utxo_chain(cs, &utxo_chain) != 0) return (size_t)-1;
+    len = utxo_chain -> len;
+    kyk_free_utxo_chain(utxo_chain);
+
+    return len;
+}
+
+/* coins of chain that other does not have */
+static size_t utxo_chain_new_count(const struct kyk_utxo_chain* chain, const struct kyk_utxo_chain* other)
+{
+    const struct kyk_utxo* utxo = NULL;
+    const struct kyk_utxo* other_utxo = NULL;
+    size_t count = 0;
+
+    for(utxo = chain -> hd; utxo; utxo = utxo -> next){
+	for(other_utxo = other -> hd; other_utxo; other_utxo = other_utxo -> next){
+	    if(kyk_cmp_utxo(utxo, other_utxo) == 0) break;
+	}
+	if(other_utxo == NULL) count++;
+    }
+
+    return count;
+}
+
+char* test_kyk_chainstate_connect_block()
+{
+    struct kyk_block_db db;
+    struct kyk_chainstate* cs = NULL;
+    struct kyk_block* blk = NULL;
+    struct kyk_utxo_chain* blk_chain = NULL;
+    struct kyk_utxo* utxo = NULL;
+    uint8_t blk_hash[32];
+    int res = -1;
+
+    res = open_test_chainstate(&db, &cs, 1000, 2);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_connect_block: open_test_chainstate failed");
+
+    res = kyk_deseri_new_block(&blk, BLOCK_f8517_BUF, NULL);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_connect_block: kyk_deseri_new_block failed");
+    kyk_blk_hash256(blk_hash, blk -> hd);
+
+    blk_chain = calloc(1, sizeof(*blk_chain));
+    kyk_init_utxo_chain(blk_chain);
+    res = kyk_append_utxo_chain_from_block(blk_chain, blk);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_connect_block: kyk_append_utxo_chain_from_block failed");
+
+    res = kyk_chainstate_connect_block(cs, blk);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_connect_block: kyk_chainstate_connect_block failed");
+    mu_assert(cs -> dirty_blocks == 1, "Failed to test_kyk_chainstate_connect_block: flushed before flush_blocks");
+
+    /* found in the cache */
+    res = kyk_chainstate_get_utxo(cs, blk_chain -> hd -> txid, blk_chain -> hd -> outidx, &utxo);
+    mu_assert(res == 0 && utxo, "Failed to test_kyk_chainstate_connect_block: cached utxo is not found");
+    mu_assert(kyk_cmp_utxo(utxo, blk_chain -> hd) == 0, "Failed to test_kyk_chainstate_connect_block: invalid cached utxo");
+    kyk_free_utxo(utxo);
+    utxo = NULL;
+
+    mu_assert(chainstate_coin_count(cs) == blk_chain -> len, "Failed to test_kyk_chainstate_connect_block: invalid cached coin count");
+
+    res = kyk_chainstate_flush(cs);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_connect_block: kyk_chainstate_flush failed");
+    mu_assert(cs -> cache -> len == 0 && cs -> dirty_blocks == 0, "Failed to test_kyk_chainstate_connect_block: cache is not emptied");
+
+    /* found in the db */
+    res = kyk_chainstate_get_utxo(cs, blk_chain -> hd -> txid, blk_chain -> hd -> outidx, &utxo);
+    mu_assert(res == 0 && utxo, "Failed to test_kyk_chainstate_connect_block: flushed utxo is not found");
+    mu_assert(kyk_cmp_utxo(utxo, blk_chain -> hd) == 0, "Failed to test_kyk_chainstate_connect_block: invalid flushed utxo");
+    mu_assert(utxo -> value == blk_chain -> hd -> value, "Failed to test_kyk_chainstate_connect_block: invalid flushed value");
+    kyk_free_utxo(utxo);
+    utxo = NULL;
+
+    res = kyk_chainstate_get_utxo(cs, blk_chain -> hd -> txid, 0xffff, &utxo);
+    mu_assert(res == 0 && utxo == NULL, "Failed to test_kyk_chainstate_connect_block: found a wrong outidx");
+
+    /* the coins and the best block survive a reopen */
+    kyk_free_chainstate(cs);
+    kyk_free_block_db(&db);
+
+    res = kyk_init_store_db(&db, CHAINSTATE_TEST_DB);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_connect_block: kyk_init_store_db failed");
+
+    res = kyk_new_chainstate(&cs, &db, 1000, 2);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_connect_block: kyk_new_chainstate failed");
+    mu_assert(cs -> has_best, "Failed to test_kyk_chainstate_connect_block: best block is not found");
+    mu_assert(memcmp(cs -> best_hash, blk_hash, sizeof(blk_hash)) == 0, "Failed to test_kyk_chainstate_connect_block: invalid best block");
+    mu_assert(chainstate_coin_count(cs) == blk_chain -> len, "Failed to test_kyk_chainstate_connect_block: invalid flushed coin count");
+
+    kyk_free_chainstate(cs);
+    kyk_free_block_db(&db);
+    kyk_free_utxo_chain(blk_chain);
+    kyk_free_block(blk);
+
+    return NULL;
+}
+
+/* a block spending a flushed coin hides it at once and deletes it on the next flush */
+char* test_kyk_chainstate_spend()
+{
+    struct kyk_block_db db;
+    struct kyk_chainstate* cs = NULL;
+    struct kyk_block* blk = NULL;
+    struct kyk_block* spend_blk = NULL;
+    struct kyk_utxo_chain* blk_chain = NULL;
+    struct kyk_utxo_chain* spend_chain = NULL;
+    struct kyk_utxo* utxo = NULL;
+    struct kyk_txin* txin = NULL;
+    size_t count = 0;
+    int res = -1;
+
+    res = open_test_chainstate(&db, &cs, 1000, 16);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_spend: open_test_chainstate failed");
+
+    res = kyk_deseri_new_block(&blk, BLOCK_f8517_BUF, NULL);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_spend: kyk_deseri_new_block failed");
+
+    blk_chain = calloc(1, sizeof(*blk_chain));
+    kyk_init_utxo_chain(blk_chain);
+    kyk_append_utxo_chain_from_block(blk_chain, blk);
+
+    res = kyk_chainstate_connect_block(cs, blk);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_spend: kyk_chainstate_connect_block failed");
+    res = kyk_chainstate_flush(cs);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_spend: kyk_chainstate_flush failed");
+    count = chainstate_coin_count(cs);
+
+    /* the flushed coins are read back without the db */
+    mu_assert(kyk_utxo_set_find(cs -> reads, blk_chain -> hd -> txid, blk_chain -> hd -> outidx), "Failed to test_kyk_chainstate_spend: flushed coin is not in reads");
+
+    /* the same block with its first txin pointed at the first coin */
+    res = kyk_deseri_new_block(&spend_blk, BLOCK_f8517_BUF, NULL);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_spend: kyk_deseri_new_block failed");
+    txin = spend_blk -> tx[0].txin;
+    memcpy(txin -> pre_txid, blk_chain -> hd -> txid, sizeof(txin -> pre_txid));
+    txin -> pre_txout_inx = blk_chain -> hd -> outidx;
+
+    spend_chain = calloc(1, sizeof(*spend_chain));
+    kyk_init_utxo_chain(spend_chain);
+    kyk_append_utxo_chain_from_block(spend_chain, spend_blk);
+    /* only the changed tx has new coins, the others are the ones already flushed */
+    count = count - 1 + utxo_chain_new_count(spend_chain, blk_chain);
+
+    res = kyk_chainstate_connect_block(cs, spend_blk);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_spend: kyk_chainstate_connect_block failed");
+
+    res = kyk_chainstate_get_utxo(cs, blk_chain -> hd -> txid, blk_chain -> hd -> outidx, &utxo);
+    mu_assert(res == 0 && utxo == NULL, "Failed to test_kyk_chainstate_spend: spent utxo is found before the flush");
+    mu_assert(chainstate_coin_count(cs) == count, "Failed to test_kyk_chainstate_spend: invalid cached coin count");
+
+    res = kyk_chainstate_flush(cs);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_spend: kyk_chainstate_flush failed");
+
+    res = kyk_chainstate_get_utxo(cs, blk_chain -> hd -> txid, blk_chain -> hd -> outidx, &utxo);
+    mu_assert(res == 0 && utxo == NULL, "Failed to test_kyk_chainstate_spend: spent utxo is found after the flush");
+    mu_assert(kyk_utxo_set_find(cs -> reads, blk_chain -> hd -> txid, blk_chain -> hd -> outidx) == NULL, "Failed to test_kyk_chainstate_spend: spent coin is in reads");
+    mu_assert(chainstate_coin_count(cs) == count, "Failed to test_kyk_chainstate_spend: invalid flushed coin count");
+
+    kyk_free_chainstate(cs);
+    kyk_free_block_db(&db);
+    kyk_free_utxo_chain(spend_chain);
+    kyk_free_utxo_chain(blk_chain);
+    kyk_free_block(spend_blk);
+    kyk_free_block(blk);
+
+    return NULL;
+}
+
+/* the coinbase of two blocks is one outpoint with two coins, a txin spends one of them */
+char* test_kyk_chainstate_spend_one()
+{
+    struct kyk_block_db db;
+    struct kyk_chainstate* cs = NULL;
+    struct kyk_block* blk = NULL;
+    struct kyk_block* dup_blk = NULL;
+    struct kyk_block* spend_blk = NULL;
+    struct kyk_utxo_chain* blk_chain = NULL;
+    struct kyk_utxo* utxo = NULL;
+    struct kyk_txin* txin = NULL;
+    size_t count = 0;
+    int res = -1;
+
+    res = open_test_chainstate(&db, &cs, 1000, 16);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_spend_one: open_test_chainstate failed");
+
+    res = kyk_deseri_new_block(&blk, BLOCK_f8517_BUF, NULL);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_spend_one: kyk_deseri_new_block failed");
+    blk_chain = calloc(1, sizeof(*blk_chain));
+    kyk_init_utxo_chain(blk_chain);
+    kyk_append_utxo_chain_from_block(blk_chain, blk);
+
+    res = kyk_deseri_new_block(&dup_blk, BLOCK_f8517_BUF, NULL);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_spend_one: kyk_deseri_new_block failed");
+    dup_blk -> hd -> nonce += 1;
+
+    /* one copy flushed, the other one cached */
+    res = kyk_chainstate_connect_block(cs, blk);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_spend_one: kyk_chainstate_connect_block failed");
+    res = kyk_chainstate_flush(cs);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_spend_one: kyk_chainstate_flush failed");
+    res = kyk_chainstate_connect_block(cs, dup_blk);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_spend_one: kyk_chainstate_connect_block failed");
+    count = chainstate_coin_count(cs);
+    mu_assert(count == blk_chain -> len * 2, "Failed to test_kyk_chainstate_spend_one: invalid coin count");
+
+    res = kyk_deseri_new_block(&spend_blk, BLOCK_f8517_BUF, NULL);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_spend_one: kyk_deseri_new_block failed");
+    spend_blk -> hd -> nonce += 2;
+    txin = spend_blk -> tx[0].txin;
+    memcpy(txin -> pre_txid, blk_chain -> hd -> txid, sizeof(txin -> pre_txid));
+    txin -> pre_txout_inx = blk_chain -> hd -> outidx;
+
+    res = kyk_chainstate_connect_block(cs, spend_blk);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_spend_one: kyk_chainstate_connect_block failed");
+    mu_assert(chainstate_coin_count(cs) == count - 1 + blk_chain -> len, "Failed to test_kyk_chainstate_spend_one: not one coin is spent");
+
+    res = kyk_chainstate_get_utxo(cs, blk_chain -> hd -> txid, blk_chain -> hd -> outidx, &utxo);
+    mu_assert(res == 0 && utxo, "Failed to test_kyk_chainstate_spend_one: the other copy is not found");
+    kyk_free_utxo(utxo);
+
+    kyk_free_chainstate(cs);
+    kyk_free_block_db(&db);
+    kyk_free_utxo_chain(blk_chain);
+    kyk_free_block(spend_blk);
+    kyk_free_block(dup_blk);
+    kyk_free_block(blk);
+
+    return NULL;
+}
+
+/* a full cache is written back without waiting for flush_blocks */
+char* test_kyk_chainstate_cache_max()
+{
+    struct kyk_block_db db;
+    struct kyk_chainstate* cs = NULL;
+    struct kyk_block* blk = NULL;
+    int res = -1;
+
+    res = open_test_chainstate(&db, &cs, 1, 16);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_cache_max: open_test_chainstate failed");
+
+    res = kyk_deseri_new_block(&blk, BLOCK_f8517_BUF, NULL);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_cache_max: kyk_deseri_new_block failed");
+
+    res = kyk_chainstate_connect_block(cs, blk);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_cache_max: kyk_chainstate_connect_block failed");
+    mu_assert(cs -> cache -> len == 0 && cs -> dirty_blocks == 0, "Failed to test_kyk_chainstate_cache_max: cache is not flushed");
+    mu_assert(chainstate_coin_count(cs) > 0, "Failed to test_kyk_chainstate_cache_max: no coin is flushed");
+    mu_assert(cs -> reads -> len - cs -> reads -> spent_count <= 1, "Failed to test_kyk_chainstate_cache_max: reads holds more than cache_max coins");
+
+    kyk_free_chainstate(cs);
+    kyk_free_block_db(&db);
+    kyk_free_block(blk);
+
+    return NULL;
+}
+
+/* the flush that is due goes into the caller's batch, nothing is written until the batch is */
+char* test_kyk_chainstate_connect_block_to_batch()
+{
+    struct kyk_block_db db;
+    struct kyk_chainstate* cs = NULL;
+    struct kyk_block* blk = NULL;
+    leveldb_writebatch_t* batch = NULL;
+    struct kyk_utxo_chain empty_chain;
+    uint8_t blk_hash[32];
+    char* errptr = NULL;
+    int staged = 0;
+    int res = -1;
+
+    res = open_test_chainstate(&db, &cs, 1000, 2);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_connect_block_to_batch: open_test_chainstate failed");
+
+    /* the earlier tests left this block as the best one */
+    kyk_init_utxo_chain(&empty_chain);
+    memset(cs -> best_hash, 0, sizeof(cs -> best_hash));
+    res = kyk_chainstate_replace_utxo_chain(cs, &empty_chain);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_connect_block_to_batch: kyk_chainstate_replace_utxo_chain failed");
+
+    res = kyk_deseri_new_block(&blk, BLOCK_f8517_BUF, NULL);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_connect_block_to_batch: kyk_deseri_new_block failed");
+    kyk_blk_hash256(blk_hash, blk -> hd);
+
+    batch = leveldb_writebatch_create();
+
+    res = kyk_chainstate_connect_block_to_batch(cs, blk, batch, &staged);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_connect_block_to_batch: kyk_chainstate_connect_block_to_batch failed");
+    mu_assert(staged == 0 && cs -> dirty_blocks == 1, "Failed to test_kyk_chainstate_connect_block_to_batch: staged before flush_blocks");
+
+    /* a batch that is not written leaves the db as it was */
+    res = kyk_chainstate_discard(cs);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_connect_block_to_batch: kyk_chainstate_discard failed");
+    mu_assert(cs -> dirty_blocks == 0 && cs -> cache -> len == 0, "Failed to test_kyk_chainstate_connect_block_to_batch: cache is not discarded");
+    mu_assert(chainstate_coin_count(cs) == 0, "Failed to test_kyk_chainstate_connect_block_to_batch: discarded coins are found");
+    mu_assert(!kyk_digest_eq(cs -> best_hash, blk_hash, sizeof(blk_hash)), "Failed to test_kyk_chainstate_connect_block_to_batch: best block is not discarded");
+
+    cs -> flush_blocks = 1;
+    res = kyk_chainstate_connect_block_to_batch(cs, blk, batch, &staged);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_connect_block_to_batch: kyk_chainstate_connect_block_to_batch failed");
+    mu_assert(staged == 1, "Failed to test_kyk_chainstate_connect_block_to_batch: flush is not staged");
+
+    leveldb_write(db.db, db.wr_opts, batch, &errptr);
+    mu_assert(errptr == NULL, "Failed to test_kyk_chainstate_connect_block_to_batch: leveldb_write failed");
+    leveldb_writebatch_destroy(batch);
+
+    res = kyk_chainstate_flushed(cs);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_connect_block_to_batch: kyk_chainstate_flushed failed");
+    mu_assert(cs -> dirty_blocks == 0 && cs -> cache -> len == 0, "Failed to test_kyk_chainstate_connect_block_to_batch: cache is not emptied");
+    mu_assert(chainstate_coin_count(cs) > 0, "Failed to test_kyk_chainstate_connect_block_to_batch: staged coins are not written");
+
+    kyk_free_chainstate(cs);
+    cs = NULL;
+
+    res = kyk_new_chainstate(&cs, &db, 1000, 2);
+    mu_assert(res == 0, "Failed to test_kyk_chainstate_connect_block_to_batch: kyk_new_chainstate failed");
+    mu_assert(kyk_digest_eq(cs -> best_hash, blk_hash, sizeof(blk_hash)), "Failed to test_kyk_chainstate_connect_block_to_batch: best block is not written");
+
+    kyk_free_chainstate(cs);
+    kyk_free_block_db(&db);
+    kyk_free_block(blk);
+
+    return NULL;
+}
+
+char *all_tests()
+{
+    mu_suite_start();
+
+    mu_run_test(test_kyk_chainstate_connect_block);
+    mu_run_test(test_kyk_chainstate_spend);
+    mu_run_test(test_kyk_chainstate_spend_one);
+    mu_run_test(test_kyk_chainstate_cache_max);
+    mu_run_test(test_kyk_chainstate_connect_block_to_batch);
+
+    return NULL;
+}
+
+MU_RUN_TESTS(all_tests);
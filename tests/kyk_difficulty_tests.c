@@ -198,6 +198,108 @@ char* test_kyk_cal_next_work_req()
 }
 
 
+char* test_kyk_bts2target256()
+{
+    uint32_t bts_list[] = {0x1d00ffff, 0x1b0404cb, 486575299, 486588017, 0x1d00be71, 0x1f00ffff, 0x03123456, 0x01003456};
+    struct kyk_target tg256;
+    mpz_t tg, tg2;
+    size_t i = 0;
+    int res = -1;
+
+    mpz_init(tg);
+    mpz_init(tg2);
+
+    for(i = 0; i < sizeof(bts_list) / sizeof(bts_list[0]); i++){
+	kyk_bts2target(bts_list[i], tg);
+	res = kyk_bts2target256(bts_list[i], &tg256);
+	mu_assert(res == 0, "Failed to test_kyk_bts2target256");
+	mpz_import(tg2, 4, -1, sizeof(tg256.limb[0]), 0, 0, tg256.limb);
+	mu_assert(mpz_cmp(tg, tg2) == 0, "Failed to test_kyk_bts2target256: target is not eq to kyk_bts2target");
+    }
+
+    /* 0x23 bytes doesn't fit in 256 bits */
+    res = kyk_bts2target256(0x23123456, &tg256);
+    mu_assert(res == -1, "Failed to test_kyk_bts2target256: overflow should be rejected");
+
+    mpz_clear(tg);
+    mpz_clear(tg2);
+
+    return NULL;
+}
+
+char* test_kyk_target256_to_bts()
+{
+    uint32_t bts_list[] = {0x1d00ffff, 0x1b0404cb, 486575299, 486588017, 0x1d00be71, 0x1f00ffff};
+    struct kyk_target tg;
+    uint32_t new_bts = 0;
+    size_t i = 0;
+
+    for(i = 0; i < sizeof(bts_list) / sizeof(bts_list[0]); i++){
+	kyk_bts2target256(bts_list[i], &tg);
+	kyk_target256_to_bts(&tg, &new_bts);
+	mu_assert(new_bts == bts_list[i], "Failed to test_kyk_target256_to_bts");
+    }
+
+    return NULL;
+}
+
+char* test_kyk_digest_meets_target()
+{
+    /* Gens block hash */
+    uint8_t digest[] = {
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x19, 0xd6, 0x68,
+	0x9c, 0x08, 0x5a, 0xe1, 0x65, 0x83, 0x1e, 0x93,
+	0x4f, 0xf7, 0x63, 0xae, 0x46, 0xa2, 0xa6, 0xc1,
+	0x72, 0xb3, 0xf1, 0xb6, 0x0a, 0x8c, 0xe2, 0x6f
+    };
+    struct kyk_target tg;
+    struct kyk_target hs;
+
+    kyk_bts2target256(0x1d00ffff, &tg);
+    mu_assert(kyk_digest_meets_target(digest, &tg), "Failed to test_kyk_digest_meets_target");
+
+    kyk_bts2target256(0x1b0404cb, &tg);
+    mu_assert(!kyk_digest_meets_target(digest, &tg), "Failed to test_kyk_digest_meets_target");
+
+    /* a target always meets itself */
+    kyk_target256_from_digest(&hs, digest);
+    mu_assert(kyk_target256_cmp(&hs, &hs) == 0, "Failed to test_kyk_digest_meets_target");
+    mu_assert(kyk_digest_meets_target(digest, &hs), "Failed to test_kyk_digest_meets_target");
+
+    hs.limb[0] -= 1;
+    mu_assert(kyk_target256_cmp(&hs, &tg) > 0, "Failed to test_kyk_digest_meets_target");
+    mu_assert(!kyk_digest_meets_target(digest, &hs), "Failed to test_kyk_digest_meets_target");
+
+    return NULL;
+}
+
+char* test_kyk_dlt2target256()
+{
+    struct kyk_target tg;
+    struct kyk_target expect_tg;
+    mpz_t expect_target, target;
+
+    kyk_dlt2target256(1, &tg);
+    kyk_bts2target256(0x1d00ffff, &expect_tg);
+    mu_assert(kyk_target256_cmp(&tg, &expect_tg) == 0, "Failed to test_kyk_dlt2target256");
+
+    mpz_init(expect_target);
+    mpz_init(target);
+
+    /* ceil(difficulty_1_target / 16308) */
+    mpz_set_str(expect_target, DLT1_TARGET_HEX_STR, 0);
+    mpz_cdiv_q_ui(expect_target, expect_target, 16308);
+
+    kyk_dlt2target256(16308, &tg);
+    mpz_import(target, 4, -1, sizeof(tg.limb[0]), 0, 0, tg.limb);
+    mu_assert(mpz_cmp(target, expect_target) == 0, "Failed to test_kyk_dlt2target256");
+
+    mpz_clear(expect_target);
+    mpz_clear(target);
+
+    return NULL;
+}
+
 char* all_tests()
 {
     mu_suite_start();
@@ -208,6 +310,10 @@ char* all_tests()
     mu_run_test(test2_kyk_dlt2target);
     mu_run_test(test_kyk_target2bts);
     mu_run_test(test2_kyk_target2bts);
+    mu_run_test(test_kyk_bts2target256);
+    mu_run_test(test_kyk_target256_to_bts);
+    mu_run_test(test_kyk_digest_meets_target);
+    mu_run_test(test_kyk_dlt2target256);
     /* mu_run_test(test_kyk_cal_next_work_req); */
 
     return NULL;
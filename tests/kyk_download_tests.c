@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "kyk_message.h"
+#include "kyk_socket.h"
+#include "kyk_frame.h"
+#include "kyk_download.h"
+#include "mu_unit.h"
+
+#define TEST_PEER_COUNT 3
+#define TEST_ITEM_COUNT 500
+
+/*
+ * The far ends of the socketpairs play the peers and answer every request at once
+ * with a message carrying the item number.
+ * The last peer hangs up on its first request.
+ */
+struct test_dl {
+    struct kyk_peer_conn* conns[TEST_PEER_COUNT];
+    int peer_fds[TEST_PEER_COUNT];
+    size_t requested[TEST_PEER_COUNT];
+    uint8_t received[TEST_ITEM_COUNT];
+    size_t delivered;
+    int out_of_order;
+};
+
+static int test_request(struct kyk_peer_conn* conn, const size_t* inx_list, size_t count, void* arg)
+{
+    struct test_dl* dl = arg;
+    ptl_payload pld;
+    ptl_message* msg = NULL;
+    uint32_t inx = 0;
+    size_t p = 0;
+    size_t i = 0;
+
+    for(p = 0; dl -> conns[p] != conn; p++);
+
+    dl -> requested[p] += count;
+
+    if(p == TEST_PEER_COUNT - 1){
+	shutdown(dl -> peer_fds[p], SHUT_RDWR);
+	return 0;
+    }
+
+    for(i = 0; i < count; i++){
+	inx = (uint32_t)inx_list[i];
+	pld.len = sizeof(inx);
+	pld.data = (uint8_t*)&inx;
+	if(kyk_build_new_ptl_message(&msg, KYK_MSG_TYPE_BLOCK, NT_MAGIC_MAIN, &pld) != 0) return -1;
+	if(kyk_write_ptl_msg(dl -> peer_fds[p], msg) != 0) return -1;
+	kyk_free_ptl_msg(msg);
+    }
+
+    return 0;
+}
+
+static int test_receive(struct kyk_peer_conn* conn, size_t inx, void* arg)
+{
+    struct test_dl* dl = arg;
+    ptl_message* msg = NULL;
+    uint32_t got = 0;
+
+    if(kyk_peer_read(conn, &msg) != 0) return -1;
+
+    memcpy(&got, msg -> pld -> data, sizeof(got));
+    kyk_free_ptl_msg(msg);
+
+    if(got != inx) return -1;
+
+    dl -> received[inx]++;
+
+    return 0;
+}
+
+static int test_deliver(size_t inx, void* arg)
+{
+    struct test_dl* dl = arg;
+
+    if(inx != dl -> delivered || dl -> received[inx] != 1){
+	dl -> out_of_order = 1;
+	return -1;
+    }
+
+    dl -> delivered++;
+
+    return 0;
+}
+
+char* test_kyk_download()
+{
+    struct test_dl dl;
+    struct kyk_dl_ops ops;
+    int sv[2];
+    size_t i = 0;
+    int res = -1;
+
+    memset(&dl, 0, sizeof(dl));
+
+    for(i = 0; i < TEST_PEER_COUNT; i++){
+	res = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	mu_assert(res == 0, "Failed to test_kyk_download: socketpair failed");
+
+	dl.conns[i] = calloc(1, sizeof(*dl.conns[i]));
+	dl.conns[i] -> fd = sv[0];
+	res = kyk_new_frame_ring(&dl.conns[i] -> ring, KYK_FRAME_RING_SIZE, 1024);
+	mu_assert(res == 0, "Failed to test_kyk_download: kyk_new_frame_ring failed");
+	dl.peer_fds[i] = sv[1];
+    }
+
+    ops.request = test_request;
+    ops.receive = test_receive;
+    ops.deliver = test_deliver;
+
+    res = kyk_download(dl.conns, TEST_PEER_COUNT, TEST_ITEM_COUNT, &ops, &dl);
+    mu_assert(res == 0, "Failed to test_kyk_download: kyk_download failed");
+    mu_assert(!dl.out_of_order, "Failed to test_kyk_download: items delivered out of order");
+    mu_assert(dl.delivered == TEST_ITEM_COUNT, "Failed to test_kyk_download: items are missing");
+
+    /* the work is spread, and what the dead peer owed was asked of the others */
+    mu_assert(dl.requested[0] > 0 && dl.requested[1] > 0, "Failed to test_kyk_download: a live peer was left idle");
+    mu_assert(dl.requested[2] > 0, "Failed to test_kyk_download: the failing peer got no requests");
+    mu_assert(dl.requested[0] + dl.requested[1] == TEST_ITEM_COUNT, "Failed to test_kyk_download: requests were not reassigned");
+
+    for(i = 0; i < TEST_PEER_COUNT; i++){
+	kyk_peer_close(dl.conns[i]);
+	close(dl.peer_fds[i]);
+    }
+
+    return NULL;
+}
+
+char* test_kyk_download_no_peer_left()
+{
+    struct test_dl dl;
+    struct kyk_dl_ops ops;
+    int sv[2];
+    int res = -1;
+
+    memset(&dl, 0, sizeof(dl));
+
+    /* only the failing peer: the download gives up instead of waiting forever */
+    res = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    mu_assert(res == 0, "Failed to test_kyk_download_no_peer_left: socketpair failed");
+
+    dl.conns[TEST_PEER_COUNT - 1] = calloc(1, sizeof(struct kyk_peer_conn));
+    dl.conns[TEST_PEER_COUNT - 1] -> fd = sv[0];
+    kyk_new_frame_ring(&dl.conns[TEST_PEER_COUNT - 1] -> ring, KYK_FRAME_RING_SIZE, 1024);
+    dl.peer_fds[TEST_PEER_COUNT - 1] = sv[1];
+
+    ops.request = test_request;
+    ops.receive = test_receive;
+    ops.deliver = test_deliver;
+
+    res = kyk_download(dl.conns + TEST_PEER_COUNT - 1, 1, TEST_ITEM_COUNT, &ops, &dl);
+    mu_assert(res == -1, "Failed to test_kyk_download_no_peer_left: kyk_download succeeded without peers");
+    mu_assert(dl.delivered == 0, "Failed to test_kyk_download_no_peer_left: items delivered");
+
+    kyk_peer_close(dl.conns[TEST_PEER_COUNT - 1]);
+    close(sv[1]);
+
+    return NULL;
+}
+
+char *all_tests()
+{
+    mu_suite_start();
+
+    mu_run_test(test_kyk_download);
+    mu_run_test(test_kyk_download_no_peer_left);
+
+    return NULL;
+}
+
+MU_RUN_TESTS(all_tests);
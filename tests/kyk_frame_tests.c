@@ -0,0 +1,333 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "kyk_message.h"
+#include "kyk_frame.h"
+#include "mu_unit.h"
+
+static int seri_test_msg(ptl_msg_buf** new_msg_buf, const char* cmd, uint8_t fill, uint32_t pld_len)
+{
+    ptl_payload pld;
+    ptl_message* msg = NULL;
+    int res = -1;
+
+    pld.len = pld_len;
+    pld.data = malloc(pld_len > 0 ? pld_len : 1);
+    memset(pld.data, fill, pld_len);
+
+    res = kyk_build_new_ptl_message(&msg, cmd, NT_MAGIC_MAIN, &pld);
+    if(res == 0){
+	res = kyk_new_seri_ptl_message(new_msg_buf, msg);
+    }
+
+    free(pld.data);
+    kyk_free_ptl_msg(msg);
+
+    return res;
+}
+
+static int ring_push(struct kyk_frame_ring* ring, const uint8_t* buf, size_t len)
+{
+    uint8_t* space = NULL;
+    size_t space_len = 0;
+    size_t n = 0;
+
+    while(len > 0){
+	if(kyk_frame_ring_space(ring, &space, &space_len) != 0){
+	    return -1;
+	}
+	n = len < space_len ? len : space_len;
+	memcpy(space, buf, n);
+	kyk_frame_ring_commit(ring, n);
+	buf += n;
+	len -= n;
+    }
+
+    return 0;
+}
+
+char* test_frame_ring_back_to_back()
+{
+    struct kyk_frame_ring* ring = NULL;
+    struct kyk_frame frame;
+    ptl_msg_buf* ping_buf = NULL;
+    ptl_msg_buf* tx_buf = NULL;
+    uint8_t chunk[2048];
+    size_t i = 0;
+    int ready = 0;
+    int res = -1;
+
+    res = kyk_new_frame_ring(&ring, KYK_FRAME_RING_SIZE, 1024);
+    mu_assert(res == 0, "Failed to test_frame_ring_back_to_back: kyk_new_frame_ring failed");
+
+    res = seri_test_msg(&ping_buf, KYK_MSG_TYPE_PING, 0x11, 8);
+    mu_assert(res == 0, "Failed to test_frame_ring_back_to_back: seri_test_msg failed");
+    res = seri_test_msg(&tx_buf, KYK_MSG_TYPE_TX, 0x22, 300);
+    mu_assert(res == 0, "Failed to test_frame_ring_back_to_back: seri_test_msg failed");
+
+    /* both messages and the first half of the header of the next arrive in one read */
+    memcpy(chunk, ping_buf -> data, ping_buf -> len);
+    memcpy(chunk + ping_buf -> len, tx_buf -> data, tx_buf -> len);
+    memcpy(chunk + ping_buf -> len + tx_buf -> len, ping_buf -> data, 12);
+    res = ring_push(ring, chunk, ping_buf -> len + tx_buf -> len + 12);
+    mu_assert(res == 0, "Failed to test_frame_ring_back_to_back: ring_push failed");
+
+    res = kyk_frame_ring_next(ring, &frame, &ready);
+    mu_assert(res == 0 && ready, "Failed to test_frame_ring_back_to_back: first frame is not ready");
+    mu_assert(strcmp(frame.cmd, KYK_MSG_TYPE_PING) == 0, "Failed to test_frame_ring_back_to_back: invalid first cmd");
+    mu_assert(frame.pld_len == 8 && frame.pld[0] == 0x11, "Failed to test_frame_ring_back_to_back: invalid first payload");
+    /* the payload is a view into the ring */
+    mu_assert(frame.pld == ring -> base + KYK_MSG_HEADER_LEN, "Failed to test_frame_ring_back_to_back: payload was copied");
+    kyk_frame_ring_consume(ring, &frame);
+
+    res = kyk_frame_ring_next(ring, &frame, &ready);
+    mu_assert(res == 0 && ready, "Failed to test_frame_ring_back_to_back: second frame is not ready");
+    mu_assert(strcmp(frame.cmd, KYK_MSG_TYPE_TX) == 0, "Failed to test_frame_ring_back_to_back: invalid second cmd");
+    mu_assert(frame.pld_len == 300, "Failed to test_frame_ring_back_to_back: invalid second payload len");
+    for(i = 0; i < frame.pld_len; i++){
+	mu_assert(frame.pld[i] == 0x22, "Failed to test_frame_ring_back_to_back: invalid second payload");
+    }
+    kyk_frame_ring_consume(ring, &frame);
+
+    res = kyk_frame_ring_next(ring, &frame, &ready);
+    mu_assert(res == 0 && ready == 0, "Failed to test_frame_ring_back_to_back: partial frame is ready");
+
+    res = ring_push(ring, ping_buf -> data + 12, ping_buf -> len - 12);
+    mu_assert(res == 0, "Failed to test_frame_ring_back_to_back: ring_push failed");
+
+    res = kyk_frame_ring_next(ring, &frame, &ready);
+    mu_assert(res == 0 && ready, "Failed to test_frame_ring_back_to_back: third frame is not ready");
+    mu_assert(strcmp(frame.cmd, KYK_MSG_TYPE_PING) == 0, "Failed to test_frame_ring_back_to_back: invalid third cmd");
+    kyk_frame_ring_consume(ring, &frame);
+
+    kyk_free_ptl_msg_buf(ping_buf);
+    kyk_free_ptl_msg_buf(tx_buf);
+    kyk_free_frame_ring(ring);
+
+    return NULL;
+}
+
+/* a small ring wraps many times and grows once for a frame larger than itself */
+char* test_frame_ring_wrap()
+{
+    struct kyk_frame_ring* ring = NULL;
+    struct kyk_frame frame;
+    ptl_msg_buf* msg_buf = NULL;
+    size_t pos = 0;
+    size_t step = 0;
+    size_t count = 0;
+    uint32_t pld_len = 0;
+    int ready = 0;
+    int res = -1;
+    int i = 0;
+
+    res = kyk_new_frame_ring(&ring, KYK_MSG_HEADER_LEN + 1000, 1 << 20);
+    mu_assert(res == 0, "Failed to test_frame_ring_wrap: kyk_new_frame_ring failed");
+
+    for(i = 0; i < 50; i++){
+	pld_len = (i == 25) ? 5000 : (uint32_t)(i * 37 % 900);
+	res = seri_test_msg(&msg_buf, KYK_MSG_TYPE_BLOCK, (uint8_t)i, pld_len);
+	mu_assert(res == 0, "Failed to test_frame_ring_wrap: seri_test_msg failed");
+
+	/* fed in uneven pieces, frames complete in the middle of a read */
+	pos = 0;
+	while(pos < msg_buf -> len){
+	    step = 1 + (pos * 7 + i) % 333;
+	    if(step > msg_buf -> len - pos) step = msg_buf -> len - pos;
+	    res = ring_push(ring, msg_buf -> data + pos, step);
+	    mu_assert(res == 0, "Failed to test_frame_ring_wrap: ring_push failed");
+	    pos += step;
+
+	    res = kyk_frame_ring_next(ring, &frame, &ready);
+	    mu_assert(res == 0, "Failed to test_frame_ring_wrap: kyk_frame_ring_next failed");
+	    if(ready){
+		mu_assert(pos == msg_buf -> len, "Failed to test_frame_ring_wrap: frame is ready too early");
+		mu_assert(frame.pld_len == pld_len, "Failed to test_frame_ring_wrap: invalid payload len");
+		mu_assert(pld_len == 0 || (frame.pld[0] == (uint8_t)i && frame.pld[pld_len - 1] == (uint8_t)i),
+			  "Failed to test_frame_ring_wrap: invalid payload");
+		kyk_frame_ring_consume(ring, &frame);
+		count++;
+	    }
+	}
+
+	kyk_free_ptl_msg_buf(msg_buf);
+	msg_buf = NULL;
+    }
+
+    mu_assert(count == 50, "Failed to test_frame_ring_wrap: lost frames");
+    mu_assert(ring -> cap >= KYK_MSG_HEADER_LEN + 5000, "Failed to test_frame_ring_wrap: ring did not grow");
+
+    kyk_free_frame_ring(ring);
+
+    return NULL;
+}
+
+char* test_frame_ring_max_size()
+{
+    struct kyk_frame_ring* ring = NULL;
+    struct kyk_frame frame;
+    ptl_msg_buf* msg_buf = NULL;
+    ptl_message* msg = NULL;
+    int ready = 0;
+    int res = -1;
+
+    res = kyk_new_frame_ring(&ring, KYK_FRAME_RING_SIZE, 100);
+    mu_assert(res == 0, "Failed to test_frame_ring_max_size: kyk_new_frame_ring failed");
+
+    res = seri_test_msg(&msg_buf, KYK_MSG_TYPE_TX, 0x33, 100);
+    mu_assert(res == 0, "Failed to test_frame_ring_max_size: seri_test_msg failed");
+    res = ring_push(ring, msg_buf -> data, msg_buf -> len);
+    mu_assert(res == 0, "Failed to test_frame_ring_max_size: ring_push failed");
+
+    res = kyk_frame_ring_next(ring, &frame, &ready);
+    mu_assert(res == 0 && ready, "Failed to test_frame_ring_max_size: frame at the limit is not ready");
+
+    res = kyk_frame_to_new_ptl_message(&msg, &frame);
+    mu_assert(res == 0, "Failed to test_frame_ring_max_size: kyk_frame_to_new_ptl_message failed");
+    kyk_frame_ring_consume(ring, &frame);
+    mu_assert(msg -> pld -> len == 100 && msg -> pld -> data[99] == 0x33, "Failed to test_frame_ring_max_size: invalid message copy");
+    kyk_free_ptl_msg(msg);
+    kyk_free_ptl_msg_buf(msg_buf);
+
+    /* only the header is needed to refuse a frame */
+    res = seri_test_msg(&msg_buf, KYK_MSG_TYPE_TX, 0x33, 101);
+    mu_assert(res == 0, "Failed to test_frame_ring_max_size: seri_test_msg failed");
+    res = ring_push(ring, msg_buf -> data, KYK_MSG_HEADER_LEN);
+    mu_assert(res == 0, "Failed to test_frame_ring_max_size: ring_push failed");
+
+    res = kyk_frame_ring_next(ring, &frame, &ready);
+    mu_assert(res == -1, "Failed to test_frame_ring_max_size: oversized frame is accepted");
+
+    kyk_free_ptl_msg_buf(msg_buf);
+    kyk_free_frame_ring(ring);
+
+    return NULL;
+}
+
+/* a message larger than the socket buffer stays partly queued and goes out in order with the ones after it */
+char* test_frame_queue_partial_write()
+{
+    struct kyk_frame_queue* queue = NULL;
+    struct kyk_frame_queue* job_queue = NULL;
+    ptl_msg_buf* blk_buf = NULL;
+    ptl_msg_buf* tx_buf = NULL;
+    ptl_message* msg_list[2];
+    const ptl_message* msgp = NULL;
+    uint8_t* rbuf = NULL;
+    size_t expect_len = 0;
+    size_t rlen = 0;
+    ssize_t n = 0;
+    int sndbuf = 4096;
+    int sv[2];
+    int res = -1;
+
+    res = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    mu_assert(res == 0, "Failed to test_frame_queue_partial_write: socketpair failed");
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL, 0) | O_NONBLOCK);
+
+    res = seri_test_msg(&blk_buf, KYK_MSG_TYPE_BLOCK, 0x5a, 1000 * 1000);
+    mu_assert(res == 0, "Failed to test_frame_queue_partial_write: seri_test_msg failed");
+    res = seri_test_msg(&tx_buf, KYK_MSG_TYPE_TX, 0xa5, 300);
+    mu_assert(res == 0, "Failed to test_frame_queue_partial_write: seri_test_msg failed");
+
+    res = kyk_deseri_new_ptl_message(msg_list, blk_buf -> data, blk_buf -> len);
+    mu_assert(res == 0, "Failed to test_frame_queue_partial_write: kyk_deseri_new_ptl_message failed");
+    res = kyk_deseri_new_ptl_message(msg_list + 1, tx_buf -> data, tx_buf -> len);
+    mu_assert(res == 0, "Failed to test_frame_queue_partial_write: kyk_deseri_new_ptl_message failed");
+
+    res = kyk_new_frame_queue(&queue, sv[0], KYK_FRAME_QUEUE_MAX);
+    mu_assert(res == 0, "Failed to test_frame_queue_partial_write: kyk_new_frame_queue failed");
+
+    msgp = msg_list[0];
+    res = kyk_frame_queue_msgs(queue, &msgp, 1);
+    mu_assert(res == 0, "Failed to test_frame_queue_partial_write: kyk_frame_queue_msgs failed");
+    mu_assert(kyk_frame_queue_pending(queue) > 0, "Failed to test_frame_queue_partial_write: nothing is queued");
+
+    /* a queue without a socket only collects, the bytes join the other queue behind the block */
+    res = kyk_new_frame_queue(&job_queue, -1, KYK_FRAME_QUEUE_MAX);
+    mu_assert(res == 0, "Failed to test_frame_queue_partial_write: kyk_new_frame_queue failed");
+    msgp = msg_list[1];
+    res = kyk_frame_queue_msgs(job_queue, &msgp, 1);
+    mu_assert(res == 0, "Failed to test_frame_queue_partial_write: kyk_frame_queue_msgs failed");
+    mu_assert(kyk_frame_queue_pending(job_queue) == tx_buf -> len, "Failed to test_frame_queue_partial_write: invalid collected len");
+
+    res = kyk_frame_queue_move(queue, job_queue);
+    mu_assert(res == 0, "Failed to test_frame_queue_partial_write: kyk_frame_queue_move failed");
+    mu_assert(kyk_frame_queue_pending(job_queue) == 0, "Failed to test_frame_queue_partial_write: src is not empty");
+
+    expect_len = blk_buf -> len + tx_buf -> len;
+    rbuf = malloc(expect_len);
+    mu_assert(rbuf, "Failed to test_frame_queue_partial_write: malloc failed");
+
+    while(rlen < expect_len){
+	n = read(sv[1], rbuf + rlen, expect_len - rlen);
+	if(n > 0){
+	    rlen += n;
+	}
+	res = kyk_frame_queue_flush(queue);
+	mu_assert(res == 0, "Failed to test_frame_queue_partial_write: kyk_frame_queue_flush failed");
+    }
+
+    mu_assert(kyk_frame_queue_pending(queue) == 0, "Failed to test_frame_queue_partial_write: queue is not drained");
+    mu_assert(memcmp(rbuf, blk_buf -> data, blk_buf -> len) == 0, "Failed to test_frame_queue_partial_write: invalid block bytes");
+    mu_assert(memcmp(rbuf + blk_buf -> len, tx_buf -> data, tx_buf -> len) == 0, "Failed to test_frame_queue_partial_write: invalid tx bytes");
+
+    free(rbuf);
+    kyk_free_ptl_msg(msg_list[0]);
+    kyk_free_ptl_msg(msg_list[1]);
+    kyk_free_ptl_msg_buf(blk_buf);
+    kyk_free_ptl_msg_buf(tx_buf);
+    kyk_free_frame_queue(job_queue);
+    kyk_free_frame_queue(queue);
+    close(sv[0]);
+    close(sv[1]);
+
+    return NULL;
+}
+
+/* a sendmsg that stops inside the second entry */
+char* test_frame_iov_skip()
+{
+    uint8_t a[10];
+    uint8_t b[20];
+    uint8_t c[30];
+    struct iovec iov[3];
+    size_t iov_idx = 0;
+
+    iov[0].iov_base = a;
+    iov[0].iov_len = sizeof(a);
+    iov[1].iov_base = b;
+    iov[1].iov_len = sizeof(b);
+    iov[2].iov_base = c;
+    iov[2].iov_len = sizeof(c);
+
+    iov_idx = kyk_frame_iov_skip(iov, 3, 0, sizeof(a) + 5);
+    mu_assert(iov_idx == 1, "Failed to test_frame_iov_skip: invalid iov_idx");
+    mu_assert(iov[1].iov_base == b + 5 && iov[1].iov_len == sizeof(b) - 5, "Failed to test_frame_iov_skip: entry is not trimmed");
+
+    iov_idx = kyk_frame_iov_skip(iov, 3, iov_idx, sizeof(b) - 5 + sizeof(c));
+    mu_assert(iov_idx == 3, "Failed to test_frame_iov_skip: iovecs are left");
+
+    return NULL;
+}
+
+char *all_tests()
+{
+    mu_suite_start();
+
+    mu_run_test(test_frame_ring_back_to_back);
+    mu_run_test(test_frame_ring_wrap);
+    mu_run_test(test_frame_ring_max_size);
+    mu_run_test(test_frame_queue_partial_write);
+    mu_run_test(test_frame_iov_skip);
+
+    return NULL;
+}
+
+MU_RUN_TESTS(all_tests);
@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "test_data.h"
+#include "kyk_block.h"
+#include "kyk_utils.h"
+#include "kyk_hd_file.h"
+#include "mu_unit.h"
+
+#define HD_FILE_TEST_PATH "/tmp/test_kyk_hd_file"
+#define HD_FILE_TEST_CKPT_PATH HD_FILE_TEST_PATH ".ckpt"
+
+static void remove_test_hd_file()
+{
+    unlink(HD_FILE_TEST_PATH);
+    unlink(HD_FILE_TEST_CKPT_PATH);
+}
+
+static off_t test_hd_file_size()
+{
+    struct stat st;
+
+    if(stat(HD_FILE_TEST_PATH, &st) != 0) return -1;
+
+    return st.st_size;
+}
+
+/* the record count the checkpoint holds, -1 without one */
+static int64_t test_ckpt_count()
+{
+    uint8_t buf[8];
+    int64_t count = 0;
+    int fd = -1;
+    ssize_t n = 0;
+    int i = 0;
+
+    fd = open(HD_FILE_TEST_CKPT_PATH, O_RDONLY);
+    if(fd == -1) return -1;
+    n = read(fd, buf, sizeof(buf));
+    close(fd);
+    if(n != sizeof(buf)) return -1;
+
+    for(i = sizeof(buf) - 1; i >= 0; i--){
+	count = (count << 8) | buf[i];
+    }
+
+    return count;
+}
+
+/* writes len bytes of buf at offset of the test file */
+static int write_test_hd_file(const uint8_t* buf, size_t len, off_t offset)
+{
+    int fd = -1;
+    ssize_t n = 0;
+
+    fd = open(HD_FILE_TEST_PATH, O_WRONLY);
+    if(fd == -1) return -1;
+    n = pwrite(fd, buf, len, offset);
+    close(fd);
+
+    return n == (ssize_t)len ? 0 : -1;
+}
+
+char* test_kyk_save_hd_file()
+{
+    struct kyk_blk_hd_chain* hd_chain = NULL;
+    struct kyk_blk_hd_chain* hd_chain2 = NULL;
+    size_t i = 0;
+    int res = -1;
+
+    remove_test_hd_file();
+
+    res = make_testing_blk_hd_chain(&hd_chain);
+    mu_assert(res == 0, "Failed to test_kyk_save_hd_file: make_testing_blk_hd_chain failed");
+
+    res = kyk_save_hd_file(HD_FILE_TEST_PATH, hd_chain);
+    mu_assert(res == 0, "Failed to test_kyk_save_hd_file: kyk_save_hd_file failed");
+    mu_assert(test_hd_file_size() == (off_t)(hd_chain -> len * KYK_BLK_HD_LEN), "Failed to test_kyk_save_hd_file");
+
+    res = kyk_load_hd_file(&hd_chain2, HD_FILE_TEST_PATH);
+    mu_assert(res == 0, "Failed to test_kyk_save_hd_file: kyk_load_hd_file failed");
+    mu_assert(hd_chain2 -> len == hd_chain -> len, "Failed to test_kyk_save_hd_file");
+
+    for(i = 0; i < hd_chain -> len; i++){
+	mu_assert(kyk_eq_blk_hd(hd_chain -> hd_list + i, hd_chain2 -> hd_list + i), "Failed to test_kyk_save_hd_file");
+    }
+
+    kyk_free_blk_hd_chain(hd_chain);
+    kyk_free_blk_hd_chain(hd_chain2);
+
+    return NULL;
+}
+
+char* test_kyk_append_hd_file()
+{
+    struct kyk_blk_hd_chain* hd_chain = NULL;
+    struct kyk_blk_hd_chain* hd_chain2 = NULL;
+    size_t len = 0;
+    int res = -1;
+
+    remove_test_hd_file();
+
+    res = make_testing_blk_hd_chain(&hd_chain);
+    mu_assert(res == 0, "Failed to test_kyk_append_hd_file: make_testing_blk_hd_chain failed");
+
+    len = hd_chain -> len;
+    hd_chain -> len = 1;
+    res = kyk_save_hd_file(HD_FILE_TEST_PATH, hd_chain);
+    hd_chain -> len = len;
+    mu_assert(res == 0, "Failed to test_kyk_append_hd_file: kyk_save_hd_file failed");
+    mu_assert(test_hd_file_size() == KYK_BLK_HD_LEN, "Failed to test_kyk_append_hd_file");
+
+    res = kyk_append_hd_file(HD_FILE_TEST_PATH, hd_chain -> hd_list + 1, 1);
+    mu_assert(res == 0, "Failed to test_kyk_append_hd_file: kyk_append_hd_file failed");
+    mu_assert(test_hd_file_size() == 2 * KYK_BLK_HD_LEN, "Failed to test_kyk_append_hd_file");
+    /* a single append does not move the checkpoint */
+    mu_assert(test_ckpt_count() == 1, "Failed to test_kyk_append_hd_file: checkpoint is rewritten");
+
+    res = kyk_load_hd_file(&hd_chain2, HD_FILE_TEST_PATH);
+    mu_assert(res == 0, "Failed to test_kyk_append_hd_file: kyk_load_hd_file failed");
+    mu_assert(hd_chain2 -> len == 2, "Failed to test_kyk_append_hd_file");
+    mu_assert(kyk_eq_blk_hd(hd_chain -> hd_list + 1, hd_chain2 -> hd_list + 1), "Failed to test_kyk_append_hd_file");
+
+    kyk_free_blk_hd_chain(hd_chain);
+    kyk_free_blk_hd_chain(hd_chain2);
+
+    return NULL;
+}
+
+char* test_kyk_hd_file_torn_record()
+{
+    struct kyk_blk_hd_chain* hd_chain = NULL;
+    struct kyk_blk_hd_chain* hd_chain2 = NULL;
+    uint8_t garbage[30];
+    size_t len = 0;
+    int res = -1;
+
+    remove_test_hd_file();
+    memset(garbage, 0xab, sizeof(garbage));
+
+    res = make_testing_blk_hd_chain(&hd_chain);
+    mu_assert(res == 0, "Failed to test_kyk_hd_file_torn_record: make_testing_blk_hd_chain failed");
+
+    len = hd_chain -> len;
+    hd_chain -> len = 1;
+    res = kyk_save_hd_file(HD_FILE_TEST_PATH, hd_chain);
+    hd_chain -> len = len;
+    mu_assert(res == 0, "Failed to test_kyk_hd_file_torn_record: kyk_save_hd_file failed");
+
+    /* an append cut short */
+    res = write_test_hd_file(garbage, sizeof(garbage), KYK_BLK_HD_LEN);
+    mu_assert(res == 0, "Failed to test_kyk_hd_file_torn_record: write_test_hd_file failed");
+
+    res = kyk_load_hd_file(&hd_chain2, HD_FILE_TEST_PATH);
+    mu_assert(res == 0, "Failed to test_kyk_hd_file_torn_record: kyk_load_hd_file failed");
+    mu_assert(hd_chain2 -> len == 1, "Failed to test_kyk_hd_file_torn_record");
+    kyk_free_blk_hd_chain(hd_chain2);
+
+    res = kyk_append_hd_file(HD_FILE_TEST_PATH, hd_chain -> hd_list + 1, 1);
+    mu_assert(res == 0, "Failed to test_kyk_hd_file_torn_record: kyk_append_hd_file failed");
+    mu_assert(test_hd_file_size() == 2 * KYK_BLK_HD_LEN, "Failed to test_kyk_hd_file_torn_record");
+
+    res = kyk_load_hd_file(&hd_chain2, HD_FILE_TEST_PATH);
+    mu_assert(res == 0, "Failed to test_kyk_hd_file_torn_record: kyk_load_hd_file failed");
+    mu_assert(hd_chain2 -> len == 2, "Failed to test_kyk_hd_file_torn_record");
+    mu_assert(kyk_eq_blk_hd(hd_chain -> hd_list + 1, hd_chain2 -> hd_list + 1), "Failed to test_kyk_hd_file_torn_record");
+
+    kyk_free_blk_hd_chain(hd_chain);
+    kyk_free_blk_hd_chain(hd_chain2);
+
+    return NULL;
+}
+
+/* records under the checkpoint are not validated again, without it they are */
+char* test_kyk_hd_file_ckpt()
+{
+    struct kyk_blk_hd_chain* hd_chain = NULL;
+    struct kyk_blk_hd_chain* hd_chain2 = NULL;
+    uint8_t buf[KYK_BLK_HD_LEN];
+    size_t len = 0;
+    int res = -1;
+
+    remove_test_hd_file();
+
+    res = make_testing_blk_hd_chain(&hd_chain);
+    mu_assert(res == 0, "Failed to test_kyk_hd_file_ckpt: make_testing_blk_hd_chain failed");
+
+    res = kyk_save_hd_file(HD_FILE_TEST_PATH, hd_chain);
+    mu_assert(res == 0, "Failed to test_kyk_hd_file_ckpt: kyk_save_hd_file failed");
+
+    /* break the merkle root of the first record */
+    len = kyk_seri_blk_hd(buf, hd_chain -> hd_list);
+    mu_assert(len == KYK_BLK_HD_LEN, "Failed to test_kyk_hd_file_ckpt: kyk_seri_blk_hd failed");
+    buf[40] ^= 0xff;
+    res = write_test_hd_file(buf, sizeof(buf), 0);
+    mu_assert(res == 0, "Failed to test_kyk_hd_file_ckpt: write_test_hd_file failed");
+
+    res = kyk_load_hd_file(&hd_chain2, HD_FILE_TEST_PATH);
+    mu_assert(res == 0, "Failed to test_kyk_hd_file_ckpt: kyk_load_hd_file failed");
+    mu_assert(hd_chain2 -> len == 2, "Failed to test_kyk_hd_file_ckpt");
+    kyk_free_blk_hd_chain(hd_chain2);
+    hd_chain2 = NULL;
+
+    unlink(HD_FILE_TEST_CKPT_PATH);
+
+    res = kyk_load_hd_file(&hd_chain2, HD_FILE_TEST_PATH);
+    mu_assert(res == -1, "Failed to test_kyk_hd_file_ckpt: broken record is loaded");
+
+    kyk_free_blk_hd_chain(hd_chain);
+
+    return NULL;
+}
+
+char *all_tests()
+{
+    mu_suite_start();
+
+    mu_run_test(test_kyk_save_hd_file);
+    mu_run_test(test_kyk_append_hd_file);
+    mu_run_test(test_kyk_hd_file_torn_record);
+    mu_run_test(test_kyk_hd_file_ckpt);
+
+    return NULL;
+}
+
+MU_RUN_TESTS(all_tests);
@@ -1,11 +1,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 
 #include "test_data.h"
 #include "kyk_utils.h"
 #include "kyk_message.h"
+#include "kyk_mkl_tree.h"
+#include "kyk_socket.h"
+#include "kyk_protocol.h"
 #include "mu_unit.h"
 #include "dbg.h"
 
@@ -99,32 +106,102 @@ error:
 
 }
 
+/* headers told apart by their nonce, enough for locators and the hash index */
+static struct kyk_blk_hd_chain* make_test_hd_chain(size_t len)
+{
+    struct kyk_blk_hd_chain* hd_chain = NULL;
+    size_t i = 0;
+
+    hd_chain = calloc(1, sizeof(*hd_chain));
+    hd_chain -> hd_list = calloc(len, sizeof(*hd_chain -> hd_list));
+    hd_chain -> len = len;
+
+    for(i = 0; i < len; i++){
+	hd_chain -> hd_list[i].version = 1;
+	hd_chain -> hd_list[i].nonce = (uint32_t)i;
+    }
+
+    return hd_chain;
+}
+
 char* test_kyk_build_new_getheaders_entity()
 {
     ptl_gethder_entity* et = NULL;
+    struct kyk_blk_hd_chain* hd_chain = NULL;
+    uint8_t digest[32];
+    size_t heights[] = {99, 98, 97, 96, 95, 94, 93, 92, 91, 90, 88, 84, 76, 60, 28, 0};
     uint32_t version = 1;
+    size_t i = 0;
     int res = -1;
 
-    res = kyk_build_new_getheaders_entity(&et, version);
+    hd_chain = make_test_hd_chain(100);
+
+    res = kyk_build_new_getheaders_entity(&et, version, hd_chain);
     mu_assert(res == 0, "Failed test_kyk_build_new_getheaders_entity");
     mu_assert(et, "Failed to kyk_build_new_getheaders_entity");
 
+    /* dense from the tip, then exponentially sparse down to genesis */
+    mu_assert(et -> hash_count == sizeof(heights) / sizeof(heights[0]), "Failed to test_kyk_build_new_getheaders_entity: invalid hash_count");
+    for(i = 0; i < et -> hash_count; i++){
+	kyk_blk_hash256(digest, hd_chain -> hd_list + heights[i]);
+	mu_assert(memcmp(et -> locator_hashes[i].data, digest, sizeof(digest)) == 0, "Failed to test_kyk_build_new_getheaders_entity: invalid locator hash");
+    }
+
+    kyk_free_ptl_gethder_entity(et);
+    kyk_free_blk_hd_chain(hd_chain);
+
+    /* a single header chain is located by its genesis alone */
+    hd_chain = make_test_hd_chain(1);
+    res = kyk_build_new_getheaders_entity(&et, version, hd_chain);
+    mu_assert(res == 0 && et -> hash_count == 1, "Failed to test_kyk_build_new_getheaders_entity: invalid genesis locator");
+
+    kyk_free_ptl_gethder_entity(et);
+    kyk_free_blk_hd_chain(hd_chain);
+
     return NULL;
 }
 
 char* test_kyk_new_seri_gethder_entity_to_pld()
 {
     ptl_gethder_entity* et = NULL;
+    ptl_gethder_entity* et2 = NULL;
+    struct kyk_blk_hd_chain* hd_chain = NULL;
     ptl_payload* pld = NULL;
     uint32_t version = 1;
     int res = -1;
 
-    res = kyk_build_new_getheaders_entity(&et, version);
+    hd_chain = make_test_hd_chain(30);
+
+    res = kyk_build_new_getheaders_entity(&et, version, hd_chain);
     check(res == 0, "Failed to test_kyk_new_seri_gethder_entity_to_pld: kyk_build_new_getheaders_entity failed");
+    et -> hash_stop.data[0] = 0x42;
 
     res = kyk_new_seri_gethder_entity_to_pld(et, &pld);
     mu_assert(res == 0, "Failed to test_kyk_new_seri_gethder_entity_to_pld");
 
+    res = kyk_deseri_new_gethder_entity(&et2, pld);
+    mu_assert(res == 0, "Failed to test_kyk_new_seri_gethder_entity_to_pld: kyk_deseri_new_gethder_entity failed");
+    mu_assert(et2 -> version == version, "Failed to test_kyk_new_seri_gethder_entity_to_pld: invalid version");
+    mu_assert(et2 -> hash_count == et -> hash_count, "Failed to test_kyk_new_seri_gethder_entity_to_pld: invalid hash_count");
+    mu_assert(memcmp(et2 -> locator_hashes, et -> locator_hashes, et -> hash_count * sizeof(uint256)) == 0,
+	      "Failed to test_kyk_new_seri_gethder_entity_to_pld: invalid locator hashes");
+    mu_assert(et2 -> hash_stop.data[0] == 0x42, "Failed to test_kyk_new_seri_gethder_entity_to_pld: invalid hash_stop");
+    kyk_free_ptl_gethder_entity(et2);
+
+    /* a hash_count larger than the payload is refused */
+    pld -> len -= sizeof(uint256);
+    res = kyk_deseri_new_gethder_entity(&et2, pld);
+    mu_assert(res == -1, "Failed to test_kyk_new_seri_gethder_entity_to_pld: truncated payload is accepted");
+
+    /* a hash_count of 2^64 - 1 must not wrap the size check */
+    memset(pld -> data + sizeof(uint32_t), 0xff, 9);
+    res = kyk_deseri_new_gethder_entity(&et2, pld);
+    mu_assert(res == -1, "Failed to test_kyk_new_seri_gethder_entity_to_pld: maximal hash_count is accepted");
+
+    kyk_free_ptl_payload(pld);
+    kyk_free_ptl_gethder_entity(et);
+    kyk_free_blk_hd_chain(hd_chain);
+
     return NULL;
 
 error:
@@ -133,6 +210,133 @@ error:
 
 }
 
+/* a headers payload cut inside its count varint is refused before the varint is read */
+char* test_kyk_deseri_headers_msg_truncated()
+{
+    struct kyk_blk_hd_chain* hd_chain = NULL;
+    ptl_message msg;
+    ptl_payload pld;
+    uint8_t buf[2] = {0xfd, 0x01};
+    int res = -1;
+
+    memset(&msg, 0, sizeof(msg));
+    pld.data = buf;
+    pld.len = sizeof(buf);
+    msg.pld = &pld;
+
+    res = kyk_deseri_headers_msg_to_new_hd_chain(&msg, &hd_chain);
+    mu_assert(res == -1, "Failed to test_kyk_deseri_headers_msg_truncated: truncated count is accepted");
+
+    /* an empty reply is a count of 0 */
+    buf[0] = 0;
+    pld.len = 1;
+    res = kyk_deseri_headers_msg_to_new_hd_chain(&msg, &hd_chain);
+    mu_assert(res == 0 && hd_chain -> len == 0, "Failed to test_kyk_deseri_headers_msg_truncated: empty reply is refused");
+    kyk_free_blk_hd_chain(hd_chain);
+
+    return NULL;
+}
+
+/* an index grown header by header finds what one built over the whole chain finds */
+char* test_kyk_hd_index_append()
+{
+    struct kyk_blk_hd_chain* hd_chain = NULL;
+    struct kyk_blk_hd_chain head_chain;
+    struct kyk_hd_index* hd_index = NULL;
+    uint8_t hash[32];
+    size_t height = 0;
+    size_t i = 0;
+    int res = -1;
+
+    hd_chain = make_test_hd_chain(5000);
+    head_chain.hd_list = hd_chain -> hd_list;
+    head_chain.len = 3;
+
+    res = kyk_new_hd_index(&hd_index, &head_chain);
+    mu_assert(res == 0, "Failed to test_kyk_hd_index_append: kyk_new_hd_index failed");
+
+    for(i = head_chain.len; i < hd_chain -> len; i++){
+	res = kyk_hd_index_append(hd_index, hd_chain -> hd_list + i);
+	mu_assert(res == 0, "Failed to test_kyk_hd_index_append: kyk_hd_index_append failed");
+    }
+    mu_assert(hd_index -> len == hd_chain -> len, "Failed to test_kyk_hd_index_append: invalid index len");
+    mu_assert(hd_index -> slot_count >= hd_index -> len * 2, "Failed to test_kyk_hd_index_append: index is more than half full");
+
+    for(i = 0; i < hd_chain -> len; i++){
+	kyk_blk_hash256(hash, hd_chain -> hd_list + i);
+	mu_assert(kyk_hd_index_find(hd_index, hash, &height) && height == i, "Failed to test_kyk_hd_index_append: header is not found at its height");
+    }
+
+    hd_chain -> hd_list[10].nonce = 0xffffffff;
+    kyk_blk_hash256(hash, hd_chain -> hd_list + 10);
+    mu_assert(!kyk_hd_index_find(hd_index, hash, &height), "Failed to test_kyk_hd_index_append: unknown header is found");
+
+    kyk_free_hd_index(hd_index);
+    kyk_free_blk_hd_chain(hd_chain);
+
+    return NULL;
+}
+
+char* test_kyk_ptl_locate_headers()
+{
+    struct kyk_blk_hd_chain* hd_chain = NULL;
+    struct kyk_blk_hd_chain* peer_chain = NULL;
+    struct kyk_hd_index* hd_index = NULL;
+    ptl_gethder_entity* et = NULL;
+    size_t start = 0;
+    size_t count = 0;
+    int res = -1;
+
+    hd_chain = make_test_hd_chain(5000);
+    res = kyk_new_hd_index(&hd_index, hd_chain);
+    mu_assert(res == 0, "Failed to test_kyk_ptl_locate_headers: kyk_new_hd_index failed");
+
+    /* a peer nearly in sync only gets what it is missing */
+    peer_chain = make_test_hd_chain(4990);
+    res = kyk_build_new_getheaders_entity(&et, 1, peer_chain);
+    mu_assert(res == 0, "Failed to test_kyk_ptl_locate_headers: kyk_build_new_getheaders_entity failed");
+    res = kyk_ptl_locate_headers(hd_index, et, &start, &count);
+    mu_assert(res == 0 && start == 4990 && count == 10, "Failed to test_kyk_ptl_locate_headers: invalid range for a near tip locator");
+    kyk_free_ptl_gethder_entity(et);
+    kyk_free_blk_hd_chain(peer_chain);
+
+    /* the peer is ahead on a header we do not know, the next known locator hash is used */
+    peer_chain = make_test_hd_chain(3001);
+    peer_chain -> hd_list[3000].nonce = 0xffffffff;
+    res = kyk_build_new_getheaders_entity(&et, 1, peer_chain);
+    mu_assert(res == 0, "Failed to test_kyk_ptl_locate_headers: kyk_build_new_getheaders_entity failed");
+    res = kyk_ptl_locate_headers(hd_index, et, &start, &count);
+    mu_assert(res == 0 && start == 3000 && count == KYK_MAX_HEADERS_RESULTS, "Failed to test_kyk_ptl_locate_headers: invalid range after an unknown tip");
+
+    /* hash_stop ends the reply early */
+    kyk_blk_hash256(et -> hash_stop.data, hd_chain -> hd_list + 3009);
+    res = kyk_ptl_locate_headers(hd_index, et, &start, &count);
+    mu_assert(res == 0 && start == 3000 && count == 10, "Failed to test_kyk_ptl_locate_headers: hash_stop is ignored");
+    kyk_free_ptl_gethder_entity(et);
+    kyk_free_blk_hd_chain(peer_chain);
+
+    /* an empty locator starts at genesis and is capped */
+    peer_chain = make_test_hd_chain(0);
+    res = kyk_build_new_getheaders_entity(&et, 1, peer_chain);
+    mu_assert(res == 0 && et -> hash_count == 0, "Failed to test_kyk_ptl_locate_headers: invalid empty locator");
+    res = kyk_ptl_locate_headers(hd_index, et, &start, &count);
+    mu_assert(res == 0 && start == 0 && count == KYK_MAX_HEADERS_RESULTS, "Failed to test_kyk_ptl_locate_headers: invalid range for an empty locator");
+    kyk_free_ptl_gethder_entity(et);
+    kyk_free_blk_hd_chain(peer_chain);
+
+    /* in sync, nothing to send */
+    res = kyk_build_new_getheaders_entity(&et, 1, hd_chain);
+    mu_assert(res == 0, "Failed to test_kyk_ptl_locate_headers: kyk_build_new_getheaders_entity failed");
+    res = kyk_ptl_locate_headers(hd_index, et, &start, &count);
+    mu_assert(res == 0 && count == 0, "Failed to test_kyk_ptl_locate_headers: in sync peer gets headers");
+    kyk_free_ptl_gethder_entity(et);
+
+    kyk_free_hd_index(hd_index);
+    kyk_free_blk_hd_chain(hd_chain);
+
+    return NULL;
+}
+
 char* test_kyk_seri_hd_chain_to_new_pld()
 {
     ptl_payload* pld = NULL;
@@ -260,6 +464,272 @@ char* test_kyk_deseri_new_reject_entity()
     return NULL;
 }
 
+char* test_kyk_seri_merkle_blk_to_new_pld()
+{
+    struct kyk_block* blk = NULL;
+    struct kyk_blk_header hd;
+    struct kyk_partial_mkl* pmt = NULL;
+    struct kyk_partial_mkl* pmt2 = NULL;
+    ptl_payload* pld = NULL;
+    ptl_message* msg = NULL;
+    uint8_t matches[2] = {0, 1};
+    uint8_t root[32];
+    uint8_t* txids = NULL;
+    size_t match_count = 0;
+    size_t blk_size = 0;
+    int res = -1;
+
+    res = kyk_deseri_new_block(&blk, BLOCK_BUF, &blk_size);
+    check(res == 0, "Failed to test_kyk_seri_merkle_blk_to_new_pld: kyk_deseri_new_block failed");
+    check(blk -> tx_count == 2, "Failed to test_kyk_seri_merkle_blk_to_new_pld: unexpected tx_count");
+
+    res = kyk_build_partial_mkl_from_tx_list(&pmt, blk -> tx, matches, blk -> tx_count);
+    check(res == 0, "Failed to test_kyk_seri_merkle_blk_to_new_pld: kyk_build_partial_mkl_from_tx_list failed");
+
+    res = kyk_seri_merkle_blk_to_new_pld(&pld, blk -> hd, pmt);
+    mu_assert(res == 0, "Failed to test_kyk_seri_merkle_blk_to_new_pld");
+
+    res = kyk_build_new_ptl_message(&msg, KYK_MSG_TYPE_MERKLEBLOCK, NT_MAGIC_MAIN, pld);
+    check(res == 0, "Failed to test_kyk_seri_merkle_blk_to_new_pld: kyk_build_new_ptl_message failed");
+
+    res = kyk_deseri_merkle_blk_msg(msg, &hd, &pmt2);
+    mu_assert(res == 0, "Failed to test_kyk_seri_merkle_blk_to_new_pld: kyk_deseri_merkle_blk_msg failed");
+
+    res = kyk_partial_mkl_extract(pmt2, root, &txids, &match_count);
+    mu_assert(res == 0, "Failed to test_kyk_seri_merkle_blk_to_new_pld: kyk_partial_mkl_extract failed");
+    mu_assert(match_count == 1, "Failed to test_kyk_seri_merkle_blk_to_new_pld: invalid match_count");
+    mu_assert(kyk_digest_eq(root, hd.mrk_root_hash, sizeof(root)), "Failed to test_kyk_seri_merkle_blk_to_new_pld: root mismatch");
+
+    free(txids);
+    kyk_free_partial_mkl(pmt);
+    kyk_free_partial_mkl(pmt2);
+    kyk_free_ptl_msg(msg);
+    kyk_free_block(blk);
+
+    return NULL;
+
+error:
+
+    return "Failed to test_kyk_seri_merkle_blk_to_new_pld";
+}
+
+char* test_kyk_deseri_getdata_pkh_filter()
+{
+    struct ptl_inv inv_list[2];
+    struct ptl_pkh_filter filter;
+    struct ptl_pkh_filter* filter2 = NULL;
+    ptl_payload* pld = NULL;
+    struct ptl_inv* inv_list2 = NULL;
+    varint_t inv_count = 0;
+    uint8_t pkhs[40];
+    int res = -1;
+
+    memset(inv_list, 0x11, sizeof(inv_list));
+    inv_list[0].type = PTL_INV_MSG_FILTERED_BLOCK;
+    inv_list[1].type = PTL_INV_MSG_FILTERED_BLOCK;
+    memset(pkhs, 0xab, sizeof(pkhs));
+    filter.count = 2;
+    filter.pkhs = pkhs;
+
+    res = kyk_seri_filtered_getdata_to_new_pld(&pld, inv_list, 2, &filter);
+    mu_assert(res == 0, "Failed to test_kyk_deseri_getdata_pkh_filter: kyk_seri_filtered_getdata_to_new_pld failed");
+
+    res = kyk_deseri_new_ptl_inv_list(pld -> data, &inv_list2, &inv_count);
+    mu_assert(res == 0 && inv_count == 2, "Failed to test_kyk_deseri_getdata_pkh_filter: kyk_deseri_new_ptl_inv_list failed");
+
+    res = kyk_deseri_getdata_pkh_filter(pld, inv_count, &filter2);
+    mu_assert(res == 0, "Failed to test_kyk_deseri_getdata_pkh_filter: kyk_deseri_getdata_pkh_filter failed");
+    mu_assert(filter2 -> count == 2, "Failed to test_kyk_deseri_getdata_pkh_filter: invalid count");
+    mu_assert(memcmp(filter2 -> pkhs, pkhs, sizeof(pkhs)) == 0, "Failed to test_kyk_deseri_getdata_pkh_filter: invalid pkhs");
+
+    free(inv_list2);
+    kyk_free_pkh_filter(filter2);
+    kyk_free_ptl_payload(pld);
+
+    return NULL;
+}
+
+char* test_kyk_deseri_getdata_pkh_filter_truncated()
+{
+    struct ptl_inv inv_list[2];
+    struct ptl_pkh_filter filter;
+    struct ptl_pkh_filter* filter2 = NULL;
+    ptl_payload* pld = NULL;
+    uint8_t pkhs[40];
+    size_t offset = 0;
+    size_t len = 0;
+    int res = -1;
+
+    memset(inv_list, 0x11, sizeof(inv_list));
+    inv_list[0].type = PTL_INV_MSG_FILTERED_BLOCK;
+    inv_list[1].type = PTL_INV_MSG_FILTERED_BLOCK;
+    memset(pkhs, 0xab, sizeof(pkhs));
+    filter.count = 2;
+    filter.pkhs = pkhs;
+
+    res = kyk_seri_filtered_getdata_to_new_pld(&pld, inv_list, 2, &filter);
+    mu_assert(res == 0, "Failed to test_kyk_deseri_getdata_pkh_filter_truncated: kyk_seri_filtered_getdata_to_new_pld failed");
+
+    offset = get_varint_size(2) + sizeof(inv_list);
+    len = pld -> len;
+
+    /* a count larger than the pkhs that follow */
+    pld -> data[offset] = 3;
+    res = kyk_deseri_getdata_pkh_filter(pld, 2, &filter2);
+    mu_assert(res == -1, "Failed to test_kyk_deseri_getdata_pkh_filter_truncated: filter is loaded");
+
+    /* a count varint cut short by the end of the payload */
+    pld -> data[offset] = 0xff;
+    pld -> len = offset + 1;
+    res = kyk_deseri_getdata_pkh_filter(pld, 2, &filter2);
+    mu_assert(res == -1, "Failed to test_kyk_deseri_getdata_pkh_filter_truncated: filter is loaded");
+
+    pld -> len = len;
+    kyk_free_ptl_payload(pld);
+
+    return NULL;
+}
+
+char* test_kyk_reply_ptl_buf_msg()
+{
+    struct kyk_frame_queue* outq = NULL;
+    ptl_payload pld;
+    ptl_message* msg = NULL;
+    ptl_msg_buf* msg_buf = NULL;
+    uint8_t data[3000];
+    uint8_t rbuf[sizeof(data) + KYK_MSG_HEADER_LEN];
+    size_t rlen = 0;
+    ssize_t n = 0;
+    size_t i = 0;
+    int sv[2];
+    int res = -1;
+
+    for(i = 0; i < sizeof(data); i++){
+	data[i] = (uint8_t)(i * 7);
+    }
+
+    res = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    mu_assert(res == 0, "Failed to test_kyk_reply_ptl_buf_msg: socketpair failed");
+
+    res = kyk_new_frame_queue(&outq, sv[0], KYK_FRAME_QUEUE_MAX);
+    mu_assert(res == 0, "Failed to test_kyk_reply_ptl_buf_msg: kyk_new_frame_queue failed");
+
+    res = kyk_reply_ptl_buf_msg(outq, KYK_MSG_TYPE_BLOCK, NT_MAGIC_MAIN, data, sizeof(data));
+    mu_assert(res == 0, "Failed to test_kyk_reply_ptl_buf_msg: kyk_reply_ptl_buf_msg failed");
+    mu_assert(kyk_frame_queue_pending(outq) == 0, "Failed to test_kyk_reply_ptl_buf_msg: message is queued");
+
+    while(rlen < sizeof(rbuf)){
+	n = read(sv[1], rbuf + rlen, sizeof(rbuf) - rlen);
+	mu_assert(n > 0, "Failed to test_kyk_reply_ptl_buf_msg: read failed");
+	rlen += n;
+    }
+
+    pld.len = sizeof(data);
+    pld.data = data;
+    res = kyk_build_new_ptl_message(&msg, KYK_MSG_TYPE_BLOCK, NT_MAGIC_MAIN, &pld);
+    mu_assert(res == 0, "Failed to test_kyk_reply_ptl_buf_msg: kyk_build_new_ptl_message failed");
+
+    res = kyk_new_seri_ptl_message(&msg_buf, msg);
+    mu_assert(res == 0, "Failed to test_kyk_reply_ptl_buf_msg: kyk_new_seri_ptl_message failed");
+    mu_assert(msg_buf -> len == sizeof(rbuf), "Failed to test_kyk_reply_ptl_buf_msg: invalid message len");
+    mu_assert(memcmp(msg_buf -> data, rbuf, sizeof(rbuf)) == 0, "Failed to test_kyk_reply_ptl_buf_msg: invalid message");
+
+    kyk_free_ptl_msg_buf(msg_buf);
+    kyk_free_ptl_msg(msg);
+    kyk_free_frame_queue(outq);
+    close(sv[0]);
+    close(sv[1]);
+
+    return NULL;
+}
+
+struct test_sink {
+    int fd;
+    uint8_t* buf;
+    size_t len;
+    size_t cap;
+};
+
+static void* test_sink_run(void* arg)
+{
+    struct test_sink* sink = arg;
+    ssize_t n = 0;
+
+    while(sink -> len < sink -> cap){
+	n = read(sink -> fd, sink -> buf + sink -> len, sink -> cap - sink -> len);
+	if(n <= 0) break;
+	sink -> len += n;
+    }
+
+    return NULL;
+}
+
+char* test_kyk_send_ptl_msgs()
+{
+    ptl_payload plds[3];
+    ptl_message* msgs[3] = {NULL, NULL, NULL};
+    ptl_msg_buf* msg_buf = NULL;
+    uint8_t* expect = NULL;
+    size_t expect_len = 0;
+    uint32_t pld_lens[3] = {8, 300000, 0};
+    const char* cmds[3] = {KYK_MSG_TYPE_PING, KYK_MSG_TYPE_BLOCK, KYK_MSG_TYPE_PONG};
+    struct test_sink sink;
+    pthread_t tid;
+    int sndbuf = 4096;
+    int sv[2];
+    size_t i = 0;
+    int res = -1;
+
+    memset(&sink, 0, sizeof(sink));
+
+    for(i = 0; i < 3; i++){
+	plds[i].len = pld_lens[i];
+	plds[i].data = malloc(pld_lens[i] + 1);
+	memset(plds[i].data, (int)i + 1, pld_lens[i]);
+	res = kyk_build_new_ptl_message(msgs + i, cmds[i], NT_MAGIC_MAIN, plds + i);
+	mu_assert(res == 0, "Failed to test_kyk_send_ptl_msgs: kyk_build_new_ptl_message failed");
+	sink.cap += KYK_MSG_HEADER_LEN + pld_lens[i];
+    }
+
+    /* the messages serialized one by one are what must arrive */
+    expect = malloc(sink.cap);
+    for(i = 0; i < 3; i++){
+	res = kyk_new_seri_ptl_message(&msg_buf, msgs[i]);
+	mu_assert(res == 0, "Failed to test_kyk_send_ptl_msgs: kyk_new_seri_ptl_message failed");
+	memcpy(expect + expect_len, msg_buf -> data, msg_buf -> len);
+	expect_len += msg_buf -> len;
+	kyk_free_ptl_msg_buf(msg_buf);
+    }
+
+    /* a small non-blocking send buffer forces partial writes */
+    res = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    mu_assert(res == 0, "Failed to test_kyk_send_ptl_msgs: socketpair failed");
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0) | O_NONBLOCK);
+
+    sink.fd = sv[1];
+    sink.buf = malloc(sink.cap);
+    pthread_create(&tid, NULL, test_sink_run, &sink);
+
+    res = kyk_send_ptl_msgs(sv[0], (const ptl_message**)msgs, 3);
+    mu_assert(res == 0, "Failed to test_kyk_send_ptl_msgs: kyk_send_ptl_msgs failed");
+
+    pthread_join(tid, NULL);
+    mu_assert(sink.len == expect_len, "Failed to test_kyk_send_ptl_msgs: invalid length");
+    mu_assert(memcmp(sink.buf, expect, expect_len) == 0, "Failed to test_kyk_send_ptl_msgs: invalid bytes");
+
+    for(i = 0; i < 3; i++){
+	kyk_free_ptl_msg(msgs[i]);
+	free(plds[i].data);
+    }
+    free(expect);
+    free(sink.buf);
+    close(sv[0]);
+    close(sv[1]);
+
+    return NULL;
+}
+
 char *all_tests()
 {
     mu_suite_start();
@@ -270,11 +740,19 @@ char *all_tests()
     mu_run_test(test_kyk_new_seri_ver_entity_to_pld);
     mu_run_test(test_kyk_build_new_getheaders_entity);
     mu_run_test(test_kyk_new_seri_gethder_entity_to_pld);
+    mu_run_test(test_kyk_deseri_headers_msg_truncated);
+    mu_run_test(test_kyk_hd_index_append);
+    mu_run_test(test_kyk_ptl_locate_headers);
     mu_run_test(test_kyk_seri_hd_chain_to_new_pld);
     mu_run_test(test_kyk_deseri_new_ptl_inv_list);
     mu_run_test(test_kyk_seri_blk_to_new_pld);
     mu_run_test(test_kyk_build_new_reject_ptl_payload);
     mu_run_test(test_kyk_deseri_new_reject_entity);
+    mu_run_test(test_kyk_seri_merkle_blk_to_new_pld);
+    mu_run_test(test_kyk_deseri_getdata_pkh_filter);
+    mu_run_test(test_kyk_deseri_getdata_pkh_filter_truncated);
+    mu_run_test(test_kyk_reply_ptl_buf_msg);
+    mu_run_test(test_kyk_send_ptl_msgs);
     
     return NULL;
 }
@@ -302,6 +302,12 @@ char* test777_make_mkl_tree_root_from_tx_list()
     size_t target_blk_size = 446843;
     size_t target_tx_count = 777;
     struct kyk_mkltree_level* mkl_rt;
+    struct kyk_mkl_template* tpl = NULL;
+    uint8_t flat_rt[32];
+    uint8_t branch_rt[32];
+    uint8_t cb_hash[32];
+    uint8_t branch[(KYK_MKL_TPL_MAX_LEVELS - 1) * MKL_NODE_BODY_LEN];
+    size_t branch_len = 0;
     int res = -1;
     const uint8_t target_rt[32] = {
 	0x64, 0x66, 0x1f, 0x58, 0x77, 0x3c, 0x0a, 0xdc,
@@ -326,6 +332,32 @@ char* test777_make_mkl_tree_root_from_tx_list()
     check(mkl_rt, "Failed to test777_make_mkl_tree_root_from_tx_list: kyk_make_mkl_tree_root_from_tx_list failed");
     mu_assert(kyk_digest_eq(mkl_rt -> nd -> bdy, target_rt, sizeof(target_rt)), "Failed to test_make_mkl_tree_root_from_tx_list");
 
+    res = kyk_mkl_root_from_tx_list(flat_rt, tx_list, tx_count);
+    check(res == 0, "Failed to test777_make_mkl_tree_root_from_tx_list: kyk_mkl_root_from_tx_list failed");
+    mu_assert(kyk_digest_eq(flat_rt, target_rt, sizeof(target_rt)), "Failed to test777_make_mkl_tree_root_from_tx_list: flat root mismatch");
+
+    memset(flat_rt, 0, sizeof(flat_rt));
+    res = kyk_mkl_root_from_tx_list_mt(flat_rt, tx_list, tx_count, 3);
+    check(res == 0, "Failed to test777_make_mkl_tree_root_from_tx_list: kyk_mkl_root_from_tx_list_mt failed");
+    mu_assert(kyk_digest_eq(flat_rt, target_rt, sizeof(target_rt)), "Failed to test777_make_mkl_tree_root_from_tx_list: parallel root mismatch");
+
+    /* the one pass template hashes 777 leaves on the workers */
+    res = kyk_new_mkl_template_from_tx_list(&tpl, tx_list, tx_count);
+    check(res == 0, "Failed to test777_make_mkl_tree_root_from_tx_list: kyk_new_mkl_template_from_tx_list failed");
+    memset(flat_rt, 0, sizeof(flat_rt));
+    kyk_mkl_template_root(tpl, flat_rt);
+    mu_assert(kyk_digest_eq(flat_rt, target_rt, sizeof(target_rt)), "Failed to test777_make_mkl_tree_root_from_tx_list: template root mismatch");
+
+    branch_len = kyk_mkl_template_branch(tpl, branch);
+    kyk_mkl_template_set_coinbase(tpl, tx_list + 1);
+    kyk_mkl_template_root(tpl, flat_rt);
+    kyk_tx_hash256(cb_hash, tx_list + 1);
+    kyk_reverse(cb_hash, sizeof(cb_hash));
+    kyk_mkl_root_from_branch(branch_rt, cb_hash, branch, branch_len);
+    mu_assert(kyk_digest_eq(flat_rt, branch_rt, sizeof(branch_rt)), "Failed to test777_make_mkl_tree_root_from_tx_list: branch root mismatch");
+    kyk_free_mkl_template(tpl);
+    tpl = NULL;
+
     kyk_free_block(blk);
     blk = NULL;
     res = kyk_free_mkl_tree(mkl_rt);
@@ -337,10 +369,302 @@ char* test777_make_mkl_tree_root_from_tx_list()
     return NULL;
 error:
     if(fp) fclose(fp);
+    if(tpl) kyk_free_mkl_template(tpl);
     return "test32_make_mkl_tree_root_from_tx_list failed";
 }
 
 
+/* odd and even levels, every count up to 40 must match the pointer tree */
+char* test_mkl_root_from_hashes()
+{
+    const char* hexs[40];
+    char hex_buf[40][65];
+    uint8_t hashes[40 * MKL_NODE_BODY_LEN];
+    uint8_t root[MKL_NODE_BODY_LEN];
+    struct kyk_mkltree_level* leaf_level = NULL;
+    struct kyk_mkltree_level* mkl_rt = NULL;
+    size_t count = 0;
+    size_t i = 0;
+    size_t j = 0;
+    int res = -1;
+
+    for(i = 0; i < 40; i++){
+	for(j = 0; j < 64; j++){
+	    hex_buf[i][j] = "0123456789abcdef"[(i * 7 + j * 13) % 16];
+	}
+	hex_buf[i][64] = '\0';
+	hexs[i] = hex_buf[i];
+    }
+
+    for(count = 1; count <= 40; count++){
+	leaf_level = create_mkl_leafs_from_txid_hexs(hexs, count);
+	check(leaf_level, "Failed to test_mkl_root_from_hashes: create_mkl_leafs_from_txid_hexs failed");
+	mkl_rt = create_mkl_tree(leaf_level);
+	check(mkl_rt, "Failed to test_mkl_root_from_hashes: create_mkl_tree failed");
+
+	/* the flat array takes the internal byte order */
+	for(i = 0; i < count; i++){
+	    memcpy(hashes + i * MKL_NODE_BODY_LEN, leaf_level -> nd[i].bdy, MKL_NODE_BODY_LEN);
+	    kyk_reverse(hashes + i * MKL_NODE_BODY_LEN, MKL_NODE_BODY_LEN);
+	}
+
+	res = kyk_mkl_root_from_hashes(root, hashes, count);
+	check(res == 0, "Failed to test_mkl_root_from_hashes: kyk_mkl_root_from_hashes failed");
+	mu_assert(kyk_digest_eq(root, mkl_rt -> nd -> bdy, sizeof(root)), "Failed to test_mkl_root_from_hashes: root mismatch");
+
+	kyk_free_mkl_tree(mkl_rt);
+	mkl_rt = NULL;
+    }
+
+    return NULL;
+
+error:
+    if(mkl_rt) kyk_free_mkl_tree(mkl_rt);
+    return "Failed to test_mkl_root_from_hashes";
+}
+
+
+/* partial trees over every count up to 40 must give back the full root and exactly the matched txids */
+char* test_partial_mkl()
+{
+    struct kyk_partial_mkl* pmt = NULL;
+    struct kyk_partial_mkl* pmt2 = NULL;
+    uint8_t hashes[40 * MKL_NODE_BODY_LEN];
+    uint8_t work[40 * MKL_NODE_BODY_LEN];
+    uint8_t matches[40];
+    uint8_t full_root[MKL_NODE_BODY_LEN];
+    uint8_t root[MKL_NODE_BODY_LEN];
+    uint8_t txid[MKL_NODE_BODY_LEN];
+    uint8_t buf[40 * MKL_NODE_BODY_LEN + 100];
+    uint8_t* txids = NULL;
+    size_t match_count = 0;
+    size_t count = 0;
+    size_t len = 0;
+    size_t checknum = 0;
+    size_t i = 0;
+    size_t j = 0;
+    int pattern = 0;
+    int res = -1;
+
+    for(i = 0; i < sizeof(hashes); i++){
+	hashes[i] = (uint8_t)(i * 31 + 7);
+    }
+    /* the pattern repeats every 8 hashes, make each leaf unique */
+    for(i = 0; i < 40; i++){
+	hashes[i * MKL_NODE_BODY_LEN] = (uint8_t)i;
+    }
+
+    for(count = 1; count <= 40; count++){
+	memcpy(work, hashes, count * MKL_NODE_BODY_LEN);
+	res = kyk_mkl_root_from_hashes(full_root, work, count);
+	check(res == 0, "Failed to test_partial_mkl: kyk_mkl_root_from_hashes failed");
+
+	for(pattern = 0; pattern < 4; pattern++){
+	    for(i = 0; i < count; i++){
+		matches[i] = (pattern == 1) || (pattern == 2 && i % 3 == 1) || (pattern == 3 && i == count - 1);
+	    }
+
+	    res = kyk_build_partial_mkl(&pmt, hashes, matches, count);
+	    check(res == 0, "Failed to test_partial_mkl: kyk_build_partial_mkl failed");
+
+	    len = kyk_seri_partial_mkl(buf, pmt);
+	    mu_assert(len == kyk_get_partial_mkl_size(pmt), "Failed to test_partial_mkl: invalid size");
+
+	    res = kyk_deseri_new_partial_mkl(&pmt2, buf, len, &checknum);
+	    check(res == 0, "Failed to test_partial_mkl: kyk_deseri_new_partial_mkl failed");
+	    mu_assert(checknum == len, "Failed to test_partial_mkl: invalid checknum");
+
+	    res = kyk_partial_mkl_extract(pmt2, root, &txids, &match_count);
+	    check(res == 0, "Failed to test_partial_mkl: kyk_partial_mkl_extract failed");
+	    mu_assert(kyk_digest_eq(root, full_root, sizeof(root)), "Failed to test_partial_mkl: root mismatch");
+
+	    for(i = 0, j = 0; i < count; i++){
+		if(!matches[i]) continue;
+		memcpy(txid, hashes + i * MKL_NODE_BODY_LEN, sizeof(txid));
+		kyk_reverse(txid, sizeof(txid));
+		mu_assert(j < match_count, "Failed to test_partial_mkl: too few matches");
+		mu_assert(kyk_digest_eq(txids + j * MKL_NODE_BODY_LEN, txid, sizeof(txid)), "Failed to test_partial_mkl: txid mismatch");
+		j++;
+	    }
+	    mu_assert(j == match_count, "Failed to test_partial_mkl: too many matches");
+
+	    free(txids);
+	    txids = NULL;
+
+	    /* a forged hash changes the root */
+	    pmt2 -> hashes[0] ^= 0x01;
+	    res = kyk_partial_mkl_extract(pmt2, root, &txids, &match_count);
+	    if(res == 0){
+		mu_assert(!kyk_digest_eq(root, full_root, sizeof(root)), "Failed to test_partial_mkl: forged root accepted");
+		free(txids);
+		txids = NULL;
+	    }
+
+	    /* hashes left over are rejected */
+	    if(pmt -> hash_count < count){
+		pmt -> hashes = realloc(pmt -> hashes, (pmt -> hash_count + 1) * MKL_NODE_BODY_LEN);
+		pmt -> hash_count++;
+		res = kyk_partial_mkl_extract(pmt, root, &txids, &match_count);
+		mu_assert(res == -1, "Failed to test_partial_mkl: unused hash accepted");
+	    }
+
+	    kyk_free_partial_mkl(pmt);
+	    kyk_free_partial_mkl(pmt2);
+	    pmt = NULL;
+	    pmt2 = NULL;
+	}
+    }
+
+    return NULL;
+
+error:
+    if(pmt) kyk_free_partial_mkl(pmt);
+    if(pmt2) kyk_free_partial_mkl(pmt2);
+    return "Failed to test_partial_mkl";
+}
+
+/* a tree duplicating the last tx as its own sibling must not verify (CVE-2012-2459) */
+char* test_partial_mkl_dup_sibling()
+{
+    struct kyk_partial_mkl* pmt = NULL;
+    uint8_t hashes[3 * MKL_NODE_BODY_LEN];
+    uint8_t matches[4] = {0, 0, 1, 1};
+    uint8_t root[MKL_NODE_BODY_LEN];
+    uint8_t* txids = NULL;
+    size_t match_count = 0;
+    size_t i = 0;
+    int res = -1;
+
+    for(i = 0; i < sizeof(hashes); i++){
+	hashes[i] = (uint8_t)(i * 17 + 3);
+    }
+
+    /* 4 leaves where the 4th is a copy of the 3rd has the same root as the 3 leaves tree */
+    res = kyk_build_partial_mkl(&pmt, hashes, matches, 3);
+    check(res == 0, "Failed to test_partial_mkl_dup_sibling: kyk_build_partial_mkl failed");
+
+    pmt -> tx_count = 4;
+    pmt -> hashes = realloc(pmt -> hashes, (pmt -> hash_count + 1) * MKL_NODE_BODY_LEN);
+    memcpy(pmt -> hashes + pmt -> hash_count * MKL_NODE_BODY_LEN, hashes + 2 * MKL_NODE_BODY_LEN, MKL_NODE_BODY_LEN);
+    pmt -> hash_count++;
+    /* root, left subtree, right parent, leaf 2, leaf 3 */
+    pmt -> flags[0] = 0x1d;
+
+    res = kyk_partial_mkl_extract(pmt, root, &txids, &match_count);
+    mu_assert(res == -1, "Failed to test_partial_mkl_dup_sibling: duplicated sibling accepted");
+
+    kyk_free_partial_mkl(pmt);
+
+    return NULL;
+
+error:
+    if(pmt) kyk_free_partial_mkl(pmt);
+    return "Failed to test_partial_mkl_dup_sibling";
+}
+
+/* every cut of a serialized tree is rejected, including the ones ending inside a varint */
+char* test_partial_mkl_truncated()
+{
+    struct kyk_partial_mkl* pmt = NULL;
+    struct kyk_partial_mkl* pmt2 = NULL;
+    uint8_t hashes[5 * MKL_NODE_BODY_LEN];
+    uint8_t matches[5] = {0, 1, 0, 0, 1};
+    uint8_t buf[5 * MKL_NODE_BODY_LEN + 100];
+    uint8_t bad_buf[6] = {0x05, 0x00, 0x00, 0x00, 0xff, 0xff};
+    size_t len = 0;
+    size_t cut = 0;
+    size_t i = 0;
+    int res = -1;
+
+    for(i = 0; i < sizeof(hashes); i++){
+	hashes[i] = (uint8_t)(i * 13 + 5);
+    }
+
+    res = kyk_build_partial_mkl(&pmt, hashes, matches, 5);
+    check(res == 0, "Failed to test_partial_mkl_truncated: kyk_build_partial_mkl failed");
+
+    len = kyk_seri_partial_mkl(buf, pmt);
+    for(cut = 0; cut < len; cut++){
+	res = kyk_deseri_new_partial_mkl(&pmt2, buf, cut, NULL);
+	mu_assert(res == -1, "Failed to test_partial_mkl_truncated: truncated buf accepted");
+    }
+
+    /* a 9 bytes hash_count prefix with only one byte after it */
+    res = kyk_deseri_new_partial_mkl(&pmt2, bad_buf, sizeof(bad_buf), NULL);
+    mu_assert(res == -1, "Failed to test_partial_mkl_truncated: truncated hash_count accepted");
+
+    kyk_free_partial_mkl(pmt);
+
+    return NULL;
+
+error:
+    if(pmt) kyk_free_partial_mkl(pmt);
+    return "Failed to test_partial_mkl_truncated";
+}
+
+/* after every append and coinbase change the template root must match the flat root */
+char* test_mkl_template()
+{
+    struct kyk_mkl_template* tpl = NULL;
+    uint8_t hashes[40 * MKL_NODE_BODY_LEN];
+    uint8_t work[40 * MKL_NODE_BODY_LEN];
+    uint8_t branch[(KYK_MKL_TPL_MAX_LEVELS - 1) * MKL_NODE_BODY_LEN];
+    uint8_t cb_hash[MKL_NODE_BODY_LEN];
+    uint8_t flat_root[MKL_NODE_BODY_LEN];
+    uint8_t root[MKL_NODE_BODY_LEN];
+    size_t branch_len = 0;
+    size_t count = 0;
+    size_t i = 0;
+    int res = -1;
+
+    for(i = 0; i < sizeof(hashes); i++){
+	hashes[i] = (uint8_t)(i * 13 + 5);
+    }
+    for(i = 0; i < 40; i++){
+	hashes[i * MKL_NODE_BODY_LEN] = (uint8_t)i;
+    }
+
+    /* start small so that the levels have to grow */
+    res = kyk_new_mkl_template(&tpl, 3);
+    check(res == 0, "Failed to test_mkl_template: kyk_new_mkl_template failed");
+
+    for(count = 1; count <= 40; count++){
+	res = kyk_mkl_template_append(tpl, hashes + (count - 1) * MKL_NODE_BODY_LEN);
+	check(res == 0, "Failed to test_mkl_template: kyk_mkl_template_append failed");
+
+	memcpy(work, hashes, count * MKL_NODE_BODY_LEN);
+	kyk_mkl_root_from_hashes(flat_root, work, count);
+	kyk_mkl_template_root(tpl, root);
+	mu_assert(kyk_digest_eq(root, flat_root, sizeof(root)), "Failed to test_mkl_template: root mismatch after append");
+
+	/* roll the coinbase */
+	memset(cb_hash, (int)count, sizeof(cb_hash));
+	res = kyk_mkl_template_set_leaf(tpl, 0, cb_hash);
+	check(res == 0, "Failed to test_mkl_template: kyk_mkl_template_set_leaf failed");
+
+	memcpy(work, hashes, count * MKL_NODE_BODY_LEN);
+	memcpy(work, cb_hash, MKL_NODE_BODY_LEN);
+	kyk_mkl_root_from_hashes(flat_root, work, count);
+	kyk_mkl_template_root(tpl, root);
+	mu_assert(kyk_digest_eq(root, flat_root, sizeof(root)), "Failed to test_mkl_template: root mismatch after coinbase change");
+
+	branch_len = kyk_mkl_template_branch(tpl, branch);
+	kyk_mkl_root_from_branch(root, cb_hash, branch, branch_len);
+	mu_assert(kyk_digest_eq(root, flat_root, sizeof(root)), "Failed to test_mkl_template: branch root mismatch");
+
+	kyk_mkl_template_set_leaf(tpl, 0, hashes);
+    }
+
+    kyk_free_mkl_template(tpl);
+
+    return NULL;
+
+error:
+    if(tpl) kyk_free_mkl_template(tpl);
+    return "Failed to test_mkl_template";
+}
+
+
 char *all_tests()
 {
     mu_suite_start();
@@ -351,6 +675,11 @@ char *all_tests()
     mu_run_test(test15_make_mkl_tree_root_from_tx_list);
     mu_run_test(test32_make_mkl_tree_root_from_tx_list);
     mu_run_test(test777_make_mkl_tree_root_from_tx_list);
+    mu_run_test(test_mkl_root_from_hashes);
+    mu_run_test(test_partial_mkl);
+    mu_run_test(test_partial_mkl_dup_sibling);
+    mu_run_test(test_partial_mkl_truncated);
+    mu_run_test(test_mkl_template);
     
     return NULL;
 }
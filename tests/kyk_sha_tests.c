@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include "kyk_sha.h"
+#include "kyk_sha_simd.h"
 #include "kyk_utils.h"
 #include "mu_unit.h"
 
@@ -101,6 +102,125 @@ char* test_kyk_dgst_hash160()
     return NULL;
 }
 
+char* test_kyk_hash256_ctx()
+{
+    struct kyk_hash256_ctx ctx;
+    uint8_t digest[32];
+    uint8_t expect[32];
+    size_t len = strlen(message);
+
+    kyk_dgst_hash256(expect, (uint8_t*)message, len);
+
+    kyk_hash256_init(&ctx);
+    kyk_hash256_update(&ctx, message, 5);
+    kyk_hash256_update(&ctx, message + 5, 0);
+    kyk_hash256_update(&ctx, message + 5, len - 5);
+    kyk_hash256_final(&ctx, digest);
+    mu_assert(kyk_digest_eq(digest, expect, sizeof(digest)), "Failed to test_kyk_hash256_ctx");
+
+    return NULL;
+}
+
+char* test_kyk_dgst_hash256_rev()
+{
+    struct kyk_digst* ivhash = NULL;
+    uint8_t digest[32];
+    uint8_t target_digest[32] = {
+	0xda, 0xbc, 0x91, 0xd8, 0x21, 0x0c, 0x29, 0x4c,
+	0xb0, 0xa8, 0x28, 0x98, 0xaf, 0x6e, 0xca, 0x21,
+	0xb2, 0x81, 0xea, 0x87, 0xba, 0xbe, 0xf9, 0xc7,
+	0x7c, 0x84, 0x8b, 0xe2, 0xa4, 0x6e, 0x98, 0x90
+    };
+
+    kyk_dgst_hash256_rev(digest, (uint8_t*)message, strlen(message));
+    mu_assert(kyk_digest_eq(digest, target_digest, sizeof(digest)), "Failed to test_kyk_dgst_hash256_rev");
+
+    /* kyk_inver_hash is the heap allocating form of the same hash */
+    ivhash = kyk_inver_hash(message, strlen(message));
+    mu_assert(ivhash, "Failed to test_kyk_dgst_hash256_rev: kyk_inver_hash failed");
+    mu_assert(kyk_digest_eq(ivhash -> body, digest, sizeof(digest)), "Failed to test_kyk_dgst_hash256_rev: not eq to kyk_inver_hash");
+    kyk_free_digst(ivhash);
+
+    return NULL;
+}
+
+/* 19 messages: two full AVX2 batches plus a remainder, checked against kyk_dgst_hash256 for every implementation */
+#define SIMD_TEST_MSG_NUM 19
+
+static const enum kyk_sha256d_impl simd_test_impls[] = {
+    KYK_SHA256D_SCALAR, KYK_SHA256D_SSE4, KYK_SHA256D_AVX2
+};
+
+char* test_kyk_dgst_hash256_n()
+{
+    uint8_t msgs[SIMD_TEST_MSG_NUM * 80];
+    uint8_t digests[SIMD_TEST_MSG_NUM * 32];
+    uint8_t expect[32];
+    size_t i = 0;
+    size_t k = 0;
+
+    for(i = 0; i < sizeof(msgs); i++){
+	msgs[i] = (uint8_t)(i * 131 + 7);
+    }
+
+    for(k = 0; k < sizeof(simd_test_impls) / sizeof(simd_test_impls[0]); k++){
+	kyk_sha256d_set_impl(simd_test_impls[k]);
+
+	kyk_dgst_hash256_64_n(digests, msgs, SIMD_TEST_MSG_NUM);
+	for(i = 0; i < SIMD_TEST_MSG_NUM; i++){
+	    kyk_dgst_hash256(expect, msgs + i * 64, 64);
+	    mu_assert(kyk_digest_eq(digests + i * 32, expect, 32), "Failed to test_kyk_dgst_hash256_n: 64-byte digest mismatch");
+	}
+
+	kyk_dgst_hash256_80_n(digests, msgs, SIMD_TEST_MSG_NUM);
+	for(i = 0; i < SIMD_TEST_MSG_NUM; i++){
+	    kyk_dgst_hash256(expect, msgs + i * 80, 80);
+	    mu_assert(kyk_digest_eq(digests + i * 32, expect, 32), "Failed to test_kyk_dgst_hash256_n: 80-byte digest mismatch");
+	}
+    }
+
+    kyk_sha256d_set_impl(KYK_SHA256D_AUTO);
+
+    return NULL;
+}
+
+char* test_kyk_dgst_hash256_mid_n()
+{
+    uint8_t msg[80];
+    uint8_t tails[SIMD_TEST_MSG_NUM * 16];
+    uint8_t digests[SIMD_TEST_MSG_NUM * 32];
+    uint8_t expect[32];
+    SHA256_CTX mid_ctx;
+    size_t i = 0;
+    size_t k = 0;
+
+    for(i = 0; i < sizeof(msg); i++){
+	msg[i] = (uint8_t)(i * 17 + 3);
+    }
+
+    for(i = 0; i < sizeof(tails); i++){
+	tails[i] = (uint8_t)(i * 29 + 1);
+    }
+
+    SHA256_Init(&mid_ctx);
+    SHA256_Update(&mid_ctx, msg, 64);
+
+    for(k = 0; k < sizeof(simd_test_impls) / sizeof(simd_test_impls[0]); k++){
+	kyk_sha256d_set_impl(simd_test_impls[k]);
+
+	kyk_dgst_hash256_mid_n(digests, &mid_ctx, tails, SIMD_TEST_MSG_NUM);
+	for(i = 0; i < SIMD_TEST_MSG_NUM; i++){
+	    memcpy(msg + 64, tails + i * 16, 16);
+	    kyk_dgst_hash256(expect, msg, sizeof(msg));
+	    mu_assert(kyk_digest_eq(digests + i * 32, expect, 32), "Failed to test_kyk_dgst_hash256_mid_n: digest mismatch");
+	}
+    }
+
+    kyk_sha256d_set_impl(KYK_SHA256D_AUTO);
+
+    return NULL;
+}
+
 char *all_tests()
 {
     mu_suite_start();
@@ -110,6 +230,10 @@ char *all_tests()
     mu_run_test(test_kyk_dgst_hash256);
     mu_run_test(test_kyk_dgst_hash160);
     mu_run_test(test_kyk_hash256);
+    mu_run_test(test_kyk_hash256_ctx);
+    mu_run_test(test_kyk_dgst_hash256_rev);
+    mu_run_test(test_kyk_dgst_hash256_n);
+    mu_run_test(test_kyk_dgst_hash256_mid_n);
     
     return NULL;
 }
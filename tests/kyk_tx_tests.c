@@ -243,6 +243,46 @@ char* test_make_coinbase_tx()
     return NULL;
 }
 
+/* the extranonce push grows to 4 bytes once and keeps the bits and the note around it */
+char* test_set_coinbase_extranonce()
+{
+    struct kyk_tx* tx = NULL;
+    char* note = "this is a coinbase tx";
+    uint8_t pubkey[33] = {
+	0x03, 0xd3, 0xcf, 0xed, 0xe5, 0x6a, 0x79, 0xf6,
+	0xb6, 0x90, 0x7a, 0x5f, 0x14, 0x5a, 0x76, 0xcc,
+	0x5c, 0xd7, 0x54, 0x9b, 0x24, 0x4f, 0x7d, 0x93,
+	0xbb, 0x72, 0xd4, 0xf9, 0xe4, 0x61, 0xb1, 0x46,
+	0xa9
+    };
+    uint8_t sc[100];
+    size_t sc_size = 0;
+    int res = -1;
+
+    res = kyk_make_coinbase_tx(&tx, note, 10000000000, pubkey, sizeof(pubkey));
+    mu_assert(res == 0, "Failed to test_set_coinbase_extranonce: kyk_make_coinbase_tx failed");
+    sc_size = tx -> txin -> sc_size;
+    memcpy(sc, tx -> txin -> sc, sc_size);
+
+    res = kyk_set_coinbase_extranonce(tx, 0x01020304);
+    mu_assert(res == 0, "Failed to test_set_coinbase_extranonce");
+    mu_assert(tx -> txin -> sc_size == sc_size + 3, "Failed to test_set_coinbase_extranonce: invalid sc_size");
+    mu_assert(memcmp(tx -> txin -> sc, sc, 5) == 0, "Failed to test_set_coinbase_extranonce: bits push changed");
+    mu_assert(tx -> txin -> sc[5] == 4, "Failed to test_set_coinbase_extranonce: invalid extranonce push");
+    mu_assert(tx -> txin -> sc[6] == 0x04 && tx -> txin -> sc[9] == 0x01, "Failed to test_set_coinbase_extranonce: extranonce is not little endian");
+    mu_assert(memcmp(tx -> txin -> sc + 10, sc + 7, sc_size - 7) == 0, "Failed to test_set_coinbase_extranonce: note changed");
+
+    res = kyk_set_coinbase_extranonce(tx, 0x05060708);
+    mu_assert(res == 0, "Failed to test_set_coinbase_extranonce");
+    mu_assert(tx -> txin -> sc_size == sc_size + 3, "Failed to test_set_coinbase_extranonce: sc_size changed on the second roll");
+    mu_assert(tx -> txin -> sc[6] == 0x08, "Failed to test_set_coinbase_extranonce: extranonce not updated");
+    mu_assert(memcmp(tx -> txin -> sc + 10, sc + 7, sc_size - 7) == 0, "Failed to test_set_coinbase_extranonce: note changed");
+
+    kyk_free_tx(tx);
+
+    return NULL;
+}
+
 
 char* test_kyk_get_addr_from_txout()
 {
@@ -355,6 +395,7 @@ char *all_tests()
     mu_run_test(test_deseri_tx);
     mu_run_test(test_deseri_tx_list);
     mu_run_test(test_make_coinbase_tx);
+    mu_run_test(test_set_coinbase_extranonce);
     mu_run_test(test_kyk_get_addr_from_txout);
     mu_run_test(test2_kyk_get_addr_from_txout);
     mu_run_test(test_kyk_copy_txout);
@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "test_data.h"
+#include "kyk_block.h"
+#include "kyk_tx.h"
+#include "kyk_utils.h"
+#include "kyk_ldb.h"
+#include "kyk_blk_writer.h"
+#include "kyk_blk_reader.h"
+#include "kyk_txindex.h"
+#include "varint.h"
+#include "mu_unit.h"
+
+#define TXINDEX_TEST_DIR "/tmp/test_kyk_txindex"
+#define TXINDEX_TEST_DB TXINDEX_TEST_DIR "/index"
+
+/* an empty blocks dir and index db */
+static int reset_test_dir()
+{
+    char* cmd = "rm -rf " TXINDEX_TEST_DIR;
+
+    if(system(cmd) != 0) return -1;
+
+    return mkdir(TXINDEX_TEST_DIR, 0755);
+}
+
+char* test_kyk_txindex_batch_block()
+{
+    struct kyk_block_db db;
+    struct kyk_blk_writer* writer = NULL;
+    struct kyk_blk_reader* reader = NULL;
+    struct kyk_block* blk = NULL;
+    struct kyk_tx* tx = NULL;
+    struct kyk_disk_tx_pos pos;
+    leveldb_writebatch_t* batch = NULL;
+    const uint8_t* blk_buf = NULL;
+    uint32_t blk_size = 0;
+    uint8_t txid[32];
+    uint8_t digest[32];
+    char* errptr = NULL;
+    uint64_t nDataPos = 0;
+    size_t tx_size = 0;
+    size_t len = 0;
+    varint_t i = 0;
+    int nFile = -1;
+    int found = 0;
+    int res = -1;
+
+    res = reset_test_dir();
+    mu_assert(res == 0, "Failed to test_kyk_txindex_batch_block: reset_test_dir failed");
+
+    res = kyk_deseri_new_block(&blk, BLOCK_2TX_BUF, NULL);
+    mu_assert(res == 0 && blk -> tx_count == 2, "Failed to test_kyk_txindex_batch_block: kyk_deseri_new_block failed");
+
+    res = kyk_set_blkself_info(blk);
+    mu_assert(res == 0, "Failed to test_kyk_txindex_batch_block: kyk_set_blkself_info failed");
+
+    res = kyk_init_store_db(&db, TXINDEX_TEST_DB);
+    mu_assert(res == 0 && db.errptr == NULL, "Failed to test_kyk_txindex_batch_block: kyk_init_store_db failed");
+
+    res = kyk_new_blk_writer(&writer, TXINDEX_TEST_DIR, &db, 1024 * 1024, 64 * 1024);
+    mu_assert(res == 0, "Failed to test_kyk_txindex_batch_block: kyk_new_blk_writer failed");
+
+    batch = leveldb_writebatch_create();
+
+    res = kyk_blk_writer_write(writer, blk, batch, &nFile, &nDataPos);
+    mu_assert(res == 0, "Failed to test_kyk_txindex_batch_block: kyk_blk_writer_write failed");
+
+    res = kyk_txindex_batch_block(batch, blk, nFile, nDataPos);
+    mu_assert(res == 0, "Failed to test_kyk_txindex_batch_block: kyk_txindex_batch_block failed");
+
+    /* nothing is in the index before the batch is written */
+    res = kyk_tx_hash256(txid, blk -> tx);
+    mu_assert(res == 0, "Failed to test_kyk_txindex_batch_block: kyk_tx_hash256 failed");
+    res = kyk_txindex_get(&db, txid, &pos, &found);
+    mu_assert(res == 0 && found == 0, "Failed to test_kyk_txindex_batch_block: the tx is indexed before the write");
+
+    res = kyk_blk_writer_sync(writer);
+    mu_assert(res == 0, "Failed to test_kyk_txindex_batch_block: kyk_blk_writer_sync failed");
+
+    leveldb_write(db.db, db.wr_opts, batch, &errptr);
+    mu_assert(errptr == NULL, "Failed to test_kyk_txindex_batch_block: leveldb_write failed");
+    leveldb_writebatch_destroy(batch);
+
+    res = kyk_new_blk_reader(&reader, TXINDEX_TEST_DIR, 1024 * 1024);
+    mu_assert(res == 0, "Failed to test_kyk_txindex_batch_block: kyk_new_blk_reader failed");
+
+    res = kyk_blk_reader_get_view(reader, nFile, nDataPos, &blk_buf, &blk_size);
+    mu_assert(res == 0, "Failed to test_kyk_txindex_batch_block: kyk_blk_reader_get_view failed");
+
+    for(i = 0; i < blk -> tx_count; i++){
+	res = kyk_tx_hash256(txid, blk -> tx + i);
+	mu_assert(res == 0, "Failed to test_kyk_txindex_batch_block: kyk_tx_hash256 failed");
+
+	res = kyk_txindex_get(&db, txid, &pos, &found);
+	mu_assert(res == 0 && found == 1, "Failed to test_kyk_txindex_batch_block: kyk_txindex_get failed");
+	mu_assert(pos.nFile == nFile && pos.nPos == nDataPos, "Failed to test_kyk_txindex_batch_block: invalid block pos");
+
+	if(i == 0){
+	    mu_assert(pos.nTxOffset == get_varint_size(blk -> tx_count), "Failed to test_kyk_txindex_batch_block: invalid nTxOffset");
+	} else {
+	    mu_assert(pos.nTxOffset == get_varint_size(blk -> tx_count) + tx_size, "Failed to test_kyk_txindex_batch_block: invalid nTxOffset");
+	}
+
+	/* the tx is found in the block bytes at the offset */
+	res = kyk_deseri_new_tx(&tx, blk_buf + KYK_BLK_HD_LEN + pos.nTxOffset, &len);
+	mu_assert(res == 0, "Failed to test_kyk_txindex_batch_block: kyk_deseri_new_tx failed");
+
+	res = kyk_tx_hash256(digest, tx);
+	mu_assert(res == 0, "Failed to test_kyk_txindex_batch_block: kyk_tx_hash256 failed");
+	mu_assert(kyk_digest_eq(digest, txid, sizeof(digest)), "Failed to test_kyk_txindex_batch_block: found another tx");
+
+	kyk_free_tx(tx);
+	tx = NULL;
+	tx_size += len;
+    }
+
+    /* a txid that is not in the index */
+    memset(txid, 0xab, sizeof(txid));
+    res = kyk_txindex_get(&db, txid, &pos, &found);
+    mu_assert(res == 0 && found == 0, "Failed to test_kyk_txindex_batch_block: found an unknown tx");
+
+    kyk_free_blk_reader(reader);
+    kyk_free_blk_writer(writer);
+    kyk_free_block(blk);
+    kyk_free_block_db(&db);
+
+    return NULL;
+}
+
+char* test_kyk_txindex_flag()
+{
+    struct kyk_block_db db;
+    leveldb_writebatch_t* batch = NULL;
+    char* errptr = NULL;
+    int built = -1;
+    int res = -1;
+
+    res = reset_test_dir();
+    mu_assert(res == 0, "Failed to test_kyk_txindex_flag: reset_test_dir failed");
+
+    res = kyk_init_store_db(&db, TXINDEX_TEST_DB);
+    mu_assert(res == 0 && db.errptr == NULL, "Failed to test_kyk_txindex_flag: kyk_init_store_db failed");
+
+    res = kyk_txindex_read_flag(&db, &built);
+    mu_assert(res == 0 && built == 0, "Failed to test_kyk_txindex_flag: a new db has the index built");
+
+    batch = leveldb_writebatch_create();
+    kyk_txindex_batch_flag(batch, 1);
+    leveldb_write(db.db, db.wr_opts, batch, &errptr);
+    mu_assert(errptr == NULL, "Failed to test_kyk_txindex_flag: leveldb_write failed");
+
+    res = kyk_txindex_read_flag(&db, &built);
+    mu_assert(res == 0 && built == 1, "Failed to test_kyk_txindex_flag: kyk_txindex_read_flag failed");
+
+    leveldb_writebatch_clear(batch);
+    kyk_txindex_batch_flag(batch, 0);
+    leveldb_write(db.db, db.wr_opts, batch, &errptr);
+    mu_assert(errptr == NULL, "Failed to test_kyk_txindex_flag: leveldb_write failed");
+    leveldb_writebatch_destroy(batch);
+
+    res = kyk_txindex_read_flag(&db, &built);
+    mu_assert(res == 0 && built == 0, "Failed to test_kyk_txindex_flag: kyk_txindex_read_flag failed");
+
+    kyk_free_block_db(&db);
+
+    return NULL;
+}
+
+char *all_tests()
+{
+    mu_suite_start();
+
+    mu_run_test(test_kyk_txindex_batch_block);
+    mu_run_test(test_kyk_txindex_flag);
+
+    return NULL;
+}
+
+MU_RUN_TESTS(all_tests);
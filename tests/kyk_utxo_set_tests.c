@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test_data.h"
+#include "kyk_tx.h"
+#include "kyk_block.h"
+#include "kyk_utils.h"
+#include "kyk_utxo.h"
+#include "kyk_utxo_set.h"
+#include "mu_unit.h"
+
+#define TEST_UTXO_COUNT 5000
+
+/* txid from the number, the same block for all of them unless blk_no differs */
+static struct kyk_utxo* make_test_utxo(uint32_t n, uint32_t outidx, uint8_t blk_no)
+{
+    struct kyk_utxo* utxo = NULL;
+    uint32_t h = n * 2654435761u;
+
+    utxo = calloc(1, sizeof(*utxo));
+    memcpy(utxo -> txid, &h, sizeof(h));
+    memcpy(utxo -> txid + 28, &n, sizeof(n));
+    utxo -> blkhash[31] = blk_no;
+    utxo -> outidx = outidx;
+    utxo -> value = n;
+    utxo -> sc_size = 3;
+    utxo -> sc = calloc(3, 1);
+    utxo -> sc[0] = (uint8_t)n;
+    utxo -> btc_addr = strdup("1Addr");
+    utxo -> addr_len = strlen(utxo -> btc_addr);
+
+    return utxo;
+}
+
+char* test_kyk_utxo_set()
+{
+    struct kyk_utxo_set* set = NULL;
+    struct kyk_utxo_chain* utxo_chain = NULL;
+    struct kyk_utxo_chain* src_chain = NULL;
+    struct kyk_utxo_entry* entry = NULL;
+    struct kyk_utxo* utxo = NULL;
+    uint32_t i = 0;
+    uint32_t n = 0;
+    int res = -1;
+
+    src_chain = calloc(1, sizeof(*src_chain));
+    kyk_init_utxo_chain(src_chain);
+
+    res = kyk_new_utxo_set(&set, TEST_UTXO_COUNT);
+    mu_assert(res == 0, "Failed to test_kyk_utxo_set: kyk_new_utxo_set failed");
+
+    for(i = 0; i < TEST_UTXO_COUNT; i++){
+	utxo = make_test_utxo(i, i % 3, 1);
+	kyk_utxo_chain_append(src_chain, utxo);
+	res = kyk_utxo_set_add(set, utxo);
+	mu_assert(res == 0, "Failed to test_kyk_utxo_set: kyk_utxo_set_add failed");
+    }
+
+    res = kyk_utxo_set_add(set, src_chain -> hd);
+    mu_assert(res == 1, "Failed to test_kyk_utxo_set: a repeated utxo is added");
+    mu_assert(set -> len == TEST_UTXO_COUNT, "Failed to test_kyk_utxo_set: invalid len");
+
+    utxo = src_chain -> hd;
+    for(i = 0; i < TEST_UTXO_COUNT; i++){
+	entry = kyk_utxo_set_find(set, utxo -> txid, utxo -> outidx);
+	mu_assert(entry && entry -> node == utxo, "Failed to test_kyk_utxo_set: utxo is not found");
+	mu_assert(entry -> value == i, "Failed to test_kyk_utxo_set: invalid value");
+	mu_assert(kyk_utxo_set_find(set, utxo -> txid, utxo -> outidx + 1) == NULL, "Failed to test_kyk_utxo_set: found a wrong outidx");
+	utxo = utxo -> next;
+    }
+
+    /* spend the even ones, the full set then compacts them away before it grows */
+    utxo = src_chain -> hd;
+    for(i = 0; i < TEST_UTXO_COUNT; i++){
+	if(i % 2 == 0){
+	    res = kyk_utxo_set_spend(set, utxo -> txid, utxo -> outidx);
+	    mu_assert(res == 1, "Failed to test_kyk_utxo_set: kyk_utxo_set_spend failed");
+	}
+	utxo = utxo -> next;
+    }
+    mu_assert(kyk_utxo_set_spend(set, src_chain -> hd -> txid, src_chain -> hd -> outidx) == 0, "Failed to test_kyk_utxo_set: spent twice");
+    mu_assert(kyk_utxo_set_find(set, src_chain -> hd -> txid, src_chain -> hd -> outidx) == NULL, "Failed to test_kyk_utxo_set: found a spent utxo");
+
+    for(i = TEST_UTXO_COUNT; i < TEST_UTXO_COUNT * 2; i++){
+	utxo = make_test_utxo(i, 0, 1);
+	kyk_utxo_chain_append(src_chain, utxo);
+	res = kyk_utxo_set_add(set, utxo);
+	mu_assert(res == 0, "Failed to test_kyk_utxo_set: kyk_utxo_set_add failed");
+    }
+    mu_assert(set -> len == TEST_UTXO_COUNT + TEST_UTXO_COUNT / 2, "Failed to test_kyk_utxo_set: spent entries are not compacted");
+    mu_assert(set -> cap > TEST_UTXO_COUNT, "Failed to test_kyk_utxo_set: set did not grow");
+
+    /* the chain keeps the order the utxos were added in */
+    res = kyk_utxo_set_to_new_chain(&utxo_chain, set);
+    mu_assert(res == 0, "Failed to test_kyk_utxo_set: kyk_utxo_set_to_new_chain failed");
+    mu_assert(utxo_chain -> len == TEST_UTXO_COUNT + TEST_UTXO_COUNT / 2, "Failed to test_kyk_utxo_set: invalid chain len");
+
+    utxo = utxo_chain -> hd;
+    for(i = 0; i < utxo_chain -> len; i++){
+	n = i < TEST_UTXO_COUNT / 2 ? i * 2 + 1 : i + TEST_UTXO_COUNT / 2;
+	mu_assert(utxo -> value == n, "Failed to test_kyk_utxo_set: invalid chain order");
+	mu_assert(utxo -> sc_size == 3 && utxo -> sc[0] == (uint8_t)n, "Failed to test_kyk_utxo_set: invalid sc");
+	mu_assert(strcmp(utxo -> btc_addr, "1Addr") == 0, "Failed to test_kyk_utxo_set: invalid btc_addr");
+	utxo = utxo -> next;
+    }
+    mu_assert(utxo == NULL, "Failed to test_kyk_utxo_set: chain is too long");
+
+    kyk_free_utxo_chain(utxo_chain);
+    kyk_free_utxo_chain(src_chain);
+    kyk_free_utxo_set(set);
+
+    return NULL;
+}
+
+/* the same coinbase output mined in two blocks is two utxos, one txin spends both */
+char* test_kyk_utxo_set_same_txid()
+{
+    struct kyk_utxo_set* set = NULL;
+    struct kyk_utxo* utxo1 = NULL;
+    struct kyk_utxo* utxo2 = NULL;
+    int res = -1;
+
+    res = kyk_new_utxo_set(&set, 0);
+    mu_assert(res == 0, "Failed to test_kyk_utxo_set_same_txid: kyk_new_utxo_set failed");
+
+    utxo1 = make_test_utxo(7, 0, 1);
+    utxo2 = make_test_utxo(7, 0, 2);
+
+    mu_assert(kyk_utxo_set_add(set, utxo1) == 0, "Failed to test_kyk_utxo_set_same_txid: kyk_utxo_set_add failed");
+    mu_assert(kyk_utxo_set_add(set, utxo2) == 0, "Failed to test_kyk_utxo_set_same_txid: the second block's utxo is not added");
+
+    mu_assert(kyk_utxo_set_find(set, utxo1 -> txid, 0) -> node == utxo1, "Failed to test_kyk_utxo_set_same_txid: the first one is not found first");
+    mu_assert(kyk_utxo_set_find_utxo(set, utxo2) -> node == utxo2, "Failed to test_kyk_utxo_set_same_txid: kyk_utxo_set_find_utxo failed");
+
+    res = kyk_utxo_set_spend(set, utxo1 -> txid, 0);
+    mu_assert(res == 2, "Failed to test_kyk_utxo_set_same_txid: not every copy is spent");
+
+    kyk_free_utxo(utxo1);
+    kyk_free_utxo(utxo2);
+    kyk_free_utxo_set(set);
+
+    return NULL;
+}
+
+/* the set gives the same utxos as the chain built from the block */
+char* test_kyk_utxo_set_add_block()
+{
+    struct kyk_block* blk = NULL;
+    struct kyk_utxo_set* set = NULL;
+    struct kyk_utxo_chain* utxo_chain = NULL;
+    struct kyk_utxo_chain* set_chain = NULL;
+    struct kyk_utxo* utxo = NULL;
+    struct kyk_utxo* set_utxo = NULL;
+    size_t len = 0;
+    uint32_t i = 0;
+    int res = -1;
+
+    res = kyk_deseri_new_block(&blk, BLOCK_f8517_BUF, NULL);
+    mu_assert(res == 0, "Failed to test_kyk_utxo_set_add_block: kyk_deseri_new_block failed");
+
+    utxo_chain = calloc(1, sizeof(*utxo_chain));
+    kyk_init_utxo_chain(utxo_chain);
+    res = kyk_append_utxo_chain_from_block(utxo_chain, blk);
+    mu_assert(res == 0, "Failed to test_kyk_utxo_set_add_block: kyk_append_utxo_chain_from_block failed");
+
+    res = kyk_new_utxo_set(&set, 0);
+    mu_assert(res == 0, "Failed to test_kyk_utxo_set_add_block: kyk_new_utxo_set failed");
+
+    res = kyk_utxo_set_add_block(set, blk);
+    mu_assert(res == 0, "Failed to test_kyk_utxo_set_add_block: kyk_utxo_set_add_block failed");
+    len = set -> len;
+
+    res = kyk_utxo_set_add_block(set, blk);
+    mu_assert(res == 0 && set -> len == len, "Failed to test_kyk_utxo_set_add_block: the block is added twice");
+
+    res = kyk_utxo_set_to_new_chain(&set_chain, set);
+    mu_assert(res == 0, "Failed to test_kyk_utxo_set_add_block: kyk_utxo_set_to_new_chain failed");
+    mu_assert(set_chain -> len == utxo_chain -> len, "Failed to test_kyk_utxo_set_add_block: invalid len");
+
+    utxo = utxo_chain -> hd;
+    set_utxo = set_chain -> hd;
+    for(i = 0; i < utxo_chain -> len; i++){
+	mu_assert(kyk_cmp_utxo(utxo, set_utxo) == 0, "Failed to test_kyk_utxo_set_add_block: utxo differs");
+	mu_assert(utxo -> value == set_utxo -> value, "Failed to test_kyk_utxo_set_add_block: value differs");
+	mu_assert(utxo -> sc_size == set_utxo -> sc_size, "Failed to test_kyk_utxo_set_add_block: sc_size differs");
+	mu_assert(memcmp(utxo -> sc, set_utxo -> sc, utxo -> sc_size) == 0, "Failed to test_kyk_utxo_set_add_block: sc differs");
+	mu_assert(strcmp(utxo -> btc_addr, set_utxo -> btc_addr) == 0, "Failed to test_kyk_utxo_set_add_block: btc_addr differs");
+	utxo = utxo -> next;
+	set_utxo = set_utxo -> next;
+    }
+
+    kyk_free_utxo_chain(set_chain);
+    kyk_free_utxo_chain(utxo_chain);
+    kyk_free_utxo_set(set);
+    kyk_free_block(blk);
+
+    return NULL;
+}
+
+char *all_tests()
+{
+    mu_suite_start();
+
+    mu_run_test(test_kyk_utxo_set);
+    mu_run_test(test_kyk_utxo_set_same_txid);
+    mu_run_test(test_kyk_utxo_set_add_block);
+
+    return NULL;
+}
+
+MU_RUN_TESTS(all_tests);
@@ -4,6 +4,7 @@
 
 #include "test_data.h"
 #include "kyk_utxo.h"
+#include "kyk_chainstate.h"
 #include "kyk_wallet.h"
 #include "kyk_utils.h"
 #include "kyk_validate.h"
@@ -533,6 +534,178 @@ error:
 }
 
 
+/* blocks whose coins were not flushed before a crash are connected again on open */
+char* test_kyk_wallet_connect_block_recover()
+{
+    const char* wdir = "/tmp/test_kyk_wallet_connect_block_recover";
+    struct kyk_wallet* wallet = NULL;
+    uint64_t balance = 0;
+    uint64_t balance2 = 0;
+    int res = -1;
+
+    res = kyk_setup_wallet(&wallet, wdir);
+    check(res == 0, "Failed to test_kyk_wallet_connect_block_recover: kyk_setup_wallet failed");
+
+    res = kyk_wallet_make_coinbase_block(NULL, wallet);
+    mu_assert(res == 0, "Failed to test_kyk_wallet_connect_block_recover: kyk_wallet_make_coinbase_block failed");
+
+    res = kyk_wallet_make_coinbase_block(NULL, wallet);
+    mu_assert(res == 0, "Failed to test_kyk_wallet_connect_block_recover: kyk_wallet_make_coinbase_block failed");
+
+    res = kyk_wallet_query_total_balance(wallet, &balance);
+    mu_assert(res == 0 && balance > 0, "Failed to test_kyk_wallet_connect_block_recover: kyk_wallet_query_total_balance failed");
+
+    /* the cached coins are lost as in a crash */
+    kyk_free_chainstate(wallet -> chainstate);
+    wallet -> chainstate = NULL;
+    kyk_destroy_wallet(wallet);
+
+    wallet = kyk_open_wallet(wdir);
+    mu_assert(wallet, "Failed to test_kyk_wallet_connect_block_recover: kyk_open_wallet failed");
+
+    res = kyk_wallet_query_total_balance(wallet, &balance2);
+    mu_assert(res == 0, "Failed to test_kyk_wallet_connect_block_recover: kyk_wallet_query_total_balance failed");
+    mu_assert(balance2 == balance, "Failed to test_kyk_wallet_connect_block_recover: coins are not recovered");
+
+    kyk_destroy_wallet(wallet);
+
+    return NULL;
+
+error:
+    if(wallet) kyk_destroy_wallet(wallet);
+    return "Failed to test_kyk_wallet_connect_block_recover";
+}
+
+/* the index db is opened with the ldb* options of wallet.cfg */
+char* test_kyk_wallet_db_opts()
+{
+    const char* wdir = "/tmp/test_kyk_wallet_db_opts";
+    const char* cfg_path = "/tmp/test_kyk_wallet_db_opts/wallet.cfg";
+    struct kyk_wallet* wallet = NULL;
+    uint8_t* pubkey = NULL;
+    size_t pbk_len = 0;
+    FILE* fp = NULL;
+    int res = -1;
+
+    res = kyk_setup_wallet(&wallet, wdir);
+    check(res == 0, "Failed to test_kyk_wallet_db_opts: kyk_setup_wallet failed");
+    mu_assert(wallet -> blk_index_db -> opts.cache_size == KYK_LDB_CACHE_SIZE, "Failed to test_kyk_wallet_db_opts: invalid default cache size");
+    kyk_destroy_wallet(wallet);
+    wallet = NULL;
+
+    fp = fopen(cfg_path, "a");
+    check(fp, "Failed to test_kyk_wallet_db_opts: fopen failed");
+    fprintf(fp, "ldbCacheSize = \"1048576\"\nldbBloomBits = \"0\"\nldbBulkLoad = \"1\"\n");
+    fclose(fp);
+
+    wallet = kyk_open_wallet(wdir);
+    mu_assert(wallet, "Failed to test_kyk_wallet_db_opts: kyk_open_wallet failed");
+    mu_assert(wallet -> blk_index_db -> opts.cache_size == 1048576, "Failed to test_kyk_wallet_db_opts: invalid cache size");
+    mu_assert(wallet -> blk_index_db -> filter == NULL, "Failed to test_kyk_wallet_db_opts: invalid bloom bits");
+    mu_assert(wallet -> blk_index_db -> opts.bulk_load == 1, "Failed to test_kyk_wallet_db_opts: invalid bulk load");
+    mu_assert(wallet -> blk_index_db -> opts.max_open_files == KYK_LDB_MAX_OPEN_FILES, "Failed to test_kyk_wallet_db_opts: invalid default max open files");
+
+    res = kyk_wallet_get_pubkey(&pubkey, &pbk_len, wallet, "key0.pubkey");
+    mu_assert(res == 0 && pbk_len == 33, "Failed to test_kyk_wallet_db_opts: kyk_wallet_get_pubkey failed");
+
+    free(pubkey);
+    kyk_destroy_wallet(wallet);
+
+    return NULL;
+
+error:
+    if(wallet) kyk_destroy_wallet(wallet);
+    return "Failed to test_kyk_wallet_db_opts";
+}
+
+/* the txs of connected blocks are found by txid, the index is built again once it was turned off */
+char* test_kyk_wallet_query_tx()
+{
+    const char* wdir = "/tmp/test_kyk_wallet_query_tx";
+    const char* cfg_path = "/tmp/test_kyk_wallet_query_tx/wallet.cfg";
+    struct kyk_wallet* wallet = NULL;
+    struct kyk_block* blk = NULL;
+    struct kyk_tx* tx = NULL;
+    uint8_t txid[32];
+    uint8_t digest[32];
+    FILE* fp = NULL;
+    int res = -1;
+
+    res = kyk_setup_wallet(&wallet, wdir);
+    check(res == 0, "Failed to test_kyk_wallet_query_tx: kyk_setup_wallet failed");
+    mu_assert(wallet -> blk_index_db -> txindex == KYK_TXINDEX, "Failed to test_kyk_wallet_query_tx: invalid default txindex");
+
+    res = kyk_wallet_make_coinbase_block(&blk, wallet);
+    mu_assert(res == 0, "Failed to test_kyk_wallet_query_tx: kyk_wallet_make_coinbase_block failed");
+
+    res = kyk_tx_hash256(txid, blk -> tx);
+    mu_assert(res == 0, "Failed to test_kyk_wallet_query_tx: kyk_tx_hash256 failed");
+    kyk_free_block(blk);
+    blk = NULL;
+
+    res = kyk_wallet_query_tx(wallet, txid, &tx);
+    mu_assert(res == 0 && tx, "Failed to test_kyk_wallet_query_tx: kyk_wallet_query_tx failed");
+    kyk_tx_hash256(digest, tx);
+    mu_assert(kyk_digest_eq(digest, txid, sizeof(digest)), "Failed to test_kyk_wallet_query_tx: found another tx");
+    kyk_free_tx(tx);
+    tx = NULL;
+
+    memset(digest, 0xab, sizeof(digest));
+    res = kyk_wallet_query_tx(wallet, digest, &tx);
+    mu_assert(res == 0 && tx == NULL, "Failed to test_kyk_wallet_query_tx: found an unknown tx");
+
+    kyk_destroy_wallet(wallet);
+    wallet = NULL;
+
+    res = system("cp /tmp/test_kyk_wallet_query_tx/wallet.cfg /tmp/test_kyk_wallet_query_tx/wallet.cfg.bak");
+    check(res == 0, "Failed to test_kyk_wallet_query_tx: cp failed");
+
+    fp = fopen(cfg_path, "a");
+    check(fp, "Failed to test_kyk_wallet_query_tx: fopen failed");
+    fprintf(fp, "txIndex = \"0\"\n");
+    fclose(fp);
+
+    wallet = kyk_open_wallet(wdir);
+    mu_assert(wallet, "Failed to test_kyk_wallet_query_tx: kyk_open_wallet failed");
+    mu_assert(wallet -> blk_index_db -> txindex == 0, "Failed to test_kyk_wallet_query_tx: invalid txindex");
+
+    res = kyk_wallet_query_tx(wallet, txid, &tx);
+    mu_assert(res == 0 && tx == NULL, "Failed to test_kyk_wallet_query_tx: found a tx with the index off");
+
+    /* the block is not indexed while the index is off */
+    res = kyk_wallet_make_coinbase_block(&blk, wallet);
+    mu_assert(res == 0, "Failed to test_kyk_wallet_query_tx: kyk_wallet_make_coinbase_block failed");
+    res = kyk_tx_hash256(digest, blk -> tx);
+    mu_assert(res == 0, "Failed to test_kyk_wallet_query_tx: kyk_tx_hash256 failed");
+    kyk_free_block(blk);
+    blk = NULL;
+
+    kyk_destroy_wallet(wallet);
+    wallet = NULL;
+
+    res = system("mv /tmp/test_kyk_wallet_query_tx/wallet.cfg.bak /tmp/test_kyk_wallet_query_tx/wallet.cfg");
+    check(res == 0, "Failed to test_kyk_wallet_query_tx: mv failed");
+
+    wallet = kyk_open_wallet(wdir);
+    mu_assert(wallet, "Failed to test_kyk_wallet_query_tx: kyk_open_wallet failed");
+
+    res = kyk_wallet_query_tx(wallet, digest, &tx);
+    mu_assert(res == 0 && tx, "Failed to test_kyk_wallet_query_tx: the index is not built");
+    kyk_free_tx(tx);
+    tx = NULL;
+
+    res = kyk_wallet_query_tx(wallet, txid, &tx);
+    mu_assert(res == 0 && tx, "Failed to test_kyk_wallet_query_tx: the index is not built");
+    kyk_free_tx(tx);
+
+    kyk_destroy_wallet(wallet);
+
+    return NULL;
+
+error:
+    if(wallet) kyk_destroy_wallet(wallet);
+    return "Failed to test_kyk_wallet_query_tx";
+}
 
 char* all_tests()
 {
@@ -558,6 +731,9 @@ char* all_tests()
     mu_run_test(test2_kyk_wallet_make_tx);
     mu_run_test(test3_kyk_wallet_make_tx);
     mu_run_test(test_kyk_spv_wallet_make_tx);
+    mu_run_test(test_kyk_wallet_connect_block_recover);
+    mu_run_test(test_kyk_wallet_db_opts);
+    mu_run_test(test_kyk_wallet_query_tx);
 
     return NULL;
 }
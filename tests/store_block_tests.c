@@ -109,12 +109,171 @@ error:
 }
 
 
+/* positions past 4 GiB, records with 32 bit positions read the same */
+char* test_store_block_64bit_pos()
+{
+    struct kyk_block* blk = NULL;
+    struct kyk_block_db blk_db;
+    struct kyk_bkey_val bval;
+    struct kyk_bkey_val* bval2 = NULL;
+    char* errptr = NULL;
+    uint8_t buf[16];
+    uint8_t buf64[16];
+    size_t len = 0;
+    size_t len64 = 0;
+
+    len = pack_varint(buf, 0xfedcba98);
+    len64 = pack_varint64(buf64, 0xfedcba98);
+    mu_assert(len == len64 && memcmp(buf, buf64, len) == 0, "failed to pack the same varint");
+
+    set_block_test_dir();
+
+    kyk_init_store_db(&blk_db, BLOCK_TEST_INDEX_DB);
+    mu_assert(blk_db.errptr == NULL, "failed to open db");
+
+    blk = make_gens_block();
+    set_bval(&bval, blk);
+    bval.nFile = 3;
+    bval.nDataPos = (5ULL << 30) + 8;
+    bval.nUndoPos = 1ULL << 40;
+
+    kyk_store_block(&blk_db, &bval, &errptr);
+    mu_assert(errptr == NULL, "failed to store block b key value");
+
+    bval2 = kyk_read_block(&blk_db, (char*)blk -> hd -> blk_hash, &errptr);
+    mu_assert(errptr == NULL && bval2, "failed to read b key value");
+    mu_assert(bval2 -> nFile == 3, "failed to get the correct nFile");
+    mu_assert(bval2 -> nDataPos == (5ULL << 30) + 8, "failed to get the correct nDataPos");
+    mu_assert(bval2 -> nUndoPos == 1ULL << 40, "failed to get the correct nUndoPos");
+    mu_assert(kyk_digest_eq(bval2 -> blk_hd -> mrk_root_hash, blk -> hd -> mrk_root_hash, 32), "failed to get the correct block header");
+
+    /* put the record test_read_block expects back */
+    set_bval(&bval, blk);
+    kyk_store_block(&blk_db, &bval, &errptr);
+    mu_assert(errptr == NULL, "failed to store block b key value");
+
+    kyk_free_bval(bval2);
+    kyk_free_block(blk);
+    kyk_free_block_db(&blk_db);
+
+    return NULL;
+}
+
+/* the 'b' and 'H' records are only there once their batch is written */
+char* test_batch_store_block()
+{
+    struct kyk_block* blk = NULL;
+    struct kyk_block_db blk_db;
+    struct kyk_bkey_val bval;
+    struct kyk_bkey_val* bval2 = NULL;
+    leveldb_writebatch_t* batch = NULL;
+    char* errptr = NULL;
+    uint8_t head_hash[32];
+    int found = 0;
+    int res = -1;
+
+    set_block_test_dir();
+
+    kyk_init_store_db(&blk_db, BLOCK_TEST_INDEX_DB);
+    mu_assert(blk_db.errptr == NULL, "failed to open db");
+
+    blk = make_gens_block();
+    set_bval(&bval, blk);
+    bval.nDataPos = 1024;
+
+    batch = leveldb_writebatch_create();
+    kyk_batch_store_block(batch, &bval);
+    kyk_batch_store_head_block(batch, blk -> hd -> blk_hash);
+
+    bval2 = kyk_read_block(&blk_db, (char*)blk -> hd -> blk_hash, &errptr);
+    mu_assert(errptr == NULL && bval2 && bval2 -> nDataPos == 8, "batched record is read before the batch is written");
+    kyk_free_bval(bval2);
+
+    leveldb_write(blk_db.db, blk_db.sync_wr_opts, batch, &errptr);
+    mu_assert(errptr == NULL, "failed to write the batch");
+    leveldb_writebatch_destroy(batch);
+
+    bval2 = kyk_read_block(&blk_db, (char*)blk -> hd -> blk_hash, &errptr);
+    mu_assert(errptr == NULL && bval2 && bval2 -> nDataPos == 1024, "failed to read the batched record");
+    kyk_free_bval(bval2);
+
+    res = kyk_read_head_block(&blk_db, head_hash, &found);
+    mu_assert(res == 0 && found == 1, "failed to read the head block");
+    mu_assert(kyk_digest_eq(head_hash, blk -> hd -> blk_hash, 32), "failed to get the correct head block");
+
+    /* put the record test_read_block expects back */
+    set_bval(&bval, blk);
+    kyk_store_block(&blk_db, &bval, &errptr);
+    mu_assert(errptr == NULL, "failed to store block b key value");
+
+    kyk_free_block(blk);
+    kyk_free_block_db(&blk_db);
+
+    return NULL;
+}
+
+/* records read the same whatever options the db is opened with, bulk loading reopens it */
+char* test_open_store_db_opts()
+{
+    struct kyk_block_db blk_db;
+    struct kyk_db_opts opts;
+    struct kyk_bkey_val* bval = NULL;
+    uint8_t blk_hash[32];
+    char* errptr = NULL;
+    int res = -1;
+
+    set_block_test_dir();
+
+    kyk_init_db_opts(&opts);
+    opts.cache_size = 0;
+    opts.bloom_bits = 0;
+    opts.compression = 0;
+    opts.verify_checksums = 1;
+
+    res = kyk_open_store_db(&blk_db, BLOCK_TEST_INDEX_DB, &opts);
+    mu_assert(res == 0 && blk_db.errptr == NULL, "failed to open db");
+    mu_assert(blk_db.cache == NULL && blk_db.filter == NULL, "failed to leave out the cache and the filter");
+
+    kyk_parse_hex(blk_hash, "0000876c9ef8c1f8b2a3012ec1bdea7296f95ae21681799f8adf967f548bf8f3");
+    bval = kyk_read_block(&blk_db, (char *)blk_hash, &errptr);
+    mu_assert(errptr == NULL && bval && bval -> nDataPos == 8, "failed to read b key value");
+    kyk_free_bval(bval);
+
+    res = kyk_store_db_set_bulk_load(&blk_db, 1);
+    mu_assert(res == 0 && blk_db.opts.bulk_load == 1 && blk_db.db, "failed to set bulk load");
+    mu_assert(blk_db.opts.verify_checksums == 1, "failed to keep the options");
+
+    bval = kyk_read_block(&blk_db, (char *)blk_hash, &errptr);
+    mu_assert(errptr == NULL && bval && bval -> nDataPos == 8, "failed to read b key value in bulk load");
+    kyk_free_bval(bval);
+
+    res = kyk_store_db_set_bulk_load(&blk_db, 0);
+    mu_assert(res == 0 && blk_db.opts.bulk_load == 0 && blk_db.db, "failed to unset bulk load");
+    kyk_free_block_db(&blk_db);
+
+    /* the defaults have a cache and a bloom filter */
+    res = kyk_init_store_db(&blk_db, BLOCK_TEST_INDEX_DB);
+    mu_assert(res == 0 && blk_db.errptr == NULL, "failed to open db");
+    mu_assert(blk_db.cache && blk_db.filter, "failed to set up the cache and the filter");
+
+    bval = kyk_read_block(&blk_db, (char *)blk_hash, &errptr);
+    mu_assert(errptr == NULL && bval && bval -> nDataPos == 8, "failed to read b key value");
+    kyk_free_bval(bval);
+
+    kyk_free_block_db(&blk_db);
+
+    return NULL;
+}
+
 char *all_tests()
 {
     mu_suite_start();
     
     mu_run_test(test_store_block);
     mu_run_test(test_read_block)
+    mu_run_test(test_store_block_64bit_pos);
+    mu_run_test(test_batch_store_block);
+    mu_run_test(test_open_store_db_opts);
     
     return NULL;
 }